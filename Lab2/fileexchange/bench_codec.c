@@ -0,0 +1,104 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * bench_codec.c
+ *
+ * Microbenchmark of the QUERY/HIT message codec
+ *   Usage: bench_codec [iterations]
+ *   Prints one line per operation: name, iterations and ns per message
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "codec.h"
+
+
+#define DEFAULT_ITERATIONS	10000000
+
+
+// Return the current time in nanoseconds
+static inline long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+// Print the result of one benchmark
+static void report(const char *name, long iterations, long long t0, long long t1, unsigned long sink) {
+	printf("%-14s iterations=%ld ns_per_msg=%.2f (check=%lu)\n", name, iterations,
+			(double)(t1-t0)/iterations, sink);
+}
+
+
+int main(int argc, char *argv[]) {
+	long iterations= (argc > 1) ? atol(argv[1]) : DEFAULT_ITERATIONS;
+	const char *filename= "dataset-2024-11-05.csv";
+	char buf[HIT_MAX_LENGTH];
+	struct in6_addr ip;
+	unsigned long sink= 0;
+	long long t0, t1;
+	long i;
+	int qlen, hlen;
+
+	if (iterations <= 0) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+	inet_pton(AF_INET6, "2001:db8::1", &ip);
+
+	// QUERY encode
+	t0= now_ns();
+	for (i= 0; i < iterations; i++) {
+		qlen= encode_query(buf, sizeof(buf), (uint32_t)i, filename);
+		sink += qlen + (unsigned char)buf[1];
+	}
+	t1= now_ns();
+	report("query_encode", iterations, t0, t1, sink);
+
+	// QUERY decode
+	Query_View q;
+	qlen= encode_query(buf, sizeof(buf), 1234, filename);
+	t0= now_ns();
+	for (i= 0; i < iterations; i++) {
+		if (decode_query(buf, qlen, &q))
+			sink += q.seq + q.fnlen;
+	}
+	t1= now_ns();
+	report("query_decode", iterations, t0, t1, sink);
+
+	// HIT encode
+	t0= now_ns();
+	for (i= 0; i < iterations; i++) {
+		hlen= encode_hit(buf, sizeof(buf), (uint32_t)i, filename, 123456789ULL+i, 0xCAFE, 20000, &ip);
+		sink += hlen + (unsigned char)buf[1];
+	}
+	t1= now_ns();
+	report("hit_encode", iterations, t0, t1, sink);
+
+	// HIT decode
+	Hit_View h;
+	hlen= encode_hit(buf, sizeof(buf), 1234, filename, 123456789ULL, 0xCAFE, 20000, &ip);
+	t0= now_ns();
+	for (i= 0; i < iterations; i++) {
+		if (decode_hit(buf, hlen, &h))
+			sink += h.seq + h.flen + h.sTCP_port;
+	}
+	t1= now_ns();
+	report("hit_decode", iterations, t0, t1, sink);
+
+	// Malformed HIT (truncated): the rejection path
+	t0= now_ns();
+	for (i= 0; i < iterations; i++) {
+		if (!decode_hit(buf, hlen-1-(i&7), &h))
+			sink++;
+	}
+	t1= now_ns();
+	report("hit_reject", iterations, t0, t1, sink);
+
+	return 0;
+}
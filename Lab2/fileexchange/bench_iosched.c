@@ -0,0 +1,207 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * bench_iosched.c
+ *
+ * Benchmark of the read scheduler of the senders (iosched.h) with many concurrent
+ *   readers of one emulated disk
+ *   Usage: bench_iosched [-r readers] [-f file size] [-a request size] [-S seek ms]
+ *                        [-t MB/s] [-s slots]
+ *     -r  concurrent readers, each reading its own file (default 1,16,64)
+ *     -f  bytes of each file, with K/M suffixes (default 4M)
+ *     -a  bytes of each read without the scheduler, the kernel readahead (default 128K)
+ *     -S  longest seek, in ms; seeks cost 1/4 of it plus the rest by distance (default 8)
+ *     -t  transfer rate of the disk in MB/s (default 150)
+ *     -s  reads at once in the scheduler (default 1)
+ *   The disk serves one read at a time, sleeping for its seek and transfer time.
+ *   The files are spread over the disk, in a random order of the readers.
+ *   Prints one line per test with the throughput, the seeks and the 50th/99th
+ *   percentile of the time each reader took to read its file.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "iosched.h"
+
+
+#define MAX_LIST		16				// Maximum values in each option list
+
+
+// Emulated disk
+static struct {
+	pthread_mutex_t mutex;
+	unsigned long long pos;		// Position after the last read
+	long long seeks;
+} disk= { PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+
+static double seek_ms= 8;			// Longest seek
+static double rate= 150e6;			// Bytes per second
+static unsigned long long span;		// Bytes of the disk with files
+static unsigned long long fsize= 4*1048576;
+static unsigned request= 128*1024;	// Bytes of each read without the scheduler
+static Io_Device *dev= NULL;		// Scheduler, or NULL
+static long long t0;
+
+// Reader
+typedef struct Reader {
+	pthread_t tid;
+	unsigned long long base;	// Position of its file in the disk
+	double ms;					// Time to read the file
+} Reader;
+
+
+// Return the current time in nanoseconds
+static inline long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+
+// Read 'len' bytes at 'pos' of the disk: sleep for the seek and the transfer
+static void disk_read(unsigned long long pos, size_t len) {
+	double t= len/rate;
+	struct timespec ts;
+
+	pthread_mutex_lock(&disk.mutex);
+	if (pos != disk.pos) {
+		unsigned long long dist= (pos > disk.pos) ? pos - disk.pos : disk.pos - pos;
+		t += seek_ms/1e3 * (0.25 + 0.75*(double)dist/span);
+		disk.seeks++;
+	}
+	ts.tv_sec= (time_t)t;
+	ts.tv_nsec= (long)((t - ts.tv_sec)*1e9);
+	while (nanosleep(&ts, &ts))
+		;
+	disk.pos= pos + len;
+	pthread_mutex_unlock(&disk.mutex);
+}
+
+
+// Read the file of a reader, in turns with the scheduler or in readahead sized reads
+static void *reader_thread(void *ptr) {
+	Reader *r= (Reader *)ptr;
+	unsigned long long off, len;
+
+	for (off= 0; off < fsize; off += len) {
+		if (dev != NULL) {
+			len= (fsize - off < IO_QUANTUM) ? fsize - off : IO_QUANTUM;
+			io_begin(dev, r->base + off);
+			disk_read(r->base + off, len);
+			io_end(dev);
+		} else {
+			len= (fsize - off < request) ? fsize - off : request;
+			disk_read(r->base + off, len);
+		}
+	}
+	r->ms= (now_ns() - t0)/1e6;
+	return NULL;
+}
+
+
+static int cmp_double(const void *a, const void *b) {
+	double x= *(const double *)a, y= *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+// Run 'n' readers, with the scheduler with 'slots' reads at once (0 for none)
+static void run_test(int n, int slots) {
+	Reader *r= (Reader *)calloc(n, sizeof(Reader));
+	double *ms= (double *)malloc(n*sizeof(double));
+	int *order= (int *)malloc(n*sizeof(int));
+	int i;
+
+	// Files with gaps between them, in a random order
+	for (i= 0; i < n; i++)
+		order[i]= i;
+	for (i= n-1; i > 0; i--) {
+		int j= rand() % (i+1), t= order[i];
+		order[i]= order[j];
+		order[j]= t;
+	}
+	span= 2*fsize*n;
+	for (i= 0; i < n; i++)
+		r[i].base= 2*fsize*order[i];
+	dev= (slots > 0) ? io_device_new(slots) : NULL;
+	disk.pos= 0;
+	disk.seeks= 0;
+
+	t0= now_ns();
+	for (i= 0; i < n; i++)
+		pthread_create(&r[i].tid, NULL, reader_thread, &r[i]);
+	for (i= 0; i < n; i++) {
+		pthread_join(r[i].tid, NULL);
+		ms[i]= r[i].ms;
+	}
+	double wall= (now_ns() - t0)/1e9;
+
+	qsort(ms, n, sizeof(double), cmp_double);
+	printf("readers=%d mode=%s slots=%d file=%llu request=%u mb_s=%.1f seeks=%lld p50_ms=%.1f "
+			"p99_ms=%.1f\n", n, (slots > 0) ? "sched" : "none", slots, fsize,
+			(slots > 0) ? IO_QUANTUM : request, (double)fsize*n/wall/1e6, disk.seeks,
+			ms[(n-1)/2], ms[(int)(0.99*n + 0.999999) - 1]);
+	fflush(stdout);
+	if (dev != NULL)
+		io_device_free(dev);
+	free(r);
+	free(ms);
+	free(order);
+}
+
+
+// Parse a comma separated list of sizes with K/M suffixes
+static int parse_sizes(const char *str, long long *v) {
+	char *end;
+	int n= 0;
+
+	while ((*str != '\0') && (n < MAX_LIST)) {
+		long long x= strtoll(str, &end, 10);
+		switch (*end) {
+		case 'M': case 'm': x <<= 10; /* fall through */
+		case 'K': case 'k': x <<= 10; end++; break;
+		}
+		if ((end == str) || (x <= 0) || ((*end != ',') && (*end != '\0')))
+			return 0;
+		v[n++]= x;
+		str= (*end == ',') ? end+1 : end;
+	}
+	return n;
+}
+
+
+int main(int argc, char *argv[]) {
+	long long readers[MAX_LIST], v;
+	int nreaders, slots= 1, c, i;
+
+	nreaders= parse_sizes("1,16,64", readers);
+	while ((c= getopt(argc, argv, "r:f:a:S:t:s:")) != -1) {
+		switch (c) {
+		case 'r': nreaders= parse_sizes(optarg, readers); break;
+		case 'f': fsize= (parse_sizes(optarg, &v) == 1) ? v : 0; break;
+		case 'a': request= (parse_sizes(optarg, &v) == 1) ? v : 0; break;
+		case 'S': seek_ms= atof(optarg); break;
+		case 't': rate= atof(optarg)*1e6; break;
+		case 's': slots= atoi(optarg); break;
+		default:
+			nreaders= 0;
+		}
+	}
+	if (!nreaders || !fsize || !request || (seek_ms < 0) || (rate <= 0) || (slots <= 0)) {
+		fprintf(stderr, "Usage: %s [-r readers] [-f file size] [-a request size] [-S seek ms] "
+				"[-t MB/s] [-s slots]\n", argv[0]);
+		return 1;
+	}
+	srand(1);
+	for (i= 0; i < nreaders; i++) {
+		run_test((int)readers[i], 0);
+		run_test((int)readers[i], slots);
+	}
+	return 0;
+}
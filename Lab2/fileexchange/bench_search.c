@@ -0,0 +1,86 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * bench_search.c
+ *
+ * Benchmark of the trigram index used to answer SEARCH messages
+ *   Usage: bench_search [number of names]
+ *   Prints the index build time and the time per search for several patterns
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trigram.h"
+
+
+#define DEFAULT_NAMES	1000000
+#define PAGE_SIZE		16
+#define REPEAT			100
+
+
+static const char *words[]= { "report", "dataset", "backup", "image", "invoice", "log",
+		"config", "manifest", "photo", "video", "thesis", "slides", "archive", "notes" };
+static const char *exts[]= { "pdf", "csv", "tar.gz", "jpg", "mp4", "txt", "json", "iso" };
+
+
+// Return the current time in nanoseconds
+static inline long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+
+// Time 'pattern' searches (first page and a later page)
+static void bench_pattern(const Trigram_Index *idx, const char *pattern) {
+	Tgram_Match res[PAGE_SIZE];
+	gboolean more;
+	int n= 0, i;
+	long long t0= now_ns();
+	for (i= 0; i < REPEAT; i++)
+		n= tgram_search(idx, pattern, 0, PAGE_SIZE, res, &more);
+	long long t1= now_ns();
+	for (i= 0; i < REPEAT; i++)
+		tgram_search(idx, pattern, 10*PAGE_SIZE, PAGE_SIZE, res, &more);
+	long long t2= now_ns();
+	printf("pattern=%-22s results=%2d more=%d us_first_page=%.1f us_page_10=%.1f\n",
+			pattern, n, more, (t1-t0)/1000.0/REPEAT, (t2-t1)/1000.0/REPEAT);
+}
+
+
+int main(int argc, char *argv[]) {
+	long nnames= (argc > 1) ? atol(argv[1]) : DEFAULT_NAMES;
+	Trigram_Index idx;
+	char name[128];
+	long i;
+
+	if (nnames <= 0) {
+		fprintf(stderr, "Usage: %s [number of names]\n", argv[0]);
+		return 1;
+	}
+	srand(12345);
+	tgram_init(&idx);
+	long long t0= now_ns();
+	for (i= 0; i < nnames; i++) {
+		snprintf(name, sizeof(name), "%s-%s-%ld.%s", words[rand() % G_N_ELEMENTS(words)],
+				words[rand() % G_N_ELEMENTS(words)], i, exts[rand() % G_N_ELEMENTS(exts)]);
+		tgram_add(&idx, name, (unsigned long long)rand());
+	}
+	long long t1= now_ns();
+	printf("names=%u build_ms=%.1f\n", tgram_size(&idx), (t1-t0)/1e6);
+
+	bench_pattern(&idx, "invoice-photo");
+	bench_pattern(&idx, "123456");
+	bench_pattern(&idx, "thesis-*-99*.pdf");
+	bench_pattern(&idx, "*.iso");
+	bench_pattern(&idx, "backup-[ab]*.tar.gz");
+	bench_pattern(&idx, "nonexistent");
+	bench_pattern(&idx, "?x");
+
+	tgram_free(&idx);
+	return 0;
+}
@@ -0,0 +1,541 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * bench_transfer.c
+ *
+ * Benchmark of the file transfer threads over the loopback interface
+ *   Usage: bench_transfer [-s sizes] [-b block sizes] [-m modes] [-c concurrency]
+ *                         [-n transfers] [-d directory] [-p data percentage] [-z] [-r rate]
+ *                         [-u changed percentage] [-k] [-H cache MiB] [-Z] [-R receiver]
+ *     -s  file sizes, with K/M/G suffixes (default 4K,64K,1M,16M,256M,1G,4G,16G)
+ *         Sizes whose file and received copies do not fit in the directory are skipped
+ *     -b  sizes of the blocks read and written (default 4K,64K,1M)
+ *     -m  sending modes, fast and/or slow (default fast)
+ *     -c  concurrent transfers (default 1,4,16)
+ *     -n  maximum transfers per test; each test stops after 1 GiB (default 16)
+ *     -d  directory for the test files (default /tmp)
+ *     -p  percentage of 1 MiB blocks of the files with data, the others are holes (default 100)
+ *     -z  files with CSV text instead of random bytes, downloaded with compression
+ *     -r  limit each sender to 'rate' MB/s (SO_MAX_PACING_RATE), to emulate a slower link
+ *     -u  the receivers have an older copy of the files, with this percentage of its 4 KiB
+ *         pages changed, and download deltas of it
+ *     -k  the receivers have a chunk store, with the older copies of -u indexed, and only
+ *         download the chunks not found in it
+ *     -H  the sender keeps the files sent in a file cache of this size, in MiB (default 0)
+ *     -Z  the sender sends the files in the file cache with MSG_ZEROCOPY
+ *     -R  how the receivers write the files: copy (read and write, the default), splice
+ *         (socket to file with splice, hashed) or nohash (splice, only the length checked)
+ *   The receiving and sending threads of the engine run in this process; the
+ *   sender is started by a local acceptor, as the main loop does in fileexchange.
+ *   Prints one line per test with the throughput, the CPU time of both ends per
+ *   GB transferred, the 50th/99th percentile of the transfer completion time and
+ *   the TCP segments sent per transfer (both ends, from /proc/net/snmp);
+ *   with -H, also the hit ratio of the file cache and the bytes it sent.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <netinet/in.h>
+#include "fileexchange.h"
+#include "callbacks.h"
+#include "thread.h"
+#include "file.h"
+#include "chunk.h"
+#include "filecache.h"
+
+
+#define MAX_LIST		16				// Maximum values in each option list
+#define MAX_BYTES		(1LL << 30)		// Bytes transferred per test
+#define SLOW_MAX_BLOCKS	32				// Largest slow transfer, in blocks (0.5 s each)
+#define WAIT_TIMEOUT	120				// Maximum time waiting for a transfer batch (s)
+
+
+// Results of the current batch of transfers
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	long long t0;				// Start time of the batch (ns)
+	int rcv_done, snd_done;		// Transfers that ended
+	int snd_started;			// Connections accepted
+	int failed;					// Receivers that did not get the whole file
+	long long size;				// Expected file size
+	double *times;				// Completion time of each successful receiver (ms)
+	int ntimes;
+} res= { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static gboolean slow= FALSE;	// Sending mode of the current test
+static int data_pct= 100;		// Percentage of the blocks of the test files with data
+static gboolean text= FALSE;	// Test files with text, downloaded with compression
+static unsigned rate= 0;		// Pacing rate of the senders (bytes/s, 0 for no limit)
+static int update_pct= -1;		// Percentage of the pages changed in the older copies (-1: none)
+static gboolean chunks= FALSE;	// The older copies are in the chunk store of the receivers
+static unsigned cache_mb= 0;	// Size of the file cache of the sender (MiB)
+static gboolean zerocopy= FALSE;	// The sender uses MSG_ZEROCOPY
+static const char *recv_mode= "copy";	// How the receivers write the files
+static int lsock= -1;			// Listening socket of the acceptor
+static unsigned short lport;	// Port of the acceptor
+
+
+// Return the current time in nanoseconds
+static inline long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+
+// Return the CPU time used by the process (user+system), in seconds
+static double cpu_s(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)/1e6;
+}
+
+
+// Return the TCP segments sent by the host (OutSegs of /proc/net/snmp), or 0
+//    The first "Tcp:" line has the names of the columns, the second one their values
+static unsigned long long tcp_out_segs(void) {
+	FILE *f= fopen("/proc/net/snmp", "r");
+	char line[512], *tok, *save;
+	unsigned long long v= 0;
+	int col= -1, i;
+
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, "Tcp:", 4))
+			continue;
+		for (i= 0, tok= strtok_r(line, " \n", &save); tok != NULL; tok= strtok_r(NULL, " \n", &save), i++)
+			if (col < 0) {
+				if (!strcmp(tok, "OutSegs"))
+					col= i;
+			} else if (i == col)
+				v= strtoull(tok, NULL, 10);
+		if (v > 0)
+			break;
+	}
+	fclose(f);
+	return v;
+}
+
+
+// Engine log and g_print go to stderr, keeping stdout for the results
+static void bench_log(void *ctx, int level, const char *msg) {
+}
+
+static void print_stderr(const gchar *msg) {
+	fputs(msg, stderr);
+}
+
+
+// Engine callback: a transfer is ending
+static void bench_done(void *ctx, unsigned tid, gboolean sending, long long bytes, gboolean lock) {
+	long long t= now_ns();
+	pthread_mutex_lock(&res.mutex);
+	if (sending)
+		res.snd_done++;
+	else {
+		res.rcv_done++;
+		if (bytes == res.size)
+			res.times[res.ntimes++]= (t-res.t0)/1e6;
+		else
+			res.failed++;
+	}
+	pthread_cond_signal(&res.cond);
+	pthread_mutex_unlock(&res.mutex);
+}
+
+
+// Accept connections and start the sending threads, like callback_connection_TCP
+static void *acceptor_thread(void *ptr) {
+	struct sockaddr_in6 from;
+	socklen_t len;
+	int s;
+
+	for (;;) {
+		len= sizeof(from);
+		if ((s= accept(lsock, (struct sockaddr *)&from, &len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			return NULL;
+		}
+		pthread_mutex_lock(&res.mutex);
+		res.snd_started++;
+		pthread_mutex_unlock(&res.mutex);
+		if ((rate > 0) && setsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)))
+			perror("SO_MAX_PACING_RATE");
+		if (start_snd_file_thread(s, &from.sin6_addr, ntohs(from.sin6_port), slow) == NULL) {
+			close(s);
+			pthread_mutex_lock(&res.mutex);
+			res.snd_done++;
+			pthread_mutex_unlock(&res.mutex);
+		}
+	}
+}
+
+
+// Open the listening socket of the acceptor in [::1]
+static gboolean start_acceptor(void) {
+	struct sockaddr_in6 addr;
+	socklen_t len= sizeof(addr);
+	pthread_t tid;
+
+	if ((lsock= socket(AF_INET6, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return FALSE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family= AF_INET6;
+	addr.sin6_addr= in6addr_loopback;
+	if ((bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(lsock, 128) < 0) ||
+			(getsockname(lsock, (struct sockaddr *)&addr, &len) < 0)) {
+		perror("bind/listen");
+		return FALSE;
+	}
+	lport= ntohs(addr.sin6_port);
+	if (pthread_create(&tid, NULL, acceptor_thread, NULL)) {
+		perror("pthread_create");
+		return FALSE;
+	}
+	pthread_detach(tid);
+	return TRUE;
+}
+
+
+// Fill 'buf' with CSV lines (with 'text') or pseudo-random bytes from the generator 'x'
+static void fill_block(char *buf, size_t len, unsigned long long *x) {
+	static const char *methods[]= { "GET", "POST", "PUT", "DELETE" };
+	size_t i= 0;
+
+	while (i < len) {
+		*x ^= *x << 13; *x ^= *x >> 7; *x ^= *x << 17;
+		if (!text) {
+			memcpy(buf+i, x, (len-i < sizeof(*x)) ? len-i : sizeof(*x));
+			i += sizeof(*x);
+			continue;
+		}
+		char line[96];
+		int n= snprintf(line, sizeof(line), "%llu,10.0.%u.%u,%s,/files/file%u.dat,%u,%u\n",
+				1700000000ULL + i, (unsigned)(*x >> 8) & 255, (unsigned)(*x >> 16) & 255,
+				methods[*x & 3], (unsigned)(*x >> 24) % 1000, 200 + (unsigned)(*x >> 40) % 3 * 100,
+				(unsigned)(*x >> 44) % 100000);
+		memcpy(buf+i, line, (len-i < (size_t)n) ? len-i : (size_t)n);
+		i += n;
+	}
+}
+
+
+// Return the bytes available in the filesystem of 'dir', or -1 if unknown
+static long long free_bytes(const char *dir) {
+	struct statvfs sv;
+	return statvfs(dir, &sv) ? -1 : (long long)sv.f_bavail*sv.f_frsize;
+}
+
+
+// Create a test file with 'size' pseudo-random bytes or text
+static gboolean create_file(const char *name, long long size) {
+	static char buf[1048576];
+	unsigned long long x= 88172645463325252ULL ^ (unsigned long long)size;
+	FILE *f= fopen(name, "w");
+	long long left, blk= 0;
+
+	if (f == NULL) {
+		perror(name);
+		return FALSE;
+	}
+	for (left= size; left > 0; left -= sizeof(buf), blk++) {
+		if ((blk+1)*data_pct/100 == blk*data_pct/100) {
+			// Hole
+			fseek(f, (left < (long long)sizeof(buf)) ? left : (long)sizeof(buf), SEEK_CUR);
+			continue;
+		}
+		fill_block(buf, sizeof(buf), &x);
+		if (fwrite(buf, 1, (left < (long long)sizeof(buf)) ? left : sizeof(buf), f) == 0) {
+			perror(name);
+			fclose(f);
+			return FALSE;
+		}
+	}
+	fflush(f);
+	if (ftruncate(fileno(f), size))		// Ends with a hole
+		perror(name);
+	return fclose(f) == 0;
+}
+
+
+// Create the older copy 'oname' of test file 'name', with update_pct% of its pages changed
+static gboolean create_old_copy(const char *name, const char *oname) {
+	static char buf[4096];
+	unsigned long long x= 0x2545F4914F6CDD1DULL;
+	FILE *f= fopen(name, "r"), *o= fopen(oname, "w");
+	long long pg;
+	size_t n;
+
+	if ((f == NULL) || (o == NULL)) {
+		perror(oname);
+		if (f != NULL)
+			fclose(f);
+		if (o != NULL)
+			fclose(o);
+		return FALSE;
+	}
+	for (pg= 0; (n= fread(buf, 1, sizeof(buf), f)) > 0; pg++) {
+		if ((pg+1)*update_pct/100 != pg*update_pct/100)
+			fill_block(buf, n, &x);
+		if (fwrite(buf, 1, n, o) != n) {
+			perror(oname);
+			break;
+		}
+	}
+	fclose(f);
+	return (fclose(o) == 0) && (n == 0);
+}
+
+
+static int cmp_double(const void *a, const void *b) {
+	double x= *(const double *)a, y= *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+// Return the percentile 'p' of the sorted values
+static double percentile(const double *v, int n, double p) {
+	int i= (int)(p*n + 0.999999) - 1;
+	return (n == 0) ? 0 : v[(i < 0) ? 0 : i];
+}
+
+
+// Run one test: 'conc' concurrent downloads of 'fname' in batches
+//    Each receiver starts with a link to the older copy 'oname', if not NULL
+static void run_test(const char *dir, const char *fname, const char *oname, long long size,
+		uint32_t fhash, unsigned buflen, gboolean is_slow, int conc, int max_transfers) {
+	char ofname[512];
+	int batches, b, i, total= 0;
+	struct timespec deadline;
+
+	int transfers= (int)((MAX_BYTES + size - 1)/size);
+	if (transfers > max_transfers)
+		transfers= max_transfers;
+	batches= (transfers + conc - 1)/conc;
+	if (batches < 1)
+		batches= 1;
+
+	fx_set_buffer_size(buflen);
+	slow= is_slow;
+	res.size= size;
+	res.times= (double *)malloc(batches*conc*sizeof(double));
+	res.ntimes= 0;
+	res.failed= 0;
+
+	File_Cache_Stats cs0, cs1;
+	file_cache_stats(&cs0);
+	unsigned long long segs0= tcp_out_segs();
+	double c0= cpu_s();
+	long long w0= now_ns();
+	for (b= 0; b < batches; b++) {
+		for (i= 0; (oname != NULL) && (i < conc); i++) {
+			// The received file replaces the link, not the older copy
+			snprintf(ofname, sizeof(ofname), "%s/rcv-%d-%d", dir, getpid(), i);
+			if (link(oname, ofname))
+				perror(ofname);
+		}
+		pthread_mutex_lock(&res.mutex);
+		res.rcv_done= res.snd_done= res.snd_started= 0;
+		res.t0= now_ns();
+		pthread_mutex_unlock(&res.mutex);
+		for (i= 0; i < conc; i++) {
+			snprintf(ofname, sizeof(ofname), "%s/rcv-%d-%d", dir, getpid(), i);
+			if (start_file_download_thread((struct in6_addr *)&in6addr_loopback, lport, fname,
+					ofname, size, fhash, is_slow) == NULL) {
+				pthread_mutex_lock(&res.mutex);
+				res.rcv_done++;
+				res.failed++;
+				pthread_mutex_unlock(&res.mutex);
+			}
+		}
+		total += conc;
+		// Wait for the receivers and for the senders they connected to
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += WAIT_TIMEOUT;
+		pthread_mutex_lock(&res.mutex);
+		while ((res.rcv_done < conc) || (res.snd_done < res.snd_started)) {
+			if (pthread_cond_timedwait(&res.cond, &res.mutex, &deadline) == ETIMEDOUT) {
+				fprintf(stderr, "Timeout waiting for the transfers - stopping them\n");
+				pthread_mutex_unlock(&res.mutex);
+				stop_all_threads_GUI(FALSE);
+				pthread_mutex_lock(&res.mutex);
+				res.failed += conc - res.rcv_done;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&res.mutex);
+		for (i= 0; i < conc; i++) {
+			snprintf(ofname, sizeof(ofname), "%s/rcv-%d-%d", dir, getpid(), i);
+			unlink(ofname);
+		}
+	}
+	double wall= (now_ns()-w0)/1e9;
+	double cpu= cpu_s()-c0;
+	file_cache_stats(&cs1);
+	unsigned long long segs= tcp_out_segs() - segs0;
+	unsigned long long lookups= (cs1.hits - cs0.hits) + (cs1.misses - cs0.misses);
+
+	double bytes= (double)size*res.ntimes;
+	qsort(res.times, res.ntimes, sizeof(double), cmp_double);
+	printf("size=%lld data_pct=%d text=%d rate_mb_s=%u update_pct=%d chunks=%d cache_mb=%u zerocopy=%d "
+			"recv=%s buflen=%u mode=%s conc=%d transfers=%d failed=%d mb_s=%.1f cpu_s_per_gb=%.3f p50_ms=%.3f "
+			"p99_ms=%.3f segs=%.1f hit_ratio=%.3f cache_bytes=%llu\n",
+			size, data_pct, text, rate/1000000, update_pct, chunks, cache_mb, zerocopy, recv_mode, buflen,
+			is_slow ? "slow" : "fast", conc, total, res.failed,
+			(wall > 0) ? bytes/wall/1e6 : 0, (bytes > 0) ? cpu/(bytes/1e9) : 0,
+			percentile(res.times, res.ntimes, 0.50), percentile(res.times, res.ntimes, 0.99),
+			total ? (double)segs/total : 0.0,
+			lookups ? (double)(cs1.hits - cs0.hits)/lookups : 0.0, cs1.hit_bytes - cs0.hit_bytes);
+	fflush(stdout);
+	free(res.times);
+	res.times= NULL;
+}
+
+
+// Parse a comma separated list of sizes with K/M/G suffixes
+static int parse_sizes(const char *str, long long *v) {
+	char *end;
+	int n= 0;
+
+	while ((*str != '\0') && (n < MAX_LIST)) {
+		long long x= strtoll(str, &end, 10);
+		switch (*end) {
+		case 'G': case 'g': x <<= 10; /* fall through */
+		case 'M': case 'm': x <<= 10; /* fall through */
+		case 'K': case 'k': x <<= 10; end++; break;
+		}
+		if ((end == str) || (x <= 0) || ((*end != ',') && (*end != '\0')))
+			return 0;
+		v[n++]= x;
+		str= (*end == ',') ? end+1 : end;
+	}
+	return n;
+}
+
+
+int main(int argc, char *argv[]) {
+	long long sizes[MAX_LIST], bufs[MAX_LIST], concs[MAX_LIST];
+	int nsizes, nbufs, nconcs, max_transfers= 16;
+	gboolean modes[2]= { TRUE, FALSE };		// fast, slow
+	const char *dir= "/tmp";
+	char fname[512], oname[512];
+	int c, is, ib, im, ic;
+
+	nsizes= parse_sizes("4K,64K,1M,16M,256M,1G,4G,16G", sizes);
+	nbufs= parse_sizes("4K,64K,1M", bufs);
+	nconcs= parse_sizes("1,4,16", concs);
+	while ((c= getopt(argc, argv, "s:b:m:c:n:d:p:zr:u:kH:ZR:")) != -1) {
+		switch (c) {
+		case 's': nsizes= parse_sizes(optarg, sizes); break;
+		case 'b': nbufs= parse_sizes(optarg, bufs); break;
+		case 'c': nconcs= parse_sizes(optarg, concs); break;
+		case 'm':
+			modes[0]= strstr(optarg, "fast") != NULL;
+			modes[1]= strstr(optarg, "slow") != NULL;
+			break;
+		case 'n': max_transfers= atoi(optarg); break;
+		case 'd': dir= optarg; break;
+		case 'p': data_pct= atoi(optarg); break;
+		case 'z': text= TRUE; break;
+		case 'r': rate= (unsigned)atoi(optarg)*1000000; break;
+		case 'u': update_pct= atoi(optarg); break;
+		case 'k': chunks= TRUE; break;
+		case 'H': cache_mb= (unsigned)atoi(optarg); break;
+		case 'Z': zerocopy= TRUE; break;
+		case 'R': recv_mode= optarg; break;
+		default:
+			nsizes= 0;
+		}
+	}
+	if (!nsizes || !nbufs || !nconcs || (max_transfers <= 0) || (!modes[0] && !modes[1])
+			|| (data_pct <= 0) || (data_pct > 100) || (update_pct > 100)
+			|| (strcmp(recv_mode, "copy") && strcmp(recv_mode, "splice") && strcmp(recv_mode, "nohash"))) {
+		fprintf(stderr, "Usage: %s [-s sizes] [-b block sizes] [-m fast,slow] [-c concurrency] "
+				"[-n transfers] [-d directory] [-p data percentage] [-z] [-r rate] [-u changed percentage] "
+				"[-k] [-H cache MiB] [-Z] [-R copy|splice|nohash]\n",
+				argv[0]);
+		return 1;
+	}
+
+	Fx_Callbacks cb= { .log= bench_log, .transfer_done= bench_done };
+	fx_init(&cb);
+	fx_set_compression(text);
+	fx_set_delta((update_pct >= 0) && !chunks);
+	fx_set_chunk_store(chunks);
+	fx_set_file_cache((unsigned long long)cache_mb << 20);
+	fx_set_zerocopy(zerocopy);
+	fx_set_splice(strcmp(recv_mode, "copy") != 0, strcmp(recv_mode, "nohash") != 0);
+	g_set_print_handler(print_stderr);
+	signal(SIGPIPE, SIG_IGN);
+	// The transfer threads run while the engine is active; the multicast sockets are not needed
+	active= TRUE;
+	if (!start_acceptor())
+		return 1;
+
+	long long max_conc= 1;
+	for (ic= 0; ic < nconcs; ic++)
+		if (concs[ic] > max_conc)
+			max_conc= concs[ic];
+	for (is= 0; is < nsizes; is++) {
+		// The file, its older copy and one received copy per concurrent transfer
+		long long avail= free_bytes(dir);
+		if ((avail >= 0) && (sizes[is]/100*data_pct*(max_conc + 1 + (update_pct >= 0)) > avail)) {
+			fprintf(stderr, "Skipping files of %lld bytes: %lld bytes free in '%s'\n", sizes[is],
+					avail, dir);
+			continue;
+		}
+		snprintf(fname, sizeof(fname), "%s/fxbench-%d-%lld", dir, getpid(), sizes[is]);
+		if (!create_file(fname, sizes[is]) || !fx_add_file(fname)) {
+			unlink(fname);
+			return 1;
+		}
+		uint32_t fhash= fhash_filename(fname);
+		snprintf(oname, sizeof(oname), "%s/fxbench-%d-%lld.old", dir, getpid(), sizes[is]);
+		if ((update_pct >= 0) && !create_old_copy(fname, oname)) {
+			unlink(fname);
+			unlink(oname);
+			return 1;
+		}
+		if (chunks && (update_pct >= 0))
+			chunk_store_add_file(oname);
+		for (ib= 0; ib < nbufs; ib++)
+			for (im= 0; im < 2; im++) {
+				if (!modes[im])
+					continue;
+				if ((im == 1) && (sizes[is]/bufs[ib] > SLOW_MAX_BLOCKS)) {
+					fprintf(stderr, "Skipping slow test of %lld bytes with %lld byte blocks\n",
+							sizes[is], bufs[ib]);
+					continue;
+				}
+				for (ic= 0; ic < nconcs; ic++)
+					run_test(dir, get_trunc_filename(fname), ((update_pct >= 0) && !chunks) ? oname : NULL,
+							sizes[is], fhash, (unsigned)bufs[ib], im == 1, (int)concs[ic], max_transfers);
+			}
+		fx_del_file(fname);
+		unlink(fname);
+		if (update_pct >= 0)
+			unlink(oname);
+		chunk_store_clear();
+	}
+	active= FALSE;
+	close(lsock);
+	return 0;
+}
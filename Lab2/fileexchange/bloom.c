@@ -0,0 +1,175 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * bloom.c
+ *
+ * Counting Bloom filter over filenames
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "bloom.h"
+
+
+
+// Hash function used by the filter (64 bits)
+//   Reads 8 bytes at a time and mixes them with multiply/xor-shift
+uint64_t bloom_hash(const char *key) {
+	const uint64_t m= 0x9E3779B97F4A7C15ULL;
+	size_t len= strlen(key);
+	uint64_t h= len * m;
+	uint64_t v;
+
+	while (len >= 8) {
+		memcpy(&v, key, 8);
+		h= (h ^ v) * m;
+		h ^= h >> 29;
+		key += 8;
+		len -= 8;
+	}
+	v= 0;
+	memcpy(&v, key, len);
+	h= (h ^ v) * m;
+	// Final mix (from splitmix64)
+	h ^= h >> 30;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 27;
+	h *= 0x94D049BB133111EBULL;
+	h ^= h >> 31;
+	return h;
+}
+
+
+// Compute the block and the BLOOM_K counter positions in the block for 'key'
+static inline uint8_t *locate(const Bloom_Filter *bf, const char *key, unsigned pos[BLOOM_K]) {
+	uint64_t h= bloom_hash(key);
+	uint32_t block= (uint32_t)h & ((1U << bf->nblocks_log2) - 1);
+	uint64_t bits= h >> 32;
+	int i;
+	for (i= 0; i < BLOOM_K; i++) {
+		pos[i]= bits % BLOOM_BLOCK_CNTS;	// 7 bits per counter
+		bits >>= 7;
+	}
+	return bf->cnt + (size_t)block*BLOOM_BLOCK_BYTES;
+}
+
+// Read the 4-bit counter 'i' in block 'b'
+static inline unsigned get_cnt(const uint8_t *b, unsigned i) {
+	return (b[i>>1] >> ((i&1)<<2)) & 0xF;
+}
+
+// Write the 4-bit counter 'i' in block 'b'
+static inline void set_cnt(uint8_t *b, unsigned i, unsigned v) {
+	unsigned shift= (i&1)<<2;
+	b[i>>1]= (uint8_t)((b[i>>1] & ~(0xF << shift)) | (v << shift));
+}
+
+
+// Initialize the filter with 2^nblocks_log2 blocks; returns FALSE if out of memory
+gboolean bloom_init(Bloom_Filter *bf, unsigned nblocks_log2) {
+	if (nblocks_log2 < BLOOM_MIN_LOG2)
+		nblocks_log2= BLOOM_MIN_LOG2;
+	size_t size= (size_t)BLOOM_BLOCK_BYTES << nblocks_log2;
+	// Align the counters to the cache line
+	if (posix_memalign((void **)&bf->cnt, BLOOM_BLOCK_BYTES, size)) {
+		bf->cnt= NULL;
+		return FALSE;
+	}
+	memset(bf->cnt, 0, size);
+	bf->nblocks_log2= nblocks_log2;
+	bf->n= 0;
+	return TRUE;
+}
+
+
+// Free the filter memory
+void bloom_free(Bloom_Filter *bf) {
+	free(bf->cnt);
+	bf->cnt= NULL;
+	bf->n= 0;
+}
+
+
+// Remove all keys from the filter
+void bloom_clear(Bloom_Filter *bf) {
+	if (bf->cnt != NULL)
+		memset(bf->cnt, 0, (size_t)BLOOM_BLOCK_BYTES << bf->nblocks_log2);
+	bf->n= 0;
+}
+
+
+// Add a key to the filter
+void bloom_add(Bloom_Filter *bf, const char *key) {
+	unsigned pos[BLOOM_K];
+	uint8_t *b;
+	int i;
+	if (bf->cnt == NULL)
+		return;
+	b= locate(bf, key, pos);
+	for (i= 0; i < BLOOM_K; i++) {
+		unsigned v= get_cnt(b, pos[i]);
+		if (v < 0xF)	// Saturates at 15
+			set_cnt(b, pos[i], v+1);
+	}
+	bf->n++;
+}
+
+
+// Remove a key previously added to the filter
+void bloom_del(Bloom_Filter *bf, const char *key) {
+	unsigned pos[BLOOM_K];
+	uint8_t *b;
+	int i;
+	if (bf->cnt == NULL)
+		return;
+	b= locate(bf, key, pos);
+	for (i= 0; i < BLOOM_K; i++) {
+		unsigned v= get_cnt(b, pos[i]);
+		if ((v > 0) && (v < 0xF))	// Saturated counters are sticky
+			set_cnt(b, pos[i], v-1);
+	}
+	if (bf->n > 0)
+		bf->n--;
+}
+
+
+// Return FALSE if 'key' is surely not in the filter, TRUE if it may be
+gboolean bloom_may_contain(const Bloom_Filter *bf, const char *key) {
+	unsigned pos[BLOOM_K];
+	const uint8_t *b;
+	int i;
+	if (bf->cnt == NULL)
+		return TRUE;	// No filter: everything may be there
+	b= locate(bf, key, pos);
+	for (i= 0; i < BLOOM_K; i++) {
+		if (get_cnt(b, pos[i]) == 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+
+// Return TRUE if the filter has too many keys for its size and should be rebuilt
+gboolean bloom_overloaded(const Bloom_Filter *bf) {
+	return bf->n*BLOOM_CNTS_PER_KEY > ((unsigned long)BLOOM_BLOCK_CNTS << bf->nblocks_log2);
+}
+
+
+// Return the number of blocks (log2) recommended for 'n' keys
+unsigned bloom_size_for(unsigned long n) {
+	unsigned log2= BLOOM_MIN_LOG2;
+	// Leave room to double the number of keys before growing again
+	while (2*n*BLOOM_CNTS_PER_KEY > ((unsigned long)BLOOM_BLOCK_CNTS << log2))
+		log2++;
+	return log2;
+}
+
+
+// Return the expected false positive rate for the current number of keys
+double bloom_fp_rate(const Bloom_Filter *bf) {
+	double m= (double)((unsigned long)BLOOM_BLOCK_CNTS << bf->nblocks_log2);
+	return pow(1.0 - exp(-(double)BLOOM_K*bf->n/m), BLOOM_K);
+}
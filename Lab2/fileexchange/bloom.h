@@ -0,0 +1,68 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * bloom.h
+ *
+ * Header file of a counting Bloom filter over filenames
+ *
+ * The filter is blocked: the BLOOM_K counters of a key are all in the same
+ * 64 byte block (one cache line), so a lookup costs one hash and at most one
+ * cache miss. Counters have 4 bits, allowing deletions; a saturated counter
+ * is never decremented.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_BLOOM_H_
+#define _INCL_BLOOM_H_
+
+#include <stdint.h>
+#include <glib.h>
+
+
+#define BLOOM_K				4		/* Counters per key */
+#define BLOOM_BLOCK_BYTES	64		/* Block size - one cache line */
+#define BLOOM_BLOCK_CNTS	(2*BLOOM_BLOCK_BYTES)	/* 4-bit counters per block */
+#define BLOOM_CNTS_PER_KEY	10		/* Counters per key before growing */
+#define BLOOM_MIN_LOG2		6		/* Minimum number of blocks (log2) */
+
+
+// Counting Bloom filter
+typedef struct Bloom_Filter {
+	uint8_t *cnt;			// 4-bit counters, BLOOM_BLOCK_BYTES per block
+	uint32_t nblocks_log2;	// Number of blocks (log2)
+	unsigned long n;		// Number of keys in the filter
+} Bloom_Filter;
+
+
+// Hash function used by the filter (64 bits)
+uint64_t bloom_hash(const char *key);
+
+// Initialize the filter with 2^nblocks_log2 blocks; returns FALSE if out of memory
+gboolean bloom_init(Bloom_Filter *bf, unsigned nblocks_log2);
+
+// Free the filter memory
+void bloom_free(Bloom_Filter *bf);
+
+// Remove all keys from the filter
+void bloom_clear(Bloom_Filter *bf);
+
+// Add a key to the filter
+void bloom_add(Bloom_Filter *bf, const char *key);
+
+// Remove a key previously added to the filter
+void bloom_del(Bloom_Filter *bf, const char *key);
+
+// Return FALSE if 'key' is surely not in the filter, TRUE if it may be
+gboolean bloom_may_contain(const Bloom_Filter *bf, const char *key);
+
+// Return TRUE if the filter has too many keys for its size and should be rebuilt
+gboolean bloom_overloaded(const Bloom_Filter *bf);
+
+// Return the number of blocks (log2) recommended for 'n' keys
+unsigned bloom_size_for(unsigned long n);
+
+// Return the expected false positive rate for the current number of keys
+double bloom_fp_rate(const Bloom_Filter *bf);
+
+#endif
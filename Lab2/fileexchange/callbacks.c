@@ -9,7 +9,6 @@
  *
  * @author  Luis Bernardo
 \*****************************************************************************/
-#include <gtk/gtk.h>
 #include <arpa/inet.h>
 #include <assert.h>
 #include <time.h>
@@ -17,9 +16,14 @@
 #include <glib.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
 #include "file.h"
 #include "sock.h"
-#include "gui.h"
+#include "host.h"
+#include "filetable.h"
+#include "metrics.h"
+#include "filecache.h"
 #include "callbacks.h"
 #include "callbacks_socket.h"
 #include "thread.h"
@@ -50,9 +54,11 @@ char *out_dir= NULL;
 // Query control variables
 int			qid;			// Sequence number
 char		qname[81]; 		// Name looked up
+long long	qsent_ns;		// Time the QUERY was sent
 
-// Auxiliary variable set to TRUE when the filelist is modified
-gboolean filelist_modified= FALSE;
+// Search control variables
+uint32_t	sid;			// Sequence number
+char		sname[FILENAME_MAX_LENGTH];	// Pattern searched
 
 
 
@@ -60,132 +66,144 @@ gboolean filelist_modified= FALSE;
 |*  Local variables  *|
 \*********************/
 
-static int counter = 0; // Used to define unique numbers for incoming files
+static int counter = 0; // Used to define unique query and search IDs
 static char tmp_buf[8000];
 
+#define QSTATS_SAMPLE	16		// Time one in QSTATS_SAMPLE QUERYs
+
+
 
 
 /*******************************************************\
-|* Functions that handle file list management buttons  *|
+|* Functions to control the state of the application   *|
 \*******************************************************/
 
-// Handles button "Add" - adds a file to the file list
-void on_buttonAdd_clicked (GtkButton *button, gpointer user_data) {
-	const gchar *filename= get_open_filename (main_window);
-	if (filename != NULL) {
-		if (!add_File(filename, FALSE)) {
-			sprintf(tmp_buf, "File %s not added to file list\n", filename);
-			Log("File not added");
-		}
-	}
-	filelist_modified= TRUE;
+
+// Return the current time in nanoseconds
+static inline long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
 }
 
 
-// Handles button "Remove" - removes a file from the list
-void on_buttonRemove_clicked (GtkButton *button, gpointer user_data)
-{
-	GtkTreeSelection *selection;
-	GtkTreeModel	*model;
-	GtkTreeIter	iter;
-	gchar *str_filename;
-
-	selection= gtk_tree_view_get_selection(main_window->treeFile);
-	if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
-		gtk_tree_model_get (model, &iter, 0, &str_filename, -1);
-#ifdef DEBUG
-		g_print ("File %s will be removed\n", str_filename);
-#endif
-		g_free (str_filename);
-	} else {
-		Log ("No file selected\n");
-		return;
-	}
+// Log the statistics of the QUERY Bloom filter pre-check
+void log_query_stats(void) {
+	Query_Stats qstats= file_table.qstats;
+	unsigned long long negatives= qstats.rejected + qstats.false_pos;
+	double check_ns= qstats.checks_timed ? (double)qstats.check_ns/qstats.checks_timed : 0;
+	double lookup_ns= qstats.lookups_timed ? (double)qstats.lookup_ns/qstats.lookups_timed : 0;
+	// Each rejected QUERY saves one file table lookup
+	double saved_ns= qstats.queries ? (lookup_ns*qstats.rejected)/qstats.queries : 0;
 
-	if (!gtk_list_store_remove(main_window->listFile, &iter)) {
-		Log("Failed to remove file from list\n");
-	}
-	filelist_modified= TRUE;
+	sprintf(tmp_buf, "QUERY filter: %llu queries, %llu rejected, %llu false positives "
+			"(measured FP rate %.4f, expected %.4f)\n",
+			qstats.queries, qstats.rejected, qstats.false_pos,
+			negatives ? (double)qstats.false_pos/negatives : 0.0, ft_fp_rate(&file_table));
+	Log(tmp_buf);
+	sprintf(tmp_buf, "QUERY filter: check %.1f ns, lookup %.1f ns, saved %.1f ns per query\n",
+			check_ns, lookup_ns, saved_ns);
+	Log(tmp_buf);
 }
 
 
-// Handle button "Open" - read the content of a filelist from a file
-void on_buttonOpen_clicked (GtkButton *button, gpointer user_data)
-{
-	add_filelist(get_Filelist_Filename(), FALSE);
-	filelist_modified= TRUE;
-	Log("File list opened\n");
-}
+// Answer QUERY 'seq' for 'fname' from file table 'ft', writing the HIT (with server
+//    'srvIP' and 'tport') into 'hbuf'; returns FALSE if the file is not in the table
+gboolean answer_query(File_Table *ft, uint32_t seq, const char *fname, struct in6_addr *srvIP,
+		unsigned short tport, char *hbuf, int *hlen) {
+	Query_Stats *qs= &ft->qstats;
+
+	// Reject QUERYs for files we surely do not have before searching the file table
+	gboolean timed= (qs->queries++ % QSTATS_SAMPLE) == 0;
+	long long t0= timed ? now_ns() : 0;
+	if (!ft_may_have(ft, fname)) {
+		qs->rejected++;
+		if (timed) {
+			qs->check_ns += now_ns()-t0;
+			qs->checks_timed++;
+		}
+		return FALSE;
+	}
+	if (timed) {
+		long long t1= now_ns();
+		qs->check_ns += t1-t0;
+		qs->checks_timed++;
+		t0= t1;
+	}
 
+	unsigned long long flen;
+	unsigned long long fhash;
+	gboolean found= ft_details(ft, fname, &flen, &fhash);
+	if (timed) {
+		long long dt= now_ns()-t0;
+		qs->lookup_ns += dt;
+		qs->lookups_timed++;
+		metric_observe(MH_LOOKUP_NS, dt);
+	}
+	if (!found) {
+		qs->false_pos++;
+		return FALSE;
+	}
 
-// Handle button "Save" - Write the filelist to a file
-void on_buttonSave_clicked (GtkButton *button, gpointer user_data)
-{
-	write_filelist(get_Filelist_Filename(), FALSE);
-	filelist_modified= FALSE;
-	Log("File list saved\n");
+	if (!write_hit_message(hbuf, hlen, seq, fname, flen, (uint32_t)fhash, tport, srvIP)) {
+		Log_level(FX_LOG_ERROR, "ERROR: writing Hit message\n");
+		return FALSE;
+	}
+	return TRUE;
 }
 
 
-/*******************************************************\
-|* Functions to control the state of the application   *|
-\*******************************************************/
-
-
 // Handle the reception of a Query packet
-void handle_Query(char *buf, int buflen, gboolean from_IPv6, struct in6_addr *ip, u_short port) {
+void handle_Query(char *buf, int buflen, gboolean from_IPv6, struct in6_addr *ip, u_short port,
+		unsigned ifindex) {
 	uint32_t seq;
 	const char *fname;
 
+	metric_add(MC_QUERIES_RECEIVED, 1);
 	if (!read_query_message(buf, buflen, &seq, &fname)) {
 		Log("Invalid Query packet\n");
+		metric_add(MC_QUERIES_DROPPED, 1);
 		return;
 	}
 
 	assert ((fname != NULL) && (ip != NULL));
 	if (strcmp(fname, get_trunc_filename(fname))) {
-		Log("ERROR: The Query must not include the pathname - use 'get_trunc_filename'\n");
-		return;
-	}
-	sprintf(tmp_buf, "Received Query '%s' from [%s]:%hu\n", fname, addr_ipv6(ip), port);
-	Log(tmp_buf);
-
-	unsigned long long flen;
-	unsigned long long fhash;
-	if (!get_File_details(fname, &flen, &fhash, TRUE)) {
-		g_print("File not found\n");
-		free((void *)fname);
+		Log_level(FX_LOG_ERROR, "ERROR: The Query must not include the pathname - use 'get_trunc_filename'\n");
+		metric_add(MC_QUERIES_DROPPED, 1);
 		return;
 	}
+	LOGF(FX_LOG_DEBUG, "Received Query '%s' from [%s]:%hu\n", fname, addr_ipv6(ip), port);
 
 	// Prepare Hit packet
 	int hlen;
 	static char hbuf[MESSAGE_MAX_LENGTH];  // sending buffer
 	struct in6_addr srvIP;
 
-	// Get the server IP address
-	if (from_IPv6)
-		memcpy(&srvIP, &local_ipv6, sizeof(struct in6_addr));
-	else
-		translate_ipv4_to_ipv6(addr_ipv4(&local_ipv4), &srvIP);
+	// Get the server IP address: an address of the interface where the Query arrived,
+	//   so the transfer uses the same network
+	if (!get_interface_address(ifindex, from_IPv6 ? AF_INET6 : AF_INET, &srvIP)) {
+		if (from_IPv6)
+			memcpy(&srvIP, &local_ipv6, sizeof(struct in6_addr));
+		else
+			translate_ipv4_to_ipv6(addr_ipv4(&local_ipv4), &srvIP);
+	}
 
-	if (!write_hit_message(hbuf, &hlen, seq, fname, flen, fhash, port_TCP, &srvIP)) {
-		Log("ERROR: writing Hit message\n");
-		free((void *)fname);
+	if (!answer_query(&file_table, seq, fname, &srvIP, port_TCP, hbuf, &hlen)) {
+		LOGF(FX_LOG_DEBUG, "File not found\n");
+		metric_add(MC_QUERIES_DROPPED, 1);
 		return;
 	}
 	// Send packet
 	send_unicast(ip, port, hbuf, hlen);
-	free((void *)fname);
+	metric_add(MC_QUERIES_ANSWERED, 1);
 }
 
 
 // Handle the reception of an Hit packet
 void handle_Hit(char *buf, int buflen, struct in6_addr *ip, u_short port) {
-	static int counter= 0;
 	uint32_t seq;
 	const char *fname;
-	char ofname[256];
+	char ofname[512];
 	unsigned long long flen;
 	uint32_t fhash;
 	unsigned short sTCPport;
@@ -196,6 +214,9 @@ void handle_Hit(char *buf, int buflen, struct in6_addr *ip, u_short port) {
 		Log("Invalid Hit packet\n");
 		return ;
 	}
+	metric_add(MC_HITS_RECEIVED, 1);
+	if (waitingForHIT && (seq == (uint32_t)qid))
+		metric_observe(MH_HIT_LATENCY_US, (now_ns()-qsent_ns)/1000);
 
 	waitingForHIT = FALSE;
 	sprintf(tmp_buf, "Received Hit '%s' (IP= %s; port= %hu; Len=%llu; Hash=%u)\n", fname,
@@ -219,99 +240,216 @@ void handle_Hit(char *buf, int buflen, struct in6_addr *ip, u_short port) {
 	//  ...
 
 
-	// Set the filename where the received data will be created
-	sprintf(ofname, "%s/file%d.out", out_dir, counter++);
+	// Set the filename where the received file is published - without the remote path
+	const char *bname= get_trunc_filename(fname);
+	if (!*bname || !strcmp(bname, ".") || !strcmp(bname, "..")
+			|| (snprintf(ofname, sizeof(ofname), "%s/%s", out_dir, bname) >= (int)sizeof(ofname))) {
+		LOGF(FX_LOG_WARNING, "Invalid filename '%s' in HIT - ignored\n", fname);
+		return;
+	}
 	// Start new download
 	start_file_download_thread(ip, sTCPport, fname, ofname, flen, fhash, get_slow());
 }
 
 
+// Handle the reception of a Search packet
+void handle_Search(char *buf, int buflen, struct in6_addr *ip, u_short port) {
+	Search_View sv;
+	Tgram_Match res[SEARCH_PAGE_SIZE];
+	SResult_Entry entries[SEARCH_PAGE_SIZE];
+	gboolean more;
+	int n, i, rlen;
+	static char rbuf[SRESULT_MAX_LENGTH];  // sending buffer
+
+	metric_add(MC_SEARCHES_RECEIVED, 1);
+	if (!decode_search(buf, buflen, &sv)) {
+		Log("Invalid Search packet\n");
+		return;
+	}
+	assert (ip != NULL);
+	LOGF(FX_LOG_DEBUG, "Received Search '%s' (offset %u) from [%s]:%hu\n", sv.pattern, sv.offset,
+			addr_ipv6(ip), port);
+
+	n= ft_search(&file_table, sv.pattern, (sv.offset > INT_MAX) ? INT_MAX : (int)sv.offset,
+			SEARCH_PAGE_SIZE, res, &more);
+	if ((n == 0) && (sv.offset == 0) && !more) {
+		LOGF(FX_LOG_DEBUG, "No file matches\n");
+		return;		// Like QUERYs, only peers with matches answer
+	}
+	for (i= 0; i < n; i++) {
+		entries[i].filename= res[i].name;
+		entries[i].flen= res[i].flen;
+	}
+	rlen= encode_sresult(rbuf, sizeof(rbuf), sv.seq, sv.offset, more, entries, n);
+	if (rlen < 0) {
+		Log_level(FX_LOG_ERROR, "ERROR: writing Search result message\n");
+		return;
+	}
+	// Send packet
+	send_unicast(ip, port, rbuf, rlen);
+}
+
+
+// Handle the reception of a Search result packet
+void handle_SResult(char *buf, int buflen, struct in6_addr *ip, u_short port) {
+	SResult_View rv;
+	SResult_Entry e;
+	const char *pt;
+
+	if (!decode_sresult(buf, buflen, &rv)) {
+		Log("Invalid Search result packet\n");
+		return;
+	}
+	if (rv.seq != sid) {
+		LOGF(FX_LOG_DEBUG, "Search result for an old search (%u) - ignored\n", rv.seq);
+		return;
+	}
+	sprintf(tmp_buf, "Search '%s' results %u-%u from [%s]:%hu%s\n", sname, rv.offset,
+			rv.offset+rv.count, addr_ipv6(ip), port, rv.more ? " (more)" : "");
+	Log(tmp_buf);
+	for (pt= rv.entries; next_sresult_entry(&rv, &pt, &e); ) {
+		sprintf(tmp_buf, "\t%s (Len=%llu)\n", e.filename, e.flen);
+		Log(tmp_buf);
+	}
+
+	// Ask the same peer for the next page
+	if (rv.more && (rv.count > 0) && (rv.offset+rv.count < SEARCH_MAX_RESULTS)) {
+		int slen= encode_search(tmp_buf, sizeof(tmp_buf), sid, rv.offset+rv.count, sname);
+		if (slen < 0) {
+			Log_level(FX_LOG_ERROR, "ERROR: failed to prepare Search message\n");
+			return;
+		}
+		send_unicast(ip, port, tmp_buf, slen);
+	}
+}
+
+
 // Close everything
 void close_all(void) {
-	stop_all_threads_GUI(FALSE);
+	stop_all_threads_GUI(FALSE);	// Also clears the GUI list
+	watch_local_IP(FALSE);
 	close_sockUDP();
 	close_sockTCP();
-	GUI_clear_threads(FALSE);
 }
 
 
-// Button that starts and stops the application
-void on_togglebutton1_toggled(GtkToggleButton *togglebutton, gpointer user_data) {
+// Set the directory where received files are written (copied)
+void fx_set_out_dir(const char *dir) {
+	assert(dir != NULL);
+	g_free(out_dir);
+	out_dir= g_strdup(dir);
+}
 
-	if (gtk_toggle_button_get_active(togglebutton)) {
 
-		// *** Start the server ***
-		const gchar *addr4_str, *addr6_str;
+// Start the server on the multicast groups 'addr4' and/or 'addr6' (NULL to disable) and 'mport'
+//    Returns TRUE if it is active
+gboolean fx_start(const char *addr4, const char *addr6, unsigned short mport) {
+	if (active)
+		return TRUE;
+	if (out_dir == NULL)
+		fx_set_out_dir("/tmp");
+	// Get local IP, and follow its changes
+	set_local_IP();
+	watch_local_IP(TRUE);
+	if ((mport == 0) || (mport > 32767)) {
+		Log("Invalid multicast port number\n");
+		return FALSE;
+	}
+	port_MCast = mport;
+
+	if ((addr4 != NULL) && (strlen(addr4) == 0))
+		addr4= NULL;
+	if ((addr6 != NULL) && (strlen(addr6) == 0))
+		addr6= NULL;
+	if (!addr6 && !addr4)
+		return FALSE;
+	if (!init_sockets(port_MCast, addr4, addr6)) {
+		Log("Failed configuration of server\n");
+		return FALSE;
+	}
+	active = TRUE;
+	Log("fileexchange active\n");
+	return TRUE;
+}
 
-		// Get local IP
-		set_local_IP();
-		int n = get_PortMulticast();
-		if (n < 0) {
-			Log("Invalid multicast port number\n");
-			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
-			return;
-		}
-		port_MCast = (unsigned short) n;
 
-		addr6_str = get_IPv6Multicast(NULL);
-		addr4_str = get_IPv4Multicast(NULL);
-		if (!addr6_str && !addr4_str) {
-			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
-			return;
-		}
-		if (!init_sockets(port_MCast, addr4_str, addr6_str)) {
-			Log("Failed configuration of server\n");
-			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
-			return;
-		}
-		set_PortTCP(port_TCP);
-		set_PID(getpid());
-		//
-		block_entrys(TRUE);
-		active = TRUE;
-		Log("fileexchange active\n");
+// Stop the server and all transfers
+void fx_stop(void) {
+	if (!active)
+		return;
+	if (waitingForHIT) {
+		g_source_remove(t_id);	// Cancel timer
+		waitingForHIT = FALSE;
+	}
+	close_all();
+	active = FALSE;
+	log_query_stats();
+	Log("fileexchange stopped\n");
+}
 
-	} else {
 
-		// *** Stop the server ***
-		close_all();
-		block_entrys(FALSE);
-		set_PID(0);
-		active = FALSE;
-		Log("fileexchange stopped\n");
-	}
+// Return TRUE if the server is active
+gboolean fx_active(void) {
+	return active;
+}
+
+
+// Return the TCP port used to send files, or 0 if the server is not active
+unsigned short fx_tcp_port(void) {
+	return active ? port_TCP : 0;
+}
+
+
+// Log the statistics of the file cache of the senders, if it is enabled
+static void log_file_cache_stats(void) {
+	File_Cache_Stats cs;
+
+	file_cache_stats(&cs);
+	if (cs.budget == 0)
+		return;
+	sprintf(tmp_buf, "File cache: %llu hits, %llu misses (hit ratio %.3f), %llu bytes sent from "
+			"memory, %u files in %llu of %llu bytes\n", cs.hits, cs.misses,
+			(cs.hits + cs.misses) ? (double)cs.hits/(cs.hits + cs.misses) : 0.0, cs.hit_bytes,
+			cs.files, cs.used, cs.budget);
+	Log(tmp_buf);
+}
+
 
+// Log the engine statistics
+void fx_log_stats(void) {
+	log_query_stats();
+	log_file_cache_stats();
 }
-gboolean callback_QUERY_timer (gpointer data)
+
+
+static gboolean callback_QUERY_timer (gpointer data)
 {
 	waitingForHIT = FALSE;
-	Log("QUERY TIMED OUT!");
+	Log("QUERY TIMED OUT!\n");
 	return FALSE; // cancels the timer
 }
 
-// Called when the user clicks "Query file"
-void on_buttonQuery_clicked (GtkButton *button, gpointer user_data)
-{
 
+// Send a QUERY for 'name' and download the file from the first HIT
+gboolean fx_query(const char *name)
+{
 	if (!active) {
 		Log("fileexchange is not active\n");
-		return;
+		return FALSE;
 	}
 
-	const gchar *name;
 	if (waitingForHIT) {
-		Log("Still waiting for timeout!");
-		return;
+		Log("Still waiting for timeout!\n");
+		return FALSE;
 	}
-	// Read parameters
-	name = get_QueryFile();
+	// Validate parameters
 	if ((name == NULL) || (strlen(name) == 0)) {
 		Log("Empty file name is query\n");
-		return;
+		return FALSE;
 	}
 	if (strcmp(name, get_trunc_filename(name))) {
-		Log("ERROR: the query file name must not include the pathname\n");
-		return;
+		Log_level(FX_LOG_ERROR, "ERROR: the query file name must not include the pathname\n");
+		return FALSE;
 	}
 
 	// Prepare query message
@@ -320,8 +458,8 @@ void on_buttonQuery_clicked (GtkButton *button, gpointer user_data)
 	qname[sizeof(qname)-1]= '\0';			// Query name
 	int qlen;
 	if (!write_query_message(tmp_buf, &qlen, qid, qname)) {
-		Log("ERROR: failed to prepare Query message\n");
-		return;
+		Log_level(FX_LOG_ERROR, "ERROR: failed to prepare Query message\n");
+		return FALSE;
 	}
 
 	// Send query message
@@ -343,39 +481,56 @@ void on_buttonQuery_clicked (GtkButton *button, gpointer user_data)
 	if (!sent) {
 		Log("fileexchange failed to send multicast packet - terminating\n");
 		close_all();
-		return;
+		return FALSE;
 	}
 
-	// Log("Please complete the function callbacks.on_buttonQuery_clicked (TASK 1) to handle the 'Query file' button\n");
-
-
-	// TASK 1 - complete this function
-	//
-	//  After sending the Query, fileexchange must wait for an HIT for up to during 5 seconds and
-	//			prevent sending more QUERYs
-	//	You must:
-	//		1) Add a new variables to know that you are waiting for an HIT message
-	//		2) add a new function (callback_QUERY_timer) to handle the timeout event
-	//		2) start a timer (you need a new variable), to count the QUERY_TIMEOUT maximum waiting time
-	//		3) modify the source code above to avoid having more QUERYs sent while waiting for an HIT or TIMEOUT
-	//
-	// Suggestion:
-	//	Read the tutorial (Introduction to the development of applications in Gnome 3):
-	//	- in section 2.2.2.6, an explanation on how to use timers;
+	// Wait up to QUERY_TIMEOUT for the HIT, without sending more QUERYs
 	waitingForHIT = TRUE;
+	qsent_ns= now_ns();
 	t_id = g_timeout_add(QUERY_TIMEOUT, callback_QUERY_timer,NULL);
+	return TRUE;
 }
 
 
-// Callback function that handles the end of the closing of the main window
-gboolean on_window1_delete_event (GtkWidget * widget,
-		GdkEvent * event, gpointer user_data)
+// Send a SEARCH for names containing 'pattern', or matching it if it has
+//   glob characters (*, ?, [...])
+gboolean fx_search(const char *pattern)
 {
-	if (filelist_modified)
-		write_filelist(get_Filelist_Filename(), FALSE);
-	stop_all_threads_GUI(FALSE);
-	gtk_main_quit ();		// Close Gtk main cycle
-	return FALSE;			// Must always return FALSE; otherwise the window is not closed.
-}
+	if (!active) {
+		Log("fileexchange is not active\n");
+		return FALSE;
+	}
+
+	if ((pattern == NULL) || (strlen(pattern) == 0)) {
+		Log("Empty search pattern\n");
+		return FALSE;
+	}
+	if (strchr(pattern, '/') != NULL) {
+		Log_level(FX_LOG_ERROR, "ERROR: the search pattern must not include the pathname\n");
+		return FALSE;
+	}
 
+	// Prepare search message; results of previous searches are ignored from now on
+	sid= ++counter;
+	strncpy(sname, pattern, sizeof(sname)-1);
+	sname[sizeof(sname)-1]= '\0';
+	int slen= encode_search(tmp_buf, sizeof(tmp_buf), sid, 0, sname);
+	if (slen < 0) {
+		Log_level(FX_LOG_ERROR, "ERROR: failed to prepare Search message\n");
+		return FALSE;
+	}
 
+	// Send search message
+	gboolean sent= FALSE;
+	if (active4 && send_multicast(tmp_buf, slen, FALSE))
+		sent= TRUE;
+	if (active6 && send_multicast(tmp_buf, slen, TRUE))
+		sent= TRUE;
+	if (!sent) {
+		Log("Error sending Search multicast\n");
+		return FALSE;
+	}
+	sprintf(tmp_buf, "Searching '%s'\n", sname);
+	Log(tmp_buf);
+	return TRUE;
+}
@@ -12,9 +12,10 @@
 #ifndef INCL_CALLBACKS_
 #define INCL_CALLBACKS_
 
-#include <gtk/gtk.h>
 #include <glib.h>
-#include "gui.h"
+#include <netinet/in.h>
+#include "fileexchange.h"
+#include "filetable.h"
 
 
 #ifndef FALSE
@@ -26,6 +27,7 @@
 
 
 #define QUERY_TIMEOUT		5000	/* 5 seconds */
+#define SEARCH_MAX_RESULTS	256		/* Maximum number of results requested from each peer */
 
 
 typedef enum { S_IDLE, S_WAIT_HIT } QueryState;
@@ -40,49 +42,35 @@ struct Thread_Data;
 
 extern gboolean active; // TRUE if server is active
 
-// Main window
-extern WindowElements *main_window;
 // Directory pathname to write output files
 extern char *out_dir;
-// List with active TCP connections/subprocesses
-extern GList *tcp_conn;
-
-
-/*******************************************************\
-|* Functions that handle file list management buttons  *|
-\*******************************************************/
-
-// Handle button "Add" - add a file to the file list
-void on_buttonAdd_clicked (GtkButton *button, gpointer user_data);
-// Handle button "Remove" - remove a file from the list
-void on_buttonRemove_clicked (GtkButton *button, gpointer user_data);
-// Handle button "Open" - read the content of a filelist from a file
-void on_buttonOpen_clicked (GtkButton *button, gpointer user_data);
-// Handle button "Save" - Write the filelist to a file
-void on_buttonSave_clicked (GtkButton *button, gpointer user_data);
+// Active TCP connections/threads, indexed by transfer id
+extern GHashTable *tcp_conn;
 
 
 /*******************************************************\
 |* Functions to control the state of the application   *|
 \*******************************************************/
 
+// Answer QUERY 'seq' for 'fname' from file table 'ft', writing the HIT (with server
+//    'srvIP' and 'tport') into 'hbuf'; returns FALSE if the file is not in the table
+gboolean answer_query(File_Table *ft, uint32_t seq, const char *fname, struct in6_addr *srvIP,
+		unsigned short tport, char *hbuf, int *hlen);
 // Handle the reception of a Query packet
-void handle_Query(char *buf, int buflen, gboolean from_IPv6, struct in6_addr *ip, u_short port);
+//   'ifindex' is the interface where it arrived (0 if unknown)
+void handle_Query(char *buf, int buflen, gboolean from_IPv6, struct in6_addr *ip, u_short port,
+		unsigned ifindex);
+// Log the statistics of the QUERY Bloom filter pre-check
+void log_query_stats(void);
 // Handle the reception of an Hit packet
 // First to be implemented
 void handle_Hit(char *buf, int buflen, struct in6_addr *ip, u_short port);
+// Handle the reception of a Search packet
+void handle_Search(char *buf, int buflen, struct in6_addr *ip, u_short port);
+// Handle the reception of a Search result packet
+void handle_SResult(char *buf, int buflen, struct in6_addr *ip, u_short port);
 
 // Close everything
 void close_all(void);
 
-// Button that starts and stops the application
-void on_togglebutton1_toggled(GtkToggleButton *togglebutton, gpointer user_data);
-
-// Called when the user clicks "Query file"
-void on_buttonQuery_clicked (GtkButton *button, gpointer user_data);
-
-// Callback function that handles the end of the closing of the main window
-gboolean on_window1_delete_event (GtkWidget * widget,
-		GdkEvent * event, gpointer user_data);
-
 #endif
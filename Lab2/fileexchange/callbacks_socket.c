@@ -8,16 +8,23 @@
  *
  * @author  Luis Bernardo
 \*****************************************************************************/
-#include <gtk/gtk.h>
+#define _GNU_SOURCE		// accept4
+#include <glib.h>
 #include <arpa/inet.h>
 #include <assert.h>
 #include <time.h>
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <net/if.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "file.h"
 #include "sock.h"
-#include "gui.h"
+#include "host.h"
 #include "callbacks.h"
 #include "callbacks_socket.h"
 
@@ -62,8 +69,20 @@ int sockTCP = -1; // IPv6 TCP socket descriptor
 GIOChannel *chanTCP = NULL; // GIO channel descriptor of TCPv6 socket
 guint chanTCP_id = 0; // Channel number of socket TCPv6
 
+#define TCP_BACKLOG		1024	// Default length of the queue of pending connections
+#define MAX_ACCEPTORS	64		// Maximum number of acceptor threads
+#define ACCEPT_RETRY	10000	// Wait before accepting again after a failure (us)
+
+static int tcp_backlog= TCP_BACKLOG;	// Length of the queue of pending connections
+static int n_acceptors= 0;				// Acceptor threads (0: accept in the main loop)
+static int acceptor_socks[MAX_ACCEPTORS];	// Listening sockets of the acceptor threads
+static pthread_t acceptor_tids[MAX_ACCEPTORS];
+static int acceptors_running= 0;		// Acceptor threads started
+static guint accept_retry_id= 0;		// Timer that restores the TCP callback after a failure
+
 /* Local variables */
 static char tmp_buf[8000];
+static char *mcast_ifnames= NULL;	// Interfaces that join the groups (comma separated; NULL: all)
 
 
 
@@ -77,36 +96,26 @@ gboolean write_query_message(char *buf, int *len, uint32_t seq, const char* file
 	if ((buf == NULL) || (len == NULL) || (filename == NULL))
 		return FALSE;
 
-	short int fnlen= strlen(filename)+1;
-	unsigned char cod= MSG_QUERY;
-	char *pt= buf;
-	WRITE_BUF(pt, &cod, 1);
-	WRITE_BUF(pt, &seq, 4);
-	WRITE_BUF(pt, &fnlen, 2);
-	WRITE_BUF(pt, filename, fnlen);
-	*len= pt-buf;
+	int n= encode_query(buf, QUERY_MAX_LENGTH, seq, filename);
+	if (n < 0)
+		return FALSE;
+	*len= n;
 	return TRUE;
 }
 
 
 // Read the QUERY message fields ('seq', 'filename') from buffer 'buf'
 //    with length 'len'; returns TRUE if successful, or FALSE otherwise
+//    'filename' points into 'buf' - it must not be freed
 gboolean read_query_message(char *buf, int len, uint32_t *seq, const char **filename) {
-	if ((buf == NULL) || (seq == NULL) || (filename == NULL) || (len <= 9))
+	if ((buf == NULL) || (seq == NULL) || (filename == NULL))
 		return FALSE;
 
-	unsigned char cod;
-	char *pt= buf;
-	short int fnlen;
-
-	READ_BUF(pt, &cod, 1);
-	if (cod != MSG_QUERY)
-		return FALSE;
-	READ_BUF(pt, seq, 4);
-	READ_BUF(pt, &fnlen, 2);
-	if ((fnlen != len-7) || (strlen(pt) != fnlen-1))
+	Query_View q;
+	if (!decode_query(buf, len, &q))
 		return FALSE;
-	*filename= strdup(pt);
+	*seq= q.seq;
+	*filename= q.filename;
 	return TRUE;
 }
 
@@ -115,52 +124,35 @@ gboolean read_query_message(char *buf, int len, uint32_t *seq, const char **file
 //    and returns the length in 'len'
 gboolean write_hit_message(char *buf, int *len, uint32_t seq, const char* filename, unsigned long long flen,
 							uint32_t fhash, unsigned short sTCP_port, struct in6_addr *srvIP) {
-	char *pt= buf;
-	short int fnlen;
-
 	if ((buf == NULL) || (len == NULL) || (filename == NULL) || (sTCP_port == 0))
 		return FALSE;
 
-	fnlen= strlen(filename)+1;
-	unsigned char cod= MSG_HIT;
-	WRITE_BUF(pt, &cod, 1);
-	WRITE_BUF(pt, &seq, 4);
-	WRITE_BUF(pt, &fnlen, 2);
-	WRITE_BUF(pt, filename, fnlen);
-	WRITE_BUF(pt, &flen, sizeof(unsigned long long));
-	WRITE_BUF(pt, &fhash, 4);
-	WRITE_BUF(pt, &sTCP_port, sizeof(unsigned short));
-	WRITE_BUF(pt, srvIP, sizeof(struct in6_addr));
-	*len= pt-buf;
+	int n= encode_hit(buf, HIT_MAX_LENGTH, seq, filename, flen, fhash, sTCP_port, srvIP);
+	if (n < 0)
+		return FALSE;
+	*len= n;
 	return TRUE;
 }
 
 
 // Read the HIT message fields ('seq','filename','flen','fhash','sTCP_port') from buffer 'buf'
 //    with length 'len'; returns TRUE if successful, or FALSE otherwise
+//    'filename' points into 'buf' - it must not be freed
 gboolean read_hit_message(char *buf, int len, uint32_t *seq, const char **filename, unsigned long long *flen,
 							uint32_t *fhash, unsigned short *sTCP_port, struct in6_addr *srvIP) {
 	if ((buf == NULL) || (seq == NULL) || (filename == NULL) || (flen == NULL) ||
 			(fhash == NULL) || (sTCP_port == NULL) || (srvIP == NULL))
 		return FALSE;
 
-	unsigned char cod;
-	char *pt= buf;
-	short int fnlen;
-
-	READ_BUF(pt, &cod, 1);
-	if (cod != MSG_HIT)
+	Hit_View h;
+	if (!decode_hit(buf, len, &h))
 		return FALSE;
-	READ_BUF(pt, seq, sizeof(uint32_t));
-	READ_BUF(pt, &fnlen, sizeof(fnlen));
-	if ((fnlen != len-37) || (strlen(pt) != fnlen-1))
-		return FALSE;
-	*filename= strdup(pt);
-	pt += fnlen;
-	READ_BUF(pt, flen, sizeof(unsigned long long));
-	READ_BUF(pt, fhash, sizeof(uint32_t));
-	READ_BUF(pt, sTCP_port, sizeof(unsigned short));
-	READ_BUF(pt, srvIP, sizeof(struct in6_addr));
+	*seq= h.seq;
+	*filename= h.filename;
+	*flen= h.flen;
+	*fhash= h.fhash;
+	*sTCP_port= h.sTCP_port;
+	memcpy(srvIP, &h.srvIP, sizeof(struct in6_addr));
 	return TRUE;
 }
 
@@ -213,39 +205,92 @@ gboolean send_multicast(const char *buf, int n, gboolean use_IPv6)
 }
 
 
+// Accept one connection from listening socket 'lsock' and start its sending thread
+//   Returns 1 if it was accepted, 0 if there are no more pending connections, 2 if it is
+//   out of resources (the connections stay in the queue) and -1 if the socket failed
+static int accept_connection(int lsock) {
+	struct sockaddr_in6 server;
+	int msgsock;
+	socklen_t length = sizeof(server);
+
+	// The sending thread uses blocking reads and writes - only the listening socket is non-blocking
+	msgsock = accept4(lsock, (struct sockaddr *) &server, &length, SOCK_CLOEXEC);
+	if (msgsock == -1) {
+		switch (errno) {
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+			return 0;
+		case EINTR:
+		case ECONNABORTED:
+		case EPROTO:
+			return 1;	// Try the next one
+		case EMFILE:
+		case ENFILE:
+		case ENOBUFS:
+		case ENOMEM:
+			return 2;	// The connections stay in the queue until there are resources
+		default:
+			if (errno != EINVAL)	// EINVAL: the socket was shut down
+				perror("accept");
+			return -1;
+		}
+	}
+	LOGF(FX_LOG_INFO, "Received connection from %s - %d\n", addr_ipv6(&server.sin6_addr),
+			ntohs(server.sin6_port));
+
+	// Starts a thread to read the data from the socket
+	if (start_snd_file_thread(msgsock, &server.sin6_addr, ntohs(server.sin6_port),get_slow()) == NULL)
+		close(msgsock);
+	return 1;
+}
+
+
+// Timer callback: restore the TCP callback after ACCEPT_RETRY without resources
+static gboolean callback_accept_retry(gpointer data) {
+	accept_retry_id= 0;
+	if ((chanTCP != NULL) && !restore_socket_in_mainloop(sockTCP, NULL, &chanTCP_id, chanTCP,
+			G_IO_IN, callback_connections_TCP))
+		Log("Failed restoring the TCP callback\n");
+	return FALSE;
+}
+
+
 // Callback to receive connections at TCP socket
+//   Accepts all the pending connections in each call
 gboolean callback_connections_TCP(GIOChannel *source, GIOCondition condition,
 		gpointer data) {
+	static gboolean starved= FALSE;	// Out of resources since the last connection accepted
 
 	assert(active);
 	if (condition == G_IO_IN) {
-		// Received a new connection
-		struct sockaddr_in6 server;
-		int msgsock;
-		socklen_t length = sizeof(server);
-
-		msgsock = accept(sockTCP, (struct sockaddr *) &server, &length);
-		if (msgsock == -1) {
-			perror("accept");
+		int r;
+		// Received new connections
+		while ((r= accept_connection(sockTCP)) == 1)
+			starved= FALSE;
+		if (r < 0) {
 			Log("accept failed - aborting\nPlease turn off the application!\n");
 			return FALSE; // Turns callback off
-		} else {
-			sprintf(tmp_buf, "Received connection from %s - %d\n", addr_ipv6(
-					&server.sin6_addr), ntohs(server.sin6_port));
-			Log(tmp_buf);
-
-			// Starts a thread to read the data from the socket
-			start_snd_file_thread(msgsock, &server.sin6_addr, ntohs(server.sin6_port),get_slow());
-
-			return TRUE;
 		}
+		if (r == 2) {
+			// The pending connections would wake up the callback at once: wait for resources
+			if (!starved)
+				LOGF(FX_LOG_WARNING, "accept failed: %s - retrying every %d ms\n", strerror(errno),
+						ACCEPT_RETRY/1000);
+			starved= TRUE;
+			chanTCP_id= 0;
+			accept_retry_id= g_timeout_add(ACCEPT_RETRY/1000, callback_accept_retry, NULL);
+			return FALSE; // Restored by callback_accept_retry
+		}
+		return TRUE;
 
 	} else if ((condition == G_IO_NVAL) || (condition == G_IO_ERR)) {
 		Log("Detected error in TCP socket\n");
 		// Closes the sockets
 		close_all();
 		// Quits the application
-		gtk_main_quit();
+		quit_mainloop();
 		return FALSE; // Stops callback for receiving connections in the socket
 	} else {
 		assert(0); // Should never reach this line
@@ -285,12 +330,18 @@ gboolean callback_UDPUnicast_data(GIOChannel *source, GIOCondition condition,
 			READ_BUF(pt, &m, 1); // Reads type and advances pointer
 			// Writes date and sender's data //
 			time(&tbuf);
-			g_print("%sReceived %d bytes (unicast) from %s#%hu - type %hhd\n",
+			LOGF(FX_LOG_DEBUG, "%sReceived %d bytes (unicast) from %s#%hu - type %hhd\n",
 					ctime(&tbuf), n, ip_str, port, m);
 			switch (m) {
 			case MSG_HIT:
 				handle_Hit(buf, n, &ipv6, port);
 				break;
+			case MSG_SEARCH:	// Next page of a Search
+				handle_Search(buf, n, &ipv6, port);
+				break;
+			case MSG_SRESULT:
+				handle_SResult(buf, n, &ipv6, port);
+				break;
 
 			default:
 				sprintf(tmp_buf, "Invalid packet type (%d) in unicast socket - ignored\n",
@@ -304,7 +355,7 @@ gboolean callback_UDPUnicast_data(GIOChannel *source, GIOCondition condition,
 		// Turns sockets off
 		close_all();
 		// Closes the application
-		gtk_main_quit();
+		quit_mainloop();
 		return FALSE; // Stops callback for receiving packets from socket
 	} else {
 		assert(0); // Should never reach this line
@@ -323,6 +374,7 @@ gboolean callback_UDPMulticast_data(GIOChannel *source, GIOCondition condition,
 	char ip_str[81];
 	u_short port;
 	int n;
+	unsigned ifindex;	// Interface where the packet was received
 	gboolean from_v6= ((*(int *)data) == 6); // data was set to 4 and to 6!
 
 	if (!active) {
@@ -332,11 +384,11 @@ gboolean callback_UDPMulticast_data(GIOChannel *source, GIOCondition condition,
 	if (condition == G_IO_IN) {
 		// Receive packet //
 		if (from_v6 && active6) {
-			n = read_data_ipv6(sockUDP6, buf, MESSAGE_MAX_LENGTH, &ipv6, &port);
+			n = read_data_ipv6_if(sockUDP6, buf, MESSAGE_MAX_LENGTH, &ipv6, &port, &ifindex);
 			strncpy(ip_str, addr_ipv6(&ipv6), sizeof(ip_str)-1);
 			ip_str[sizeof(ip_str)-1]= '\0';
 		} else if (!from_v6 && active4) {
-			n = read_data_ipv4(sockUDP4, buf, MESSAGE_MAX_LENGTH, &ipv4, &port);
+			n = read_data_ipv4_if(sockUDP4, buf, MESSAGE_MAX_LENGTH, &ipv4, &port, &ifindex);
 			strncpy(ip_str, addr_ipv4(&ipv4), sizeof(ip_str)-1);
 			ip_str[sizeof(ip_str)-1]= '\0';
 			if (!translate_ipv4_to_ipv6(ip_str, &ipv6)) {
@@ -361,11 +413,14 @@ gboolean callback_UDPMulticast_data(GIOChannel *source, GIOCondition condition,
 			READ_BUF(pt, &m, 1); // Reads type and advances pointer
 			// Write date and sender's data //
 			time(&tbuf);
-			g_print("%sReceived %d bytes (multicast) from %s#%hu - type %hhd\n",
+			LOGF(FX_LOG_DEBUG, "%sReceived %d bytes (multicast) from %s#%hu - type %hhd\n",
 					ctime(&tbuf), n, ip_str, port, m);
 			switch (m) {
 			case MSG_QUERY:
-				handle_Query(buf, n, from_v6, &ipv6, port);
+				handle_Query(buf, n, from_v6, &ipv6, port, ifindex);
+				break;
+			case MSG_SEARCH:
+				handle_Search(buf, n, &ipv6, port);
 				break;
 
 			default:
@@ -380,7 +435,7 @@ gboolean callback_UDPMulticast_data(GIOChannel *source, GIOCondition condition,
 		// Turn sockets off
 		close_all();
 		// Close the application
-		gtk_main_quit();
+		quit_mainloop();
 		return FALSE; // Stop callback for receiving packets from socket
 	} else {
 		assert(0); // Should never reach this line
@@ -468,11 +523,84 @@ void close_sockUDP(void) {
 }
 
 
+// Thread that accepts connections in one of the SO_REUSEPORT listening sockets
+static void *acceptor_thread(void *ptr) {
+	int lsock= *(int *)ptr;
+	gboolean starved= FALSE;	// Out of resources since the last connection accepted
+	int r;
+
+	while ((r= accept_connection(lsock)) >= 0) {
+		if (r == 2) {
+			if (!starved)
+				LOGF(FX_LOG_WARNING, "accept failed: %s - retrying every %d ms\n", strerror(errno),
+						ACCEPT_RETRY/1000);
+			starved= TRUE;
+			usleep(ACCEPT_RETRY);	// Out of resources - the connections wait in the queue
+		} else if (r == 1)
+			starved= FALSE;
+	}
+	return NULL;	// The socket was shut down
+}
+
+
+// Stop the acceptor threads and close their sockets (sockTCP is closed by close_sockTCP)
+static void stop_acceptors(void) {
+	int i;
+
+	// Shutting down a listening socket wakes up the thread blocked in accept
+	for (i= 0; i < acceptors_running; i++)
+		shutdown(acceptor_socks[i], SHUT_RDWR);
+	for (i= 0; i < acceptors_running; i++) {
+		pthread_join(acceptor_tids[i], NULL);
+		if (acceptor_socks[i] != sockTCP)
+			close(acceptor_socks[i]);
+	}
+	acceptors_running= 0;
+}
+
+
+// Start 'n' acceptor threads, each with a listening socket in port 'port_TCP' (the first uses
+//   sockTCP); the kernel distributes the connections among them
+static gboolean start_acceptors(int n) {
+	int i;
+
+	for (i= 0; i < n; i++) {
+		int s= (i == 0) ? sockTCP : init_listen_socket_ipv6(port_TCP, tcp_backlog, TRUE);
+		if (s < 0)
+			break;
+		acceptor_socks[i]= s;
+		if (pthread_create(&acceptor_tids[i], NULL, acceptor_thread, &acceptor_socks[i])) {
+			if (s != sockTCP)
+				close(s);
+			break;
+		}
+		acceptors_running++;
+	}
+	if (acceptors_running < n) {
+		Log("Failed to start the acceptor threads\n");
+		stop_acceptors();
+		return FALSE;
+	}
+	sprintf(tmp_buf, "%d acceptor threads in TCP port %hu\n", n, port_TCP);
+	Log(tmp_buf);
+	return TRUE;
+}
+
+
 // Close TCP socket
 void close_sockTCP(void) {
+	stop_acceptors();
+	if (accept_retry_id != 0) {
+		g_source_remove(accept_retry_id);
+		accept_retry_id= 0;
+	}
 	if (chanTCP != NULL) {
-		remove_socket_from_mainloop(sockTCP, chanTCP_id, chanTCP);
+		if (chanTCP_id != 0)
+			remove_socket_from_mainloop(sockTCP, chanTCP_id, chanTCP);
+		else
+			free_gio_channel(chanTCP);	// The callback was waiting for resources
 		chanTCP = NULL;
+		chanTCP_id = 0;
 	}
 	if (sockTCP > 0) {
 		close(sockTCP);
@@ -482,6 +610,92 @@ void close_sockTCP(void) {
 }
 
 
+// Set the length of the queue of pending TCP connections (0 for the default)
+void fx_set_tcp_backlog(int backlog) {
+	tcp_backlog= (backlog > 0) ? backlog : TCP_BACKLOG;
+}
+
+
+// Set the number of threads accepting TCP connections, each with its own SO_REUSEPORT
+//    socket (0 accepts them in the main loop); used by the next fx_start
+void fx_set_tcp_acceptors(int n) {
+	if (n < 0)
+		n= 0;
+	n_acceptors= (n > MAX_ACCEPTORS) ? MAX_ACCEPTORS : n;
+}
+
+
+// Set the interfaces that join the multicast groups (comma separated names; NULL or "" for all)
+void fx_set_mcast_interfaces(const char *names) {
+	g_free(mcast_ifnames);
+	mcast_ifnames= ((names != NULL) && (strlen(names) > 0)) ? g_strdup(names) : NULL;
+}
+
+// Return TRUE if interface 'ifindex' should join the multicast groups
+static gboolean mcast_interface_selected(unsigned ifindex) {
+	char ifname[IF_NAMESIZE];
+	gchar **names;
+	gboolean found= FALSE;
+	int i;
+
+	if (mcast_ifnames == NULL)
+		return TRUE;
+	if (if_indextoname(ifindex, ifname) == NULL)
+		return FALSE;
+	names= g_strsplit(mcast_ifnames, ",", -1);
+	for (i= 0; !found && (names[i] != NULL); i++)
+		found= !strcmp(g_strstrip(names[i]), ifname);
+	g_strfreev(names);
+	return found;
+}
+
+// Join the group 'group' (struct in_addr or struct in6_addr) of 'family' in socket 'sock', on
+//   all the selected interfaces with multicast and addresses of 'family'
+//   Returns the number of interfaces joined
+static int join_group_all(int sock, int family, const void *group) {
+	const Local_Addr *la;
+	int n, i, j, joined= 0;
+
+	la= get_local_addresses(&n);
+	for (i= 0; i < n; i++) {
+		if ((la[i].family != family) || !(la[i].flags & IFF_MULTICAST))
+			continue;
+		for (j= 0; j < i; j++)	// Each interface once
+			if ((la[j].family == family) && (la[j].ifindex == la[i].ifindex))
+				break;
+		if ((j < i) || !mcast_interface_selected(la[i].ifindex))
+			continue;
+		int err;
+		if (family == AF_INET) {
+			struct ip_mreqn mr;
+			memset(&mr, 0, sizeof(mr));
+			memcpy(&mr.imr_multiaddr, group, sizeof(struct in_addr));
+			mr.imr_ifindex= la[i].ifindex;
+			err= setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mr, sizeof(mr));
+		} else {
+			struct ipv6_mreq mr;
+			memcpy(&mr.ipv6mr_multiaddr, group, sizeof(struct in6_addr));
+			mr.ipv6mr_interface= la[i].ifindex;
+			err= setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mr, sizeof(mr));
+		}
+		char ifname[IF_NAMESIZE];
+		if (if_indextoname(la[i].ifindex, ifname) == NULL)
+			strcpy(ifname, "?");
+		if (err) {
+			sprintf(tmp_buf, "Failed association to IPv%d multicast group on %s: %s\n",
+					(family == AF_INET) ? 4 : 6, ifname, strerror(errno));
+			Log(tmp_buf);
+		} else {
+			sprintf(tmp_buf, "Joined IPv%d multicast group on %s\n", (family == AF_INET) ? 4 : 6,
+					ifname);
+			Log(tmp_buf);
+			joined++;
+		}
+	}
+	return joined;
+}
+
+
 // Create IPv4 UDP multicast socket, configure it, and register its callback
 gboolean init_socket_udp4(u_short port_multicast, const char *addr_multicast) {
 	char loop = 1;
@@ -538,13 +752,18 @@ gboolean init_socket_udp4(u_short port_multicast, const char *addr_multicast) {
 		return FALSE;
 	}
 
-	// Join the group
-	if(setsockopt(sockUDP4, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-			(char * ) &imr_MCast4, sizeof(imr_MCast4)) == -1) {
+	// Join the group on all interfaces, or on the default one if none was joined
+	if ((join_group_all(sockUDP4, AF_INET, &imr_MCast4.imr_multiaddr) == 0)
+			&& (setsockopt(sockUDP4, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			(char * ) &imr_MCast4, sizeof(imr_MCast4)) == -1)) {
 		perror("Failed association to IPv4 multicast address");
 		Log("Failed to associate socket to IPv4 multicast group");
 	}
 	str_addr_MCast4 = addr_multicast; // Memorizes it is associated to a group
+	// Receive the interface of each packet, to answer with its address
+	int on= 1;
+	if (setsockopt(sockUDP4, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on)) < 0)
+		perror("Failed to set IP_PKTINFO");
 
 	// Configure the socket to receive an echo of the multicast packets sent by this application
 	setsockopt(sockUDP4, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
@@ -596,14 +815,19 @@ gboolean init_socket_udp6(u_short port_multicast, const char *addr_multicast) {
 		Log("Failed opening IPv6 UDP socket\n");
 		return FALSE;
 	}
-	// Join the multicast group
-	if (setsockopt(sockUDP6, IPPROTO_IPV6, IPV6_JOIN_GROUP,
-			(char *) &imr_MCast6, sizeof(imr_MCast6)) == -1) {
+	// Join the multicast group on all interfaces, or on the default one if none was joined
+	if ((join_group_all(sockUDP6, AF_INET6, &imr_MCast6.ipv6mr_multiaddr) == 0)
+			&& (setsockopt(sockUDP6, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+			(char *) &imr_MCast6, sizeof(imr_MCast6)) == -1)) {
 		perror("Failed association to IPv6 multicast group");
 		Log("Failed association to IPv6 multicast group\n");
 		return FALSE;
 	}
 	str_addr_MCast6 = addr_multicast; // Memorize it is associated to a group
+	// Receive the interface of each packet, to answer with its address
+	int on= 1;
+	if (setsockopt(sockUDP6, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on)) < 0)
+		perror("Failed to set IPV6_RECVPKTINFO");
 
 	// Configure the socket to receive an echo of the multicast packets sent by this application
 	setsockopt(sockUDP6, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
@@ -655,8 +879,8 @@ gboolean init_sockets(u_short port_multicast, const char *addr4_multicast, const
 		debugstr("WARNING: 'init_sockets' closed TCP socket\n");
 		close_sockTCP();
 	}
-	// Create TCP socket
-	sockTCP = init_socket_ipv6(SOCK_STREAM, 0, FALSE);
+	// Create TCP socket, shared by the acceptor threads, and prepare it to receive connections
+	sockTCP = init_listen_socket_ipv6(0, tcp_backlog, n_acceptors > 0);
 	if (sockTCP < 0) {
 		Log("Failed opening IPv6 TCP socket\n");
 		close_sockUDP();
@@ -670,17 +894,19 @@ gboolean init_sockets(u_short port_multicast, const char *addr4_multicast, const
 		close_sockTCP();
 		return FALSE;
 	}
-	// Prepare the socket to receive connections
-	if (listen(sockTCP, 1) < 0) {
-		perror("Listen failed\n");
-		Log("Listen failed\n");
-		close_sockUDP();
-		close_sockTCP();
-		return FALSE;
+	if (n_acceptors > 0) {
+		if (!start_acceptors(n_acceptors)) {
+			close_sockUDP();
+			close_sockTCP();
+			return FALSE;
+		}
+		return TRUE;
 	}
+	// The callback accepts connections until the queue is empty
+	fcntl(sockTCP, F_SETFL, fcntl(sockTCP, F_GETFL) | O_NONBLOCK);
 
 	// Regist the TCP socket in Gtk+ main loop
-	if (!put_socket_in_mainloop(sockTCP, main_window, &chanTCP_id, &chanTCP, G_IO_IN,
+	if (!put_socket_in_mainloop(sockTCP, NULL, &chanTCP_id, &chanTCP, G_IO_IN,
 			callback_connections_TCP)) {
 		Log("Failed registration of TCPv6 socket at Gnome\n");
 		close_sockUDP();
@@ -11,9 +11,9 @@
 #ifndef INCL_CALLBACKS_SOCKET_H
 #define INCL_CALLBACKS_SOCKET_H
 
-#include <gtk/gtk.h>
 #include <glib.h>
-#include "gui.h"
+#include "host.h"
+#include "codec.h"
 
 #ifndef FALSE
 #define FALSE 0
@@ -27,10 +27,6 @@
 
 #define QUERY_TIMEOUT		5000	/* 5 seconds */
 
-/* Packet type */
-#define MSG_QUERY		20
-#define MSG_HIT			10
-
 
 /*********************\
 |* Global variables  *|
@@ -78,6 +74,7 @@ gboolean write_query_message(char *buf, int *len, uint32_t seq, const char* file
 
 // Read the QUERY message fields ('seq', 'filename') from buffer 'buf'
 //    with length 'len'; returns TRUE if successful, or FALSE otherwise
+//    'filename' points into 'buf' - it must not be freed
 gboolean read_query_message(char *buf, int len, uint32_t *seq, const char **filename);
 
 // Write the HIT message fields ('seq','filename','flen','fhash','sTCP_port') into buffer 'buf'
@@ -87,6 +84,7 @@ gboolean write_hit_message(char *buf, int *len, uint32_t seq, const char* filena
 
 // Read the HIT message fields ('seq','filename','flen','fhash','sTCP_port') from buffer 'buf'
 //    with length 'len'; returns TRUE if successful, or FALSE otherwise
+//    'filename' points into 'buf' - it must not be freed
 gboolean read_hit_message(char *buf, int len, uint32_t *seq, const char **filename, unsigned long long *flen,
 							uint32_t *fhash, unsigned short *sTCP_port, struct in6_addr *srvIP);
 
@@ -0,0 +1,325 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * chunk.c
+ *
+ * Content-defined chunking (FastCDC, with normalized chunk sizes) and the chunk
+ *   store of the receiver, a hash table of the chunks of the files received
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "chunk.h"
+
+// Masks of the gear hash before and after CHUNK_AVG bytes (15 and 11 bits): cuts are
+//    less likely before the normal size and more likely after it
+#define MASK_S		0x0003590703530000ULL
+#define MASK_L		0x0000d90003530000ULL
+
+
+static uint64_t gear[256];		// Random value of each byte
+static pthread_once_t gear_once= PTHREAD_ONCE_INIT;
+
+
+// Fill the gear table (from splitmix64, the same in every node)
+static void gear_init(void) {
+	uint64_t x= 0x9E3779B97F4A7C15ULL;
+
+	for (int i= 0; i < 256; i++) {
+		uint64_t z= (x += 0x9E3779B97F4A7C15ULL);
+		z= (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z= (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		gear[i]= z ^ (z >> 31);
+	}
+}
+
+
+// Return the length of the first chunk of the 'n' bytes of 'buf'
+uint32_t chunk_cut(const uint8_t *buf, size_t n) {
+	size_t i= CHUNK_MIN, normal= CHUNK_AVG, max= CHUNK_MAX;
+	uint64_t fp= 0;
+
+	if (n <= CHUNK_MIN)
+		return (uint32_t)n;
+	if (n < max)
+		max= n;
+	if (normal > max)
+		normal= max;
+	pthread_once(&gear_once, gear_init);
+	for (; i < normal; i++) {
+		fp= (fp << 1) + gear[buf[i]];
+		if (!(fp & MASK_S))
+			return i + 1;
+	}
+	for (; i < max; i++) {
+		fp= (fp << 1) + gear[buf[i]];
+		if (!(fp & MASK_L))
+			return i + 1;
+	}
+	return (uint32_t)max;
+}
+
+
+// Final mix of a 64-bit hash (from splitmix64)
+static inline uint64_t mix64(uint64_t h) {
+	h ^= h >> 30;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 27;
+	h *= 0x94D049BB133111EBULL;
+	return h ^ (h >> 31);
+}
+
+
+// Compute the 128-bit hash of the 'n' bytes of 'buf' to 'hash'
+//    Two lanes of multiply/xor-shift over 8 byte words, each mixed with the other at the end
+void chunk_hash(const uint8_t *buf, uint32_t n, uint64_t hash[2]) {
+	uint64_t h1= n * 0x9E3779B97F4A7C15ULL, h2= ~h1, v, w;
+	uint32_t i= 0;
+
+	for (; i + 16 <= n; i += 16) {
+		memcpy(&v, buf+i, 8);
+		memcpy(&w, buf+i+8, 8);
+		h1= (h1 ^ v) * 0x9E3779B97F4A7C15ULL;
+		h1 ^= h1 >> 29;
+		h2= (h2 ^ w) * 0xC2B2AE3D27D4EB4FULL;
+		h2 ^= h2 >> 31;
+	}
+	v= w= 0;
+	memcpy(&v, buf+i, (n-i < 8) ? n-i : 8);
+	if (n-i > 8)
+		memcpy(&w, buf+i+8, n-i-8);
+	h1= mix64((h1 ^ v) * 0x9E3779B97F4A7C15ULL);
+	h2= mix64((h2 ^ w) * 0xC2B2AE3D27D4EB4FULL);
+	hash[0]= mix64(h1 + h2);
+	hash[1]= mix64(h2 ^ (h1 << 1));
+}
+
+
+// Return the chunks of file 'fd' (read from offset 0) and their number in 'n'
+Chunk_Ref *chunk_file(int fd, uint32_t *n) {
+	size_t bsize= 16*CHUNK_MAX, fill= 0, p= 0, cap= 1024;
+	uint8_t *buf= (uint8_t *)malloc(bsize);
+	Chunk_Ref *list= (Chunk_Ref *)malloc(cap*sizeof(Chunk_Ref));
+	unsigned long long base= 0;		// File offset of buf[0]
+	gboolean eof= FALSE;
+
+	*n= 0;
+	if ((buf == NULL) || (list == NULL))
+		goto fail;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (;;) {
+		if ((fill - p < CHUNK_MAX) && !eof) {
+			memmove(buf, buf+p, fill-p);
+			base += p;
+			fill -= p;
+			p= 0;
+			while (!eof && (fill < bsize)) {
+				ssize_t r= pread(fd, buf+fill, bsize-fill, base+fill);
+				if (r < 0) {
+					if (errno == EINTR)
+						continue;
+					goto fail;
+				}
+				fill += r;
+				eof= (r == 0);
+			}
+		}
+		if (p == fill)
+			break;
+		if (*n == cap) {
+			Chunk_Ref *l= (Chunk_Ref *)realloc(list, 2*cap*sizeof(Chunk_Ref));
+			if (l == NULL)
+				goto fail;
+			list= l;
+			cap *= 2;
+		}
+		list[*n].length= chunk_cut(buf+p, fill-p);
+		chunk_hash(buf+p, list[*n].length, list[*n].hash);
+		p += list[(*n)++].length;
+	}
+	free(buf);
+	return list;
+
+fail:
+	free(buf);
+	free(list);
+	return NULL;
+}
+
+
+/***********************\
+|*   The chunk store   *|
+\***********************/
+
+// File with indexed chunks
+typedef struct Chunk_Source {
+	char *path;
+	unsigned refs;				// Chunks of the file in the store
+	dev_t dev;					// Identity, size and modification time when it was indexed
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	gboolean changed;			// The file was modified or removed
+} Chunk_Source;
+
+// Chunk in the store
+typedef struct Chunk_Entry {
+	uint64_t hash[2];
+	uint64_t len;
+	unsigned long long off;		// Offset in the file
+	Chunk_Source *src;
+} Chunk_Entry;
+
+
+static GHashTable *store= NULL;	// Chunk_Entry, used as key and value
+static pthread_mutex_t store_mutex= PTHREAD_MUTEX_INITIALIZER;
+
+
+static guint entry_hash(gconstpointer key) {
+	return (guint)((const Chunk_Entry *)key)->hash[0];
+}
+
+
+static gboolean entry_equal(gconstpointer a, gconstpointer b) {
+	return !memcmp(((const Chunk_Entry *)a)->hash, ((const Chunk_Entry *)b)->hash,
+			sizeof(((const Chunk_Entry *)a)->hash));
+}
+
+
+static void entry_free(gpointer key) {
+	Chunk_Entry *e= (Chunk_Entry *)key;
+
+	if (--e->src->refs == 0) {
+		free(e->src->path);
+		free(e->src);
+	}
+	free(e);
+}
+
+
+// Return TRUE if the file of 'src' was replaced, modified or removed after it was indexed
+//    Called with the store locked; stat is cheap for the files just written or read
+static gboolean source_changed(Chunk_Source *src) {
+	struct stat st;
+
+	if (!src->changed)
+		src->changed= stat(src->path, &st) || (st.st_dev != src->dev) || (st.st_ino != src->ino)
+				|| (st.st_size != src->size) || (st.st_mtim.tv_sec != src->mtime.tv_sec)
+				|| (st.st_mtim.tv_nsec != src->mtime.tv_nsec);
+	return src->changed;
+}
+
+
+// Index the 'n' chunks 'list' of file 'path', which has them in sequence from offset 0
+void chunk_store_add(const char *path, const Chunk_Ref *list, uint32_t n) {
+	Chunk_Source *src;
+	Chunk_Entry key;
+	unsigned long long off= 0;
+	struct stat st;
+
+	if ((n == 0) || stat(path, &st) || ((src= (Chunk_Source *)calloc(1, sizeof(Chunk_Source))) == NULL))
+		return;
+	if ((src->path= strdup(path)) == NULL) {
+		free(src);
+		return;
+	}
+	src->dev= st.st_dev;
+	src->ino= st.st_ino;
+	src->size= st.st_size;
+	src->mtime= st.st_mtim;
+	src->refs= 1;	// Released after adding the chunks
+	pthread_mutex_lock(&store_mutex);
+	if (store == NULL)
+		store= g_hash_table_new_full(entry_hash, entry_equal, entry_free, NULL);
+	for (uint32_t i= 0; i < n; off += list[i++].length) {
+		memcpy(key.hash, list[i].hash, sizeof(key.hash));
+		Chunk_Entry *e= (Chunk_Entry *)g_hash_table_lookup(store, &key);
+		if ((e != NULL) && !source_changed(e->src))
+			continue;	// Keep the chunk in the file indexed first
+		if ((g_hash_table_size(store) >= CHUNK_STORE_MAX)
+				|| ((e= (Chunk_Entry *)malloc(sizeof(Chunk_Entry))) == NULL))
+			break;
+		memcpy(e->hash, list[i].hash, sizeof(e->hash));
+		e->len= list[i].length;
+		e->off= off;
+		e->src= src;
+		src->refs++;
+		g_hash_table_replace(store, e, e);
+	}
+	if (--src->refs == 0) {
+		free(src->path);
+		free(src);
+	}
+	pthread_mutex_unlock(&store_mutex);
+}
+
+
+// Chunk file 'path' and index its chunks; returns FALSE if it could not read it
+gboolean chunk_store_add_file(const char *path) {
+	int fd= open(path, O_RDONLY | O_CLOEXEC);
+	Chunk_Ref *list;
+	uint32_t n;
+
+	if (fd < 0)
+		return FALSE;
+	list= chunk_file(fd, &n);
+	close(fd);
+	if (list == NULL)
+		return FALSE;
+	chunk_store_add(path, list, n);
+	free(list);
+	return TRUE;
+}
+
+
+// Look for the chunk with 'hash' and 'len' bytes in the store
+gboolean chunk_store_find(const uint64_t hash[2], uint64_t len, char *path, size_t plen,
+		unsigned long long *off) {
+	Chunk_Entry key, *e;
+	gboolean found= FALSE;
+
+	memcpy(key.hash, hash, sizeof(key.hash));
+	pthread_mutex_lock(&store_mutex);
+	if ((store != NULL) && ((e= (Chunk_Entry *)g_hash_table_lookup(store, &key)) != NULL)
+			&& (e->len == len)) {
+		Chunk_Source *src= e->src;
+		if (source_changed(src))
+			g_hash_table_remove(store, e);
+		else if (strlen(src->path) < plen) {
+			strcpy(path, src->path);
+			*off= e->off;
+			found= TRUE;
+		}
+	}
+	pthread_mutex_unlock(&store_mutex);
+	return found;
+}
+
+
+// Remove the chunk with 'hash', whose contents changed
+void chunk_store_forget(const uint64_t hash[2]) {
+	Chunk_Entry key;
+
+	memcpy(key.hash, hash, sizeof(key.hash));
+	pthread_mutex_lock(&store_mutex);
+	if (store != NULL)
+		g_hash_table_remove(store, &key);
+	pthread_mutex_unlock(&store_mutex);
+}
+
+
+// Remove all the chunks
+void chunk_store_clear(void) {
+	pthread_mutex_lock(&store_mutex);
+	if (store != NULL)
+		g_hash_table_remove_all(store);
+	pthread_mutex_unlock(&store_mutex);
+}
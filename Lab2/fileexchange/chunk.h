@@ -0,0 +1,66 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * chunk.h
+ *
+ * Header file of the content-defined chunking (FastCDC) and of the chunk store
+ *
+ * Files are cut where a gear rolling hash of the last bytes matches a mask, so
+ * the chunk boundaries follow the content: identical regions of different files,
+ * at any offset, are cut into the same chunks. The chunk store indexes the chunks
+ * of the files received by their 128-bit hash, pointing to the file and offset
+ * where each one can be read; the chunks are not copied.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_CHUNK_H_
+#define _INCL_CHUNK_H_
+
+#include <stdint.h>
+#include <glib.h>
+
+
+#define CHUNK_MIN		2048		/* Smallest chunk, except the last one of a file */
+#define CHUNK_AVG		8192		/* Normal chunk size */
+#define CHUNK_MAX		65536		/* Largest chunk */
+#define CHUNK_STORE_MAX	(1 << 22)	/* Most chunks in the store */
+
+
+// Chunk of a file, as sent in the chunk list
+typedef struct Chunk_Ref {
+	uint64_t hash[2];			// 128-bit hash of the contents
+	uint64_t length;			// Bytes of the chunk (0: end of the list)
+} Chunk_Ref;
+
+
+// Return the length of the first chunk of the 'n' bytes of 'buf'
+//    'buf' must have CHUNK_MAX bytes, except at the end of the file
+uint32_t chunk_cut(const uint8_t *buf, size_t n);
+
+// Compute the 128-bit hash of the 'n' bytes of 'buf' to 'hash'
+void chunk_hash(const uint8_t *buf, uint32_t n, uint64_t hash[2]);
+
+// Return the chunks of file 'fd' (read from offset 0) and their number in 'n'
+//    Returns NULL if it failed; the list is freed with free
+Chunk_Ref *chunk_file(int fd, uint32_t *n);
+
+
+// Index the 'n' chunks 'list' of file 'path', which has them in sequence from offset 0
+void chunk_store_add(const char *path, const Chunk_Ref *list, uint32_t n);
+
+// Chunk file 'path' and index its chunks; returns FALSE if it could not read it
+gboolean chunk_store_add_file(const char *path);
+
+// Look for the chunk with 'hash' and 'len' bytes; returns FALSE if there is none or its
+//    file changed, or writes its file in 'path' (with room for 'plen' bytes) and offset in 'off'
+gboolean chunk_store_find(const uint64_t hash[2], uint64_t len, char *path, size_t plen,
+		unsigned long long *off);
+
+// Remove the chunk with 'hash', whose contents changed
+void chunk_store_forget(const uint64_t hash[2]);
+
+// Remove all the chunks
+void chunk_store_clear(void);
+
+#endif
@@ -0,0 +1,224 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * codec.c
+ *
+ * QUERY/HIT message codec
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <string.h>
+#include <arpa/inet.h>
+#include "codec.h"
+
+
+
+// Validate the filename field at 'pt' with length 'fnlen' (including '\0')
+static inline gboolean valid_filename(const char *pt, uint16_t fnlen) {
+	if ((fnlen < 2) || (fnlen > FILENAME_MAX_LENGTH))
+		return FALSE;
+	// It must end with '\0' and must not have any other '\0' inside
+	return (pt[fnlen-1] == '\0') && (memchr(pt, '\0', fnlen-1) == NULL);
+}
+
+
+// Encode the common header (cod, seq, fnlen, filename)
+static inline gboolean encode_header(char **pt, const char *end, uint8_t cod, uint32_t seq,
+		const char *filename) {
+	size_t fnlen= strnlen(filename, FILENAME_MAX_LENGTH)+1;
+	if (fnlen > FILENAME_MAX_LENGTH)
+		return FALSE;
+	return codec_put_u8(pt, end, cod) && codec_put_u32(pt, end, seq) &&
+			codec_put_u16(pt, end, (uint16_t)fnlen) && codec_put_bytes(pt, end, filename, fnlen);
+}
+
+
+// Decode the common header (cod, seq, fnlen, filename)
+static inline gboolean decode_header(const char **pt, const char *end, uint8_t cod, uint32_t *seq,
+		const char **filename, uint16_t *fnlen) {
+	uint8_t m;
+	if (!codec_get_u8(pt, end, &m) || (m != cod))
+		return FALSE;
+	if (!codec_get_u32(pt, end, seq) || !codec_get_u16(pt, end, fnlen))
+		return FALSE;
+	if ((end-*pt < *fnlen) || !valid_filename(*pt, *fnlen))
+		return FALSE;
+	*filename= *pt;
+	*pt += *fnlen;
+	return TRUE;
+}
+
+
+// Encode a QUERY message into 'buf' with capacity 'buflen'
+//    Returns the message length, or -1 if it does not fit or is invalid
+int encode_query(char *buf, int buflen, uint32_t seq, const char *filename) {
+	if ((buf == NULL) || (filename == NULL) || (buflen <= 0))
+		return -1;
+
+	char *pt= buf;
+	if (!encode_header(&pt, buf+buflen, MSG_QUERY, seq, filename))
+		return -1;
+	return pt-buf;
+}
+
+
+// Decode a QUERY message from 'buf' with length 'len' into 'q'
+//    Returns TRUE if the message is well formed, or FALSE otherwise
+gboolean decode_query(const char *buf, int len, Query_View *q) {
+	if ((buf == NULL) || (q == NULL) || (len <= QUERY_HDR_LENGTH))
+		return FALSE;
+
+	const char *pt= buf, *end= buf+len;
+	if (!decode_header(&pt, end, MSG_QUERY, &q->seq, &q->filename, &q->fnlen))
+		return FALSE;
+	return pt == end;	// No trailing bytes
+}
+
+
+// Encode a HIT message into 'buf' with capacity 'buflen'
+//    Returns the message length, or -1 if it does not fit or is invalid
+int encode_hit(char *buf, int buflen, uint32_t seq, const char *filename, unsigned long long flen,
+				uint32_t fhash, unsigned short sTCP_port, const struct in6_addr *srvIP) {
+	if ((buf == NULL) || (filename == NULL) || (srvIP == NULL) || (buflen <= 0) || (sTCP_port == 0))
+		return -1;
+
+	char *pt= buf;
+	const char *end= buf+buflen;
+	if (!encode_header(&pt, end, MSG_HIT, seq, filename) ||
+			!codec_put_u64(&pt, end, flen) || !codec_put_u32(&pt, end, fhash) ||
+			!codec_put_u16(&pt, end, sTCP_port) || !codec_put_bytes(&pt, end, srvIP, sizeof(struct in6_addr)))
+		return -1;
+	return pt-buf;
+}
+
+
+// Decode a HIT message from 'buf' with length 'len' into 'h'
+//    Returns TRUE if the message is well formed, or FALSE otherwise
+gboolean decode_hit(const char *buf, int len, Hit_View *h) {
+	if ((buf == NULL) || (h == NULL) || (len <= HIT_HDR_LENGTH+HIT_TAIL_LENGTH))
+		return FALSE;
+
+	const char *pt= buf, *end= buf+len;
+	uint64_t flen;
+	if (!decode_header(&pt, end, MSG_HIT, &h->seq, &h->filename, &h->fnlen))
+		return FALSE;
+	if (!codec_get_u64(&pt, end, &flen) || !codec_get_u32(&pt, end, &h->fhash) ||
+			!codec_get_u16(&pt, end, &h->sTCP_port) ||
+			!codec_get_bytes(&pt, end, &h->srvIP, sizeof(struct in6_addr)))
+		return FALSE;
+	h->flen= flen;
+	return pt == end;	// No trailing bytes
+}
+
+
+// Encode a SEARCH message into 'buf' with capacity 'buflen'
+//    Returns the message length, or -1 if it does not fit or is invalid
+int encode_search(char *buf, int buflen, uint32_t seq, uint32_t offset, const char *pattern) {
+	if ((buf == NULL) || (pattern == NULL) || (buflen <= 0))
+		return -1;
+
+	char *pt= buf;
+	const char *end= buf+buflen;
+	size_t plen= strnlen(pattern, FILENAME_MAX_LENGTH)+1;
+	if ((plen < 2) || (plen > FILENAME_MAX_LENGTH))
+		return -1;
+	if (!codec_put_u8(&pt, end, MSG_SEARCH) || !codec_put_u32(&pt, end, seq) ||
+			!codec_put_u32(&pt, end, offset) || !codec_put_u16(&pt, end, (uint16_t)plen) ||
+			!codec_put_bytes(&pt, end, pattern, plen))
+		return -1;
+	return pt-buf;
+}
+
+
+// Decode a SEARCH message from 'buf' with length 'len' into 's'
+//    Returns TRUE if the message is well formed, or FALSE otherwise
+gboolean decode_search(const char *buf, int len, Search_View *s) {
+	if ((buf == NULL) || (s == NULL) || (len <= SEARCH_HDR_LENGTH))
+		return FALSE;
+
+	const char *pt= buf, *end= buf+len;
+	uint8_t m;
+	if (!codec_get_u8(&pt, end, &m) || (m != MSG_SEARCH) || !codec_get_u32(&pt, end, &s->seq) ||
+			!codec_get_u32(&pt, end, &s->offset) || !codec_get_u16(&pt, end, &s->plen))
+		return FALSE;
+	if ((end-pt != s->plen) || !valid_filename(pt, s->plen))
+		return FALSE;
+	s->pattern= pt;
+	return TRUE;
+}
+
+
+// Encode a SRESULT message with 'count' entries into 'buf' with capacity 'buflen'
+//    Returns the message length, or -1 if it does not fit or is invalid
+int encode_sresult(char *buf, int buflen, uint32_t seq, uint32_t offset, gboolean more,
+					const SResult_Entry *entries, int count) {
+	if ((buf == NULL) || (buflen <= 0) || (count < 0) || (count > SEARCH_PAGE_SIZE) ||
+			((count > 0) && (entries == NULL)))
+		return -1;
+
+	char *pt= buf;
+	const char *end= buf+buflen;
+	int i;
+	if (!codec_put_u8(&pt, end, MSG_SRESULT) || !codec_put_u32(&pt, end, seq) ||
+			!codec_put_u32(&pt, end, offset) || !codec_put_u8(&pt, end, more ? 1 : 0) ||
+			!codec_put_u8(&pt, end, (uint8_t)count))
+		return -1;
+	for (i= 0; i < count; i++) {
+		size_t fnlen= strnlen(entries[i].filename, FILENAME_MAX_LENGTH)+1;
+		if ((fnlen > FILENAME_MAX_LENGTH) || !codec_put_u16(&pt, end, (uint16_t)fnlen) ||
+				!codec_put_bytes(&pt, end, entries[i].filename, fnlen) ||
+				!codec_put_u64(&pt, end, entries[i].flen))
+			return -1;
+	}
+	return pt-buf;
+}
+
+
+// Read the entry at '*pt' of a SRESULT message ending at 'end', validating it
+static inline gboolean read_sresult_entry(const char **pt, const char *end, SResult_Entry *e) {
+	uint16_t fnlen;
+	uint64_t flen;
+	if (!codec_get_u16(pt, end, &fnlen) || (end-*pt < fnlen) || !valid_filename(*pt, fnlen))
+		return FALSE;
+	e->filename= *pt;
+	*pt += fnlen;
+	if (!codec_get_u64(pt, end, &flen))
+		return FALSE;
+	e->flen= flen;
+	return TRUE;
+}
+
+
+// Decode a SRESULT message from 'buf' with length 'len' into 'r', validating all entries
+//    Returns TRUE if the message is well formed, or FALSE otherwise
+gboolean decode_sresult(const char *buf, int len, SResult_View *r) {
+	if ((buf == NULL) || (r == NULL) || (len < SRESULT_HDR_LENGTH))
+		return FALSE;
+
+	const char *pt= buf, *end= buf+len;
+	uint8_t m, more;
+	SResult_Entry e;
+	int i;
+	if (!codec_get_u8(&pt, end, &m) || (m != MSG_SRESULT) || !codec_get_u32(&pt, end, &r->seq) ||
+			!codec_get_u32(&pt, end, &r->offset) || !codec_get_u8(&pt, end, &more) ||
+			!codec_get_u8(&pt, end, &r->count) || (r->count > SEARCH_PAGE_SIZE))
+		return FALSE;
+	r->more= (more != 0);
+	r->entries= pt;
+	r->end= end;
+	for (i= 0; i < r->count; i++) {
+		if (!read_sresult_entry(&pt, end, &e))
+			return FALSE;
+	}
+	return pt == end;	// No trailing bytes
+}
+
+
+// Read the entry at '*pt' (initially r->entries) of a decoded SRESULT message and advance '*pt'
+//    Returns FALSE when there are no more entries
+gboolean next_sresult_entry(const SResult_View *r, const char **pt, SResult_Entry *e) {
+	if ((r == NULL) || (pt == NULL) || (e == NULL) || (*pt >= r->end))
+		return FALSE;
+	return read_sresult_entry(pt, r->end, e);
+}
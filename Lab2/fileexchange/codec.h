@@ -0,0 +1,240 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * codec.h
+ *
+ * Header file of the QUERY/HIT message codec
+ *
+ * All multi-byte fields are written in network byte order (Big Endian).
+ * Decoding never allocates memory: the filename returned is a view into the
+ * receive buffer, valid while the buffer is not reused.
+ *
+ * QUERY:   | cod(1) | seq(4) | fnlen(2) | filename(fnlen, with '\0') |
+ * HIT:     | cod(1) | seq(4) | fnlen(2) | filename(fnlen, with '\0') |
+ *          | flen(8) | fhash(4) | sTCP_port(2) | srvIP(16) |
+ * SEARCH:  | cod(1) | seq(4) | offset(4) | plen(2) | pattern(plen, with '\0') |
+ * SRESULT: | cod(1) | seq(4) | offset(4) | more(1) | count(1) |
+ *          | count x { fnlen(2) | filename(fnlen, with '\0') | flen(8) } |
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_CODEC_H_
+#define _INCL_CODEC_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <glib.h>
+
+
+/* Packet type */
+#define MSG_QUERY		20
+#define MSG_HIT			10
+#define MSG_SEARCH		30
+#define MSG_SRESULT		40
+
+#define FILENAME_MAX_LENGTH	256		/* Maximum filename length, including '\0' */
+
+#define QUERY_HDR_LENGTH	7		/* cod + seq + fnlen */
+#define HIT_HDR_LENGTH		7		/* cod + seq + fnlen */
+#define HIT_TAIL_LENGTH		30		/* flen + fhash + sTCP_port + srvIP */
+
+#define SEARCH_HDR_LENGTH	11		/* cod + seq + offset + plen */
+#define SRESULT_HDR_LENGTH	11		/* cod + seq + offset + more + count */
+#define SRESULT_ENTRY_LENGTH	10	/* fnlen + flen, without the filename */
+#define SEARCH_PAGE_SIZE	16		/* Maximum number of results per SRESULT message */
+
+/* Maximum length of the encoded messages */
+#define QUERY_MAX_LENGTH	(QUERY_HDR_LENGTH+FILENAME_MAX_LENGTH)
+#define HIT_MAX_LENGTH		(HIT_HDR_LENGTH+FILENAME_MAX_LENGTH+HIT_TAIL_LENGTH)
+#define SEARCH_MAX_LENGTH	(SEARCH_HDR_LENGTH+FILENAME_MAX_LENGTH)
+#define SRESULT_MAX_LENGTH	(SRESULT_HDR_LENGTH+SEARCH_PAGE_SIZE*(SRESULT_ENTRY_LENGTH+FILENAME_MAX_LENGTH))
+
+
+// Decoded QUERY message
+typedef struct Query_View {
+	uint32_t seq;			// Sequence number
+	const char *filename;	// Points into the receive buffer ('\0' terminated)
+	uint16_t fnlen;			// Filename length, including '\0'
+} Query_View;
+
+// Decoded HIT message
+typedef struct Hit_View {
+	uint32_t seq;			// Sequence number
+	const char *filename;	// Points into the receive buffer ('\0' terminated)
+	uint16_t fnlen;			// Filename length, including '\0'
+	unsigned long long flen;// File length
+	uint32_t fhash;			// File hash
+	unsigned short sTCP_port;// TCP port of the server
+	struct in6_addr srvIP;	// IP address of the server
+} Hit_View;
+
+// Decoded SEARCH message
+typedef struct Search_View {
+	uint32_t seq;			// Sequence number
+	uint32_t offset;		// Number of matches to skip (paging)
+	const char *pattern;	// Points into the receive buffer ('\0' terminated)
+	uint16_t plen;			// Pattern length, including '\0'
+} Search_View;
+
+// One result of a SRESULT message
+typedef struct SResult_Entry {
+	const char *filename;	// Filename without path ('\0' terminated)
+	unsigned long long flen;// File length
+} SResult_Entry;
+
+// Decoded SRESULT message; the entries are read with next_sresult_entry
+typedef struct SResult_View {
+	uint32_t seq;			// Sequence number
+	uint32_t offset;		// Offset of the first entry
+	gboolean more;			// TRUE if the responder has more matches
+	uint8_t count;			// Number of entries
+	const char *entries;	// Points to the first entry in the receive buffer
+	const char *end;		// End of the message
+} SResult_View;
+
+
+/*************************************************\
+|* Functions to read/write fields from a buffer  *|
+\*************************************************/
+
+// Each function writes/reads one field at 'pt' if it fits before 'end',
+//   advances 'pt' and returns TRUE; otherwise returns FALSE and leaves 'pt'.
+
+static inline gboolean codec_put_u8(char **pt, const char *end, uint8_t v) {
+	if (end-*pt < 1)
+		return FALSE;
+	*(*pt)++= (char)v;
+	return TRUE;
+}
+
+static inline gboolean codec_put_u16(char **pt, const char *end, uint16_t v) {
+	if (end-*pt < 2)
+		return FALSE;
+	v= htons(v);
+	memcpy(*pt, &v, 2);
+	*pt += 2;
+	return TRUE;
+}
+
+static inline gboolean codec_put_u32(char **pt, const char *end, uint32_t v) {
+	if (end-*pt < 4)
+		return FALSE;
+	v= htonl(v);
+	memcpy(*pt, &v, 4);
+	*pt += 4;
+	return TRUE;
+}
+
+static inline gboolean codec_put_u64(char **pt, const char *end, uint64_t v) {
+	if (end-*pt < 8)
+		return FALSE;
+	uint32_t hi= htonl((uint32_t)(v>>32)), lo= htonl((uint32_t)v);
+	memcpy(*pt, &hi, 4);
+	memcpy(*pt+4, &lo, 4);
+	*pt += 8;
+	return TRUE;
+}
+
+static inline gboolean codec_put_bytes(char **pt, const char *end, const void *v, size_t n) {
+	if ((size_t)(end-*pt) < n)
+		return FALSE;
+	memcpy(*pt, v, n);
+	*pt += n;
+	return TRUE;
+}
+
+static inline gboolean codec_get_u8(const char **pt, const char *end, uint8_t *v) {
+	if (end-*pt < 1)
+		return FALSE;
+	*v= (uint8_t)*(*pt)++;
+	return TRUE;
+}
+
+static inline gboolean codec_get_u16(const char **pt, const char *end, uint16_t *v) {
+	if (end-*pt < 2)
+		return FALSE;
+	memcpy(v, *pt, 2);
+	*v= ntohs(*v);
+	*pt += 2;
+	return TRUE;
+}
+
+static inline gboolean codec_get_u32(const char **pt, const char *end, uint32_t *v) {
+	if (end-*pt < 4)
+		return FALSE;
+	memcpy(v, *pt, 4);
+	*v= ntohl(*v);
+	*pt += 4;
+	return TRUE;
+}
+
+static inline gboolean codec_get_u64(const char **pt, const char *end, uint64_t *v) {
+	uint32_t hi, lo;
+	if (end-*pt < 8)
+		return FALSE;
+	memcpy(&hi, *pt, 4);
+	memcpy(&lo, *pt+4, 4);
+	*v= ((uint64_t)ntohl(hi)<<32) | ntohl(lo);
+	*pt += 8;
+	return TRUE;
+}
+
+static inline gboolean codec_get_bytes(const char **pt, const char *end, void *v, size_t n) {
+	if ((size_t)(end-*pt) < n)
+		return FALSE;
+	memcpy(v, *pt, n);
+	*pt += n;
+	return TRUE;
+}
+
+
+/*******************************\
+|* QUERY and HIT message codec *|
+\*******************************/
+
+// Encode a QUERY message into 'buf' with capacity 'buflen'
+//    Returns the message length, or -1 if it does not fit or is invalid
+int encode_query(char *buf, int buflen, uint32_t seq, const char *filename);
+
+// Decode a QUERY message from 'buf' with length 'len' into 'q'
+//    Returns TRUE if the message is well formed, or FALSE otherwise
+gboolean decode_query(const char *buf, int len, Query_View *q);
+
+// Encode a HIT message into 'buf' with capacity 'buflen'
+//    Returns the message length, or -1 if it does not fit or is invalid
+int encode_hit(char *buf, int buflen, uint32_t seq, const char *filename, unsigned long long flen,
+				uint32_t fhash, unsigned short sTCP_port, const struct in6_addr *srvIP);
+
+// Decode a HIT message from 'buf' with length 'len' into 'h'
+//    Returns TRUE if the message is well formed, or FALSE otherwise
+gboolean decode_hit(const char *buf, int len, Hit_View *h);
+
+
+/***********************************\
+|* SEARCH and SRESULT message codec *|
+\***********************************/
+
+// Encode a SEARCH message into 'buf' with capacity 'buflen'
+//    Returns the message length, or -1 if it does not fit or is invalid
+int encode_search(char *buf, int buflen, uint32_t seq, uint32_t offset, const char *pattern);
+
+// Decode a SEARCH message from 'buf' with length 'len' into 's'
+//    Returns TRUE if the message is well formed, or FALSE otherwise
+gboolean decode_search(const char *buf, int len, Search_View *s);
+
+// Encode a SRESULT message with 'count' entries into 'buf' with capacity 'buflen'
+//    Returns the message length, or -1 if it does not fit or is invalid
+int encode_sresult(char *buf, int buflen, uint32_t seq, uint32_t offset, gboolean more,
+					const SResult_Entry *entries, int count);
+
+// Decode a SRESULT message from 'buf' with length 'len' into 'r', validating all entries
+//    Returns TRUE if the message is well formed, or FALSE otherwise
+gboolean decode_sresult(const char *buf, int len, SResult_View *r);
+
+// Read the entry at '*pt' (initially r->entries) of a decoded SRESULT message and advance '*pt'
+//    Returns FALSE when there are no more entries
+gboolean next_sresult_entry(const SResult_View *r, const char **pt, SResult_Entry *e);
+
+#endif
@@ -0,0 +1,140 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * delta.c
+ *
+ * Block signatures of delta transfers: rsync rolling checksum, 64-bit block hash
+ *   and a chained hash table of the signatures by rolling checksum
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include "delta.h"
+
+
+// Return the block size used for a file with 'len' bytes (about sqrt(len))
+uint32_t delta_block_size(unsigned long long len) {
+	uint32_t b= DELTA_MIN_BLOCK;
+
+	while ((b < DELTA_MAX_BLOCK) && ((unsigned long long)b*b < len))
+		b <<= 1;
+	return b;
+}
+
+
+// Return the rolling checksum of the 'n' bytes of 'buf'
+//    a= sum of the bytes, b= sum of (n-i)*byte[i], both mod 2^16
+uint32_t delta_weak(const uint8_t *buf, uint32_t n) {
+	uint32_t a= 0, b= 0;
+
+	for (uint32_t i= 0; i < n; i++) {
+		a += buf[i];
+		b += a;
+	}
+	return (a & 0xFFFF) | (b << 16);
+}
+
+
+// Compute the 64-bit hash of the 'n' bytes of 'buf' to 'strong'
+//    Two lanes of multiply/xor-shift over 8 byte words, mixed as in bloom_hash
+void delta_strong(const uint8_t *buf, uint32_t n, uint32_t strong[2]) {
+	const uint64_t m= 0x9E3779B97F4A7C15ULL;
+	uint64_t h1= n * m, h2= ~h1, v, w;
+	uint32_t i= 0;
+
+	for (; i + 16 <= n; i += 16) {
+		memcpy(&v, buf+i, 8);
+		memcpy(&w, buf+i+8, 8);
+		h1= (h1 ^ v) * m;
+		h1 ^= h1 >> 29;
+		h2= (h2 ^ w) * 0xC2B2AE3D27D4EB4FULL;
+		h2 ^= h2 >> 31;
+	}
+	v= w= 0;
+	memcpy(&v, buf+i, (n-i < 8) ? n-i : 8);
+	if (n-i > 8)
+		memcpy(&w, buf+i+8, n-i-8);
+	h1= (h1 ^ v) * m;
+	h2= (h2 ^ w) * 0xC2B2AE3D27D4EB4FULL;
+	h1 ^= h2 + (h1 << 6) + (h1 >> 2);
+	// Final mix (from splitmix64)
+	h1 ^= h1 >> 30;
+	h1 *= 0xBF58476D1CE4E5B9ULL;
+	h1 ^= h1 >> 27;
+	h1 *= 0x94D049BB133111EBULL;
+	h1 ^= h1 >> 31;
+	strong[0]= (uint32_t)h1;
+	strong[1]= (uint32_t)(h1 >> 32);
+}
+
+
+// Bucket of checksum 'weak'
+static inline uint32_t bucket(const Delta_Index *di, uint32_t weak) {
+	return (weak * 2654435761U) >> 7 & di->mask;
+}
+
+
+// Index the 'n' signatures 'sig' (not copied)
+gboolean delta_index_init(Delta_Index *di, const Delta_Sig *sig, uint32_t n) {
+	uint32_t size= 1024;
+
+	while (size < 2*n)
+		size <<= 1;
+	di->sig= sig;
+	di->nsig= n;
+	di->mask= size - 1;
+	di->head= (int32_t *)malloc(size*sizeof(int32_t));
+	di->next= (int32_t *)malloc((n ? n : 1)*sizeof(int32_t));
+	if ((di->head == NULL) || (di->next == NULL)) {
+		delta_index_free(di);
+		return FALSE;
+	}
+	memset(di->head, 0xFF, size*sizeof(int32_t));
+	// Inserted backwards, so each bucket lists the first blocks first
+	for (int32_t i= (int32_t)n - 1; i >= 0; i--) {
+		uint32_t b= bucket(di, sig[i].weak);
+		di->next[i]= di->head[b];
+		di->head[b]= i;
+	}
+	return TRUE;
+}
+
+
+// Return the block with checksum 'weak' and the same content as 'buf', preferring 'hint'
+int32_t delta_find(const Delta_Index *di, uint32_t weak, const uint8_t *buf, uint32_t blen,
+		int32_t hint) {
+	int32_t i= di->head[bucket(di, weak)];
+	uint32_t strong[2];
+	gboolean hashed= FALSE;
+
+	if (i < 0)
+		return -1;
+	if ((hint >= 0) && ((uint32_t)hint < di->nsig) && (di->sig[hint].weak == weak)) {
+		delta_strong(buf, blen, strong);
+		hashed= TRUE;
+		if (!memcmp(strong, di->sig[hint].strong, sizeof(strong)))
+			return hint;
+	}
+	for (; i >= 0; i= di->next[i]) {
+		if (di->sig[i].weak != weak)
+			continue;
+		if (!hashed) {
+			delta_strong(buf, blen, strong);
+			hashed= TRUE;
+		}
+		if (!memcmp(strong, di->sig[i].strong, sizeof(strong)))
+			return i;
+	}
+	return -1;
+}
+
+
+// Free the index
+void delta_index_free(Delta_Index *di) {
+	free(di->head);
+	free(di->next);
+	di->head= di->next= NULL;
+	di->nsig= 0;
+}
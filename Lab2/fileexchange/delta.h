@@ -0,0 +1,72 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * delta.h
+ *
+ * Header file of the block signatures of delta transfers (rsync algorithm)
+ *
+ * The receiver sends the signature of each full block of its copy of the file:
+ * a rolling checksum ('weak'), which the sender updates byte by byte while it
+ * reads the new file, and a 64-bit hash ('strong'), only computed by the sender
+ * when the weak checksum matches. The sender then sends the new file as copies
+ * of the blocks matched and literal bytes.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_DELTA_H_
+#define _INCL_DELTA_H_
+
+#include <stdint.h>
+#include <glib.h>
+
+
+#define DELTA_MIN_BLOCK		2048		/* Smallest block */
+#define DELTA_MAX_BLOCK		65536		/* Largest block */
+
+
+// Signature of a block
+typedef struct Delta_Sig {
+	uint32_t weak;				// Rolling checksum
+	uint32_t strong[2];			// 64-bit hash
+} Delta_Sig;
+
+// Index of the signatures by rolling checksum
+typedef struct Delta_Index {
+	const Delta_Sig *sig;		// Signatures, by block number
+	uint32_t nsig;
+	uint32_t mask;				// Size of 'head' - 1
+	int32_t *head;				// First block of each bucket (-1: none)
+	int32_t *next;				// Next block in the same bucket
+} Delta_Index;
+
+
+// Return the block size used for a file with 'len' bytes (about sqrt(len))
+uint32_t delta_block_size(unsigned long long len);
+
+// Return the rolling checksum of the 'n' bytes of 'buf'
+uint32_t delta_weak(const uint8_t *buf, uint32_t n);
+
+// Return the rolling checksum 'weak' of a block of 'n' bytes moved one byte forward,
+//    removing byte 'out' and adding byte 'in'
+static inline uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, uint32_t n) {
+	uint32_t a= (weak & 0xFFFF) - out + in;
+	uint32_t b= (weak >> 16) - n*out + a;
+	return (a & 0xFFFF) | (b << 16);
+}
+
+// Compute the 64-bit hash of the 'n' bytes of 'buf' to 'strong'
+void delta_strong(const uint8_t *buf, uint32_t n, uint32_t strong[2]);
+
+// Index the 'n' signatures 'sig' (not copied); returns FALSE if there is not enough memory
+gboolean delta_index_init(Delta_Index *di, const Delta_Sig *sig, uint32_t n);
+
+// Return the block with checksum 'weak' and the same content as the 'blen' bytes of 'buf',
+//    preferring block 'hint', or -1 if there is none
+int32_t delta_find(const Delta_Index *di, uint32_t weak, const uint8_t *buf, uint32_t blen,
+		int32_t hint);
+
+// Free the index
+void delta_index_free(Delta_Index *di);
+
+#endif
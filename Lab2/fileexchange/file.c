@@ -12,13 +12,14 @@
 #  include <config.h>
 #endif
 
-#include <gtk/gtk.h>
+#include <glib.h>
 #include <assert.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
-#include "gui.h"
+#include <stdio.h>
+#include "file.h"
 
 
 
@@ -51,15 +52,91 @@ unsigned long long get_filesize(const char *FileName)
 }
 
 
+// Start the XOR HASH of a new file
+void fhash_init(Fhash_State *st) {
+  assert(st != NULL);
+  st->sum= 0;
+  st->aux= 0;
+  st->n= 0;
+}
+
+
+// Add 'len' bytes of the file to the XOR HASH
+//   The words are XORed 64 bits at a time, and the halves are folded at the end
+void fhash_update(Fhash_State *st, const void *buf, size_t len) {
+  const unsigned char *p= (const unsigned char *)buf;
+  assert((st != NULL) && ((buf != NULL) || (len == 0)));
+  // Complete the word started by the previous block
+  while ((st->n > 0) && (len > 0)) {
+    ((unsigned char *)&st->aux)[st->n++]= *p++;
+    len--;
+    if (st->n == sizeof(uint32_t)) {
+      st->sum ^= st->aux;
+      st->n= 0;
+    }
+  }
+  if (len >= 2*sizeof(uint32_t)) {
+    uint64_t acc= 0, w;
+    size_t nw= len / sizeof(uint64_t);
+    for (size_t i= 0; i < nw; i++) {
+      memcpy(&w, p + i*sizeof(uint64_t), sizeof(w));
+      acc ^= w;
+    }
+    st->sum ^= (uint32_t)acc ^ (uint32_t)(acc >> 32);
+    memcpy(&st->aux, p + nw*sizeof(uint64_t) - sizeof(uint32_t), sizeof(uint32_t));
+    p += nw*sizeof(uint64_t);
+    len -= nw*sizeof(uint64_t);
+  }
+  for (; len >= sizeof(uint32_t); p += sizeof(uint32_t), len -= sizeof(uint32_t)) {
+    memcpy(&st->aux, p, sizeof(uint32_t));
+    st->sum ^= st->aux;
+  }
+  // Start the next word - like fread, only the first bytes of 'aux' are replaced
+  if (len > 0) {
+    memcpy(&st->aux, p, len);
+    st->n= (int)len;
+  }
+}
+
+
+// Add 'len' zero bytes to the XOR HASH - whole zero words do not change it
+void fhash_zeros(Fhash_State *st, unsigned long long len) {
+  static const unsigned char zeros[2*sizeof(uint32_t)];
+  assert(st != NULL);
+  if (len <= sizeof(zeros)) {
+    fhash_update(st, zeros, (size_t)len);
+    return;
+  }
+  if (st->n > 0) {
+    // Complete the word started before
+    size_t k= sizeof(uint32_t) - st->n;
+    fhash_update(st, zeros, k);
+    len -= k;
+  }
+  st->aux= 0;   // Last word read
+  fhash_update(st, zeros, (size_t)(len % sizeof(uint32_t)));
+}
+
+
+// Return the XOR HASH value of the data added
+uint32_t fhash_final(const Fhash_State *st) {
+  assert(st != NULL);
+  return (st->n > 0) ? st->sum ^ st->aux : st->sum;
+}
+
+
 // Return a XOR HASH value for the contents of a file
 uint32_t fhash(FILE *f) {
+  Fhash_State st;
+  char buf[65536];
+  size_t n;
+
   assert(f != NULL);
   rewind(f);
-  uint32_t sum= 0;
-  uint32_t aux= 0;
-  while (fread(&aux, 1, sizeof(uint32_t), f) > 0)
-      sum ^= aux;
-  return sum;
+  fhash_init(&st);
+  while ((n= fread(buf, 1, sizeof(buf), f)) > 0)
+    fhash_update(&st, buf, n);
+  return fhash_final(&st);
 }
 
 
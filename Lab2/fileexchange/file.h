@@ -20,6 +20,25 @@ const char *get_trunc_filename(const char *FileName);
 // Return the file length
 unsigned long long get_filesize(const char *FileName);
 
+// State of the XOR HASH of data received in blocks of any size
+typedef struct Fhash_State {
+	uint32_t sum;		// XOR of the complete words
+	uint32_t aux;		// Last word read, partially overwritten by the last bytes
+	int n;				// Bytes of the word being completed
+} Fhash_State;
+
+// Start the XOR HASH of a new file
+void fhash_init(Fhash_State *st);
+
+// Add 'len' bytes of the file to the XOR HASH
+void fhash_update(Fhash_State *st, const void *buf, size_t len);
+
+// Add 'len' zero bytes (a hole of a sparse file) to the XOR HASH, without reading them
+void fhash_zeros(Fhash_State *st, unsigned long long len);
+
+// Return the XOR HASH value of the data added, equal to fhash of the file
+uint32_t fhash_final(const Fhash_State *st);
+
 // Return a XOR HASH value for the contents of a file
 uint32_t fhash(FILE *f);
 
@@ -0,0 +1,226 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * filecache.c
+ *
+ * Cache of the contents of small files sent often: a hash table of the files
+ *   by pathname, with a list in LRU order to evict them within the budget
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "filecache.h"
+#include "metrics.h"
+
+
+// File in memory
+struct File_Cache_Entry {
+	char *path;
+	char *data;
+	size_t len;
+	dev_t dev;					// Identity and modification time when it was read
+	ino_t ino;
+	struct timespec mtime;
+	unsigned refs;				// Users, plus one while it is in the cache
+	struct File_Cache_Entry *prev, *next;	// LRU list, most recently used first
+};
+
+
+static GHashTable *files= NULL;		// File_Cache_Entry by pathname
+static File_Cache_Entry *lru_head= NULL, *lru_tail= NULL;
+static unsigned long long budget= 0, used= 0;
+static unsigned long long hits= 0, misses= 0, hit_bytes= 0;
+static pthread_mutex_t cache_mutex= PTHREAD_MUTEX_INITIALIZER;
+
+
+// Free entry 'e' after its last user
+static void entry_unref(File_Cache_Entry *e) {
+	if (--e->refs > 0)
+		return;
+	free(e->path);
+	free(e->data);
+	free(e);
+}
+
+
+static void lru_unlink(File_Cache_Entry *e) {
+	if (e->prev != NULL)
+		e->prev->next= e->next;
+	else
+		lru_head= e->next;
+	if (e->next != NULL)
+		e->next->prev= e->prev;
+	else
+		lru_tail= e->prev;
+	e->prev= e->next= NULL;
+}
+
+
+static void lru_push(File_Cache_Entry *e) {
+	e->prev= NULL;
+	e->next= lru_head;
+	if (lru_head != NULL)
+		lru_head->prev= e;
+	else
+		lru_tail= e;
+	lru_head= e;
+}
+
+
+// Remove entry 'e' from the cache; it is freed when its users release it
+//    Called with the cache locked
+static void cache_remove(File_Cache_Entry *e) {
+	g_hash_table_remove(files, e->path);
+	lru_unlink(e);
+	used -= e->len;
+	entry_unref(e);
+}
+
+
+// Return TRUE if entry 'e' has the contents of the file described by 'st'
+static inline gboolean entry_valid(const File_Cache_Entry *e, const struct stat *st) {
+	return (st->st_dev == e->dev) && (st->st_ino == e->ino) && ((size_t)st->st_size == e->len)
+			&& (st->st_mtim.tv_sec == e->mtime.tv_sec) && (st->st_mtim.tv_nsec == e->mtime.tv_nsec);
+}
+
+
+// Read file 'path' to a new entry, with one reference; returns NULL if it is not a regular
+//    file of 'len' bytes, or if it changed while it was read
+static File_Cache_Entry *read_entry(const char *path, size_t len) {
+	File_Cache_Entry *e= (File_Cache_Entry *)calloc(1, sizeof(File_Cache_Entry));
+	int fd= open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	size_t got= 0;
+
+	if ((e == NULL) || (fd < 0) || fstat(fd, &st) || !S_ISREG(st.st_mode) || ((size_t)st.st_size != len)
+			|| ((e->data= (char *)malloc(len ? len : 1)) == NULL) || ((e->path= strdup(path)) == NULL))
+		goto fail;
+	while (got < len) {
+		ssize_t r= pread(fd, e->data+got, len-got, got);
+		if (r <= 0) {
+			if ((r < 0) && (errno == EINTR))
+				continue;
+			goto fail;
+		}
+		got += r;
+	}
+	e->len= len;
+	e->dev= st.st_dev;
+	e->ino= st.st_ino;
+	e->mtime= st.st_mtim;
+	e->refs= 1;
+	// A write during the read changes the modification time
+	if (fstat(fd, &st) || !entry_valid(e, &st))
+		goto fail;
+	close(fd);
+	return e;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	if (e != NULL) {
+		free(e->data);
+		free(e->path);
+		free(e);
+	}
+	return NULL;
+}
+
+
+// Set the memory budget of the cache in bytes (0 disables it, freeing all the files)
+void file_cache_set_budget(unsigned long long b) {
+	pthread_mutex_lock(&cache_mutex);
+	__atomic_store_n(&budget, b, __ATOMIC_RELAXED);
+	while ((lru_tail != NULL) && (used > budget))
+		cache_remove(lru_tail);
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+
+// Return the contents of file 'path', from memory or reading the file into the cache
+File_Cache_Entry *file_cache_get(const char *path, const char **data, size_t *len) {
+	File_Cache_Entry *e;
+	unsigned long long max;
+	struct stat st;
+
+	if (!__atomic_load_n(&budget, __ATOMIC_RELAXED) || stat(path, &st) || !S_ISREG(st.st_mode))
+		return NULL;
+	pthread_mutex_lock(&cache_mutex);
+	max= (budget/8 < FILE_CACHE_MAX_FILE) ? budget/8 : FILE_CACHE_MAX_FILE;
+	if ((unsigned long long)st.st_size > max) {
+		pthread_mutex_unlock(&cache_mutex);
+		return NULL;
+	}
+	if ((files != NULL) && ((e= (File_Cache_Entry *)g_hash_table_lookup(files, path)) != NULL)) {
+		if (entry_valid(e, &st)) {
+			lru_unlink(e);
+			lru_push(e);
+			e->refs++;
+			hits++;
+			hit_bytes += e->len;
+			pthread_mutex_unlock(&cache_mutex);
+			metric_add(MC_FILE_CACHE_HITS, 1);
+			metric_add(MC_FILE_CACHE_BYTES, e->len);
+			*data= e->data;
+			*len= e->len;
+			return e;
+		}
+		cache_remove(e);	// The file changed
+	}
+	misses++;
+	pthread_mutex_unlock(&cache_mutex);
+	metric_add(MC_FILE_CACHE_MISSES, 1);
+
+	// Read it without the lock; concurrent misses of the same file keep the last one read
+	if ((e= read_entry(path, st.st_size)) == NULL)
+		return NULL;
+	pthread_mutex_lock(&cache_mutex);
+	if (e->len <= max) {
+		File_Cache_Entry *old;
+		if (files == NULL)
+			files= g_hash_table_new(g_str_hash, g_str_equal);
+		if ((old= (File_Cache_Entry *)g_hash_table_lookup(files, path)) != NULL)
+			cache_remove(old);
+		while ((lru_tail != NULL) && (used + e->len > budget))
+			cache_remove(lru_tail);
+		if (used + e->len <= budget) {
+			g_hash_table_insert(files, e->path, e);
+			lru_push(e);
+			used += e->len;
+			e->refs++;
+		}
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	*data= e->data;
+	*len= e->len;
+	return e;
+}
+
+
+// Release an entry returned by file_cache_get
+void file_cache_release(File_Cache_Entry *e) {
+	pthread_mutex_lock(&cache_mutex);
+	entry_unref(e);
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+
+// Copy the statistics of the cache to 's'
+void file_cache_stats(File_Cache_Stats *s) {
+	pthread_mutex_lock(&cache_mutex);
+	s->hits= hits;
+	s->misses= misses;
+	s->hit_bytes= hit_bytes;
+	s->used= used;
+	s->budget= budget;
+	s->files= (files != NULL) ? g_hash_table_size(files) : 0;
+	pthread_mutex_unlock(&cache_mutex);
+}
@@ -0,0 +1,53 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * filecache.h
+ *
+ * Header file of the cache of the contents of small files sent often
+ *
+ * Files up to FILE_CACHE_MAX_FILE bytes are kept in memory after they are sent,
+ * up to a memory budget, and the least recently sent ones are evicted first.
+ * Each lookup checks the file with stat: a cached copy is dropped when the
+ * file is replaced or its size or modification time change.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_FILECACHE_H_
+#define _INCL_FILECACHE_H_
+
+#include <stddef.h>
+#include <glib.h>
+
+
+#define FILE_CACHE_MAX_FILE	65536		/* Largest file cached (at most 1/8 of the budget) */
+
+
+typedef struct File_Cache_Entry File_Cache_Entry;
+
+// Statistics of the cache
+typedef struct File_Cache_Stats {
+	unsigned long long hits;		// Lookups served from memory
+	unsigned long long misses;		// Lookups of files small enough that were read
+	unsigned long long hit_bytes;	// Bytes served from memory
+	unsigned long long used;		// Bytes of the files in memory
+	unsigned long long budget;		// Memory budget
+	unsigned files;					// Files in memory
+} File_Cache_Stats;
+
+
+// Set the memory budget of the cache in bytes (0 disables it, freeing all the files)
+void file_cache_set_budget(unsigned long long budget);
+
+// Return the contents of file 'path' in '*data' and its length in '*len', from memory or
+//    reading the file into the cache. Returns NULL if the cache is disabled, the file is too
+//    large or could not be read; the entry must be released with file_cache_release
+File_Cache_Entry *file_cache_get(const char *path, const char **data, size_t *len);
+
+// Release an entry returned by file_cache_get
+void file_cache_release(File_Cache_Entry *e);
+
+// Copy the statistics of the cache to 's'
+void file_cache_stats(File_Cache_Stats *s);
+
+#endif
@@ -0,0 +1,165 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * fileexchange.c
+ *
+ * Engine configuration and forwarding of the engine reports to the
+ *   application callbacks
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include "fileexchange.h"
+#include "host.h"
+#include "filetable.h"
+
+
+// Application callbacks
+static Fx_Callbacks cb;
+// Slow sending mode
+static gboolean slow= FALSE;
+// Lowest log level reported; read by the transfer threads without locks
+int fx_log_level= FX_LOG_INFO;
+
+static const char *level_names[]= { "debug", "info", "warning", "error" };
+
+
+
+// Return FX_API_VERSION of the library
+int fx_api_version(void) {
+	return FX_API_VERSION;
+}
+
+
+// Initialize the engine with the application callbacks (copied); call it first
+gboolean fx_init(const Fx_Callbacks *callbacks) {
+	if (callbacks != NULL)
+		memcpy(&cb, callbacks, sizeof(Fx_Callbacks));
+	else
+		memset(&cb, 0, sizeof(Fx_Callbacks));
+	init_file_table();
+	return TRUE;
+}
+
+
+// Log a message through the log callback
+void fx_log(const char *msg) {
+	Log(msg);
+}
+
+
+// Set the lowest level of the messages logged
+void fx_set_log_level(int level) {
+	if ((level >= FX_LOG_DEBUG) && (level <= FX_LOG_ERROR))
+		__atomic_store_n(&fx_log_level, level, __ATOMIC_RELAXED);
+}
+
+
+// Return the name of log level 'level'
+const char *fx_log_level_name(int level) {
+	return ((level >= FX_LOG_DEBUG) && (level <= FX_LOG_ERROR)) ? level_names[level] : NULL;
+}
+
+
+// Return the log level named 'name', or -1
+int fx_log_level_from_name(const char *name) {
+	int i;
+	for (i= FX_LOG_DEBUG; (name != NULL) && (i <= FX_LOG_ERROR); i++)
+		if (!g_ascii_strcasecmp(name, level_names[i]))
+			return i;
+	return -1;
+}
+
+
+// Set the slow sending mode, used to test concurrent transfers
+void fx_set_slow(gboolean s) {
+	slow= s;
+}
+
+
+/********************************************\
+|*  Forwarding to the application callbacks *|
+\********************************************/
+
+// Log the message str with level 'level'
+void Log_level (int level, const gchar * str) {
+	if (level < __atomic_load_n(&fx_log_level, __ATOMIC_RELAXED))
+		return;
+	if (cb.log != NULL)
+		cb.log(cb.ctx, level, str);
+	else
+		g_print("%s", str);
+}
+
+
+// Log the message str
+void Log (const gchar * str) {
+	Log_level(FX_LOG_INFO, str);
+}
+
+
+// Log a formatted message with level 'level'
+void Log_printf (int level, const char *fmt, ...) {
+	char buf[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	Log_level(level, buf);
+}
+
+
+// Report a fatal socket error to the application, which should leave its main loop
+void quit_mainloop (void) {
+	if (cb.fatal != NULL)
+		cb.fatal(cb.ctx);
+}
+
+
+// Return TRUE if slow sending is configured
+gboolean get_slow(void) {
+	return slow;
+}
+
+
+// Report a new transfer
+gboolean GUI_regist_thread(unsigned tid, gboolean is_snd, const char *f_name, const char *of_name, gboolean lock_gdk) {
+	if (cb.transfer_new != NULL)
+		cb.transfer_new(cb.ctx, tid, is_snd, f_name, of_name, lock_gdk);
+	return TRUE;
+}
+
+
+// Report the filename of a sending transfer
+gboolean GUI_update_filename(unsigned tid, const char *f_name, gboolean lock_gdk) {
+	if (cb.transfer_file != NULL)
+		cb.transfer_file(cb.ctx, tid, f_name, lock_gdk);
+	return TRUE;
+}
+
+
+// Report the bytes moved by a transfer that is ending
+void GUI_transfer_done(unsigned tid, gboolean is_snd, long long bytes, gboolean lock_gdk) {
+	if (cb.transfer_done != NULL)
+		cb.transfer_done(cb.ctx, tid, is_snd, bytes, lock_gdk);
+}
+
+
+// Report the end of a transfer
+gboolean GUI_del_thread(unsigned tid, gboolean lock_gdk) {
+	if (cb.transfer_end != NULL)
+		cb.transfer_end(cb.ctx, tid, lock_gdk);
+	return TRUE;
+}
+
+
+// Report the end of all transfers
+void GUI_clear_threads(gboolean lock_gdk) {
+	if (cb.transfers_clear != NULL)
+		cb.transfers_clear(cb.ctx, lock_gdk);
+}
@@ -0,0 +1,215 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * fileexchange.h
+ *
+ * Public API of libfileexchange - the fileexchange engine (sockets, protocol,
+ *   shared file index and file transfers) without any user interface.
+ *
+ * The engine runs in the GLib main loop of the application: fx_start registers
+ *   the sockets in the default main context, and the application must run it
+ *   (g_main_loop_run, gtk_main, ...). Transfers run in their own threads.
+ *   The engine reports to the application through the Fx_Callbacks functions;
+ *   NULL callbacks are ignored.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_FILEEXCHANGE_H_
+#define _INCL_FILEEXCHANGE_H_
+
+#include <stdint.h>
+#include <glib.h>
+
+#define FX_API_VERSION		4	/* Incremented on incompatible API changes */
+
+
+// Levels of the log messages
+typedef enum { FX_LOG_DEBUG, FX_LOG_INFO, FX_LOG_WARNING, FX_LOG_ERROR } Fx_Log_Level;
+
+// Devices whose senders read in turns: none, rotational disks or all
+typedef enum { FX_IO_SCHED_OFF, FX_IO_SCHED_ROTATIONAL, FX_IO_SCHED_ALL } Fx_Io_Sched;
+
+
+// Functions called by the engine. 'lock' is TRUE when the function is called
+//   from a transfer thread, outside the main loop. They are never called with the engine
+//   locks held; applications with a global lock (e.g. GDK) should queue the transfer
+//   callbacks to their main loop instead of taking it from a transfer thread
+typedef struct Fx_Callbacks {
+	void *ctx;		// First argument of all callbacks
+
+	// Log message with level 'level' (Fx_Log_Level); may be called from any thread
+	void (*log)(void *ctx, int level, const char *msg);
+	// New transfer 'tid' - sending file 'fname', or receiving 'fname' into 'ofname'
+	void (*transfer_new)(void *ctx, unsigned tid, gboolean sending, const char *fname,
+			const char *ofname, gboolean lock);
+	// The filename of sending transfer 'tid' is known
+	void (*transfer_file)(void *ctx, unsigned tid, const char *fname, gboolean lock);
+	// Transfer 'tid' is ending after moving 'bytes' (called before transfer_end)
+	void (*transfer_done)(void *ctx, unsigned tid, gboolean sending, long long bytes, gboolean lock);
+	// Transfer 'tid' ended
+	void (*transfer_end)(void *ctx, unsigned tid, gboolean lock);
+	// All transfers ended
+	void (*transfers_clear)(void *ctx, gboolean lock);
+	// A socket failed and the engine was stopped; the application should leave its main loop
+	void (*fatal)(void *ctx);
+} Fx_Callbacks;
+
+
+/***********************\
+|*  Engine control     *|
+\***********************/
+
+// Return FX_API_VERSION of the library
+int fx_api_version(void);
+
+// Initialize the engine with the application callbacks (copied); call it first
+gboolean fx_init(const Fx_Callbacks *cb);
+
+// Log a message through the log callback, with level FX_LOG_INFO
+void fx_log(const char *msg);
+
+// Set the lowest level of the messages logged (default FX_LOG_INFO)
+void fx_set_log_level(int level);
+
+// Return the name of log level 'level', or NULL if it is not valid
+const char *fx_log_level_name(int level);
+
+// Return the log level named 'name' (debug, info, warning or error), or -1 if it is not valid
+int fx_log_level_from_name(const char *name);
+
+// Set the directory where received files are written (copied)
+void fx_set_out_dir(const char *dir);
+
+// Set the slow sending mode, used to test concurrent transfers
+void fx_set_slow(gboolean slow);
+
+// Set the size of the blocks read and written by new transfers (0 for the default, 64 KiB)
+void fx_set_buffer_size(unsigned size);
+
+// Set the interfaces that join the multicast groups (comma separated names, NULL or "" for all
+//    the interfaces with multicast); used by the next fx_start
+void fx_set_mcast_interfaces(const char *names);
+
+// Set the length of the queue of pending TCP connections (0 for the default, 1024)
+void fx_set_tcp_backlog(int backlog);
+
+// Set the number of threads accepting TCP connections, each with its own SO_REUSEPORT socket
+//    in the same port (0, the default, accepts them in the main loop); used by the next fx_start
+void fx_set_tcp_acceptors(int n);
+
+// Drop the received files from the page cache after they are written (default FALSE), so
+//    large downloads do not evict the files being shared
+void fx_set_drop_cache(gboolean drop);
+
+// Move the files received to the file with splice, through a pipe, instead of reading them
+//    to a buffer and writing it (default FALSE); only files sent whole (not sparse,
+//    compressed, deltas or chunks) are spliced. With 'hash' (default TRUE) the data is read
+//    back from the page cache to verify the hash; without it, only the length is verified
+void fx_set_splice(gboolean enable, gboolean hash);
+
+// Received files are written to a hidden file ('.<name>.<tid>.part' in the output directory) and
+//    renamed to their name after their length and hash are verified. With 'noreplace' (default
+//    FALSE) existing files are kept, and the received file is renamed to '<name>.<tid>'
+void fx_set_rename_noreplace(gboolean noreplace);
+
+// Create the marker '<name>.done' (name, length and hash) after each received file is renamed
+//    to its name (default FALSE); markers are also renamed into place
+void fx_set_done_marker(gboolean marker);
+
+// Ask the senders to compress the files downloaded next (default FALSE). Each sender samples
+//    the file and only compresses it if it saves enough, in 64 KiB blocks compressed with LZ
+void fx_set_compression(gboolean compress);
+
+// Download files that exist in the output directory as deltas of the existing copy (default
+//    FALSE): the sender only sends the blocks that changed, found with rsync signatures
+void fx_set_delta(gboolean enable);
+
+// Keep a store of the chunks of the files received (default FALSE): files are cut into
+//    content-defined chunks, and senders only send the chunks that no file received has
+//    Disabling it clears the store
+void fx_set_chunk_store(gboolean enable);
+
+// Keep the files of up to 64 KiB sent to other nodes in memory, up to 'bytes' (default 0:
+//    disabled), evicting the least recently sent ones. Cached files are checked with stat
+//    before each transfer, and read again if they changed
+void fx_set_file_cache(unsigned long long bytes);
+
+// Send the files of 16 KiB or more in the file cache with MSG_ZEROCOPY (default FALSE); the
+//    cache keeps each file until the kernel releases its pages. When the kernel copies them
+//    (e.g. to the loopback), the next files are copied, backing off up to 64 files
+void fx_set_zerocopy(gboolean enable);
+
+// Make the senders of files in the same device read in turns (Fx_Io_Sched, default
+//    FX_IO_SCHED_ROTATIONAL), each turn a 2 MiB read, with 'slots' turns at once (default 1)
+void fx_set_io_scheduler(int mode, int slots);
+
+// Start the server on the multicast groups 'addr4' and/or 'addr6' (NULL to disable) and 'mport'
+//    Returns TRUE if it is active
+gboolean fx_start(const char *addr4, const char *addr6, unsigned short mport);
+
+// Stop the server and all transfers
+void fx_stop(void);
+
+// Return TRUE if the server is active
+gboolean fx_active(void);
+
+// Return the TCP port used to send files, or 0 if the server is not active
+unsigned short fx_tcp_port(void);
+
+// Log the engine statistics
+void fx_log_stats(void);
+
+// Return the engine metrics in the Prometheus text format; it must be freed with g_free
+char *fx_metrics_text(void);
+
+// Expose the metrics in the Unix socket 'path', independently of fx_start (NULL closes it)
+gboolean fx_metrics_listen(const char *path);
+
+
+/***********************\
+|*  Shared files       *|
+\***********************/
+
+// Add or replace a shared file, given its full pathname
+gboolean fx_add_file(const char *fullname);
+
+// Remove a shared file, given its full pathname
+gboolean fx_del_file(const char *fullname);
+
+// Remove all shared files
+void fx_clear_files(void);
+
+// Add all files in the file list 'filelist' (one full pathname per line)
+gboolean fx_add_filelist(const char *filelist);
+
+// Write the shared files to the file list 'filelist'
+gboolean fx_write_filelist(const char *filelist);
+
+// Call 'fn' for each shared file
+void fx_foreach_file(void (*fn)(void *data, const char *fullname, unsigned long long flen,
+		uint32_t fhash), void *data);
+
+
+/***********************\
+|*  Requests           *|
+\***********************/
+
+// Send a QUERY for 'filename' (without path) and download the file from the first HIT
+//    Returns FALSE if it was not sent, e.g. while waiting for the HIT of a previous QUERY
+gboolean fx_query(const char *filename);
+
+// Send a SEARCH for names containing 'pattern', or matching it if it has glob characters
+//    Returns FALSE if it was not sent
+gboolean fx_search(const char *pattern);
+
+// Stop transfer 'tid'
+void fx_stop_transfer(unsigned tid);
+
+// Call 'fn' for each transfer with the percentage transferred. The transfer threads
+//    publish it without locks; poll it from a timer instead of being called per block.
+//    'fn' runs with the transfer list locked and must not call the engine
+void fx_foreach_transfer(void (*fn)(void *data, unsigned tid, gboolean sending, int percent),
+		void *data);
+
+#endif
@@ -0,0 +1,340 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * filetable.c
+ *
+ * Tables of shared files
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include "fileexchange.h"
+#include "filetable.h"
+#include "host.h"
+#include "file.h"
+#include "bloom.h"
+#include "trigram.h"
+#include "metrics.h"
+
+
+// Shared file
+typedef struct File_Entry {
+	char *fullname;				// Full pathname
+	unsigned long long flen;	// File length
+	uint32_t fhash;				// File hash value
+} File_Entry;
+
+// File table of the engine - initialized by init_file_table
+File_Table file_table;
+
+
+
+/** Free a File_Entry */
+static void free_file_entry(gpointer data) {
+	File_Entry *e= (File_Entry *)data;
+	g_free(e->fullname);
+	g_free(e);
+}
+
+
+/** Initialize a file table */
+void ft_init(File_Table *ft) {
+	ft->files= g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_file_entry);
+	g_queue_init(&ft->order);
+	ft->basenames= g_hash_table_new(g_str_hash, g_str_equal);
+	memset(&ft->filter, 0, sizeof(ft->filter));
+	tgram_init(&ft->index);
+	pthread_rwlock_init(&ft->rwlock, NULL);
+	memset(&ft->qstats, 0, sizeof(ft->qstats));
+}
+
+
+/** Free the memory used by a file table */
+void ft_free(File_Table *ft) {
+	g_queue_clear(&ft->order);
+	g_hash_table_destroy(ft->basenames);
+	g_hash_table_destroy(ft->files);
+	bloom_free(&ft->filter);
+	tgram_free(&ft->index);
+	pthread_rwlock_destroy(&ft->rwlock);
+}
+
+
+/** Rebuild the Bloom filter from the file table, resizing it for the current number of files */
+static void rebuild_file_filter(File_Table *ft) {
+	GList *l;
+
+	bloom_free(&ft->filter);
+	if (!bloom_init(&ft->filter, bloom_size_for(g_hash_table_size(ft->files)))) {
+		Log("Failed to allocate the file Bloom filter - QUERYs are not filtered\n");
+		return;
+	}
+	for (l= ft->order.head; l != NULL; l= l->next)
+		bloom_add(&ft->filter, get_trunc_filename(((File_Entry *)l->data)->fullname));
+}
+
+
+/** Return FALSE if 'filename' (without path) is surely not in the table */
+gboolean ft_may_have(File_Table *ft, const char *filename) {
+	gboolean ok;
+	pthread_rwlock_rdlock(&ft->rwlock);
+	ok= bloom_may_contain(&ft->filter, filename);
+	pthread_rwlock_unlock(&ft->rwlock);
+	return ok;
+}
+
+
+/** Return the expected false positive rate of the Bloom filter */
+double ft_fp_rate(File_Table *ft) {
+	double r;
+	pthread_rwlock_rdlock(&ft->rwlock);
+	r= (ft->filter.cnt == NULL) ? 1.0 : bloom_fp_rate(&ft->filter);
+	pthread_rwlock_unlock(&ft->rwlock);
+	return r;
+}
+
+
+/** Return the number of files */
+unsigned ft_size(File_Table *ft) {
+	unsigned n;
+	pthread_rwlock_rdlock(&ft->rwlock);
+	n= ft->order.length;
+	pthread_rwlock_unlock(&ft->rwlock);
+	return n;
+}
+
+
+/** Search for basenames matching 'pattern' (substring or glob)
+ *   The names returned are valid until the table is modified; the engine table is
+ *   modified in the main loop, where SEARCHs are also handled */
+int ft_search(File_Table *ft, const char *pattern, int offset, int max, Tgram_Match *res, gboolean *more) {
+	int n;
+	pthread_rwlock_rdlock(&ft->rwlock);
+	n= tgram_search(&ft->index, pattern, offset, max, res, more);
+	pthread_rwlock_unlock(&ft->rwlock);
+	return n;
+}
+
+
+/** Return the full pathname of 'filename'; it must be freed with free() */
+gboolean ft_fullname(File_Table *ft, const char *filename, const char **fullname) {
+	if ((filename == NULL) || (fullname == NULL)) {
+		Log_level(FX_LOG_ERROR, "ERROR: Invalid parameters in ft_fullname()\n");
+		return FALSE;
+	}
+	pthread_rwlock_rdlock(&ft->rwlock);
+	File_Entry *e= (File_Entry *)g_hash_table_lookup(ft->basenames, filename);
+	if (e != NULL)
+		*fullname= strdup(e->fullname);
+	pthread_rwlock_unlock(&ft->rwlock);
+	return e != NULL;
+}
+
+
+/** Return length and hash value of file 'filename' */
+gboolean ft_details(File_Table *ft, const char *filename, unsigned long long *flen, unsigned long long *fhash) {
+	if ((filename == NULL) || (flen == NULL) || (fhash == NULL)) {
+		Log_level(FX_LOG_ERROR, "ERROR: Invalid parameters in ft_details()\n");
+		return FALSE;
+	}
+	pthread_rwlock_rdlock(&ft->rwlock);
+	File_Entry *e= (File_Entry *)g_hash_table_lookup(ft->basenames, filename);
+	if (e != NULL) {
+		*flen= e->flen;
+		*fhash= e->fhash;
+	}
+	pthread_rwlock_unlock(&ft->rwlock);
+	return e != NULL;
+}
+
+
+/** Add or replace file 'fullname', with length 'flen' and hash 'fhash' */
+void ft_add(File_Table *ft, const char *fullname, unsigned long long flen, uint32_t fhash) {
+	File_Entry *e= g_new(File_Entry, 1);
+	e->fullname= g_strdup(fullname);
+	e->flen= flen;
+	e->fhash= fhash;
+	const char *bname= get_trunc_filename(e->fullname);
+
+	pthread_rwlock_wrlock(&ft->rwlock);
+	File_Entry *old= (File_Entry *)g_hash_table_lookup(ft->files, fullname);
+	if (old != NULL) {
+		Log("Replacing file\n");
+		tgram_del(&ft->index, bname);
+		if (g_hash_table_lookup(ft->basenames, bname) == old)
+			g_hash_table_replace(ft->basenames, (gpointer)bname, e);
+		g_queue_find(&ft->order, old)->data= e;
+	} else {
+		// new file
+		bloom_add(&ft->filter, bname);
+		if (!g_hash_table_contains(ft->basenames, bname))
+			g_hash_table_insert(ft->basenames, (gpointer)bname, e);
+		g_queue_push_tail(&ft->order, e);
+	}
+	g_hash_table_replace(ft->files, e->fullname, e);	// Frees 'old'
+	tgram_add(&ft->index, bname, e->flen);
+	if ((ft->filter.cnt == NULL) || bloom_overloaded(&ft->filter))
+		rebuild_file_filter(ft);
+	pthread_rwlock_unlock(&ft->rwlock);
+}
+
+
+/** Remove file 'fullname' */
+gboolean ft_del(File_Table *ft, const char *fullname) {
+	GList *l;
+
+	pthread_rwlock_wrlock(&ft->rwlock);
+	File_Entry *e= (File_Entry *)g_hash_table_lookup(ft->files, fullname);
+	if (e == NULL) {
+		pthread_rwlock_unlock(&ft->rwlock);
+		return FALSE;
+	}
+	const char *bname= get_trunc_filename(e->fullname);
+	bloom_del(&ft->filter, bname);
+	tgram_del(&ft->index, bname);
+	g_queue_remove(&ft->order, e);
+	if (g_hash_table_lookup(ft->basenames, bname) == e) {
+		g_hash_table_remove(ft->basenames, bname);
+		// Another file with the same name in other directory
+		for (l= ft->order.head; l != NULL; l= l->next) {
+			File_Entry *o= (File_Entry *)l->data;
+			if (!strcmp(get_trunc_filename(o->fullname), bname)) {
+				g_hash_table_insert(ft->basenames, (gpointer)get_trunc_filename(o->fullname), o);
+				break;
+			}
+		}
+	}
+	g_hash_table_remove(ft->files, fullname);
+	pthread_rwlock_unlock(&ft->rwlock);
+	return TRUE;
+}
+
+
+/** Remove all files */
+void ft_clear(File_Table *ft) {
+	pthread_rwlock_wrlock(&ft->rwlock);
+	g_queue_clear(&ft->order);
+	g_hash_table_remove_all(ft->basenames);
+	g_hash_table_remove_all(ft->files);
+	bloom_clear(&ft->filter);
+	tgram_clear(&ft->index);
+	pthread_rwlock_unlock(&ft->rwlock);
+}
+
+
+
+/*********************************************\
+|*  Shared files of the engine - public API  *|
+\*********************************************/
+
+/** Initialize the file table of the engine */
+void init_file_table(void) {
+	if (file_table.files == NULL)
+		ft_init(&file_table);
+}
+
+
+/** Add or replace a shared file, given its full pathname */
+gboolean fx_add_file(const char *fullname) {
+	if (fullname == NULL)
+		return FALSE;
+	init_file_table();
+
+	// Read the file before taking the lock
+	metric_gauge_add(MG_HASH_BACKLOG, 1);
+	long long t0= metric_now_ns();
+	uint32_t fhash= fhash_filename(fullname);
+	metric_observe(MH_HASH_US, (metric_now_ns()-t0)/1000);
+	metric_gauge_add(MG_HASH_BACKLOG, -1);
+	ft_add(&file_table, fullname, get_filesize(fullname), fhash);
+	return TRUE;
+}
+
+
+/** Remove a shared file, given its full pathname */
+gboolean fx_del_file(const char *fullname) {
+	if ((fullname == NULL) || (file_table.files == NULL))
+		return FALSE;
+	return ft_del(&file_table, fullname);
+}
+
+
+/** Remove all shared files */
+void fx_clear_files(void) {
+	if (file_table.files != NULL)
+		ft_clear(&file_table);
+}
+
+
+/** Add all files in the file list 'filelist' (one full pathname per line) */
+gboolean fx_add_filelist(const char *filelist) {
+	char buf[256];	// Maximum filename size
+
+	if ((filelist != NULL) && (strlen(filelist)>0)) {
+		FILE *f= fopen(filelist, "r");
+		if (f == NULL) {
+			sprintf(buf, "Open(r) of filelist file '%s' failed\n", filelist);
+			Log(buf);
+			return FALSE;
+		}
+		while(!feof(f)) {
+			buf[0]= '\0';
+			if (fgets(buf, sizeof(buf), f) != NULL) {
+				if (strlen(buf)>1) {
+					buf[strlen(buf)-1]= '\0';	// Clear '\n' in Linux
+					fx_add_file(buf);
+				}
+			}
+		}
+		fclose(f);
+		return TRUE;
+	} else
+		return FALSE;
+}
+
+
+/** Write the shared files to the file list 'filelist' */
+gboolean fx_write_filelist(const char *filelist) {
+	GList *l;
+	gboolean ok= TRUE;
+	char tmp_buf[100];
+
+	if ((filelist == NULL) || (strlen(filelist) == 0))
+		return FALSE;
+	FILE *f= fopen(filelist, "w");
+	if (f == NULL) {
+		snprintf(tmp_buf, sizeof(tmp_buf), "Could not open file list '%s' for writing\n", filelist);
+		Log(tmp_buf);
+		return FALSE;
+	}
+	pthread_rwlock_rdlock(&file_table.rwlock);
+	for (l= file_table.order.head; ok && (l != NULL); l= l->next)
+		ok= fprintf(f, "%s\n", ((File_Entry *)l->data)->fullname) > 0;
+	pthread_rwlock_unlock(&file_table.rwlock);
+	fclose(f);
+	if (!ok) {
+		snprintf(tmp_buf, sizeof(tmp_buf), "Failed writing to file list '%s'\n", filelist);
+		Log(tmp_buf);
+	}
+	return ok;
+}
+
+
+/** Call 'fn' for each shared file, in the order they were added */
+void fx_foreach_file(void (*fn)(void *data, const char *fullname, unsigned long long flen,
+		uint32_t fhash), void *data) {
+	GList *l;
+	assert(fn != NULL);
+	pthread_rwlock_rdlock(&file_table.rwlock);
+	for (l= file_table.order.head; l != NULL; l= l->next) {
+		File_Entry *e= (File_Entry *)l->data;
+		fn(data, e->fullname, e->flen, e->fhash);
+	}
+	pthread_rwlock_unlock(&file_table.rwlock);
+}
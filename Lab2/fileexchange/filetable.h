@@ -0,0 +1,87 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * filetable.h
+ *
+ * Header file of the tables of shared files: a hash table by full pathname and
+ *   by basename, a counting Bloom filter to reject QUERYs for unknown files and
+ *   a trigram index to answer SEARCHs.
+ *   Lookups take a read lock, so QUERYs and sending threads run in parallel.
+ *   The engine uses 'file_table'; the discovery simulator creates one per peer.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_FILETABLE_H_
+#define _INCL_FILETABLE_H_
+
+#include <glib.h>
+#include <pthread.h>
+#include "bloom.h"
+#include "trigram.h"
+
+
+// Statistics of the Bloom filter pre-check of QUERYs
+typedef struct Query_Stats {
+	unsigned long long queries;		// QUERYs received
+	unsigned long long rejected;	// QUERYs rejected by the Bloom filter
+	unsigned long long false_pos;	// QUERYs accepted by the filter for files we do not have
+	unsigned long long checks_timed, check_ns;	// Sampled Bloom filter check time
+	unsigned long long lookups_timed, lookup_ns;// Sampled file table lookup time
+} Query_Stats;
+
+// Table of shared files
+typedef struct File_Table {
+	GHashTable *files;			// Full pathname -> File_Entry
+	GQueue order;				// Files in the order they were added
+	GHashTable *basenames;		// Basename -> File_Entry, used to answer QUERYs
+	Bloom_Filter filter;		// Basenames of the files in the table
+	Trigram_Index index;		// Basenames of the files in the table, used to answer SEARCHs
+	pthread_rwlock_t rwlock;	// QUERYs and senders only read the table
+	Query_Stats qstats;			// QUERY statistics, updated by the thread answering QUERYs
+} File_Table;
+
+
+// File table of the engine
+extern File_Table file_table;
+
+// Initialize the file table of the engine
+void init_file_table(void);
+
+
+// Initialize a file table
+void ft_init(File_Table *ft);
+
+// Free the memory used by a file table
+void ft_free(File_Table *ft);
+
+// Add or replace file 'fullname', with length 'flen' and hash 'fhash'
+void ft_add(File_Table *ft, const char *fullname, unsigned long long flen, uint32_t fhash);
+
+// Remove file 'fullname'; returns FALSE if it is not in the table
+gboolean ft_del(File_Table *ft, const char *fullname);
+
+// Remove all files
+void ft_clear(File_Table *ft);
+
+// Return the number of files
+unsigned ft_size(File_Table *ft);
+
+// Return FALSE if 'filename' (without path) is surely not in the table (Bloom filter)
+gboolean ft_may_have(File_Table *ft, const char *filename);
+
+// Return the expected false positive rate of the Bloom filter
+double ft_fp_rate(File_Table *ft);
+
+// Return the full pathname of 'filename' (without path); it must be freed with free()
+gboolean ft_fullname(File_Table *ft, const char *filename, const char **fullname);
+
+// Return length and hash value of file 'filename' (without path)
+gboolean ft_details(File_Table *ft, const char *filename, unsigned long long *flen, unsigned long long *fhash);
+
+// Search for basenames matching 'pattern' (substring or glob)
+//   Skips 'offset' matches and returns up to 'max' matches in 'res'; the names are
+//   valid until the table is modified
+int ft_search(File_Table *ft, const char *pattern, int offset, int max, Tgram_Match *res, gboolean *more);
+
+#endif
@@ -0,0 +1,350 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * filewriter.c
+ *
+ * Write-behind writer of received files: the receiving thread fills blocks and a
+ *   writer thread writes them with pwrite, so the socket is read while the disk
+ *   is written. Preallocation avoids fragmentation, and sync_file_range keeps
+ *   writeback running in chunks instead of in large bursts. Holes of sparse files
+ *   are queued with the blocks and skipped by the writer. Spliced files have no
+ *   blocks nor writer thread: the pages move from the socket to a pipe and from the
+ *   pipe to the file, in the receiving thread.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#define _GNU_SOURCE		// fallocate, sync_file_range and splice
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include "filewriter.h"
+#include "host.h"
+
+#define FW_ALIGN		4096		// Alignment of the blocks in memory and in the file
+
+
+struct File_Writer {
+	int fd;
+	gboolean drop_cache;			// Drop the pages written from the page cache
+	int blen;						// Size of the blocks
+	char *blocks[FW_BLOCKS];
+	int fill[FW_BLOCKS];			// Bytes of each queued block
+	unsigned long long hole[FW_BLOCKS];	// Bytes skipped after each queued block
+	unsigned head;					// Next block written (by the writer thread)
+	unsigned tail;					// Block being filled (by the receiving thread)
+	int cur;						// Bytes in the block being filled
+	unsigned long long committed;	// Bytes committed, including the holes
+	unsigned long long written;		// Bytes written by the writer thread
+	unsigned long long sync_start;	// Start of the chunk whose writeback was started
+	unsigned long long synced;		// End of that chunk
+	gboolean closing;
+	gboolean error;
+	pthread_mutex_t mutex;
+	pthread_cond_t queued;			// Signals the writer thread
+	pthread_cond_t freed;			// Signals the receiving thread
+	pthread_t thread;
+	gboolean threaded;				// FALSE: files of one block are written by fw_close
+	gboolean spliced;				// Written by fw_splice, through 'pipe'
+	int pipe[2];
+	int pipe_len;					// Capacity of the pipe
+};
+
+
+/** Start the writeback of the bytes written since the last chunk. When the pages are
+ *   dropped, waits for the writeback of the previous chunk and drops its pages; otherwise
+ *   the writer never waits for the disk */
+static void fw_writeback(File_Writer *fw, gboolean last) {
+	if (fw->written > fw->synced)
+		sync_file_range(fw->fd, fw->synced, fw->written-fw->synced, SYNC_FILE_RANGE_WRITE);
+	if (fw->drop_cache && (fw->synced > fw->sync_start)) {
+		sync_file_range(fw->fd, fw->sync_start, fw->synced-fw->sync_start,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fw->fd, fw->sync_start, fw->synced-fw->sync_start, POSIX_FADV_DONTNEED);
+	}
+	fw->sync_start= fw->synced;
+	fw->synced= fw->written;
+	if (last && (fw->synced > fw->sync_start))
+		fw_writeback(fw, FALSE);	// Wait for (and drop) the last chunk
+}
+
+
+/** Write 'len' bytes of block 'b' at the end of the file, followed by its hole
+ *   Returns FALSE if it failed */
+static gboolean fw_write_block(File_Writer *fw, int b, int len) {
+	int done= 0;
+
+	while (done < len) {
+		ssize_t m= pwrite(fw->fd, fw->blocks[b]+done, len-done, fw->written+done);
+		if (m < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGF(FX_LOG_ERROR, "ERROR: writing received file: %s\n", strerror(errno));
+			break;
+		}
+		done += m;
+	}
+	fw->written += done;
+	if (fw->written - fw->synced >= FW_SYNC_CHUNK)
+		fw_writeback(fw, FALSE);
+	if ((done == len) && (fw->hole[b] > 0)) {
+		if (fw->written > fw->synced)
+			fw_writeback(fw, fw->drop_cache);	// The chunks never include holes
+		fw->written += fw->hole[b];
+		fw->synced= fw->sync_start= fw->written;
+	}
+	return done == len;
+}
+
+
+/** Writer thread: write the queued blocks in order */
+static void *fw_thread(void *ptr) {
+	File_Writer *fw= (File_Writer *)ptr;
+
+	for (;;) {
+		pthread_mutex_lock(&fw->mutex);
+		while ((fw->head == fw->tail) && !fw->closing)
+			pthread_cond_wait(&fw->queued, &fw->mutex);
+		if (fw->head == fw->tail) {
+			pthread_mutex_unlock(&fw->mutex);
+			break;		// Closing and everything written
+		}
+		int b= fw->head % FW_BLOCKS;
+		int len= fw->fill[b];
+		pthread_mutex_unlock(&fw->mutex);
+
+		gboolean ok= fw_write_block(fw, b, len);
+
+		pthread_mutex_lock(&fw->mutex);
+		if (!ok) {
+			fw->error= TRUE;
+			fw->head= fw->tail;		// Discard the queue
+		} else
+			fw->head++;
+		pthread_cond_signal(&fw->freed);
+		pthread_mutex_unlock(&fw->mutex);
+	}
+	if (fw->drop_cache)
+		fw_writeback(fw, TRUE);
+	return NULL;
+}
+
+
+/** Create file 'path' for 'len' bytes and start its writer thread */
+File_Writer *fw_open(const char *path, unsigned long long len, int flags) {
+	File_Writer *fw;
+	int i;
+
+	assert(path != NULL);
+	if ((fw= (File_Writer *)calloc(1, sizeof(File_Writer))) == NULL)
+		return NULL;
+	// Spliced files are read back to hash them
+	if ((fw->fd= open(path, ((flags & FW_SPLICE) ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0644)) < 0) {
+		free(fw);
+		return NULL;
+	}
+	// Allocate the whole file at once - ignored by filesystems that do not support it
+	if ((len > 0) && !(flags & FW_SPARSE) && fallocate(fw->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)len) && (errno != EOPNOTSUPP))
+		LOGF(FX_LOG_WARNING, "Failed preallocating %llu bytes for '%s': %s\n", len, path,
+				strerror(errno));
+	posix_fadvise(fw->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	fw->drop_cache= (flags & FW_DROP_CACHE) != 0;
+	if (flags & FW_SPLICE) {
+		if (pipe2(fw->pipe, O_CLOEXEC)) {
+			close(fw->fd);
+			unlink(path);
+			free(fw);
+			return NULL;
+		}
+		// Larger pipes move more per splice; unprivileged users are limited to pipe-max-size
+		fcntl(fw->pipe[1], F_SETPIPE_SZ, FW_BLOCK);
+		if ((fw->pipe_len= fcntl(fw->pipe[1], F_GETPIPE_SZ)) <= 0)
+			fw->pipe_len= FW_ALIGN;
+		fw->spliced= TRUE;
+		pthread_mutex_init(&fw->mutex, NULL);
+		pthread_cond_init(&fw->queued, NULL);
+		pthread_cond_init(&fw->freed, NULL);
+		return fw;
+	}
+	// Small files use one smaller block, written when the file is closed
+	fw->threaded= (len > FW_BLOCK);
+	fw->blen= fw->threaded ? FW_BLOCK : (int)((len + FW_ALIGN-1) / FW_ALIGN * FW_ALIGN);
+	if (fw->blen == 0)
+		fw->blen= FW_ALIGN;
+	for (i= 0; i < (fw->threaded ? FW_BLOCKS : 1); i++)
+		if (posix_memalign((void **)&fw->blocks[i], FW_ALIGN, fw->blen)) {
+			fw->blocks[i]= NULL;
+			break;
+		}
+	pthread_mutex_init(&fw->mutex, NULL);
+	pthread_cond_init(&fw->queued, NULL);
+	pthread_cond_init(&fw->freed, NULL);
+	if ((fw->blocks[0] == NULL) || (fw->threaded && ((i < FW_BLOCKS)
+			|| pthread_create(&fw->thread, NULL, fw_thread, fw)))) {
+		for (i= 0; i < FW_BLOCKS; i++)
+			free(fw->blocks[i]);
+		close(fw->fd);
+		unlink(path);
+		free(fw);
+		return NULL;
+	}
+	return fw;
+}
+
+
+/** Queue the block being filled, followed by a hole of 'hole' bytes; called with the
+ *   mutex unlocked */
+static void fw_queue(File_Writer *fw, unsigned long long hole) {
+	if (!fw->threaded) {
+		fw->hole[0]= hole;
+		if (!fw_write_block(fw, 0, fw->cur))
+			fw->error= TRUE;
+		fw->cur= 0;
+		return;
+	}
+	pthread_mutex_lock(&fw->mutex);
+	fw->fill[fw->tail % FW_BLOCKS]= fw->cur;
+	fw->hole[fw->tail % FW_BLOCKS]= hole;
+	fw->tail++;
+	pthread_cond_signal(&fw->queued);
+	pthread_mutex_unlock(&fw->mutex);
+	fw->cur= 0;
+}
+
+
+/** Wait for a free block; returns FALSE after a write error */
+static gboolean fw_wait(File_Writer *fw) {
+	pthread_mutex_lock(&fw->mutex);
+	while ((fw->tail - fw->head >= FW_BLOCKS) && !fw->error)
+		pthread_cond_wait(&fw->freed, &fw->mutex);
+	gboolean error= fw->error;
+	pthread_mutex_unlock(&fw->mutex);
+	return !error;
+}
+
+
+/** Return the free space of the block being filled, and its size in 'n' */
+char *fw_buffer(File_Writer *fw, int *n) {
+	assert((fw != NULL) && (n != NULL));
+	if (!fw_wait(fw))
+		return NULL;
+	*n= fw->blen - fw->cur;
+	return fw->blocks[fw->tail % FW_BLOCKS] + fw->cur;
+}
+
+
+/** Add 'n' bytes written to the buffer returned by fw_buffer */
+gboolean fw_commit(File_Writer *fw, int n) {
+	assert((fw != NULL) && (n >= 0) && (fw->cur + n <= fw->blen));
+	fw->cur += n;
+	fw->committed += n;
+	if (fw->cur == fw->blen)
+		fw_queue(fw, 0);
+	return !fw->error;
+}
+
+
+/** Leave a hole of 'len' bytes after the data committed */
+gboolean fw_hole(File_Writer *fw, unsigned long long len) {
+	assert(fw != NULL);
+	if (len == 0)
+		return !fw->error;
+	if (!fw_wait(fw))
+		return FALSE;
+	fw->committed += len;
+	fw_queue(fw, len);	// The block being filled ends at the hole
+	return !fw->error;
+}
+
+
+/** Move up to 'max' bytes from socket 'fd' to the end of the file, through the pipe */
+int fw_splice(File_Writer *fw, int fd, int max, void *copy) {
+	loff_t off;
+	ssize_t n, m, done;
+
+	assert((fw != NULL) && fw->spliced && (max > 0));
+	if (fw->error)
+		return -1;
+	if (max > fw->pipe_len)
+		max= fw->pipe_len;
+	do
+		n= splice(fd, NULL, fw->pipe[1], NULL, max, SPLICE_F_MOVE | SPLICE_F_MORE);
+	while ((n < 0) && (errno == EINTR));
+	if (n <= 0)
+		return (int)n;
+	// The pipe must be emptied: the next splice from the socket would be written after it
+	off= fw->written;
+	while (off < (loff_t)(fw->written + n)) {
+		m= splice(fw->pipe[0], NULL, fw->fd, &off, fw->written + n - off, SPLICE_F_MOVE);	// Advances 'off'
+		if ((m < 0) && (errno == EINTR))
+			continue;
+		if (m <= 0) {
+			LOGF(FX_LOG_ERROR, "ERROR: writing received file: %s\n",
+					(m < 0) ? strerror(errno) : "no space");
+			fw->error= TRUE;
+			return -1;
+		}
+	}
+	// Read back from the page cache, before the writeback may drop the pages
+	for (done= 0; (copy != NULL) && (done < n); done += m) {
+		m= pread(fw->fd, (char *)copy + done, n - done, fw->written + done);
+		if ((m < 0) && (errno == EINTR)) {
+			m= 0;
+			continue;
+		}
+		if (m <= 0) {
+			LOGF(FX_LOG_ERROR, "ERROR: reading back received file: %s\n",
+					(m < 0) ? strerror(errno) : "short read");
+			fw->error= TRUE;
+			return -1;
+		}
+	}
+	fw->written += n;
+	fw->committed += n;
+	if (fw->written - fw->synced >= FW_SYNC_CHUNK)
+		fw_writeback(fw, FALSE);
+	return (int)n;
+}
+
+
+/** Write the remaining data, stop the writer thread and close the file */
+gboolean fw_close(File_Writer *fw) {
+	gboolean ok;
+	int i;
+
+	assert(fw != NULL);
+	if (fw->cur > 0)
+		fw_queue(fw, 0);
+	if (fw->threaded) {
+		pthread_mutex_lock(&fw->mutex);
+		fw->closing= TRUE;
+		pthread_cond_signal(&fw->queued);
+		pthread_mutex_unlock(&fw->mutex);
+		pthread_join(fw->thread, NULL);
+	} else if (fw->drop_cache)
+		fw_writeback(fw, TRUE);
+
+	ok= !fw->error;
+	// Release the space preallocated and not used
+	if (ftruncate(fw->fd, (off_t)fw->written))
+		ok= FALSE;
+	if (close(fw->fd))
+		ok= FALSE;
+	if (fw->spliced) {
+		close(fw->pipe[0]);
+		close(fw->pipe[1]);
+	}
+	for (i= 0; i < FW_BLOCKS; i++)
+		free(fw->blocks[i]);
+	pthread_mutex_destroy(&fw->mutex);
+	pthread_cond_destroy(&fw->queued);
+	pthread_cond_destroy(&fw->freed);
+	free(fw);
+	return ok;
+}
@@ -0,0 +1,61 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * filewriter.h
+ *
+ * Header file of the write-behind writer of received files.
+ *   The file is preallocated with its final length and written by a writer thread
+ *   with large aligned pwrites, while the receiving thread fills the next blocks.
+ *   Writeback is started every FW_SYNC_CHUNK bytes (sync_file_range). Optionally, the
+ *   writer waits for each chunk to reach the disk and drops its pages from the page cache.
+ *   Sparse files are not preallocated; their holes are skipped and never written.
+ *   Spliced files are moved from the socket to the file through a pipe (fw_splice),
+ *   without copying them to user space.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_FILEWRITER_H_
+#define _INCL_FILEWRITER_H_
+
+#include <glib.h>
+
+#define FW_BLOCK		1048576		// Size of the blocks written (bytes)
+#define FW_BLOCKS		4			// Blocks being filled or written
+#define FW_SYNC_CHUNK	(8*1048576)	// Bytes written between writeback requests
+
+// Options of fw_open
+#define FW_DROP_CACHE	1			// Drop the pages from the page cache after they are on disk
+#define FW_SPARSE		2			// The file has holes (fw_hole) - it is not preallocated
+#define FW_SPLICE		4			// The data is spliced (fw_splice), instead of fw_buffer/fw_commit
+
+
+typedef struct File_Writer File_Writer;
+
+
+// Create file 'path' for 'len' bytes and start its writer thread; 'flags' has FW_* options
+//    Returns NULL if the file cannot be created
+File_Writer *fw_open(const char *path, unsigned long long len, int flags);
+
+// Return the free space of the block being filled, and its size in 'n'; waits while all
+//    the blocks are queued. Returns NULL after a write error
+char *fw_buffer(File_Writer *fw, int *n);
+
+// Add 'n' bytes written to the buffer returned by fw_buffer; full blocks are queued
+//    Returns FALSE after a write error
+gboolean fw_commit(File_Writer *fw, int n);
+
+// Leave a hole of 'len' bytes after the data committed; waits like fw_buffer
+//    Returns FALSE after a write error
+gboolean fw_hole(File_Writer *fw, unsigned long long len);
+
+// Move up to 'max' bytes from socket 'fd' to the end of a file opened with FW_SPLICE, through
+//    a pipe; they are also copied to 'copy' if it is not NULL (e.g. to hash them)
+//    Returns the bytes moved, 0 if 'fd' was closed, or -1 if the socket or the write failed
+int fw_splice(File_Writer *fw, int fd, int max, void *copy);
+
+// Write the remaining data, stop the writer thread and close the file, which is truncated
+//    to the bytes committed and the holes. Returns FALSE if a write failed
+gboolean fw_close(File_Writer *fw);
+
+#endif
@@ -0,0 +1,221 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * fuzz_codec.c
+ *
+ * Fuzzing driver of the QUERY/HIT/SEARCH/SRESULT message codec
+ *   Usage: fuzz_codec [file ...]    decodes each file (or stdin) as one packet
+ *          fuzz_codec -w dir        writes the seed corpus to 'dir'
+ *   Prints the number of inputs and of packets decoded of each type; aborts
+ *   if a decoded packet breaks the codec invariants or does not encode back
+ *   to the same bytes. With libFuzzer, the seeds are in fuzz_corpus:
+ *   clang -g -fsanitize=fuzzer,address -DFUZZ_LIBFUZZER `pkg-config --cflags glib-2.0` \
+ *       -o fuzz_codec_lf fuzz_codec.c codec.c && ./fuzz_codec_lf fuzz_corpus
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include "codec.h"
+
+
+#define MAX_INPUT	65536		/* Largest packet read (the UDP payload limit) */
+
+// Packets decoded of each type, and rejected
+static unsigned long n_query, n_hit, n_search, n_sresult, n_rejected;
+
+
+// Abort if 'cond' fails, naming the check
+#define CHECK(cond, what) do { if (!(cond)) { fprintf(stderr, "fuzz_codec: %s\n", what); abort(); } } while (0)
+
+// Check a filename view of 'fnlen' bytes (with '\0') inside the packet 'buf' of 'len' bytes
+static void check_filename(const char *buf, size_t len, const char *fn, uint16_t fnlen) {
+	CHECK((fn >= buf) && (fn + fnlen <= buf + len), "filename outside the packet");
+	CHECK((fnlen >= 2) && (fnlen <= FILENAME_MAX_LENGTH), "filename length out of range");
+	CHECK(strlen(fn) + 1 == fnlen, "filename not terminated at its length");
+}
+
+// Check that an encoding of 'n' bytes in 'enc' equals the packet 'buf' of 'len' bytes
+static void check_same(const char *buf, size_t len, const char *enc, int n, const char *what) {
+	CHECK((n == (int)len) && !memcmp(buf, enc, len), what);
+}
+
+
+// Decode one packet of 'size' bytes with all the decoders, checking the packets accepted
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	char *buf= (char *)malloc(size ? size : 1);	// Exact size, for the address sanitizer
+	char enc[SRESULT_MAX_LENGTH];
+	SResult_Entry entries[SEARCH_PAGE_SIZE];
+	Query_View q;
+	Hit_View h;
+	Search_View s;
+	SResult_View r;
+	const char *pt;
+	int n, accepted= 0;
+
+	if ((buf == NULL) || (size > MAX_INPUT)) {
+		free(buf);
+		return 0;
+	}
+	memcpy(buf, data, size);
+	if (decode_query(buf, (int)size, &q)) {
+		check_filename(buf, size, q.filename, q.fnlen);
+		n= encode_query(enc, sizeof(enc), q.seq, q.filename);
+		check_same(buf, size, enc, n, "QUERY does not encode back");
+		n_query++;
+		accepted++;
+	}
+	if (decode_hit(buf, (int)size, &h)) {
+		check_filename(buf, size, h.filename, h.fnlen);
+		n= encode_hit(enc, sizeof(enc), h.seq, h.filename, h.flen, h.fhash, h.sTCP_port, &h.srvIP);
+		CHECK((n > 0) || (h.sTCP_port == 0), "HIT does not encode back");
+		if (n > 0)
+			check_same(buf, size, enc, n, "HIT does not encode back");
+		n_hit++;
+		accepted++;
+	}
+	if (decode_search(buf, (int)size, &s)) {
+		check_filename(buf, size, s.pattern, s.plen);
+		n= encode_search(enc, sizeof(enc), s.seq, s.offset, s.pattern);
+		check_same(buf, size, enc, n, "SEARCH does not encode back");
+		n_search++;
+		accepted++;
+	}
+	if (decode_sresult(buf, (int)size, &r)) {
+		n= 0;
+		for (pt= r.entries; next_sresult_entry(&r, &pt, &entries[n]); n++) {
+			CHECK(n < r.count, "SRESULT has more entries than its count");
+			check_filename(buf, size, entries[n].filename, strlen(entries[n].filename)+1);
+		}
+		CHECK(n == r.count, "SRESULT has fewer entries than its count");
+		n= encode_sresult(enc, sizeof(enc), r.seq, r.offset, r.more, entries, r.count);
+		enc[9]= buf[9];		// Any non zero 'more' byte is read as TRUE
+		check_same(buf, size, enc, n, "SRESULT does not encode back");
+		n_sresult++;
+		accepted++;
+	}
+	CHECK(accepted <= 1, "packet accepted as more than one type");
+	if (accepted == 0)
+		n_rejected++;
+	free(buf);
+	return 0;
+}
+
+
+#ifndef FUZZ_LIBFUZZER
+
+// Write the 'len' bytes of 'buf' to file 'name' in directory 'dir'. Returns FALSE if it failed
+static gboolean write_seed(const char *dir, const char *name, const char *buf, int len) {
+	char path[512];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((len < 0) || ((f= fopen(path, "wb")) == NULL)) {
+		perror(path);
+		return FALSE;
+	}
+	if (fwrite(buf, 1, len, f) != (size_t)len) {
+		perror(path);
+		fclose(f);
+		return FALSE;
+	}
+	return !fclose(f);
+}
+
+
+// Write the seed corpus to 'dir': valid, truncated, unterminated and oversized packets
+static gboolean write_corpus(const char *dir) {
+	char buf[SRESULT_MAX_LENGTH], name[FILENAME_MAX_LENGTH+64];
+	SResult_Entry entries[2]= { { "report.pdf", 123456 }, { "notes.txt", 0 } };
+	struct in6_addr ip;
+	int n, ok= TRUE;
+
+	if (mkdir(dir, 0755) && (errno != EEXIST)) {
+		perror(dir);
+		return FALSE;
+	}
+	inet_pton(AF_INET6, "2001:db8::1", &ip);
+
+	n= encode_query(buf, sizeof(buf), 1, "dataset-2024-11-05.csv");
+	ok &= write_seed(dir, "query-valid", buf, n);
+	ok &= write_seed(dir, "query-truncated", buf, n-5);
+	buf[n-1]= 'x';
+	ok &= write_seed(dir, "query-unterminated", buf, n);
+	memset(name, 'a', sizeof(name)-1);
+	name[sizeof(name)-1]= '\0';
+	buf[0]= MSG_QUERY;
+	memset(buf+1, 0, 4);
+	buf[5]= (char)(sizeof(name) >> 8);
+	buf[6]= (char)sizeof(name);
+	memcpy(buf+QUERY_HDR_LENGTH, name, sizeof(name));
+	ok &= write_seed(dir, "query-oversized", buf, QUERY_HDR_LENGTH+sizeof(name));
+
+	n= encode_hit(buf, sizeof(buf), 2, "dataset-2024-11-05.csv", 1ULL<<33, 0xdeadbeef, 20000, &ip);
+	ok &= write_seed(dir, "hit-valid", buf, n);
+	ok &= write_seed(dir, "hit-truncated", buf, n-HIT_TAIL_LENGTH/2);
+	buf[HIT_HDR_LENGTH+strlen("dataset-2024-11-05.csv")]= 'x';
+	ok &= write_seed(dir, "hit-unterminated", buf, n);
+	buf[0]= MSG_HIT;
+	buf[5]= (char)(sizeof(name) >> 8);
+	buf[6]= (char)sizeof(name);
+	memcpy(buf+HIT_HDR_LENGTH, name, sizeof(name));
+	memset(buf+HIT_HDR_LENGTH+sizeof(name), 0, HIT_TAIL_LENGTH);
+	ok &= write_seed(dir, "hit-oversized", buf, HIT_HDR_LENGTH+sizeof(name)+HIT_TAIL_LENGTH);
+
+	n= encode_search(buf, sizeof(buf), 3, 16, "*.csv");
+	ok &= write_seed(dir, "search-valid", buf, n);
+	n= encode_sresult(buf, sizeof(buf), 3, 16, TRUE, entries, 2);
+	ok &= write_seed(dir, "sresult-valid", buf, n);
+	ok &= write_seed(dir, "sresult-truncated", buf, n-4);
+	return ok;
+}
+
+
+// Read 'f' into 'buf' (up to MAX_INPUT bytes) and decode it
+static gboolean fuzz_file(FILE *f, const char *name) {
+	static uint8_t buf[MAX_INPUT];
+	size_t n= fread(buf, 1, sizeof(buf), f);
+
+	if (ferror(f)) {
+		perror(name);
+		return FALSE;
+	}
+	LLVMFuzzerTestOneInput(buf, n);
+	return TRUE;
+}
+
+
+int main(int argc, char *argv[]) {
+	unsigned long inputs= 0;
+	int i, failed= 0;
+
+	if ((argc == 3) && !strcmp(argv[1], "-w"))
+		return write_corpus(argv[2]) ? 0 : 1;
+	if (argc == 1) {
+		failed= !fuzz_file(stdin, "stdin");
+		inputs= !failed;
+	}
+	for (i= 1; i < argc; i++) {
+		FILE *f= fopen(argv[i], "rb");
+		if (f == NULL) {
+			perror(argv[i]);
+			failed++;
+			continue;
+		}
+		if (fuzz_file(f, argv[i]))
+			inputs++;
+		else
+			failed++;
+		fclose(f);
+	}
+	printf("inputs=%lu query=%lu hit=%lu search=%lu sresult=%lu rejected=%lu failed=%d\n",
+			inputs, n_query, n_hit, n_search, n_sresult, n_rejected, failed);
+	return failed ? 1 : 0;
+}
+
+#endif
@@ -13,6 +13,7 @@
 
 #include <gtk/gtk.h>
 #include <netinet/in.h>
+#include "fileexchange.h"
 
 /* store the widgets which may need to be accessed in a typedef struct */
 typedef struct
@@ -37,12 +38,9 @@ typedef struct
 // Global pointer to the main window elements
 extern WindowElements *main_window;
 
-// Initialization function
+// Initialization function - registers the GUI callbacks in the engine
 gboolean init_app (WindowElements *window);
 
-// Log the message str to the textview and command line
-void Log (const gchar * str);
-
 
 
 /************************************************\
@@ -93,9 +91,6 @@ const gchar *get_OutDir();
 /** Set the output directory box's contents */
 void set_OutDir(const char *addr);
 
-/** Return the value of the CheckButton "Slow" */
-gboolean get_slow(void);
-
 // Block or unblock the configuration GtkEntry boxes in the GUI
 void block_entrys(gboolean block);
 
@@ -107,11 +102,8 @@ void block_entrys(gboolean block);
 /** Search for a filename in the file treeview list */
 gboolean locate_File(const char *filename, GtkTreeIter *iter, gboolean incl_path, gboolean lock_gdk);
 
-/** Return the full pathname associated to 'filename' */
-gboolean get_File_fullname(const char *filename, const char **fullname, gboolean lock_gdk);
-
-/** Return length and hash value of file 'filename' */
-gboolean get_File_details(const char *filename, unsigned long long *flen, unsigned long long *fhash, gboolean lock_gdk);
+/** Reload the file treeview list from the engine file table */
+void refresh_Files(gboolean lock_gdk);
 
 /** Add a file to the file table */
 gboolean add_File(const char *filename, gboolean lock_gdk);
@@ -122,9 +114,6 @@ gboolean del_File(const char *filename, gboolean lock_gdk);
 // Add all files in 'filename' file to the list
 gboolean add_filelist(const char *filelist_filename, gboolean lock_gdk);
 
-// Write the filelist contents to a file
-gboolean write_filelist(const char *filelist_filename, gboolean lock_gdk);
-
 /** Delete all files from the file table */
 void clear_Files(gboolean lock_gdk);
 
@@ -135,19 +124,9 @@ void clear_Files(gboolean lock_gdk);
 
 // Search for 'tid' in file transfer list; returns iter
 gboolean GUI_locate_thread_by_id(unsigned tid, GtkTreeIter *iter, gboolean lock_gdk);
-// Add line with thread 'tid' data to list
-gboolean GUI_regist_thread(unsigned tid, gboolean is_snd, const char *f_name, const char *of_name, gboolean lock_gdk);
-// Update the file information in thread tid information - for senders
-gboolean GUI_update_filename(unsigned tid, const char *f_name, gboolean lock_gdk);
-// Update the percentage information in thread tid information - for both
-gboolean GUI_update_bytes_sent(unsigned tid, int trans, gboolean lock_gdk);
 // Get all information from the line with 'tid' in the thread list
 gboolean GUI_get_thread_info(unsigned tid, const char **sndrcv,
 		int *transf, const char **filename, const char *ofilename, gboolean lock_gdk);
-// Delete the line with 'tid' in thread list
-gboolean GUI_del_thread(unsigned tid, gboolean lock_gdk);
-// Delete all threads from the threads table
-void GUI_clear_threads(gboolean lock_gdk);
 
 
 /***************************\
@@ -173,7 +152,6 @@ const gchar *get_save_filename (WindowElements *win);
 void on_buttonClear_clicked (GtkButton *button, gpointer user_data);
 
 
-// External event handlers in file.c and callbacks.c
 void on_togglebutton1_toggled (GtkToggleButton *togglebutton, gpointer user_data);
 
 void on_buttonAdd_clicked (GtkButton *button, gpointer user_data);
@@ -182,7 +160,13 @@ void on_buttonOpen_clicked (GtkButton *button, gpointer user_data);
 void on_buttonSave_clicked (GtkButton *button, gpointer user_data);
 
 void on_buttonQuery_clicked (GtkButton *button, gpointer user_data);
+void on_buttonSearch_clicked (GtkButton *button, gpointer user_data);
 void on_buttonStop_clicked (GtkButton *button, gpointer user_data);
+void on_buttonStats_clicked (GtkButton *button, gpointer user_data);
+
+// Callback function that handles the end of the closing of the main window
+gboolean on_window1_delete_event (GtkWidget * widget,
+		GdkEvent * event, gpointer user_data);
 
 #endif
 
@@ -17,22 +17,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <unistd.h>
 #include <glib.h>
 #include <glib/gi18n.h>
 #include "gui.h"
 #include "file.h"
-#include "callbacks.h"
+#include "fileexchange.h"
+#include "logring.h"
 
 // Set here the glade file name
 #define GLADE_FILE "fileexchange.glade"
 
 
-// Mutex to synchronize changes to GUI log window
-pthread_mutex_t lmutex = PTHREAD_MUTEX_INITIALIZER;
+// Log messages written by any thread, shown in the textview by the main loop
+#define LOG_RING_SIZE		4096	// Messages waiting to be shown; more are dropped
+#define LOG_DRAIN_PERIOD	100		// Period of the textview update (ms)
+#define LOG_DRAIN_MAX		256		// Messages shown in each update
+#define LOG_MAX_LINES		2000	// Lines kept in the textview
+static Log_Ring log_ring;
+static unsigned long long log_dropped= 0;	// Dropped messages already reported
+
+// Period of the refresh of the transfer percentages (ms)
+#define PROGRESS_PERIOD		100
+
 // Mutex to synchronize changes to GUI database of file transfer threads
 pthread_mutex_t gmutex = PTHREAD_MUTEX_INITIALIZER;
-// Mutex to synchronize changes to GUI database of files
-pthread_mutex_t fmutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Auxiliary variable set to TRUE when the filelist is modified
+static gboolean filelist_modified= FALSE;
 
 #ifdef DEBUG
 #define LOCK_MUTEX(mutex,str) { \
@@ -58,6 +70,23 @@ pthread_mutex_t fmutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 
+static void gui_log (void *ctx, int level, const gchar * str);
+static gboolean callback_log_drain (gpointer data);
+static void gui_fatal (void *ctx);
+static void GUI_regist_thread(void *ctx, unsigned tid, gboolean is_snd, const char *f_name,
+		const char *of_name, gboolean lock_glib);
+static void GUI_update_filename(void *ctx, unsigned tid, const char *f_name, gboolean lock_glib);
+static gboolean callback_progress_refresh(gpointer data);
+static void GUI_del_thread(void *ctx, unsigned tid, gboolean lock_glib);
+static void GUI_clear_threads(void *ctx, gboolean lock_glib);
+static void queue_regist_thread(void *ctx, unsigned tid, gboolean is_snd, const char *f_name,
+		const char *of_name, gboolean lock_glib);
+static void queue_update_filename(void *ctx, unsigned tid, const char *f_name, gboolean lock_glib);
+static void queue_del_thread(void *ctx, unsigned tid, gboolean lock_glib);
+static void queue_clear_threads(void *ctx, gboolean lock_glib);
+static void on_checkSlow_toggled (GtkToggleButton *togglebutton, gpointer user_data);
+
+
 /** Initialization function */
 gboolean
 init_app (WindowElements *win)
@@ -112,25 +141,88 @@ init_app (WindowElements *win)
         /* free memory used by GtkBuilder object */
         g_object_unref (G_OBJECT (builder));
 
+        /* register the GUI in the engine */
+        Fx_Callbacks cb= {
+        		.ctx= win,
+        		.log= gui_log,
+        		.transfer_new= queue_regist_thread,
+        		.transfer_file= queue_update_filename,
+        		.transfer_end= queue_del_thread,
+        		.transfers_clear= queue_clear_threads,
+        		.fatal= gui_fatal
+        };
+        if (!fx_init(&cb)) {
+        		error_message ("Failed initialization of the fileexchange engine");
+        		return FALSE;
+        }
+        g_signal_connect (win->checkSlow, "toggled", G_CALLBACK (on_checkSlow_toggled), NULL);
+
+        /* log messages are queued and shown by the main loop; FX_LOG_LEVEL selects the level */
+        if (!logring_init(&log_ring, LOG_RING_SIZE)) {
+        		error_message ("Failed allocation of the log");
+        		return FALSE;
+        }
+        const char *level= getenv("FX_LOG_LEVEL");
+        if ((level != NULL) && (fx_log_level_from_name(level) >= 0))
+        		fx_set_log_level(fx_log_level_from_name(level));
+        gdk_threads_add_timeout(LOG_DRAIN_PERIOD, callback_log_drain, NULL);
+        /* FX_MCAST_INTERFACES selects the interfaces that join the groups (default all) */
+        fx_set_mcast_interfaces(getenv("FX_MCAST_INTERFACES"));
+        /* the transfer percentages are refreshed by a timer, not by the transfer threads */
+        g_timeout_add(PROGRESS_PERIOD, callback_progress_refresh, NULL);
+
         return TRUE;
 }
 
 
-/** Log the message str to the textview and command line */
-void Log (const gchar * str)
+/** Engine callback: a socket failed and the engine stopped - quit the main loop */
+static void gui_fatal (void *ctx)
 {
-  GtkTextBuffer *textbuf;
-  GtkTextIter tend;
+	gtk_main_quit();
+}
 
-  // Adds text to the command line
-  g_print("%s", str);
 
-  pthread_mutex_lock( &lmutex );
-  textbuf = GTK_TEXT_BUFFER (gtk_text_view_get_buffer (main_window->textView));
-  gtk_text_buffer_get_iter_at_offset (textbuf, &tend, -1);	// Gets reference to the last position
-  // Adds text to the textview
-  gtk_text_buffer_insert (textbuf, &tend, g_strdup (str), strlen (str));
-  pthread_mutex_unlock( &lmutex );
+/** Engine callback: queue the message str for the textview and command line
+ *   Called by any thread; it never waits - messages are dropped if the queue is full */
+static void gui_log (void *ctx, int level, const gchar * str)
+{
+  logring_push(&log_ring, level, str);
+}
+
+
+/** Timer callback: move up to LOG_DRAIN_MAX queued messages to the command line and the
+ *   textview, keeping the last LOG_MAX_LINES lines */
+static gboolean callback_log_drain (gpointer data)
+{
+  GtkTextBuffer *textbuf;
+  GtkTextIter tbegin, tend;
+  GString *text= g_string_sized_new(4096);
+  char msg[LOG_TEXT_LEN];
+  int i, level, lines;
+
+  for (i= 0; (i < LOG_DRAIN_MAX) && logring_pop(&log_ring, &level, msg); i++)
+    g_string_append(text, msg);
+  unsigned long long dropped= logring_dropped(&log_ring);
+  if ((dropped > log_dropped) && (i < LOG_DRAIN_MAX)) {
+    // Report when the queue has room again
+    g_string_append_printf(text, "[%llu log messages dropped]\n", dropped-log_dropped);
+    log_dropped= dropped;
+  }
+  if (text->len > 0) {
+    // Adds text to the command line
+    g_print("%s", text->str);
+    textbuf = GTK_TEXT_BUFFER (gtk_text_view_get_buffer (main_window->textView));
+    gtk_text_buffer_get_end_iter (textbuf, &tend);	// Gets reference to the last position
+    // Adds text to the textview
+    gtk_text_buffer_insert (textbuf, &tend, text->str, text->len);
+    if ((lines= gtk_text_buffer_get_line_count (textbuf)) > LOG_MAX_LINES) {
+      gtk_text_buffer_get_start_iter (textbuf, &tbegin);
+      gtk_text_buffer_get_iter_at_line (textbuf, &tend, lines-LOG_MAX_LINES);
+      gtk_text_buffer_delete (textbuf, &tbegin, &tend);
+    }
+  }
+  g_string_free(text, TRUE);
+  return TRUE;	// Keeps the timer
 }
 
 /** Get the content of entryIPv6, validating if it is a valid IPv6 address.
@@ -147,17 +239,17 @@ const gchar *get_IPv6Multicast(struct in6_addr *addrv6) {
 	addrv6_pt= (addrv6==NULL) ? &addrv6_aux : addrv6;
 
 	if (inet_pton(AF_INET, textIP, &addrv4)) {
-		Log("Invalid IPv6 address: sockets IPv6 cannot use IPv4 multicast addresses\n");
+		fx_log("Invalid IPv6 address: sockets IPv6 cannot use IPv4 multicast addresses\n");
 		return NULL;
 	} else if (inet_pton(AF_INET6, textIP, addrv6_pt)) {
 		if ((textIP[0]=='f' || textIP[0]=='F') && (textIP[1]=='f' || textIP[1]=='F'))
 			return textIP;
 		else {
-			Log("Invalid IPv6 address: it is not multicast (must start with FF01:: - FF1E::)\n");
+			fx_log("Invalid IPv6 address: it is not multicast (must start with FF01:: - FF1E::)\n");
 			return NULL;
 		}
 	} else {
-		Log("Invalid IPv6 address\n");
+		fx_log("Invalid IPv6 address\n");
 		return NULL;
 	}
 }
@@ -182,12 +274,12 @@ const gchar *get_IPv4Multicast(struct in_addr *addrv4) {
 
 	if (inet_pton(AF_INET, textIP, addrv4_pt)) {
 		if (!IN_MULTICAST(ntohl(addrv4_pt->s_addr))) {
-			Log("Invalid IPv4 address: not multicast\n");
+			fx_log("Invalid IPv4 address: not multicast\n");
 			return NULL;
 		} else
 			return textIP;
 	} else {
-		Log("Invalid IPv4 address\n");
+		fx_log("Invalid IPv4 address\n");
 		return NULL;
 	}
 }
@@ -287,9 +379,9 @@ void set_OutDir(const char *dir) {
 }
 
 
-/** Return the value of the CheckButton "Slow" */
-gboolean get_slow(void) {
-	return gtk_toggle_button_get_active(main_window->checkSlow);
+/** Pass the value of the CheckButton "Slow" to the engine */
+static void on_checkSlow_toggled (GtkToggleButton *togglebutton, gpointer user_data) {
+	fx_set_slow(gtk_toggle_button_get_active(togglebutton));
 }
 
 
@@ -357,213 +449,62 @@ gboolean locate_File(const char *filename, GtkTreeIter *iter, gboolean incl_path
 }
 
 
-/** Return the full pathname associated to 'filename' */
-gboolean get_File_fullname(const char *filename, const char **fullname, gboolean lock_gdk) {
-	if ((filename == NULL) || (fullname == NULL)) {
-		Log("ERROR: Invalid parameters in get_File_fullname()\n");
-		return FALSE;
-	}
-
-	if (lock_gdk) {
-		/* get GTK thread lock */
-		gdk_threads_enter ();
-	}
-	GtkTreeModel *list_store= GTK_TREE_MODEL(main_window->listFile);
+// Append a file of the engine file table to the file treeview list
+static void append_File(void *data, const char *fullname, unsigned long long flen, uint32_t fhash) {
 	GtkTreeIter iter;
-	gboolean ok= FALSE;
-	if (locate_File(filename, &iter, FALSE, FALSE)) {
-		gtk_tree_model_get (list_store, &iter, 0, fullname, -1);
-		ok= TRUE;
-	}
-
-	if (lock_gdk) {
-		/* release GTK thread lock */
-		gdk_threads_leave ();
-	}
-	return ok;
+	gtk_list_store_append(main_window->listFile, &iter);
+	gtk_list_store_set(main_window->listFile, &iter, 0, fullname, 1, (unsigned long)flen,
+			2, (unsigned long)fhash, -1);
 }
 
 
-/** Return length and hash value of file 'filename' */
-gboolean get_File_details(const char *filename, unsigned long long *flen, unsigned long long *fhash, gboolean lock_gdk) {
-	if ((filename == NULL) || (flen == NULL) || (fhash == NULL)) {
-		Log("ERROR: Invalid parameters in get_File_details()\n");
-		return FALSE;
-	}
-
+/** Reload the file treeview list from the engine file table */
+void refresh_Files(gboolean lock_gdk) {
 	if (lock_gdk) {
 		/* get GTK thread lock */
 		gdk_threads_enter ();
 	}
-
-	GtkTreeModel *list_store= GTK_TREE_MODEL(main_window->listFile);
-	GtkTreeIter iter;
-	unsigned long lenaux, hashaux;
-	gboolean ok= FALSE;
-	if (locate_File(filename, &iter, FALSE, FALSE)) {
-		gtk_tree_model_get (list_store, &iter, 1, &lenaux, 2, &hashaux, -1);
-		*flen= (unsigned long long)lenaux;
-		*fhash= (unsigned long long)hashaux;
-		ok= TRUE;
-	}
-
+	gtk_list_store_clear(main_window->listFile);
+	fx_foreach_file(append_File, NULL);
 	if (lock_gdk) {
 		/* release GTK thread lock */
 		gdk_threads_leave ();
 	}
-	return ok;
 }
 
 
 /** Add a file to the file table */
 gboolean add_File(const char *filename, gboolean lock_gdk) {
 	assert(filename != NULL);
-
-	GtkTreeIter iter;
-
-	if (lock_gdk) {
-		/* get GTK thread lock */
-		gdk_threads_enter ();
-	}
-
-	if (locate_File(filename, &iter, TRUE, FALSE)) {
-		Log("Replacing file\n");
-	} else {
-		// new file
-		gtk_list_store_append(main_window->listFile, &iter);
-	}
-	unsigned long alength= (unsigned long)get_filesize(filename);
-	unsigned long afilehash= (unsigned long)fhash_filename(filename);
-	gtk_list_store_set(main_window->listFile, &iter, 0, filename, 1, alength, 2, afilehash, -1);
-
-	if (lock_gdk) {
-		/* release GTK thread lock */
-		gdk_threads_leave ();
-	}
+	if (!fx_add_file(filename))
+		return FALSE;
+	refresh_Files(lock_gdk);
 	return TRUE;
 }
 
+
 /** Delete a file from the file table */
 gboolean del_File(const char *filename, gboolean lock_gdk) {
 	assert(filename != NULL);
-	GtkTreeIter iter;
-	gboolean ok= FALSE;
-
-	if (lock_gdk) {
-		/* get GTK thread lock */
-		gdk_threads_enter ();
-	}
-	if (locate_File(filename, &iter, TRUE, FALSE)) {
-		if (!gtk_list_store_remove(main_window->listFile, &iter)) {
-			Log("Failed to remove file from list\n");
-			return FALSE;
-		}
-		ok= TRUE;
-	}
-	if (lock_gdk) {
-		/* release GTK thread lock */
-		gdk_threads_leave ();
-	}
-	return ok;
+	if (!fx_del_file(filename))
+		return FALSE;
+	refresh_Files(lock_gdk);
+	return TRUE;
 }
 
 
 // Add all files in 'filename' file to the list
 gboolean add_filelist(const char *filelist_filename, gboolean lock_gdk) {
-	char buf[256];	// Maximum filename size
-
-	if ((filelist_filename != NULL) && (strlen(filelist_filename)>0)) {
-		FILE *f= fopen(filelist_filename, "r");
-		if (f == NULL) {
-			sprintf(buf, "Open(r) of filelist file '%s' failed\n", filelist_filename);
-			Log(buf);
-			return FALSE;
-		}
-		while(!feof(f)) {
-			buf[0]= '\0';
-			if (fgets(buf, sizeof(buf), f) != NULL) {
-				if (strlen(buf)>1) {
-					buf[strlen(buf)-1]= '\0';	// Clear '\n' in Linux
-					add_File(buf, lock_gdk);
-				}
-			}
-		}
-		return TRUE;
-	} else
-		return FALSE;
-}
-
-
-// Write the filelist contents to a file
-gboolean write_filelist(const char *filelist_filename, gboolean lock_gdk) {
-	if ((filelist_filename != NULL) && (strlen(filelist_filename)>0)) {
-		char tmp_buf[100];
-		FILE *f= fopen(filelist_filename, "w");
-		GtkTreeIter iter;
-		GtkTreeModel *list_store;
-		gboolean valid;
-
-		if (f == NULL) {
-			sprintf(tmp_buf, "Could not open file list '%s' for writing\n", filelist_filename);
-			Log(tmp_buf);
-			return FALSE;
-		}
-
-		if (lock_gdk) {
-			/* get GTK thread lock */
-			gdk_threads_enter ();
-		}
-		list_store= GTK_TREE_MODEL(main_window->listFile);
-		// Get the first iter in the list
-		valid = gtk_tree_model_get_iter_first (list_store, &iter);
-
-		while (valid)
-		{
-			// Walk through the list, reading the filename in each row
-			gchar *str_filename;
-
-			// Make sure you terminate calls to gtk_tree_model_get() with a '-1' value
-			gtk_tree_model_get (list_store, &iter,
-					0, &str_filename,
-					-1);
-			// Do something with the data
-#ifdef DEBUG
-			g_print ("Filename: %s\n", str_filename);
-#endif
-			if (fprintf(f, "%s\n", str_filename)<= 0) {
-				sprintf(tmp_buf, "Failed writing to file list '%s'\n", filelist_filename);
-				Log(tmp_buf);
-				g_free (str_filename);
-				fclose(f);
-				return FALSE;
-			}
-			g_free (str_filename);
-			valid = gtk_tree_model_iter_next (list_store, &iter);
-		}
-		fclose(f);
-		if (lock_gdk) {
-			/* release GTK thread lock */
-			gdk_threads_leave ();
-		}
-		return TRUE;
-
-	} else
-		return FALSE;
-
+	gboolean ok= fx_add_filelist(filelist_filename);
+	refresh_Files(lock_gdk);
+	return ok;
 }
 
 
 /** Deletes all files from the file table */
 void clear_Files(gboolean lock_gdk) {
-	if (lock_gdk) {
-		/* get GTK thread lock */
-		gdk_threads_enter ();
-	}
-	gtk_list_store_clear(main_window->listFile);
-	if (lock_gdk) {
-		/* release GTK thread lock */
-		gdk_threads_leave ();
-	}
+	fx_clear_files();
+	refresh_Files(lock_gdk);
 }
 
 
@@ -610,8 +551,73 @@ gboolean GUI_locate_thread_by_id(unsigned tid, GtkTreeIter *iter, gboolean lock_
 }
 
 
+// Change of the threads list reported by the engine
+typedef enum { ROW_NEW, ROW_FILE, ROW_END, ROW_CLEAR } Row_Change;
+
+typedef struct Row_Event {
+	Row_Change change;
+	unsigned tid;
+	gboolean is_snd;
+	char *f_name;
+	char *of_name;
+} Row_Event;
+
+
+// Idle callback, with the GTK lock: apply one change to the threads list
+static gboolean callback_row_event(gpointer data) {
+	Row_Event *ev= (Row_Event *)data;
+
+	switch (ev->change) {
+	case ROW_NEW: GUI_regist_thread(NULL, ev->tid, ev->is_snd, ev->f_name, ev->of_name, FALSE); break;
+	case ROW_FILE: GUI_update_filename(NULL, ev->tid, ev->f_name, FALSE); break;
+	case ROW_END: GUI_del_thread(NULL, ev->tid, FALSE); break;
+	case ROW_CLEAR: GUI_clear_threads(NULL, FALSE); break;
+	}
+	g_free(ev->f_name);
+	g_free(ev->of_name);
+	g_free(ev);
+	return FALSE;
+}
+
+
+// Queue a change to the threads list to the main loop, which applies the changes in order
+//   The transfer threads never take the GTK lock, held by the main loop while it calls the
+//   engine (e.g. fx_stop_transfer)
+static void queue_row_event(Row_Change change, unsigned tid, gboolean is_snd, const char *f_name,
+		const char *of_name) {
+	Row_Event *ev= g_new0(Row_Event, 1);
+
+	ev->change= change;
+	ev->tid= tid;
+	ev->is_snd= is_snd;
+	ev->f_name= g_strdup(f_name);
+	ev->of_name= g_strdup(of_name);
+	gdk_threads_add_idle(callback_row_event, ev);
+}
+
+
+// Engine callbacks: queue the changes of the threads list
+static void queue_regist_thread(void *ctx, unsigned tid, gboolean is_snd, const char *f_name,
+		const char *of_name, gboolean lock_glib) {
+	queue_row_event(ROW_NEW, tid, is_snd, f_name, of_name);
+}
+
+static void queue_update_filename(void *ctx, unsigned tid, const char *f_name, gboolean lock_glib) {
+	queue_row_event(ROW_FILE, tid, FALSE, f_name, NULL);
+}
+
+static void queue_del_thread(void *ctx, unsigned tid, gboolean lock_glib) {
+	queue_row_event(ROW_END, tid, FALSE, NULL, NULL);
+}
+
+static void queue_clear_threads(void *ctx, gboolean lock_glib) {
+	queue_row_event(ROW_CLEAR, 0, FALSE, NULL, NULL);
+}
+
+
 // Add line with thread 'tid' data to list
-gboolean GUI_regist_thread(unsigned tid, gboolean is_snd, const char *f_name, const char *of_name, gboolean lock_glib)
+static void GUI_regist_thread(void *ctx, unsigned tid, gboolean is_snd, const char *f_name,
+		const char *of_name, gboolean lock_glib)
 {
 	assert(f_name != NULL);
 	assert(of_name != NULL);
@@ -630,7 +636,7 @@ gboolean GUI_regist_thread(unsigned tid, gboolean is_snd, const char *f_name, co
 		// PID already in the table
 		char tmp_buf[80];
 		sprintf(tmp_buf, "Replacing tid %u in table\n", tid);
-		Log(tmp_buf);
+		fx_log(tmp_buf);
 	} else {
 		// new file
 		gtk_list_store_append(main_window->listThread, &iter);
@@ -642,19 +648,17 @@ gboolean GUI_regist_thread(unsigned tid, gboolean is_snd, const char *f_name, co
 		/* release GTK thread lock */
 		gdk_threads_leave ();
 	}
-	return TRUE;
 }
 
 
 // Update the file information in thread tid information - for senders
-gboolean GUI_update_filename(unsigned tid, const char *f_name, gboolean lock_glib) {
+static void GUI_update_filename(void *ctx, unsigned tid, const char *f_name, gboolean lock_glib) {
 	assert(f_name != NULL);
 #ifdef DEBUG
 	g_print("Thread %u updated file \"%s\"\n", tid, f_name);
 #endif
 
 	GtkTreeIter iter;
-	gboolean ok;
 	if (lock_glib) {
 		/* get GTK thread lock */
 		gdk_threads_enter ();
@@ -662,48 +666,54 @@ gboolean GUI_update_filename(unsigned tid, const char *f_name, gboolean lock_gli
 	LOCK_MUTEX(&gmutex, "lock_g2\n");
 	if (!GUI_locate_thread_by_id(tid, &iter, FALSE)) {
 		UNLOCK_MUTEX(&gmutex, "unlock_g2\n");
-		ok= FALSE;
 	} else {
 		gtk_list_store_set(main_window->listThread, &iter, 3, strdup(f_name), -1);
 		UNLOCK_MUTEX(&gmutex, "unlock_g2\n");
-		ok= TRUE;
 	}
 
 	if (lock_glib) {
 		/* release GTK thread lock */
 		gdk_threads_leave ();
 	}
-	return ok;
 }
 
 
-// Update the percentage information in thread tid information - for both
-gboolean GUI_update_bytes_sent(unsigned tid, int trans, gboolean lock_glib) {
+// Collect the progress of one transfer, without the GTK lock
+static void collect_progress(void *data, unsigned tid, gboolean sending, int percent) {
+	g_hash_table_insert((GHashTable *)data, GUINT_TO_POINTER(tid), GINT_TO_POINTER(percent));
+}
+
+// Timer callback: refresh the percentage of all transfers in one pass over the list
+//   The transfer threads only publish their progress; they never wait for the GUI
+static gboolean callback_progress_refresh(gpointer data) {
+	GHashTable *progress= g_hash_table_new(g_direct_hash, g_direct_equal);
+	GtkTreeModel *list_store;
 	GtkTreeIter iter;
-	gboolean ok= FALSE;
-#ifdef DEBUG
-	g_print("Thread %u updated trans %d\n", tid, trans);
-#endif
+	gboolean valid;
 
-	if (lock_glib) {
-		/* get GTK thread lock */
+	// Read the progress before taking the GTK lock - fx_foreach_transfer takes the engine lock
+	fx_foreach_transfer(collect_progress, progress);
+	if (g_hash_table_size(progress) > 0) {
 		gdk_threads_enter ();
-	}
-	LOCK_MUTEX(&gmutex, "lock_g3\n");
-	if (!GUI_locate_thread_by_id(tid, &iter, FALSE)) {
-		Log("Internal error: update of a non existing thread\n");
-		ok= FALSE;
-	} else {
-		gtk_list_store_set(main_window->listThread, &iter, 2, trans, -1);
-		ok= TRUE;
-	}
-	UNLOCK_MUTEX(&gmutex, "unlock_g3\n");
-
-	if (lock_glib) {
-		/* release GTK thread lock */
+		LOCK_MUTEX(&gmutex, "lock_g3\n");
+		list_store= GTK_TREE_MODEL(main_window->listThread);
+		valid = gtk_tree_model_get_iter_first (list_store, &iter);
+		while (valid) {
+			unsigned tid;
+			int trans;
+			gpointer percent;
+
+			gtk_tree_model_get (list_store, &iter, 0, &tid, 2, &trans, -1);
+			if (g_hash_table_lookup_extended(progress, GUINT_TO_POINTER(tid), NULL, &percent)
+					&& (GPOINTER_TO_INT(percent) != trans))
+				gtk_list_store_set(main_window->listThread, &iter, 2, GPOINTER_TO_INT(percent), -1);
+			valid = gtk_tree_model_iter_next (list_store, &iter);
+		}
+		UNLOCK_MUTEX(&gmutex, "unlock_g3\n");
 		gdk_threads_leave ();
 	}
-	return ok;
+	g_hash_table_destroy(progress);
+	return TRUE;	// Keeps the timer
 }
 
 
@@ -738,9 +748,8 @@ gboolean GUI_get_thread_info(unsigned tid, const char **sndrcv,
 
 
 // Delete the line with 'tid' in threads list
-gboolean GUI_del_thread(unsigned tid, gboolean lock_glib) {
+static void GUI_del_thread(void *ctx, unsigned tid, gboolean lock_glib) {
 	GtkTreeIter iter;
-	gboolean ok;
 #ifdef DEBUG
 	g_print("Thread %u deleted from list\n", tid);
 #endif
@@ -752,22 +761,19 @@ gboolean GUI_del_thread(unsigned tid, gboolean lock_glib) {
 	if (GUI_locate_thread_by_id(tid, &iter, FALSE)) {
 		gtk_list_store_remove(main_window->listThread, &iter);
 		UNLOCK_MUTEX(&gmutex, "unlock_g5-f\n");
-		ok= TRUE;
 	} else {
 		UNLOCK_MUTEX(&gmutex, "unlock_g5-nf\n");
-		ok= FALSE;
 	}
 
 	if (lock_glib) {
 		/* release GTK thread lock */
 		gdk_threads_leave ();
 	}
-	return ok;
 }
 
 
 // Delete all threads from the threads table
-void GUI_clear_threads(gboolean lock_glib) {
+static void GUI_clear_threads(void *ctx, gboolean lock_glib) {
 	if (lock_glib) {
 		/* get GTK thread lock */
 		gdk_threads_enter ();
@@ -868,12 +874,207 @@ void on_buttonClear_clicked (GtkButton * button, gpointer user_data)
   GtkTextBuffer *textbuf;
   GtkTextIter tbegin, tend;
 
-  pthread_mutex_lock( &lmutex );
   textbuf = GTK_TEXT_BUFFER (gtk_text_view_get_buffer (main_window->textView));
   gtk_text_buffer_get_iter_at_offset (textbuf, &tbegin, 0);
   gtk_text_buffer_get_iter_at_offset (textbuf, &tend, -1);
   gtk_text_buffer_delete (textbuf, &tbegin, &tend);
-  pthread_mutex_unlock( &lmutex );
 }
 
 
+
+
+/*******************************************************\
+|* Functions that handle file list management buttons  *|
+\*******************************************************/
+
+// Handles button "Add" - adds a file to the file list
+void on_buttonAdd_clicked (GtkButton *button, gpointer user_data) {
+	const gchar *filename= get_open_filename (main_window);
+	if (filename != NULL) {
+		if (!add_File(filename, FALSE)) {
+			fx_log("File not added\n");
+		}
+	}
+	filelist_modified= TRUE;
+}
+
+
+// Handles button "Remove" - removes a file from the list
+void on_buttonRemove_clicked (GtkButton *button, gpointer user_data)
+{
+	GtkTreeSelection *selection;
+	GtkTreeModel	*model;
+	GtkTreeIter	iter;
+	gchar *str_filename;
+
+	selection= gtk_tree_view_get_selection(main_window->treeFile);
+	if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
+		gtk_tree_model_get (model, &iter, 0, &str_filename, -1);
+#ifdef DEBUG
+		g_print ("File %s will be removed\n", str_filename);
+#endif
+	} else {
+		fx_log ("No file selected\n");
+		return;
+	}
+
+	// Remove it from the engine file table, which keeps the QUERY filter updated
+	if (!del_File(str_filename, FALSE)) {
+		fx_log("Failed to remove file from list\n");
+	}
+	g_free (str_filename);
+	filelist_modified= TRUE;
+}
+
+
+// Handle button "Open" - read the content of a filelist from a file
+void on_buttonOpen_clicked (GtkButton *button, gpointer user_data)
+{
+	add_filelist(get_Filelist_Filename(), FALSE);
+	filelist_modified= TRUE;
+	fx_log("File list opened\n");
+}
+
+
+// Handle button "Save" - Write the filelist to a file
+void on_buttonSave_clicked (GtkButton *button, gpointer user_data)
+{
+	fx_write_filelist(get_Filelist_Filename());
+	filelist_modified= FALSE;
+	fx_log("File list saved\n");
+}
+
+
+
+/*******************************************************\
+|* Functions to control the state of the application   *|
+\*******************************************************/
+
+// Button that starts and stops the application
+void on_togglebutton1_toggled(GtkToggleButton *togglebutton, gpointer user_data) {
+
+	if (gtk_toggle_button_get_active(togglebutton)) {
+		// *** Start the server ***
+		short n= get_PortMulticast();
+		if (n < 0) {
+			fx_log("Invalid multicast port number\n");
+			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
+			return;
+		}
+		if (strlen(get_OutDir()) > 0)
+			fx_set_out_dir(get_OutDir());
+		fx_set_slow(gtk_toggle_button_get_active(main_window->checkSlow));
+		if (!fx_start(get_IPv4Multicast(NULL), get_IPv6Multicast(NULL), (unsigned short)n)) {
+			gtk_toggle_button_set_active(togglebutton, FALSE); // Turns button off
+			return;
+		}
+		set_PortTCP(fx_tcp_port());
+		set_PID(getpid());
+		block_entrys(TRUE);
+	} else {
+		// *** Stop the server ***
+		fx_stop();
+		block_entrys(FALSE);
+		set_PID(0);
+	}
+}
+
+
+// Called when the user clicks "Query file"
+void on_buttonQuery_clicked (GtkButton *button, gpointer user_data)
+{
+	fx_query(get_QueryFile());
+}
+
+
+// Called when the user clicks "Search" - searches for files whose name contains
+//   the text in the query box, or matches it if it has glob characters (*, ?, [...])
+void on_buttonSearch_clicked (GtkButton *button, gpointer user_data)
+{
+	fx_search(get_QueryFile());
+}
+
+
+// Callback button 'Stop': stops the selected TCP subprocess transmission
+void on_buttonStop_clicked(GtkButton *button, gpointer user_data) {
+	GtkTreeSelection *selection;
+	GtkTreeModel	*model;
+	GtkTreeIter	iter;
+	unsigned tid;
+
+	selection= gtk_tree_view_get_selection(main_window->treeThread);
+	if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
+		gtk_tree_model_get (model, &iter, 0, &tid, -1);
+#ifdef DEBUG
+		g_print ("Thread %u will be stopped\n", tid);
+#endif
+	} else {
+		fx_log ("No thread selected\n");
+		return;
+	}
+	if (tid <= 0) {
+		fx_log("Invalid TID in the selected line\n");
+		return;
+	}
+
+	if (!gtk_list_store_remove(main_window->listThread, &iter)) {
+		fx_log("Failed to stop thread from list\n");
+	}
+	// Stop thread
+	fx_stop_transfer(tid);
+}
+
+
+// Stats window, refreshed every STATS_PERIOD ms while it is open
+#define STATS_PERIOD	1000
+static GtkWidget *stats_window= NULL;
+static GtkTextView *stats_view= NULL;
+static guint stats_timer_id= 0;
+
+static gboolean callback_stats_timer(gpointer data) {
+	char *text= fx_metrics_text();
+	gtk_text_buffer_set_text(gtk_text_view_get_buffer(stats_view), text, -1);
+	g_free(text);
+	return TRUE;	// Keeps the timer
+}
+
+static void on_stats_window_destroy(GtkWidget *widget, gpointer user_data) {
+	g_source_remove(stats_timer_id);
+	stats_timer_id= 0;
+	stats_window= NULL;
+	stats_view= NULL;
+}
+
+
+// Callback button 'Stats': opens a window with the engine metrics
+void on_buttonStats_clicked(GtkButton *button, gpointer user_data) {
+	if (stats_window != NULL) {
+		gtk_window_present(GTK_WINDOW(stats_window));
+		return;
+	}
+	stats_window= gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	gtk_window_set_title(GTK_WINDOW(stats_window), "fileexchange metrics");
+	gtk_window_set_default_size(GTK_WINDOW(stats_window), 520, 600);
+	GtkWidget *scrolled= gtk_scrolled_window_new(NULL, NULL);
+	stats_view= GTK_TEXT_VIEW(gtk_text_view_new());
+	gtk_text_view_set_editable(stats_view, FALSE);
+	gtk_text_view_set_monospace(stats_view, TRUE);
+	gtk_container_add(GTK_CONTAINER(scrolled), GTK_WIDGET(stats_view));
+	gtk_container_add(GTK_CONTAINER(stats_window), scrolled);
+	g_signal_connect(stats_window, "destroy", G_CALLBACK(on_stats_window_destroy), NULL);
+	callback_stats_timer(NULL);
+	stats_timer_id= gdk_threads_add_timeout(STATS_PERIOD, callback_stats_timer, NULL);
+	gtk_widget_show_all(stats_window);
+}
+
+
+// Callback function that handles the end of the closing of the main window
+gboolean on_window1_delete_event (GtkWidget * widget,
+		GdkEvent * event, gpointer user_data)
+{
+	if (filelist_modified)
+		fx_write_filelist(get_Filelist_Filename());
+	fx_stop();
+	gtk_main_quit ();		// Close Gtk main cycle
+	return FALSE;			// Must always return FALSE; otherwise the window is not closed.
+}
@@ -0,0 +1,60 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * host.h
+ *
+ * Header file of the functions used by the engine modules to report to the
+ *   application, forwarded to the Fx_Callbacks registered with fx_init
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_HOST_H_
+#define _INCL_HOST_H_
+
+#include <glib.h>
+#include "fileexchange.h"
+
+
+// Lowest log level compiled in - build with -DFX_LOG_MIN_LEVEL=1 to remove the LOGF debug messages
+#ifndef FX_LOG_MIN_LEVEL
+#define FX_LOG_MIN_LEVEL	FX_LOG_DEBUG
+#endif
+
+// Lowest log level reported (runtime), set by fx_set_log_level; not exported by the library
+G_GNUC_INTERNAL extern int fx_log_level;
+
+// Log a message with printf format; the arguments are only formatted if 'level' is logged
+#define LOGF(level, ...)	do { \
+			if (((level) >= FX_LOG_MIN_LEVEL) \
+					&& ((level) >= __atomic_load_n(&fx_log_level, __ATOMIC_RELAXED))) \
+				Log_printf((level), __VA_ARGS__); \
+		} while (0)
+
+// Log the message str, with level FX_LOG_INFO
+void Log (const gchar * str);
+
+// Log the message str with level 'level'
+void Log_level (int level, const gchar * str);
+
+// Log a formatted message with level 'level' - use LOGF
+void Log_printf (int level, const char *fmt, ...) G_GNUC_PRINTF(2, 3);
+
+// Report a fatal socket error to the application, which should leave its main loop
+void quit_mainloop (void);
+
+// Return TRUE if slow sending is configured
+gboolean get_slow(void);
+
+// Report a new transfer
+gboolean GUI_regist_thread(unsigned tid, gboolean is_snd, const char *f_name, const char *of_name, gboolean lock_gdk);
+// Report the filename of a sending transfer
+gboolean GUI_update_filename(unsigned tid, const char *f_name, gboolean lock_gdk);
+// Report the bytes moved by a transfer that is ending
+void GUI_transfer_done(unsigned tid, gboolean is_snd, long long bytes, gboolean lock_gdk);
+// Report the end of a transfer
+gboolean GUI_del_thread(unsigned tid, gboolean lock_gdk);
+// Report the end of all transfers
+void GUI_clear_threads(gboolean lock_gdk);
+
+#endif
@@ -0,0 +1,197 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * iosched.c
+ *
+ * Read scheduler of the sending threads: a table of the devices of the files
+ *   sent, each with its read turns served in FSCAN order
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include "iosched.h"
+
+
+// Read waiting for its turn
+typedef struct Io_Wait {
+	unsigned long long key;
+	gboolean granted;
+	pthread_cond_t cond;
+	struct Io_Wait *next;
+} Io_Wait;
+
+struct Io_Device {
+	dev_t dev;
+	gboolean rotational;
+	int slots;						// Reads at once
+	int busy;						// Reads running
+	Io_Wait *sweep;					// Reads of the current sweep, by key
+	Io_Wait *next;					// Reads of the next sweep, by key
+	pthread_mutex_t mutex;
+};
+
+
+static GHashTable *devices= NULL;	// Io_Device by dev_t, never freed
+static pthread_mutex_t devices_mutex= PTHREAD_MUTEX_INITIALIZER;
+
+
+// Create a device where 'slots' reads run at once
+Io_Device *io_device_new(int slots) {
+	Io_Device *d= (Io_Device *)calloc(1, sizeof(Io_Device));
+
+	if (d == NULL)
+		return NULL;
+	d->slots= (slots > 0) ? slots : 1;
+	pthread_mutex_init(&d->mutex, NULL);
+	return d;
+}
+
+
+// Free a device without reads
+void io_device_free(Io_Device *d) {
+	pthread_mutex_destroy(&d->mutex);
+	free(d);
+}
+
+
+// Read the integer of file 'path', or -1
+static int read_int(const char *path) {
+	FILE *f= fopen(path, "r");
+	int v= -1;
+
+	if (f != NULL) {
+		if (fscanf(f, "%d", &v) != 1)
+			v= -1;
+		fclose(f);
+	}
+	return v;
+}
+
+
+// Return TRUE if device 'dev' is a rotational disk; partitions use the flag of their disk
+gboolean io_rotational(dev_t dev) {
+	char path[PATH_MAX], real[PATH_MAX];
+	int r;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+	if ((r= read_int(path)) >= 0)
+		return r == 1;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+	if ((realpath(path, real) == NULL) || (strlen(real) + 24 > sizeof(real)))
+		return FALSE;	// Not a block device (tmpfs, NFS, ...)
+	strcat(real, "/../queue/rotational");
+	return read_int(real) == 1;
+}
+
+
+static guint dev_hash(gconstpointer key) {
+	dev_t dev= *(const dev_t *)key;
+	return (guint)(dev ^ (dev >> 32));
+}
+
+
+static gboolean dev_equal(gconstpointer a, gconstpointer b) {
+	return *(const dev_t *)a == *(const dev_t *)b;
+}
+
+
+// Return the device of the file 'fd', or NULL if it is not scheduled
+Io_Device *io_device_get(int fd, gboolean all, int slots) {
+	Io_Device *d;
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return NULL;
+	pthread_mutex_lock(&devices_mutex);
+	if (devices == NULL)
+		devices= g_hash_table_new(dev_hash, dev_equal);
+	if (((d= (Io_Device *)g_hash_table_lookup(devices, &st.st_dev)) == NULL)
+			&& ((d= io_device_new(slots)) != NULL)) {
+		d->dev= st.st_dev;
+		d->rotational= io_rotational(st.st_dev);
+		g_hash_table_insert(devices, &d->dev, d);
+	}
+	pthread_mutex_unlock(&devices_mutex);
+	if ((d == NULL) || (!d->rotational && !all))
+		return NULL;
+	pthread_mutex_lock(&d->mutex);
+	d->slots= (slots > 0) ? slots : 1;
+	pthread_mutex_unlock(&d->mutex);
+	return d;
+}
+
+
+// Return the position in the device of offset 'off' of file 'fd' (FIEMAP), or the inode and
+//    offset if the filesystem does not report it
+unsigned long long io_key(int fd, unsigned long long off) {
+	union {
+		struct fiemap fm;
+		char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} m;
+	struct stat st;
+
+	memset(&m, 0, sizeof(m));
+	m.fm.fm_start= off;
+	m.fm.fm_length= 1;
+	m.fm.fm_extent_count= 1;
+	if (!ioctl(fd, FS_IOC_FIEMAP, &m.fm) && (m.fm.fm_mapped_extents == 1)
+			&& !(m.fm.fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC)))
+		return m.fm.fm_extents[0].fe_physical + (off - m.fm.fm_extents[0].fe_logical);
+	if (fstat(fd, &st))
+		return 0;
+	return ((unsigned long long)st.st_ino << 32) + (off >> 12);
+}
+
+
+// Wait for the turn of a read at position 'key' of device 'd'
+void io_begin(Io_Device *d, unsigned long long key) {
+	Io_Wait w, **p;
+
+	pthread_mutex_lock(&d->mutex);
+	if ((d->busy < d->slots) && (d->sweep == NULL) && (d->next == NULL)) {
+		d->busy++;
+		pthread_mutex_unlock(&d->mutex);
+		return;
+	}
+	// Wait in the next sweep, ordered by key
+	w.key= key;
+	w.granted= FALSE;
+	pthread_cond_init(&w.cond, NULL);
+	for (p= &d->next; (*p != NULL) && ((*p)->key <= key); p= &(*p)->next)
+		;
+	w.next= *p;
+	*p= &w;
+	while (!w.granted)
+		pthread_cond_wait(&w.cond, &d->mutex);
+	pthread_mutex_unlock(&d->mutex);
+	pthread_cond_destroy(&w.cond);
+}
+
+
+// End the read, giving the turn to the next one
+void io_end(Io_Device *d) {
+	Io_Wait *w;
+
+	pthread_mutex_lock(&d->mutex);
+	if (d->sweep == NULL) {
+		d->sweep= d->next;	// Start the next sweep
+		d->next= NULL;
+	}
+	if ((w= d->sweep) != NULL) {
+		d->sweep= w->next;
+		w->granted= TRUE;	// The slot passes to 'w'
+		pthread_cond_signal(&w->cond);
+	} else
+		d->busy--;
+	pthread_mutex_unlock(&d->mutex);
+}
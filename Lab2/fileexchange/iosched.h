@@ -0,0 +1,52 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * iosched.h
+ *
+ * Header file of the read scheduler of the sending threads
+ *
+ * Senders of files in the same device read in turns, one long read (a quantum)
+ * per turn, instead of interleaving small reads that make a disk seek between
+ * files. Waiting reads are served in sweeps ordered by their position in the
+ * device (FSCAN): reads that arrive during a sweep wait for the next one, so
+ * every sender gets one turn per sweep.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_IOSCHED_H_
+#define _INCL_IOSCHED_H_
+
+#include <sys/types.h>
+#include <glib.h>
+
+
+#define IO_QUANTUM		(2*1048576)	/* Bytes read in each turn */
+
+
+typedef struct Io_Device Io_Device;
+
+
+// Create a device where 'slots' reads run at once
+Io_Device *io_device_new(int slots);
+
+// Free a device without reads
+void io_device_free(Io_Device *d);
+
+// Return the device of the file 'fd', with 'slots' reads at once, or NULL if it is not
+//    scheduled (not a rotational disk, unless 'all')
+Io_Device *io_device_get(int fd, gboolean all, int slots);
+
+// Return TRUE if device 'dev' is a rotational disk
+gboolean io_rotational(dev_t dev);
+
+// Return the position in the device of offset 'off' of file 'fd', used to order the reads
+unsigned long long io_key(int fd, unsigned long long off);
+
+// Wait for the turn of a read at position 'key' of device 'd'
+void io_begin(Io_Device *d, unsigned long long key);
+
+// End the read, giving the turn to the next one
+void io_end(Io_Device *d);
+
+#endif
@@ -0,0 +1,89 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * logring.c
+ *
+ * Bounded ring of log records: writers reserve a slot by advancing 'tail' with a
+ *   compare-and-swap and publish it through the slot sequence number
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logring.h"
+
+
+/** Initialize a ring with at least 'size' records */
+gboolean logring_init(Log_Ring *r, unsigned size) {
+	unsigned n= 1, i;
+
+	while (n < size)
+		n <<= 1;
+	memset(r, 0, sizeof(*r));
+	if ((r->rec= (Log_Record *)malloc(n*sizeof(Log_Record))) == NULL)
+		return FALSE;
+	for (i= 0; i < n; i++)
+		r->rec[i].seq= i;		// Slot i is free for position i
+	r->mask= n-1;
+	return TRUE;
+}
+
+
+/** Free the memory used by the ring */
+void logring_free(Log_Ring *r) {
+	free(r->rec);
+	r->rec= NULL;
+}
+
+
+/** Add a record; returns FALSE if the ring is full */
+gboolean logring_push(Log_Ring *r, int level, const char *text) {
+	unsigned pos= __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	Log_Record *rec;
+
+	for (;;) {
+		rec= &r->rec[pos & r->mask];
+		int dif= (int)(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - pos);
+		if (dif == 0) {
+			// Slot free - reserve it
+			if (__atomic_compare_exchange_n(&r->tail, &pos, pos+1, TRUE,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			// The reader did not free the slot yet: ring full
+			__atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+			return FALSE;
+		} else
+			pos= __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	}
+	rec->level= level;
+	strncpy(rec->text, text, LOG_TEXT_LEN-1);
+	rec->text[LOG_TEXT_LEN-1]= '\0';
+	if ((strlen(text) >= LOG_TEXT_LEN) && (text[strlen(text)-1] == '\n'))
+		rec->text[LOG_TEXT_LEN-2]= '\n';		// Keep the end of line of truncated messages
+	__atomic_store_n(&rec->seq, pos+1, __ATOMIC_RELEASE);	// Publish it
+	return TRUE;
+}
+
+
+/** Remove the oldest record; only one thread may call it */
+gboolean logring_pop(Log_Ring *r, int *level, char *text) {
+	unsigned pos= r->head;
+	Log_Record *rec= &r->rec[pos & r->mask];
+
+	if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != pos+1)
+		return FALSE;		// Empty, or the writer of 'pos' did not finish yet
+	*level= rec->level;
+	memcpy(text, rec->text, LOG_TEXT_LEN);
+	__atomic_store_n(&rec->seq, pos + r->mask + 1, __ATOMIC_RELEASE);	// Free for the next lap
+	r->head= pos+1;
+	return TRUE;
+}
+
+
+/** Return the number of records dropped */
+unsigned long long logring_dropped(Log_Ring *r) {
+	return __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,56 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * logring.h
+ *
+ * Header file of a bounded ring of log records, written without locks by any
+ *   thread and read by one thread (the main loop).
+ *   When the ring is full the records are dropped and counted, so writers never
+ *   wait for the reader.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_LOGRING_H_
+#define _INCL_LOGRING_H_
+
+#include <glib.h>
+
+#define LOG_TEXT_LEN	240		// Longer messages are truncated
+
+
+// Log record
+typedef struct Log_Record {
+	unsigned seq;				// Position the slot is ready for (written or read)
+	int level;					// Fx_Log_Level
+	char text[LOG_TEXT_LEN];
+} Log_Record;
+
+// Ring of log records
+typedef struct Log_Ring {
+	Log_Record *rec;
+	unsigned mask;				// Number of slots - 1 (a power of two)
+	unsigned tail __attribute__((aligned(64)));	// Next position written
+	unsigned head __attribute__((aligned(64)));	// Next position read
+	unsigned long long dropped;	// Records dropped because the ring was full
+} Log_Ring;
+
+
+// Initialize a ring with at least 'size' records
+gboolean logring_init(Log_Ring *r, unsigned size);
+
+// Free the memory used by the ring
+void logring_free(Log_Ring *r);
+
+// Add a record; returns FALSE if the ring is full and the record was dropped
+//    May be called by any thread
+gboolean logring_push(Log_Ring *r, int level, const char *text);
+
+// Remove the oldest record, copying its text to 'text' (LOG_TEXT_LEN bytes)
+//    Returns FALSE if the ring is empty. Only one thread may read the ring
+gboolean logring_pop(Log_Ring *r, int *level, char *text);
+
+// Return the number of records dropped
+unsigned long long logring_dropped(Log_Ring *r);
+
+#endif
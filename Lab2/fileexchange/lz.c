@@ -0,0 +1,207 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * lz.c
+ *
+ * Fast LZ77 block compressor: a single hash table of the last position of each
+ *   4-byte sequence finds the matches, and the search skips faster through data
+ *   without matches, so incompressible blocks cost little time.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <string.h>
+#include "lz.h"
+
+#define LZ_LAST_LITERALS	5		// Bytes at the end of a block that are never matched
+#define LZ_SKIP_SHIFT		6		// The search step grows by 1 every 64 bytes without a match
+
+
+static inline uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+
+static inline uint64_t read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+
+// Copy 'len' bytes in 8 byte words; may write up to 7 bytes after dst+len
+static inline void wild_copy(uint8_t *dst, const uint8_t *src, int len) {
+	uint8_t *end= dst + len;
+	do {
+		memcpy(dst, src, 8);
+		dst += 8;
+		src += 8;
+	} while (dst < end);
+}
+
+
+// Return the length of the common prefix of 'a' and 'b', up to 'max' bytes
+static inline int common_length(const uint8_t *a, const uint8_t *b, int max) {
+	int len= 0;
+
+	while (len + 8 <= max) {
+		uint64_t x= read64(a+len) ^ read64(b+len);
+		if (x != 0)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return len + (__builtin_ctzll(x) >> 3);
+#else
+			return len + (__builtin_clzll(x) >> 3);
+#endif
+		len += 8;
+	}
+	while ((len < max) && (a[len] == b[len]))
+		len++;
+	return len;
+}
+
+
+static inline uint32_t lz_hash(uint32_t seq) {
+	return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+
+// Write length 'len' after a token nibble of 15; returns the next output position or NULL
+static uint8_t *write_length(uint8_t *op, const uint8_t *oend, int len) {
+	for (; len >= 255; len -= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++= 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++= (uint8_t)len;
+	return op;
+}
+
+
+// Write one sequence: 'nlit' literals from 'lit', and a match of 'mlen' bytes at 'off'
+//    (mlen == 0 for the last sequence). Returns the next output position or NULL
+static uint8_t *write_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *lit, int nlit,
+		int off, int mlen) {
+	uint8_t *token= op++;
+	int ml= (mlen > 0) ? mlen - LZ_MIN_MATCH : 0;
+
+	if (op > oend)
+		return NULL;
+	*token= (uint8_t)(((nlit < 15) ? nlit : 15) << 4 | ((ml < 15) ? ml : 15));
+	if ((nlit >= 15) && ((op= write_length(op, oend, nlit - 15)) == NULL))
+		return NULL;
+	if (op + nlit > oend)
+		return NULL;
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen == 0)
+		return op;
+	if (op + 2 > oend)
+		return NULL;
+	*op++= (uint8_t)off;
+	*op++= (uint8_t)(off >> 8);
+	if ((ml >= 15) && ((op= write_length(op, oend, ml - 15)) == NULL))
+		return NULL;
+	return op;
+}
+
+
+// Compress the 'n' bytes of 'src' to 'dst', with room for 'cap' bytes
+int lz_compress(const uint8_t *src, int n, uint8_t *dst, int cap) {
+	uint32_t table[1 << LZ_HASH_BITS];	// Last position + 1 of each hash (0: none)
+	const uint8_t *oend= dst + cap;
+	uint8_t *op= dst;
+	int ip= 0, anchor= 0;
+	int limit= n - LZ_LAST_LITERALS;	// Matches end before it
+
+	memset(table, 0, sizeof(table));
+	while (ip + LZ_MIN_MATCH <= limit) {
+		uint32_t seq= read32(src+ip);
+		uint32_t h= lz_hash(seq);
+		int ref= (int)table[h] - 1;
+		table[h]= ip + 1;
+		if ((ref < 0) || (ip - ref > LZ_MAX_OFFSET) || (read32(src+ref) != seq)) {
+			ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+			continue;
+		}
+		// Extend the match forward and backward
+		int len= LZ_MIN_MATCH + common_length(src+ref+LZ_MIN_MATCH, src+ip+LZ_MIN_MATCH,
+				limit - ip - LZ_MIN_MATCH);
+		while ((ip > anchor) && (ref > 0) && (src[ip-1] == src[ref-1])) {
+			ip--;
+			ref--;
+			len++;
+		}
+		if ((op= write_sequence(op, oend, src+anchor, ip-anchor, ip-ref, len)) == NULL)
+			return 0;
+		ip += len;
+		anchor= ip;
+		if (ip - 2 >= 0)
+			table[lz_hash(read32(src+ip-2))]= ip - 1;	// Position inside the match
+	}
+	if ((op= write_sequence(op, oend, src+anchor, n-anchor, 0, 0)) == NULL)
+		return 0;
+	return (int)(op - dst);
+}
+
+
+// Read a length continued after a token nibble of 15; returns -1 if the data ends
+static int read_length(const uint8_t *src, int clen, int *ip) {
+	int len= 0, b;
+
+	do {
+		if (*ip >= clen)
+			return -1;
+		b= src[(*ip)++];
+		len += b;
+		if (len > (1 << 30))
+			return -1;
+	} while (b == 255);
+	return len;
+}
+
+
+// Decompress the 'clen' bytes of 'src' to 'dst', with room for 'n' bytes
+int lz_decompress(const uint8_t *src, int clen, uint8_t *dst, int n) {
+	int ip= 0, op= 0;
+
+	while (ip < clen) {
+		int token= src[ip++];
+		int nlit= token >> 4, mlen, off, x;
+
+		if ((nlit == 15) && ((x= read_length(src, clen, &ip)) < 0 || ((nlit += x) < 0)))
+			return -1;
+		if ((nlit > clen - ip) || (nlit > n - op))
+			return -1;
+		if ((nlit <= clen - ip - 8) && (nlit <= n - op - 8))
+			wild_copy(dst+op, src+ip, nlit);	// Room for the extra bytes
+		else
+			memcpy(dst+op, src+ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == clen)
+			break;		// Last sequence
+		if (ip + 2 > clen)
+			return -1;
+		off= src[ip] | (src[ip+1] << 8);
+		ip += 2;
+		mlen= token & 15;
+		if ((mlen == 15) && ((x= read_length(src, clen, &ip)) < 0 || ((mlen += x) < 0)))
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if ((off == 0) || (off > op) || (mlen > n - op))
+			return -1;
+		if ((off >= 8) && (mlen <= n - op - 8))
+			wild_copy(dst+op, dst+op-off, mlen);
+		else if (off >= mlen)
+			memcpy(dst+op, dst+op-off, mlen);
+		else
+			for (x= 0; x < mlen; x++)	// Overlapping copy repeats the last 'off' bytes
+				dst[op+x]= dst[op-off+x];
+		op += mlen;
+	}
+	return op;
+}
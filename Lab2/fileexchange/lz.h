@@ -0,0 +1,36 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * lz.h
+ *
+ * Header file of a fast LZ77 block compressor, used to compress file transfers
+ *
+ * Each block is compressed independently, with a window of up to 64 KiB, as a
+ * sequence of | token(1) | literal length | literals | offset(2, LE) | match length |
+ * The token has the literal length (high 4 bits) and the match length minus
+ * LZ_MIN_MATCH (low 4 bits); the value 15 continues in the next bytes, each adding
+ * up to 255. The last sequence has only literals.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_LZ_H_
+#define _INCL_LZ_H_
+
+#include <stdint.h>
+
+
+#define LZ_MIN_MATCH	4			/* Shortest match */
+#define LZ_MAX_OFFSET	65535		/* Longest distance of a match */
+#define LZ_HASH_BITS	13			/* Size of the match finder table (log2) */
+
+
+// Compress the 'n' bytes of 'src' to 'dst', with room for 'cap' bytes
+//    Returns the compressed length, or 0 if it does not fit in 'cap' bytes
+int lz_compress(const uint8_t *src, int n, uint8_t *dst, int cap);
+
+// Decompress the 'clen' bytes of 'src' to 'dst', with room for 'n' bytes
+//    Returns the decompressed length, or -1 if the data is not valid
+int lz_decompress(const uint8_t *src, int clen, uint8_t *dst, int n);
+
+#endif
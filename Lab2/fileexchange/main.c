@@ -15,9 +15,10 @@
 #include <memory.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
 #include "gui.h"
-#include "sock.h"
-#include "callbacks.h"
+#include "fileexchange.h"
 #include "file.h"
 
 /* Public variables */
@@ -50,17 +51,18 @@ int main (int argc, char *argv[]) {
       homedir= getenv("PWD");
     if (homedir == NULL)
       homedir= "/tmp";
-    out_dir= g_strdup_printf("%s/out%d", homedir, getpid());
+    char *out_dir= g_strdup_printf("%s/out%d", homedir, getpid());
     if (!make_directory(out_dir)) {
-      Log("Failed creation of output directory: '");
-      Log(out_dir);
-      Log("'.\n");
+      fx_log("Failed creation of output directory: '");
+      fx_log(out_dir);
+      fx_log("'.\n");
       out_dir= "/tmp";
     }
-    Log("Received files will be created at: '");
-    Log(out_dir);
-    Log("'\n");
+    fx_log("Received files will be created at: '");
+    fx_log(out_dir);
+    fx_log("'\n");
     set_OutDir(out_dir);
+    fx_set_out_dir(out_dir);
 
 	add_filelist(get_Filelist_Filename(), TRUE);	// Read filelist from configuration file
 
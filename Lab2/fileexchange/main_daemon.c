@@ -0,0 +1,361 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * main_daemon.c
+ *
+ * Main function of fileexchanged, the fileexchange server without GTK
+ *   Usage: fileexchanged [-c config_file] [-d]
+ *     -c  configuration file (default fileexchanged.conf)
+ *     -d  detach from the terminal
+ *   Signals: SIGINT/SIGTERM stop the server; SIGHUP reloads the file list;
+ *     SIGUSR1 logs the QUERY statistics
+ *   The metrics are read from the Unix socket 'metrics_socket', if configured
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <glib.h>
+#include <glib-unix.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include "fileexchange.h"
+#include "file.h"
+
+#define DEFAULT_CONFIG	"fileexchanged.conf"
+#define CONFIG_GROUP	"fileexchange"
+
+
+// Configuration values - replace the GtkEntry boxes of the GUI
+static struct {
+	char *ipv6;				// IPv6 multicast address
+	char *ipv4;				// IPv4 multicast address
+	int mport;				// Multicast port
+	char *filelist;			// File with the list of shared files
+	char *out_dir;			// Output directory
+	gboolean slow;			// Slow sending
+	gboolean drop_cache;	// Drop the received files from the page cache
+	gboolean splice;		// Splice the received files from the socket to the file
+	gboolean splice_hash;	// Verify the hash of the spliced files
+	gboolean rename_noreplace;	// Keep existing files when received files are published
+	gboolean done_marker;	// Create a '.done' marker for each received file
+	gboolean compression;	// Ask the senders to compress the files
+	gboolean delta;			// Download deltas of the existing files
+	gboolean chunk_store;	// Only download the chunks not found in the files received
+	char *log_file;			// Log file (NULL for stderr)
+	int log_level;			// Lowest level logged (Fx_Log_Level)
+	char *metrics_socket;	// Unix socket exposing the metrics (NULL for none)
+	char *mcast_interfaces;	// Interfaces that join the multicast groups (NULL for all)
+	int tcp_backlog;		// Queue of pending TCP connections (0 for the default)
+	int tcp_acceptors;		// Threads accepting TCP connections (0 for the main loop)
+	int io_scheduler;		// Devices whose senders read in turns (Fx_Io_Sched)
+	int io_slots;			// Reads at once in each scheduled device
+	int file_cache_mb;		// Memory for the small files sent often, in MiB (0 to disable)
+	gboolean zerocopy;		// Send the files in memory with MSG_ZEROCOPY
+} cfg;
+
+// Log output
+static FILE *log_f= NULL;
+// Mutex to synchronize writes to the log
+static pthread_mutex_t lmutex = PTHREAD_MUTEX_INITIALIZER;
+
+static GMainLoop *main_loop= NULL;
+
+
+/** Load the configuration file of the daemon (GKeyFile format, group [fileexchange])
+ *   Missing keys keep the defaults of the GUI */
+static gboolean load_config (const char *filename) {
+	GKeyFile *kf= g_key_file_new();
+	GError *err= NULL;
+
+	// Defaults
+	cfg.ipv6= g_strdup("ff18:10:33::1");
+	cfg.ipv4= g_strdup("225.0.0.1");
+	cfg.mport= 20000;
+	cfg.filelist= g_strdup("list.txt");
+	cfg.out_dir= NULL;
+	cfg.slow= FALSE;
+	cfg.drop_cache= FALSE;
+	cfg.splice= FALSE;
+	cfg.splice_hash= TRUE;
+	cfg.rename_noreplace= FALSE;
+	cfg.done_marker= FALSE;
+	cfg.compression= FALSE;
+	cfg.delta= FALSE;
+	cfg.chunk_store= FALSE;
+	cfg.log_file= NULL;
+	cfg.log_level= FX_LOG_INFO;
+	cfg.metrics_socket= NULL;
+	cfg.mcast_interfaces= NULL;
+	cfg.tcp_backlog= 0;
+	cfg.tcp_acceptors= 0;
+	cfg.io_scheduler= FX_IO_SCHED_ROTATIONAL;
+	cfg.io_slots= 1;
+	cfg.file_cache_mb= 0;
+	cfg.zerocopy= FALSE;
+
+	if (!g_key_file_load_from_file(kf, filename, G_KEY_FILE_NONE, &err)) {
+		fprintf(stderr, "Failed loading configuration file '%s': %s\n", filename, err->message);
+		g_error_free(err);
+		g_key_file_free(kf);
+		return FALSE;
+	}
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "ipv6_multicast", NULL)) {
+		g_free(cfg.ipv6);
+		cfg.ipv6= g_key_file_get_string(kf, CONFIG_GROUP, "ipv6_multicast", NULL);
+	}
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "ipv4_multicast", NULL)) {
+		g_free(cfg.ipv4);
+		cfg.ipv4= g_key_file_get_string(kf, CONFIG_GROUP, "ipv4_multicast", NULL);
+	}
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "multicast_port", NULL))
+		cfg.mport= g_key_file_get_integer(kf, CONFIG_GROUP, "multicast_port", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "filelist", NULL)) {
+		g_free(cfg.filelist);
+		cfg.filelist= g_key_file_get_string(kf, CONFIG_GROUP, "filelist", NULL);
+	}
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "out_dir", NULL))
+		cfg.out_dir= g_key_file_get_string(kf, CONFIG_GROUP, "out_dir", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "slow", NULL))
+		cfg.slow= g_key_file_get_boolean(kf, CONFIG_GROUP, "slow", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "drop_cache", NULL))
+		cfg.drop_cache= g_key_file_get_boolean(kf, CONFIG_GROUP, "drop_cache", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "splice", NULL))
+		cfg.splice= g_key_file_get_boolean(kf, CONFIG_GROUP, "splice", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "splice_hash", NULL))
+		cfg.splice_hash= g_key_file_get_boolean(kf, CONFIG_GROUP, "splice_hash", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "rename_noreplace", NULL))
+		cfg.rename_noreplace= g_key_file_get_boolean(kf, CONFIG_GROUP, "rename_noreplace", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "done_marker", NULL))
+		cfg.done_marker= g_key_file_get_boolean(kf, CONFIG_GROUP, "done_marker", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "compression", NULL))
+		cfg.compression= g_key_file_get_boolean(kf, CONFIG_GROUP, "compression", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "delta", NULL))
+		cfg.delta= g_key_file_get_boolean(kf, CONFIG_GROUP, "delta", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "chunk_store", NULL))
+		cfg.chunk_store= g_key_file_get_boolean(kf, CONFIG_GROUP, "chunk_store", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "log_file", NULL))
+		cfg.log_file= g_key_file_get_string(kf, CONFIG_GROUP, "log_file", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "log_level", NULL)) {
+		char *level= g_key_file_get_string(kf, CONFIG_GROUP, "log_level", NULL);
+		if ((cfg.log_level= fx_log_level_from_name(level)) < 0) {
+			fprintf(stderr, "Invalid log_level '%s' in '%s'\n", level, filename);
+			g_free(level);
+			g_key_file_free(kf);
+			return FALSE;
+		}
+		g_free(level);
+	}
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "metrics_socket", NULL))
+		cfg.metrics_socket= g_key_file_get_string(kf, CONFIG_GROUP, "metrics_socket", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "multicast_interfaces", NULL))
+		cfg.mcast_interfaces= g_key_file_get_string(kf, CONFIG_GROUP, "multicast_interfaces", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "tcp_backlog", NULL))
+		cfg.tcp_backlog= g_key_file_get_integer(kf, CONFIG_GROUP, "tcp_backlog", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "tcp_acceptors", NULL))
+		cfg.tcp_acceptors= g_key_file_get_integer(kf, CONFIG_GROUP, "tcp_acceptors", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "io_scheduler", NULL)) {
+		static const char *modes[]= { "off", "rotational", "all" };
+		char *mode= g_key_file_get_string(kf, CONFIG_GROUP, "io_scheduler", NULL);
+		for (cfg.io_scheduler= FX_IO_SCHED_ALL; cfg.io_scheduler >= 0; cfg.io_scheduler--)
+			if ((mode != NULL) && !g_ascii_strcasecmp(mode, modes[cfg.io_scheduler]))
+				break;
+		if (cfg.io_scheduler < 0) {
+			fprintf(stderr, "Invalid io_scheduler '%s' in '%s'\n", mode, filename);
+			g_free(mode);
+			g_key_file_free(kf);
+			return FALSE;
+		}
+		g_free(mode);
+	}
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "io_slots", NULL))
+		cfg.io_slots= g_key_file_get_integer(kf, CONFIG_GROUP, "io_slots", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "file_cache_mb", NULL))
+		cfg.file_cache_mb= g_key_file_get_integer(kf, CONFIG_GROUP, "file_cache_mb", NULL);
+	if (g_key_file_has_key(kf, CONFIG_GROUP, "zerocopy", NULL))
+		cfg.zerocopy= g_key_file_get_boolean(kf, CONFIG_GROUP, "zerocopy", NULL);
+	g_key_file_free(kf);
+	return TRUE;
+}
+
+
+/** Engine callback: log the message str to the log file, with the time (and the level, for
+ *   warnings and errors) at the start of each line */
+static void daemon_log (void *ctx, int level, const gchar * str)
+{
+	static gboolean line_start= TRUE;
+	const char *pt, *nl;
+
+	pthread_mutex_lock( &lmutex );
+	for (pt= str; *pt; pt= nl+1) {
+		if (line_start) {
+			char tbuf[32];
+			time_t t= time(NULL);
+			struct tm tm;
+			strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+			if (level >= FX_LOG_WARNING)
+				fprintf(log_f, "%s %s: ", tbuf, fx_log_level_name(level));
+			else
+				fprintf(log_f, "%s ", tbuf);
+		}
+		if ((nl= strchr(pt, '\n')) == NULL) {
+			fputs(pt, log_f);
+			line_start= FALSE;
+			break;
+		}
+		fwrite(pt, 1, nl-pt+1, log_f);
+		line_start= TRUE;
+	}
+	fflush(log_f);
+	pthread_mutex_unlock( &lmutex );
+}
+
+
+/** Engine callback: a socket failed - quit the main loop */
+static void daemon_fatal (void *ctx) {
+	if (main_loop != NULL)
+		g_main_loop_quit(main_loop);
+}
+
+
+/** Initialization function of the daemon, after loading the configuration */
+static gboolean init_app (void) {
+	Fx_Callbacks cb= { .log= daemon_log, .fatal= daemon_fatal };
+
+	log_f= stderr;
+	if ((cfg.log_file != NULL) && (strlen(cfg.log_file) > 0)) {
+		if ((log_f= fopen(cfg.log_file, "a")) == NULL) {
+			fprintf(stderr, "Failed opening log file '%s'\n", cfg.log_file);
+			log_f= stderr;
+			return FALSE;
+		}
+	}
+	if (fx_api_version() != FX_API_VERSION) {
+		fprintf(stderr, "libfileexchange version %d, expected %d\n", fx_api_version(), FX_API_VERSION);
+		return FALSE;
+	}
+	if (!fx_init(&cb))
+		return FALSE;
+	fx_set_log_level(cfg.log_level);
+	return TRUE;
+}
+
+
+// SIGINT and SIGTERM - stop the server
+static gboolean on_signal_stop(gpointer data) {
+	fx_log("Stop signal received\n");
+	daemon_fatal(NULL);
+	return TRUE;
+}
+
+
+// SIGHUP - reload the file list
+static gboolean on_signal_reload(gpointer data) {
+	fx_log("Reloading the file list\n");
+	fx_clear_files();
+	fx_add_filelist(cfg.filelist);
+	return TRUE;
+}
+
+
+// SIGUSR1 - log the statistics
+static gboolean on_signal_stats(gpointer data) {
+	fx_log_stats();
+	return TRUE;
+}
+
+
+int main (int argc, char *argv[]) {
+	const char *config= DEFAULT_CONFIG;
+	gboolean detach= FALSE;
+	int c;
+
+	while ((c= getopt(argc, argv, "c:d")) != -1) {
+		switch (c) {
+		case 'c':
+			config= optarg;
+			break;
+		case 'd':
+			detach= TRUE;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c config_file] [-d]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!load_config(config) || !init_app())
+		return 1;
+	// Keep the working directory - relative paths in the configuration stay valid
+	if (detach && daemon(1, 0)) {
+		perror("daemon");
+		return 1;
+	}
+
+	// Define the output directory, where the files will be written
+	char *out_dir= cfg.out_dir;
+	if (out_dir == NULL) {
+		char *homedir= getenv("HOME");
+		if (homedir == NULL)
+			homedir= getenv("PWD");
+		if (homedir == NULL)
+			homedir= "/tmp";
+		out_dir= g_strdup_printf("%s/out%d", homedir, getpid());
+	}
+	if (!make_directory(out_dir)) {
+		fx_log("Failed creation of output directory: '");
+		fx_log(out_dir);
+		fx_log("'.\n");
+		out_dir= "/tmp";
+	}
+	fx_set_out_dir(out_dir);
+	fx_log("Received files will be created at: '");
+	fx_log(out_dir);
+	fx_log("'\n");
+	fx_set_slow(cfg.slow);
+	fx_set_drop_cache(cfg.drop_cache);
+	fx_set_splice(cfg.splice, cfg.splice_hash);
+	fx_set_rename_noreplace(cfg.rename_noreplace);
+	fx_set_done_marker(cfg.done_marker);
+	fx_set_compression(cfg.compression);
+	fx_set_delta(cfg.delta);
+	fx_set_chunk_store(cfg.chunk_store);
+	fx_set_file_cache((cfg.file_cache_mb > 0) ? (unsigned long long)cfg.file_cache_mb << 20 : 0);
+	fx_set_zerocopy(cfg.zerocopy);
+
+	fx_add_filelist(cfg.filelist);	// Read filelist from configuration file
+
+	// Make the process ignore SIGPIPE signal to have read and write return -1 on errors
+	signal(SIGPIPE, SIG_IGN);
+
+	main_loop= g_main_loop_new(NULL, FALSE);
+	g_unix_signal_add(SIGINT, on_signal_stop, NULL);
+	g_unix_signal_add(SIGTERM, on_signal_stop, NULL);
+	g_unix_signal_add(SIGHUP, on_signal_reload, NULL);
+	g_unix_signal_add(SIGUSR1, on_signal_stats, NULL);
+
+	if ((cfg.mport <= 0) || (cfg.mport > 32767)) {
+		fx_log("Invalid multicast port number in the configuration\n");
+		g_main_loop_unref(main_loop);
+		return 1;
+	}
+	fx_set_mcast_interfaces(cfg.mcast_interfaces);
+	fx_set_tcp_backlog(cfg.tcp_backlog);
+	fx_set_tcp_acceptors(cfg.tcp_acceptors);
+	fx_set_io_scheduler(cfg.io_scheduler, cfg.io_slots);
+	if (!fx_start(cfg.ipv4, cfg.ipv6, (unsigned short)cfg.mport)) {
+		g_main_loop_unref(main_loop);
+		return 1;
+	}
+	fx_metrics_listen(cfg.metrics_socket);
+	// Infinite loop handled by GLib
+	g_main_loop_run(main_loop);
+
+	fx_metrics_listen(NULL);
+	fx_stop();
+	g_main_loop_unref(main_loop);
+	return 0;
+}
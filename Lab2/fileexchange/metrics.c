@@ -0,0 +1,329 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * metrics.c
+ *
+ * Engine metrics and their exposition in a local Unix socket, in the
+ *   Prometheus text format
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#define _GNU_SOURCE		// accept4
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "fileexchange.h"
+#include "metrics.h"
+#include "host.h"
+#include "sock.h"
+
+
+#define METRIC_SHARDS	32		// Counter blocks; threads share them round-robin beyond this
+#define HIST_SUB_BITS	4		// 16 sub-buckets per power of two
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	((64 - HIST_SUB_BITS + 1)*HIST_SUB)
+#define METRICS_RETRY	100		// Wait before accepting clients again without resources (ms)
+
+
+// Counters of one thread, in their own cache line(s)
+typedef struct {
+	unsigned long long v[MC_COUNTERS];
+} __attribute__((aligned(64))) Counter_Shard;
+
+// Histogram with log-linear buckets
+typedef struct {
+	unsigned long long count, sum, max;
+	unsigned long long b[HIST_BUCKETS];
+} Histogram;
+
+static Counter_Shard shards[METRIC_SHARDS];
+static unsigned next_shard= 0;
+static __thread int my_shard= -1;
+static long long gauges[MG_GAUGES];
+static Histogram hists[MH_HISTOGRAMS];
+
+static const struct { const char *name, *help; } counter_info[MC_COUNTERS]= {
+	{ "fx_queries_received_total", "QUERYs received" },
+	{ "fx_queries_answered_total", "QUERYs answered with a HIT" },
+	{ "fx_queries_dropped_total", "QUERYs invalid or for files not shared" },
+	{ "fx_hits_received_total", "HITs received" },
+	{ "fx_searches_received_total", "SEARCHs received" },
+	{ "fx_bytes_sent_total", "File bytes sent" },
+	{ "fx_bytes_received_total", "File bytes received" },
+	{ "fx_transfers_started_total", "Transfers started" },
+	{ "fx_file_cache_hits_total", "Files sent from the file cache" },
+	{ "fx_file_cache_misses_total", "Files small enough for the file cache read from disk" },
+	{ "fx_file_cache_bytes_total", "File bytes sent from the file cache" },
+	{ "fx_zerocopy_sends_total", "Files sent with MSG_ZEROCOPY" },
+	{ "fx_zerocopy_copied_total", "Zerocopy sends that the kernel copied" },
+	{ "fx_delta_copied_bytes_total", "File bytes copied from the local copy in delta downloads" },
+	{ "fx_chunk_dedup_bytes_total", "File bytes read from the chunk store in chunked downloads" },
+};
+static const struct { const char *name, *help; } gauge_info[MG_GAUGES]= {
+	{ "fx_transfers_active", "Transfers running" },
+	{ "fx_hash_backlog", "Files waiting to be hashed" },
+};
+static const struct { const char *name, *help; } hist_info[MH_HISTOGRAMS]= {
+	{ "fx_hit_latency_us", "Time from QUERY to the first HIT in microseconds" },
+	{ "fx_transfer_kbps", "Throughput of each transfer in KB/s" },
+	{ "fx_lookup_ns", "File table lookup time of sampled QUERYs in nanoseconds" },
+	{ "fx_hash_us", "Time hashing each shared file in microseconds" },
+};
+
+// Exposition socket
+static int msock= -1;
+static guint mchan_id;			// 0 while it waits for resources
+static GIOChannel *mchan= NULL;
+static char *mpath= NULL;
+static guint mretry_id= 0;		// Timer that restores the callback
+
+
+/** Add 'v' to counter 'c' - each thread gets its own block of counters */
+void metric_add(Metric_Counter c, unsigned long long v) {
+	if (my_shard < 0)
+		my_shard= __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRIC_SHARDS;
+	// Atomic only because threads may share a block after METRIC_SHARDS threads
+	__atomic_fetch_add(&shards[my_shard].v[c], v, __ATOMIC_RELAXED);
+}
+
+
+/** Add 'v' to gauge 'g' */
+void metric_gauge_add(Metric_Gauge g, long long v) {
+	__atomic_fetch_add(&gauges[g], v, __ATOMIC_RELAXED);
+}
+
+
+/** Return the bucket of value 'v': values below HIST_SUB have their own bucket;
+ *   the others are split in HIST_SUB buckets per power of two */
+static inline int hist_bucket(unsigned long long v) {
+	if (v < HIST_SUB)
+		return (int)v;
+	int m= 63 - __builtin_clzll(v);		// m >= HIST_SUB_BITS
+	return (m - HIST_SUB_BITS + 1)*HIST_SUB + (int)((v >> (m - HIST_SUB_BITS)) & (HIST_SUB-1));
+}
+
+
+/** Return the highest value in bucket 'i' */
+static unsigned long long hist_bucket_max(int i) {
+	if (i < HIST_SUB)
+		return i;
+	int m= i/HIST_SUB + HIST_SUB_BITS - 1;
+	unsigned long long low= (unsigned long long)(HIST_SUB + i%HIST_SUB) << (m - HIST_SUB_BITS);
+	return low + (1ULL << (m - HIST_SUB_BITS)) - 1;
+}
+
+
+/** Record value 'v' in histogram 'h' */
+void metric_observe(Metric_Histogram h, unsigned long long v) {
+	Histogram *hg= &hists[h];
+	unsigned long long max= __atomic_load_n(&hg->max, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&hg->b[hist_bucket(v)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hg->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hg->sum, v, __ATOMIC_RELAXED);
+	while ((v > max) && !__atomic_compare_exchange_n(&hg->max, &max, v, TRUE,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+
+/** Return the value of quantile 'q' of histogram 'hg', given the bucket copy 'b' and 'count' */
+static unsigned long long hist_quantile(const unsigned long long *b, unsigned long long count,
+		unsigned long long max, double q) {
+	unsigned long long rank= (unsigned long long)(q*count + 0.5), acc= 0;
+	int i;
+
+	if (rank == 0)
+		rank= 1;
+	for (i= 0; i < HIST_BUCKETS; i++) {
+		acc += b[i];
+		if (acc >= rank) {
+			unsigned long long v= hist_bucket_max(i);
+			return (v > max) ? max : v;
+		}
+	}
+	return max;
+}
+
+
+/** Return the metrics in the Prometheus text format; the string must be freed with g_free */
+char *fx_metrics_text(void) {
+	static const double quantiles[]= { 0.5, 0.9, 0.99 };
+	static unsigned long long b[HIST_BUCKETS];
+	static GMutex mutex;		// Protects 'b'
+	GString *out= g_string_sized_new(4096);
+	int i, j, k;
+
+	for (i= 0; i < MC_COUNTERS; i++) {
+		unsigned long long v= 0;
+		for (j= 0; j < METRIC_SHARDS; j++)
+			v += __atomic_load_n(&shards[j].v[i], __ATOMIC_RELAXED);
+		g_string_append_printf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_info[i].name,
+				counter_info[i].help, counter_info[i].name, counter_info[i].name, v);
+	}
+	for (i= 0; i < MG_GAUGES; i++)
+		g_string_append_printf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gauge_info[i].name,
+				gauge_info[i].help, gauge_info[i].name, gauge_info[i].name,
+				__atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+	g_mutex_lock(&mutex);
+	for (i= 0; i < MH_HISTOGRAMS; i++) {
+		Histogram *hg= &hists[i];
+		const char *name= hist_info[i].name;
+		unsigned long long count= 0;
+		// The buckets are the reference - count and sum may be slightly ahead of them
+		for (k= 0; k < HIST_BUCKETS; k++)
+			count += (b[k]= __atomic_load_n(&hg->b[k], __ATOMIC_RELAXED));
+		unsigned long long max= __atomic_load_n(&hg->max, __ATOMIC_RELAXED);
+		g_string_append_printf(out, "# HELP %s %s\n# TYPE %s summary\n", name, hist_info[i].help, name);
+		for (j= 0; j < (int)(sizeof(quantiles)/sizeof(quantiles[0])); j++)
+			g_string_append_printf(out, "%s{quantile=\"%g\"} %llu\n", name, quantiles[j],
+					count ? hist_quantile(b, count, max, quantiles[j]) : 0);
+		g_string_append_printf(out, "%s_max %llu\n%s_sum %llu\n%s_count %llu\n", name, max,
+				name, __atomic_load_n(&hg->sum, __ATOMIC_RELAXED), name, count);
+	}
+	g_mutex_unlock(&mutex);
+	return g_string_free(out, FALSE);
+}
+
+
+/** Close the metrics socket; 'in_callback' is TRUE when the callback returns FALSE,
+ *   removing itself from the main loop */
+static void close_metrics_socket(gboolean in_callback) {
+	if (msock < 0)
+		return;
+	if (mretry_id != 0) {
+		g_source_remove(mretry_id);
+		mretry_id= 0;
+	}
+	if (in_callback || (mchan_id == 0))
+		free_gio_channel(mchan);
+	else
+		remove_socket_from_mainloop(msock, mchan_id, mchan);
+	mchan= NULL;
+	mchan_id= 0;
+	close(msock);
+	msock= -1;
+	unlink(mpath);
+	g_free(mpath);
+	mpath= NULL;
+}
+
+
+static gboolean callback_metrics(GIOChannel *source, GIOCondition condition, gpointer data);
+
+/** Timer callback: restore the callback of the metrics socket after METRICS_RETRY */
+static gboolean callback_metrics_retry(gpointer data) {
+	mretry_id= 0;
+	if ((msock >= 0) && !restore_socket_in_mainloop(msock, NULL, &mchan_id, mchan, G_IO_IN,
+			callback_metrics)) {
+		Log("Failed restoring the metrics socket in the main loop\n");
+		close_metrics_socket(TRUE);		// Without a watch, like in the callback
+	}
+	return FALSE;
+}
+
+
+/** Callback of the metrics socket: write the metrics to each client and close it
+ *   Clients are non-blocking: one that does not read the text is dropped, instead of
+ *   blocking the main loop */
+static gboolean callback_metrics(GIOChannel *source, GIOCondition condition, gpointer data) {
+	if (condition != G_IO_IN) {
+		Log("Detected error in the metrics socket\n");
+		close_metrics_socket(TRUE);
+		return FALSE;
+	}
+	int s= accept4(msock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (s < 0) {
+		switch (errno) {
+		case EINTR:
+		case EAGAIN:
+		case ECONNABORTED:
+			return TRUE;
+		case EMFILE:
+		case ENFILE:
+		case ENOBUFS:
+		case ENOMEM:
+			// The client waits in the queue, which would wake up the callback at once
+			mchan_id= 0;
+			mretry_id= g_timeout_add(METRICS_RETRY, callback_metrics_retry, NULL);
+			return FALSE;	// Restored by callback_metrics_retry
+		default:
+			LOGF(FX_LOG_ERROR, "Metrics socket failed: %s\n", strerror(errno));
+			close_metrics_socket(TRUE);
+			return FALSE;
+		}
+	}
+	char *text= fx_metrics_text();
+	size_t len= strlen(text), sent= 0;
+	while (sent < len) {
+		ssize_t n= write(s, text+sent, len-sent);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				LOGF(FX_LOG_WARNING, "Metrics client not reading - dropped after %zu of %zu bytes\n",
+						sent, len);
+			break;
+		}
+		sent += n;
+	}
+	g_free(text);
+	close(s);
+	return TRUE;
+}
+
+
+/** Expose the metrics in the Unix socket 'path' (NULL closes it)
+ *   Each connection receives the metrics and is closed: socat - UNIX-CONNECT:path */
+gboolean fx_metrics_listen(const char *path) {
+	struct sockaddr_un addr;
+	struct stat st;
+	char tmp_buf[200];
+
+	close_metrics_socket(FALSE);
+	if ((path == NULL) || (strlen(path) == 0))
+		return TRUE;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		Log("Metrics socket path too long\n");
+		return FALSE;
+	}
+	// Only a socket left by a previous run is replaced - never other files
+	if (!lstat(path, &st) && !S_ISSOCK(st.st_mode)) {
+		LOGF(FX_LOG_ERROR, "Metrics socket '%s' exists and is not a socket\n", path);
+		return FALSE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family= AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((msock= socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("Metrics socket creation");
+		return FALSE;
+	}
+	unlink(path);		// Left by a previous run, or no file
+	if (bind(msock, (struct sockaddr *)&addr, sizeof(addr)) || listen(msock, 5)) {
+		snprintf(tmp_buf, sizeof(tmp_buf), "Failed binding the metrics socket '%s': %s\n", path,
+				strerror(errno));
+		Log(tmp_buf);
+		close(msock);
+		msock= -1;
+		return FALSE;
+	}
+	if (!put_socket_in_mainloop(msock, NULL, &mchan_id, &mchan, G_IO_IN, callback_metrics)) {
+		Log("Failed registration of the metrics socket in the main loop\n");
+		close(msock);
+		msock= -1;
+		unlink(path);
+		return FALSE;
+	}
+	mpath= g_strdup(path);
+	snprintf(tmp_buf, sizeof(tmp_buf), "Metrics available at '%s'\n", path);
+	Log(tmp_buf);
+	return TRUE;
+}
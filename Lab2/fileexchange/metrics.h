@@ -0,0 +1,74 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * metrics.h
+ *
+ * Header file of the engine metrics: counters, gauges and histograms updated
+ *   without locks by the main loop and the transfer threads.
+ *   Counters are kept per thread (one cache line per thread) and summed when read;
+ *   histograms have log-linear buckets, with a relative error below 1/16.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_METRICS_H_
+#define _INCL_METRICS_H_
+
+#include <glib.h>
+#include <time.h>
+
+
+// Counters
+typedef enum {
+	MC_QUERIES_RECEIVED,	// QUERYs received
+	MC_QUERIES_ANSWERED,	// QUERYs answered with a HIT
+	MC_QUERIES_DROPPED,		// QUERYs invalid or for files not shared
+	MC_HITS_RECEIVED,		// Valid HITs received
+	MC_SEARCHES_RECEIVED,	// SEARCHs received
+	MC_BYTES_SENT,			// File bytes sent
+	MC_BYTES_RECEIVED,		// File bytes received
+	MC_TRANSFERS_STARTED,	// Transfers started
+	MC_FILE_CACHE_HITS,		// Files sent from the file cache
+	MC_FILE_CACHE_MISSES,	// Files small enough for the file cache read from disk
+	MC_FILE_CACHE_BYTES,	// File bytes sent from the file cache
+	MC_ZEROCOPY_SENDS,		// Files sent with MSG_ZEROCOPY
+	MC_ZEROCOPY_COPIED,		// Zerocopy sends that the kernel copied
+	MC_DELTA_COPIED_BYTES,	// File bytes copied from the local copy in delta downloads
+	MC_CHUNK_DEDUP_BYTES,	// File bytes read from the chunk store in chunked downloads
+	MC_COUNTERS
+} Metric_Counter;
+
+// Gauges
+typedef enum {
+	MG_TRANSFERS_ACTIVE,	// Transfers running
+	MG_HASH_BACKLOG,		// Files waiting to be hashed
+	MG_GAUGES
+} Metric_Gauge;
+
+// Histograms
+typedef enum {
+	MH_HIT_LATENCY_US,		// Time from QUERY to the first HIT (us)
+	MH_TRANSFER_KBPS,		// Throughput of each transfer (KB/s)
+	MH_LOOKUP_NS,			// File table lookup time of sampled QUERYs (ns)
+	MH_HASH_US,				// Time hashing each shared file (us)
+	MH_HISTOGRAMS
+} Metric_Histogram;
+
+
+// Add 'v' to counter 'c'
+void metric_add(Metric_Counter c, unsigned long long v);
+
+// Add 'v' (may be negative) to gauge 'g'
+void metric_gauge_add(Metric_Gauge g, long long v);
+
+// Record value 'v' in histogram 'h'
+void metric_observe(Metric_Histogram h, unsigned long long v);
+
+// Return the current time in nanoseconds
+static inline long long metric_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+#endif
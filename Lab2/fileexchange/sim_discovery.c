@@ -0,0 +1,365 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * sim_discovery.c
+ *
+ * Discovery simulator: N virtual peers in one process answer QUERYs
+ *   Usage: sim_discovery [-p peers] [-f files] [-r replicas] [-q queries] [-x miss ratio]
+ *                        [-w window] [-t threads] [-g group] [-P port] [-s seed]
+ *     -p  virtual peers (default 256)
+ *     -f  files shared by each peer (default 100)
+ *     -r  peers sharing each file (default 3)
+ *     -q  QUERYs sent (default 1000)
+ *     -x  fraction of QUERYs for files no peer has (default 0.1)
+ *     -w  time waiting for the HITs of each QUERY, in ms (default 50)
+ *     -t  threads answering QUERYs (default 4)
+ *     -g  IPv6 multicast group joined by all peers on the loopback interface;
+ *         (needs 'ip link set lo multicast on'); without it the QUERYs are sent
+ *         by unicast to every peer in [::1]
+ *     -P  multicast port (default 20000)
+ *     -s  random seed (default 1)
+ *   Each peer has its own file table and UDP socket and answers with answer_query,
+ *   like handle_Query does in fileexchange. The driver writes the QUERYs with
+ *   write_query_message and reads the HITs with read_hit_message; it does not use
+ *   handle_Hit, which would start the downloads.
+ *   Prints one line with the QUERY->first HIT latency percentiles, the HITs per QUERY
+ *   and the CPU time of the process (driver and peers) per QUERY.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include "fileexchange.h"
+#include "filetable.h"
+#include "callbacks.h"
+#include "callbacks_socket.h"
+#include "sock.h"
+
+
+#define EPOLL_EVENTS	64				// Events read by each epoll_wait
+#define PEER_TPORT		10000			// TCP port announced by peer 0 in the HITs
+
+
+// Virtual peer
+typedef struct Peer {
+	int s;					// UDP socket
+	unsigned short port;	// Port of the socket (unicast mode)
+	File_Table ft;			// Shared files
+} Peer;
+
+static Peer *peers;
+static int npeers= 256;
+static int nthreads= 4;
+static volatile gboolean running= TRUE;
+
+
+// Return the current time in nanoseconds
+static inline long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+
+// Return the CPU time used by the process (user+system), in seconds
+static double cpu_s(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)/1e6;
+}
+
+
+// Engine log and g_print go to stderr, keeping stdout for the results
+static void sim_log(void *ctx, int level, const char *msg) {
+}
+
+static void print_stderr(const gchar *msg) {
+	fputs(msg, stderr);
+}
+
+
+// Answer the QUERYs received by the peers registered in 'epfd'
+//   Each peer belongs to one thread, so its file table statistics are not shared
+static void *peer_thread(void *ptr) {
+	int epfd= (int)(long)ptr;
+	struct epoll_event ev[EPOLL_EVENTS];
+	char buf[MESSAGE_MAX_LENGTH], hbuf[MESSAGE_MAX_LENGTH];
+	struct sockaddr_in6 from;
+	socklen_t len;
+	uint32_t seq;
+	const char *fname;
+	int i, n, m, hlen;
+
+	while (running) {
+		if ((n= epoll_wait(epfd, ev, EPOLL_EVENTS, 100)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return NULL;
+		}
+		for (i= 0; i < n; i++) {
+			Peer *p= (Peer *)ev[i].data.ptr;
+			// Drain the socket - it is edge triggered
+			for (;;) {
+				len= sizeof(from);
+				m= recvfrom(p->s, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &len);
+				if (m < 0)
+					break;
+				if (!read_query_message(buf, m, &seq, &fname))
+					continue;
+				if (answer_query(&p->ft, seq, fname, (struct in6_addr *)&in6addr_loopback,
+						PEER_TPORT + (p-peers), hbuf, &hlen))
+					sendto(p->s, hbuf, hlen, 0, (struct sockaddr *)&from, len);
+			}
+		}
+	}
+	return NULL;
+}
+
+
+// Create the peer sockets and the threads answering them
+static gboolean start_peers(const char *group, unsigned short mport) {
+	struct ipv6_mreq imr;
+	pthread_t tid;
+	int i, *epfd;
+
+	if (group != NULL) {
+		if (!get_IPv6(group, &imr.ipv6mr_multiaddr))
+			return FALSE;
+		imr.ipv6mr_interface= if_nametoindex("lo");
+	}
+	epfd= (int *)malloc(nthreads*sizeof(int));
+	for (i= 0; i < nthreads; i++)
+		if ((epfd[i]= epoll_create1(0)) < 0) {
+			perror("epoll_create1");
+			return FALSE;
+		}
+	for (i= 0; i < npeers; i++) {
+		Peer *p= &peers[i];
+		p->s= init_socket_ipv6(SOCK_DGRAM, (group != NULL) ? mport : 0, group != NULL);
+		if (p->s < 0) {
+			fprintf(stderr, "Failed creating the socket of peer %d - raise the open file limit\n", i);
+			return FALSE;
+		}
+		if ((group != NULL) && setsockopt(p->s, IPPROTO_IPV6, IPV6_JOIN_GROUP, &imr, sizeof(imr))) {
+			perror("Failed association to IPv6 multicast group");
+			return FALSE;
+		}
+		p->port= get_portnumber(p->s);
+		struct epoll_event ev= { .events= EPOLLIN | EPOLLET, .data.ptr= p };
+		epoll_ctl(epfd[i % nthreads], EPOLL_CTL_ADD, p->s, &ev);
+	}
+	for (i= 0; i < nthreads; i++)
+		if (pthread_create(&tid, NULL, peer_thread, (void *)(long)epfd[i])) {
+			perror("pthread_create");
+			return FALSE;
+		} else
+			pthread_detach(tid);
+	free(epfd);
+	return TRUE;
+}
+
+
+// Share 'files' files in each peer; each file is shared by 'replicas' peers
+//   File 'i' is shared by peers i, i+step, i+2*step, ... (mod npeers)
+static void fill_peers(int files, int replicas) {
+	char name[80];
+	unsigned i, nnames= (unsigned)((long long)npeers*files/replicas);
+	int j, step= npeers/replicas;
+
+	for (i= 0; i < nnames; i++)
+		for (j= 0; j < replicas; j++) {
+			int k= (i + j*step) % npeers;
+			snprintf(name, sizeof(name), "/sim/%d/file%07u.dat", k, i);
+			ft_add(&peers[k].ft, name, 1000 + i, i*2654435761u);
+		}
+}
+
+
+static int cmp_double(const void *a, const void *b) {
+	double x= *(const double *)a, y= *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+// Return the percentile 'p' of the sorted values
+static double percentile(const double *v, int n, double p) {
+	int i= (int)(p*n + 0.999999) - 1;
+	return (n == 0) ? 0 : v[(i < 0) ? 0 : i];
+}
+
+
+// Raise the open file limit to the hard limit - each peer uses one socket
+static void raise_nofile(void) {
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur= rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+
+int main(int argc, char *argv[]) {
+	int files= 100, replicas= 3, nqueries= 1000, window_ms= 50;
+	double miss= 0.1;
+	const char *group= NULL;
+	unsigned short mport= 20000;
+	unsigned seed= 1;
+	char qbuf[MESSAGE_MAX_LENGTH], buf[MESSAGE_MAX_LENGTH], qname[80];
+	int c, i, q, qlen, s;
+
+	while ((c= getopt(argc, argv, "p:f:r:q:x:w:t:g:P:s:")) != -1) {
+		switch (c) {
+		case 'p': npeers= atoi(optarg); break;
+		case 'f': files= atoi(optarg); break;
+		case 'r': replicas= atoi(optarg); break;
+		case 'q': nqueries= atoi(optarg); break;
+		case 'x': miss= atof(optarg); break;
+		case 'w': window_ms= atoi(optarg); break;
+		case 't': nthreads= atoi(optarg); break;
+		case 'g': group= optarg; break;
+		case 'P': mport= (unsigned short)atoi(optarg); break;
+		case 's': seed= (unsigned)atoi(optarg); break;
+		default:
+			npeers= 0;
+		}
+	}
+	if ((npeers <= 0) || (files <= 0) || (replicas <= 0) || (replicas > npeers) || (nqueries <= 0)
+			|| (window_ms <= 0) || (nthreads <= 0) || (miss < 0) || (miss > 1)) {
+		fprintf(stderr, "Usage: %s [-p peers] [-f files] [-r replicas] [-q queries] [-x miss ratio] "
+				"[-w window] [-t threads] [-g group] [-P port] [-s seed]\n", argv[0]);
+		return 1;
+	}
+
+	Fx_Callbacks cb= { .log= sim_log };
+	fx_init(&cb);
+	g_set_print_handler(print_stderr);
+	raise_nofile();
+	srandom(seed);
+
+	peers= (Peer *)calloc(npeers, sizeof(Peer));
+	for (i= 0; i < npeers; i++)
+		ft_init(&peers[i].ft);
+	fill_peers(files, replicas);
+	if (!start_peers(group, mport))
+		return 1;
+
+	// Driver socket
+	if ((s= init_socket_ipv6(SOCK_DGRAM, 0, FALSE)) < 0)
+		return 1;
+	if (group != NULL) {
+		unsigned ifindex= if_nametoindex("lo");
+		int loop= 1;
+		setsockopt(s, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex));
+		setsockopt(s, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
+	}
+	struct sockaddr_in6 dst= { .sin6_family= AF_INET6, .sin6_addr= in6addr_loopback };
+	if (group != NULL) {
+		get_IPv6(group, &dst.sin6_addr);
+		dst.sin6_port= htons(mport);
+	}
+
+	unsigned nnames= (unsigned)((long long)npeers*files/replicas);
+	double *lat= (double *)malloc(nqueries*sizeof(double));
+	int nlat= 0, expected_q= 0;
+	long long hits= 0, missing= 0, false_hits= 0, stale= 0;
+
+	double c0= cpu_s();
+	long long w0= now_ns();
+	for (q= 0; q < nqueries; q++) {
+		uint32_t seq= (uint32_t)q + 1;
+		gboolean exists= ((double)random()/RAND_MAX) >= miss;
+		unsigned k= (unsigned)random() % nnames;
+		snprintf(qname, sizeof(qname), exists ? "file%07u.dat" : "none%07u.dat", k);
+		int expected= exists ? replicas : 0, got= 0;
+		if (!write_query_message(qbuf, &qlen, seq, qname)) {
+			fprintf(stderr, "Failed writing QUERY\n");
+			return 1;
+		}
+
+		long long t0= now_ns(), deadline= t0 + window_ms*1000000LL, tfirst= 0;
+		if (group != NULL) {
+			if (sendto(s, qbuf, qlen, 0, (struct sockaddr *)&dst, sizeof(dst)) < 0) {
+				perror("Multicast QUERY - is the loopback interface multicast capable?");
+				return 1;
+			}
+		} else
+			for (i= 0; i < npeers; i++) {
+				dst.sin6_port= htons(peers[i].port);
+				while ((sendto(s, qbuf, qlen, 0, (struct sockaddr *)&dst, sizeof(dst)) < 0)
+						&& ((errno == EAGAIN) || (errno == ENOBUFS)))
+					sched_yield();
+			}
+
+		// Collect the HITs until all the peers with the file answered or the window ends
+		while (got < expected || expected == 0) {
+			long long now= now_ns();
+			if (now >= deadline)
+				break;
+			struct pollfd pfd= { .fd= s, .events= POLLIN };
+			if (poll(&pfd, 1, (int)((deadline-now+999999)/1000000)) <= 0)
+				continue;
+			int n= recv(s, buf, sizeof(buf), 0);
+			uint32_t hseq, fhash;
+			const char *fname;
+			unsigned long long flen;
+			unsigned short tport;
+			struct in6_addr srv;
+			if ((n <= 0) || !read_hit_message(buf, n, &hseq, &fname, &flen, &fhash, &tport, &srv))
+				continue;
+			if (hseq != seq) {
+				stale++;		// HIT that arrived after the window of its QUERY
+				continue;
+			}
+			if (got++ == 0)
+				tfirst= now_ns();
+		}
+		if (expected > 0) {
+			expected_q++;
+			hits += got;
+			missing += expected - got;
+			if (got > 0)
+				lat[nlat++]= (tfirst-t0)/1e3;
+		} else
+			false_hits += got;
+	}
+	double wall= (now_ns()-w0)/1e9;
+	double cpu= cpu_s()-c0;
+	running= FALSE;
+
+	// QUERYs rejected by the Bloom filters of the peers
+	unsigned long long pq= 0, prej= 0, pfp= 0;
+	for (i= 0; i < npeers; i++) {
+		pq += peers[i].ft.qstats.queries;
+		prej += peers[i].ft.qstats.rejected;
+		pfp += peers[i].ft.qstats.false_pos;
+	}
+
+	qsort(lat, nlat, sizeof(double), cmp_double);
+	printf("peers=%d files=%d replicas=%d mode=%s threads=%d queries=%d answered=%d "
+			"p50_us=%.1f p90_us=%.1f p99_us=%.1f max_us=%.1f hits_per_query=%.2f missing_hits=%lld "
+			"false_hits=%lld stale_hits=%lld cpu_us_per_query=%.1f queries_s=%.0f "
+			"filter_rejected=%.4f filter_fp=%llu\n",
+			npeers, files, replicas, (group != NULL) ? "multicast" : "unicast", nthreads, nqueries, nlat,
+			percentile(lat, nlat, 0.50), percentile(lat, nlat, 0.90), percentile(lat, nlat, 0.99),
+			nlat ? lat[nlat-1] : 0, expected_q ? (double)hits/expected_q : 0, missing,
+			false_hits, stale, cpu/nqueries*1e6, (wall > 0) ? nqueries/wall : 0,
+			pq ? (double)prej/pq : 0, pfp);
+	fflush(stdout);
+	free(lat);
+	close(s);
+	return 0;
+}
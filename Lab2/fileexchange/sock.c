@@ -8,6 +8,7 @@
  *
  * @author  Luis Bernardo
 \*****************************************************************************/
+#define _GNU_SOURCE		// struct in6_pktinfo
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -21,174 +22,253 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/ioctl.h>
+#include <ifaddrs.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include "sock.h"
 
 // External logging function declared elsewhere
 extern void Log(const gchar *str);
 
 
+#define MAX_LOCAL_ADDRS	64		// Maximum number of local addresses cached
+
 // Variables with local IP addresses
-static const char *devicename= NULL;
 static gboolean got_local_ip= FALSE; // Set local IP variables
 struct in_addr local_ipv4;// Local IPv4 address
 gboolean valid_local_ipv4; // TRUE if the local IPv4 address is valid
 struct in6_addr local_ipv6;// Local IPv6 address
 gboolean valid_local_ipv6; // TRUE if the local IPv6 address is valid
 
+// Cache with all the addresses of the interfaces that are up
+static Local_Addr local_addrs[MAX_LOCAL_ADDRS];
+static int n_local_addrs= 0;
 
+// Netlink socket that receives the address changes
+static int nl_sock= -1;
+static guint nl_chan_id;
+static GIOChannel *nl_chan= NULL;
 
-// Set the contents of the variables with the local IP addresses
-void set_local_IP() {
-  if (!got_local_ip) {
-    valid_local_ipv4= init_local_ipv4(&local_ipv4);
-    valid_local_ipv6= init_local_ipv6(&local_ipv6);
-    got_local_ip= TRUE;
-  }
-}
 
-// Get the local network device name
-static const char *get_device_name() {
-	static char buf[100];
-	if (system(
-		"ip link show | grep -v LOOPBACK | grep BROADCAST | awk '{ print $2 }' | sed '$ s/.$//' > /tmp/lixo0123456789.txt")<0)
-		return NULL;
-	FILE *fd = fopen("/tmp/lixo0123456789.txt", "r");
-	char *pt= fgets(buf,100,fd);
-	if (pt != NULL) {
-		pt[strlen(pt)-1]='\0';	// Remove pending '\n'
+
+// Read all the addresses of the interfaces that are up to the cache
+static void load_local_addresses(void) {
+	struct ifaddrs *ifa_list, *ifa;
+
+	n_local_addrs= 0;
+	if (getifaddrs(&ifa_list)) {
+		perror("getifaddrs");
+		return;
 	}
-	fclose(fd);
-	unlink("/tmp/lixo0123456789.txt");
-
-	return pt;
-}
-
-// Get the local IPv4 address (device dev) using "ioctl" command
-static gboolean get_local_ipv4name_using_ioctl(const char *dev,
-		struct in_addr *addr) {
-	struct ifreq req;
-	int fd;
-	assert((dev!=NULL) && (addr!=NULL));
-	fd = socket(AF_INET, SOCK_DGRAM, 0);
-	strcpy(req.ifr_name, dev);
-	req.ifr_addr.sa_family = AF_INET;
-	if (ioctl(fd, SIOCGIFADDR, &req) < 0) {
-		perror("getting local IP address");
-		close(fd);
-		return FALSE;
+	for (ifa= ifa_list; (ifa != NULL) && (n_local_addrs < MAX_LOCAL_ADDRS); ifa= ifa->ifa_next) {
+		if ((ifa->ifa_addr == NULL) || !(ifa->ifa_flags & IFF_UP))
+			continue;
+		Local_Addr *la= &local_addrs[n_local_addrs];
+		if (ifa->ifa_addr->sa_family == AF_INET) {
+			// Stored as ::ffff:a.b.c.d
+			memset(&la->ip, 0, sizeof(la->ip));
+			la->ip.s6_addr[10]= la->ip.s6_addr[11]= 0xff;
+			memcpy(&la->ip.s6_addr[12], &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr, 4);
+		} else if (ifa->ifa_addr->sa_family == AF_INET6) {
+			memcpy(&la->ip, &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr, sizeof(la->ip));
+		} else
+			continue;
+		la->family= ifa->ifa_addr->sa_family;
+		la->ifindex= if_nametoindex(ifa->ifa_name);
+		la->flags= ifa->ifa_flags;
+		n_local_addrs++;
 	}
-	close(fd);
-	struct sockaddr_in *pt = (struct sockaddr_in *) &req.ifr_ifru.ifru_addr;
-	memcpy(addr, &(pt->sin_addr), 4);
-	return TRUE;
+	freeifaddrs(ifa_list);
 }
 
-// Get the local IPv4 address (device dev) using command "ifconfig"
-static gboolean get_local_ipv4name_using_ifconfig(char *buf, int buf_len) {
-	if (system("/sbin/ifconfig | grep -w inet | grep broadcast | head -1 | awk '{ print $2 }' | sed 's/addr\\://' > /tmp/lixo0123456789.txt")
-			< 0)
-		return FALSE;
-	FILE *fd = fopen("/tmp/lixo0123456789.txt", "r");
-	int n = fread(buf, 1, buf_len, fd);
-	buf[n - 1] = '\0';
-	fclose(fd);
-	unlink("/tmp/lixo0123456789.txt");
+// Return the address advertised for 'family': the first address of an interface that is
+//   not the loopback, preferring broadcast interfaces (IPv4) or global addresses (IPv6)
+static Local_Addr *choose_local_address(int family) {
+	Local_Addr *best= NULL;
+	int i;
+
+	for (i= 0; i < n_local_addrs; i++) {
+		Local_Addr *la= &local_addrs[i];
+		if ((la->family != family) || (la->flags & IFF_LOOPBACK))
+			continue;
+		if (family == AF_INET6) {
+			if (IN6_IS_ADDR_LINKLOCAL(&la->ip))
+				continue;	// Needs the scope id
+			return la;
+		}
+		if (la->flags & IFF_BROADCAST)
+			return la;
+		if (best == NULL)
+			best= la;
+	}
+	return best;
+}
 
-	if (n <= 0)
-		return FALSE;
-	if (n >= 256)
-		return FALSE;
-	return TRUE;
+// Read the local addresses again and update the addresses advertised
+void refresh_local_IP(void) {
+	char tmp_buf[120];
+	Local_Addr *la;
+	struct in_addr old_ipv4= local_ipv4;
+	struct in6_addr old_ipv6= local_ipv6;
+
+	load_local_addresses();
+	if ((la= choose_local_address(AF_INET)) != NULL)
+		memcpy(&local_ipv4, &la->ip.s6_addr[12], 4);
+	else {
+		if (!got_local_ip)
+			Log("This machine does not have an IPv4 address\n");
+		inet_pton(AF_INET, "127.0.0.1", &local_ipv4);
+	}
+	if ((la= choose_local_address(AF_INET6)) != NULL)
+		memcpy(&local_ipv6, &la->ip, sizeof(local_ipv6));
+	else {
+		if (!got_local_ip)
+			Log("This machine does not have an IPv6 global address\n");
+		inet_pton(AF_INET6, "::1", &local_ipv6);
+	}
+	valid_local_ipv4= valid_local_ipv6= TRUE;
+	if (!got_local_ip || memcmp(&old_ipv4, &local_ipv4, sizeof(old_ipv4))
+			|| memcmp(&old_ipv6, &local_ipv6, sizeof(old_ipv6))) {
+		snprintf(tmp_buf, sizeof(tmp_buf), "Local addresses: %s", addr_ipv4(&local_ipv4));
+		snprintf(tmp_buf+strlen(tmp_buf), sizeof(tmp_buf)-strlen(tmp_buf), " and %s (%d cached)\n",
+				addr_ipv6(&local_ipv6), n_local_addrs);
+		Log(tmp_buf);
+	}
+	got_local_ip= TRUE;
+}
+
+// Set the contents of the variables with the local IP addresses
+void set_local_IP() {
+  if (!got_local_ip)
+    refresh_local_IP();
 }
 
 // Get local IPv4 address
 gboolean init_local_ipv4(struct in_addr *ip) {
-	char name[265];
-	struct hostent *hp;
+	assert(ip != NULL);
+	set_local_IP();
+	memcpy(ip, &local_ipv4, sizeof(struct in_addr));
+	return valid_local_ipv4;
+}
 
+// Get the local IPv6 address
+gboolean init_local_ipv6(struct in6_addr *ip) {
 	assert(ip != NULL);
-	devicename= get_device_name();
-	if (devicename != NULL) {
-		printf("device name='%s'\n",devicename);
-		if (get_local_ipv4name_using_ioctl(devicename, ip))
-			return TRUE;
-	} else {
-		Log("no device name found\n");
-	}
-	if (!get_local_ipv4name_using_ifconfig(name, sizeof(name)))
-		if (gethostname(name, 256)) {
-			Log("Failed to get the machine's name\n");
-			return FALSE;
+	set_local_IP();
+	memcpy(ip, &local_ipv6, sizeof(struct in6_addr));
+	return valid_local_ipv6;
+}
+
+// Get the address of 'family' of interface 'ifindex' (IPv4 as ::ffff:a.b.c.d), preferring
+//   global addresses. Returns FALSE if the interface has none
+gboolean get_interface_address(unsigned ifindex, int family, struct in6_addr *ip) {
+	const Local_Addr *found= NULL;
+	int i;
+
+	assert(ip != NULL);
+	set_local_IP();
+	if (ifindex == 0)
+		return FALSE;
+	for (i= 0; i < n_local_addrs; i++) {
+		const Local_Addr *la= &local_addrs[i];
+		if ((la->ifindex != ifindex) || (la->family != family))
+			continue;
+		if ((family == AF_INET) || !IN6_IS_ADDR_LINKLOCAL(&la->ip)) {
+			found= la;
+			break;
 		}
-	printf("Local name = %s\n", name);
-	hp = gethostbyname2(name, AF_INET);
-	if (hp == 0) {
-		Log("This machine does not have an IPv4 address\n");
-		inet_pton(AF_INET, "127.0.0.1", ip);
-		return TRUE;
 	}
-	assert(hp->h_length == 4);
-	bcopy(hp->h_addr, ip, hp->h_length);
+	if (found == NULL)
+		return FALSE;
+	memcpy(ip, &found->ip, sizeof(struct in6_addr));
 	return TRUE;
 }
 
-/*
- The ioctl SIOCGIFADDR works fine for v4 but usually returns EINVAL for v6.
- */
+// Return the cached local addresses, and their number in 'n'
+const Local_Addr *get_local_addresses(int *n) {
+	assert(n != NULL);
+	set_local_IP();
+	*n= n_local_addrs;
+	return local_addrs;
+}
 
-// Get the local IPv6 address (device dev) using command "ifconfig"
-static gboolean get_local_ipv6name_using_ifconfig(const char *dev, char *buf,
-		int buf_len) {
-	if (system("/sbin/ifconfig | grep inet6 | grep -i 'global' | head -1 | awk '{ print $2 }' > /tmp/lixo0123456789.txt")
-				< 0)
-		return FALSE;
-	FILE *fd = fopen("/tmp/lixo0123456789.txt", "r");
-	int n = fread(buf, 1, buf_len, fd);
-	fclose(fd);
-	unlink("/tmp/lixo0123456789.txt");
 
-	if (n <= 0)
-		return FALSE;
-	if (n >= 256)
-		return FALSE;
-	char *p = strchr(buf, '\n');
-	if (p == NULL)
+// Close the netlink socket; 'in_callback' is TRUE when the callback returns FALSE
+static void close_netlink_socket(gboolean in_callback) {
+	if (nl_sock < 0)
+		return;
+	if (in_callback)
+		free_gio_channel(nl_chan);		// Also closes the socket
+	else
+		remove_socket_from_mainloop(nl_sock, nl_chan_id, nl_chan);
+	nl_chan= NULL;
+	nl_sock= -1;
+}
+
+// Callback of the netlink socket: read the addresses again when they change
+static gboolean callback_netlink(GIOChannel *source, GIOCondition condition, gpointer data) {
+	char buf[8192];
+	gboolean changed= FALSE;
+	int n;
+
+	if (condition != G_IO_IN) {
+		Log("Detected error in the netlink socket\n");
+		close_netlink_socket(TRUE);
 		return FALSE;
-	*p = '\0';
+	}
+	while ((n= recv(nl_sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		struct nlmsghdr *nh;
+		int len= n;
+		for (nh= (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh= NLMSG_NEXT(nh, len))
+			if ((nh->nlmsg_type == RTM_NEWADDR) || (nh->nlmsg_type == RTM_DELADDR))
+				changed= TRUE;
+	}
+	if ((n < 0) && (errno == ENOBUFS))
+		changed= TRUE;		// Lost events - read everything again
+	if (changed)
+		refresh_local_IP();
 	return TRUE;
 }
 
-// Get the local IPv6 address
-gboolean init_local_ipv6(struct in6_addr *ip) {
-	char name[256];
-	struct hostent *hp;
+// Start (or stop, if 'on' is FALSE) updating the local addresses when they change
+gboolean watch_local_IP(gboolean on) {
+	struct sockaddr_nl addr;
 
-	assert(ip != NULL);
-	if (devicename == NULL) {
-		Log("No network device available\n");
+	if (!on) {
+		close_netlink_socket(FALSE);
+		return TRUE;
 	}
-	if (!get_local_ipv6name_using_ifconfig(devicename, name, sizeof(name)))
-		if (gethostname(name, 256)) {
-			Log("Failed to get the machine's name\n");
-			return FALSE;
-		}
-	printf("Local name = %s\n", name);
-	hp = gethostbyname2(name, AF_INET6);
-	if (hp == 0) {
-		Log("This machine does not have an IPv6 global address\n");
-		inet_pton(AF_INET6, "::1", ip);
+	if (nl_sock >= 0)
 		return TRUE;
+	if ((nl_sock= socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+		perror("Netlink socket creation");
+		return FALSE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family= AF_NETLINK;
+	addr.nl_groups= RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(nl_sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("Netlink socket bind");
+		close(nl_sock);
+		nl_sock= -1;
+		return FALSE;
 	}
-	assert(hp->h_length == 16);
-	bcopy(hp->h_addr, ip, hp->h_length);
+	if (!put_socket_in_mainloop(nl_sock, NULL, &nl_chan_id, &nl_chan, G_IO_IN, callback_netlink)) {
+		close(nl_sock);
+		nl_sock= -1;
+		return FALSE;
+	}
+	// Addresses may have changed before the subscription
+	refresh_local_IP();
 	return TRUE;
 }
 
 
 // Return TRUE if 'ip_str' is a local address
-// BUGS: It only works for 1 address per host
 gboolean is_local_ip(const char *ip_str) {
+  struct in6_addr ip;
+  int i;
+
   assert(ip_str != NULL);
   set_local_IP();
 
@@ -196,16 +276,18 @@ gboolean is_local_ip(const char *ip_str) {
     // IPv6
     if (!strcmp(ip_str, "::1"))
       return TRUE;
-    if (valid_local_ipv6)
-      return !strcmp(ip_str, addr_ipv6(&local_ipv6));
-    return FALSE;
-  }
-  // IPv4
-  if (!strncmp("127.", ip_str, 4))
-    return TRUE;
-  if (valid_local_ipv4) {
-      return !strcmp(ip_str, addr_ipv4(&local_ipv4));
+    if (inet_pton(AF_INET6, ip_str, &ip) != 1)
+      return FALSE;
+  } else {
+    // IPv4
+    if (!strncmp("127.", ip_str, 4))
+      return TRUE;
+    if (!translate_ipv4_to_ipv6(ip_str, &ip))
+      return FALSE;
   }
+  for (i= 0; i < n_local_addrs; i++)
+    if (!memcmp(&local_addrs[i].ip, &ip, sizeof(ip)))
+      return TRUE;
   return FALSE;
 }
 
@@ -365,6 +447,44 @@ int init_socket_ipv6(int dom, int port, gboolean shared) {
 	return s;
 }
 
+// Initialize an IPv6 TCP socket listening in 'port' (0 for any), with a queue of 'backlog'
+//   pending connections; with 'reuseport' other sockets may listen in the same port
+// Return: -1 - error;  >0 - socket number
+int init_listen_socket_ipv6(int port, int backlog, gboolean reuseport) {
+	struct sockaddr_in6 name;
+	int s;
+
+	s = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (s < 0) {
+		perror("IPv6 socket creation");
+		return -1;
+	}
+	if (reuseport) {
+		int reuse = 1;
+		if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+			perror("IPv6 setsockopt SO_REUSEPORT failed");
+			close(s);
+			return -1;
+		}
+	}
+	memset(&name, 0, sizeof(name));
+	name.sin6_family = AF_INET6;
+	name.sin6_addr = in6addr_any;
+	name.sin6_port = htons((short) port);
+	if (bind(s, (struct sockaddr *) &name, sizeof(name))) {
+		perror("IPv6 port number association");
+		close(s);
+		return -1;
+	}
+	// The kernel limits 'backlog' to net.core.somaxconn
+	if (listen(s, backlog) < 0) {
+		perror("Listen failed");
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
 // Return the port number associated to a socket
 int get_portnumber(int s) {
 	struct sockaddr_in6 name;
@@ -429,6 +549,72 @@ int read_data_ipv6(int sock, char *buf, int n, struct in6_addr *ip,
 	return m;
 }
 
+// Read data from a socket with IP_PKTINFO or IPV6_RECVPKTINFO enabled
+// Returns the number of byte read (<0 in case of error), the sender's address and port
+//   in 'from', and the index of the interface where it was received in 'ifindex' (0 if unknown)
+static int read_data_pktinfo(int sock, char *buf, int n, struct sockaddr *from,
+		socklen_t fromlen, unsigned *ifindex) {
+	char cbuf[CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(struct in_pktinfo))];
+	struct iovec iov= { buf, n };
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	int m;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name= from;
+	msg.msg_namelen= fromlen;
+	msg.msg_iov= &iov;
+	msg.msg_iovlen= 1;
+	msg.msg_control= cbuf;
+	msg.msg_controllen= sizeof(cbuf);
+	*ifindex= 0;
+	if ((m = recvmsg(sock, &msg, MSG_DONTWAIT /* non blocking */)) < 0)
+		return m;
+	for (cm= CMSG_FIRSTHDR(&msg); cm != NULL; cm= CMSG_NXTHDR(&msg, cm)) {
+		if ((cm->cmsg_level == IPPROTO_IP) && (cm->cmsg_type == IP_PKTINFO))
+			*ifindex= ((struct in_pktinfo *)CMSG_DATA(cm))->ipi_ifindex;
+		else if ((cm->cmsg_level == IPPROTO_IPV6) && (cm->cmsg_type == IPV6_PKTINFO))
+			*ifindex= ((struct in6_pktinfo *)CMSG_DATA(cm))->ipi6_ifindex;
+	}
+	return m;
+}
+
+// Read data from an IPv4 socket with IP_PKTINFO enabled
+// Returns the number of byte read (<0 in case of error), the sender's address and port,
+//   and the interface where it was received
+int read_data_ipv4_if(int sock, char *buf, int n, struct in_addr *ip,
+		short unsigned int *port, unsigned *ifindex) {
+	struct sockaddr_in from;
+	int m;
+
+	assert((buf != NULL) && (n > 0) && (ip != NULL) && (port != NULL) && (ifindex != NULL));
+	if (sock < 0)
+		return -1;
+	if ((m= read_data_pktinfo(sock, buf, n, (struct sockaddr *)&from, sizeof(from), ifindex)) < 0)
+		return m;
+	*ip = from.sin_addr;
+	*port = ntohs(from.sin_port);
+	return m;
+}
+
+// Read data from an IPv6 socket with IPV6_RECVPKTINFO enabled
+// Returns the number of byte read (<0 in case of error), the sender's address and port,
+//   and the interface where it was received
+int read_data_ipv6_if(int sock, char *buf, int n, struct in6_addr *ip,
+		short unsigned int *port, unsigned *ifindex) {
+	struct sockaddr_in6 from;
+	int m;
+
+	assert((buf != NULL) && (n > 0) && (ip != NULL) && (port != NULL) && (ifindex != NULL));
+	if (sock < 0)
+		return -1;
+	if ((m= read_data_pktinfo(sock, buf, n, (struct sockaddr *)&from, sizeof(from), ifindex)) < 0)
+		return m;
+	*ip = from.sin6_addr;
+	*port = ntohs(from.sin6_port);
+	return m;
+}
+
 // Create a GIOchannel object and regist a callback function in the GIO main loop
 // event = G_IO_IN ; G_IO_OUT; G_IO_IN | G_IO_OUT
 gboolean put_socket_in_mainloop(int sock, void *ptr, guint *chan_id, GIOChannel **chan,
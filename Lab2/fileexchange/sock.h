@@ -12,7 +12,6 @@
 #define _INCL_SOCK_H_
 
 #include <netinet/in.h>
-#include <gtk/gtk.h>
 #include <glib.h>
 
 
@@ -22,6 +21,14 @@ extern gboolean valid_local_ipv4; // TRUE if the local IPv4 address is valid
 extern struct in6_addr local_ipv6;// Local IPv6 address
 extern gboolean valid_local_ipv6; // TRUE if the local IPv6 address is valid
 
+// Local address of an interface that is up
+typedef struct Local_Addr {
+	int family;			// AF_INET or AF_INET6
+	unsigned ifindex;	// Interface index
+	unsigned flags;		// Interface flags (IFF_*)
+	struct in6_addr ip;	// Address; IPv4 addresses are stored as ::ffff:a.b.c.d
+} Local_Addr;
+
 
 /* Macro to read from a buffer to a variable */
 /* pt - read pointer */
@@ -37,10 +44,14 @@ extern gboolean valid_local_ipv6; // TRUE if the local IPv6 address is valid
 
 
 void set_local_IP(); // Set the contents of the variables with the local IP addresses
-					 // BUGS: It only works for 1 address per host
+void refresh_local_IP(void); // Read the local addresses again (they are cached)
+gboolean watch_local_IP(gboolean on); // Refresh the local addresses when they change (netlink)
 gboolean init_local_ipv4(struct in_addr *ip);  //  Get local IPv4 address
 gboolean init_local_ipv6(struct in6_addr *ip);  //  Get local IPv6 address
-gboolean is_local_ip(const char *ip_str); // Return TRUE if 'ip_str' is a local address
+const Local_Addr *get_local_addresses(int *n); // Return the cached local addresses (number in 'n')
+// Get the address of 'family' of interface 'ifindex' (IPv4 as ::ffff:a.b.c.d), preferring global ones
+gboolean get_interface_address(unsigned ifindex, int family, struct in6_addr *ip);
+gboolean is_local_ip(const char *ip_str); // Return TRUE if 'ip_str' is one of the local addresses
 void translate_local_ip(struct in6_addr *ip); // Convert "::1" to the local global address
 
 gboolean get_IPv6(const gchar *textIP, struct in6_addr *addrv6); // Read an IPv6 Multicast address
@@ -53,6 +64,9 @@ char *addr_ipv6(struct in6_addr *addr);	// Return a static string with an IPv6 a
 
 int init_socket_ipv4(int dom, int port, gboolean shared); // Initialize an IPv4 socket
 int init_socket_ipv6(int dom, int port, gboolean shared); // Initialize an IPv6 socket
+// Initialize an IPv6 TCP socket listening in 'port' with a queue of 'backlog' connections;
+//   'reuseport' lets other sockets listen in the same port (SO_REUSEPORT)
+int init_listen_socket_ipv6(int port, int backlog, gboolean reuseport);
 // dom = SOCK_DGRAM or SOCK_STREAM
 // Return: -1 - error;  >0 - socket number
 
@@ -68,6 +82,18 @@ int read_data_ipv4(int sock, char *buf, int n, struct in_addr *ip,
 int read_data_ipv6(int sock, char *buf, int n, struct in6_addr *ip,
 		    short unsigned int *port);
 
+// Read data from an IPv4 socket with IP_PKTINFO enabled
+// Returns the number of byte read (<0 in case of error), the sender's address and port,
+//   and the index of the interface where it was received (0 if unknown)
+int read_data_ipv4_if(int sock, char *buf, int n, struct in_addr *ip,
+		    short unsigned int *port, unsigned *ifindex);
+
+// Read data from an IPv6 socket with IPV6_RECVPKTINFO enabled
+// Returns the number of byte read (<0 in case of error), the sender's address and port,
+//   and the index of the interface where it was received (0 if unknown)
+int read_data_ipv6_if(int sock, char *buf, int n, struct in6_addr *ip,
+		    short unsigned int *port, unsigned *ifindex);
+
 // Create a GIOchannel object and regist a callback function in the GIO main loop
 // event = G_IO_IN ; G_IO_OUT; G_IO_IN | G_IO_OUT
 gboolean put_socket_in_mainloop(int sock, void *ptr, guint *chan_id, GIOChannel **chan,
@@ -8,21 +8,29 @@
  *
  * @author  Luis Bernardo
 \*****************************************************************************/
+#define _GNU_SOURCE		// renameat2
 #ifdef HAVE_CONFIG_H
 #  include <config.h>
 #endif
 
-#include <gtk/gtk.h>
+#include <glib.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <math.h>
 #include <sys/time.h>
 #include <assert.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/errqueue.h>
 #include <string.h>
 #include <errno.h>
 
@@ -32,8 +40,16 @@
 #include "callbacks.h"
 #include "callbacks_socket.h"
 #include "sock.h"
-#include "gui.h"
+#include "host.h"
+#include "filetable.h"
+#include "metrics.h"
 #include "file.h"
+#include "lz.h"
+#include "delta.h"
+#include "chunk.h"
+#include "iosched.h"
+#include "filecache.h"
+#include "codec.h"
 
 #ifdef DEBUG
 #define debugstr(x)     g_print("%s", x)
@@ -43,13 +59,133 @@
 
 
 #define SLOW_SLEEPTIME	500000		// Sleep time between reads and writes in slow sending
-#define RCV_BUFLEN 		(65536*2)		// Buffer size used to receive data
-#define SND_BUFLEN 		65536		// Buffer size used to send data
+#define IO_BUFLEN		65536		// Default size of the blocks read and written
+#define IO_BUFLEN_MIN	512			// Minimum block size
+#define IO_BUFLEN_MAX	(16*1048576)	// Maximum block size
 #define READ_TIMEOUT	60			// Read timeout - 60 seconds
-#define PERCSTEP		10			// Percentage Step  
-
-// List with active TCP connections/threads
-GList *tcp_conn = NULL;
+#define READAHEAD		(8*1048576)	// Bytes of the file sent that are prefetched (WILLNEED)
+
+// Transfer header: the request has the filename length (short) and the filename, optionally
+//    followed by options, each ending with '\0' (ignored by older senders). The reply has the
+//    file length, with SPARSE_FLAG set if the file follows as a sequence of Extent_Header,
+//    COMPRESS_FLAG if it follows as a sequence of Block_Header, DELTA_FLAG if the
+//    receiver must send the signatures of its copy, answered with a sequence of Delta_Op,
+//    or CHUNK_FLAG if it follows as a list of chunks, answered with the chunks needed. The reply
+//    and the headers that follow are in network byte order (codec.h), except for older
+//    receivers, that send no options and read the file length in host order
+#define REQ_MAX_LENGTH	257			// Longest request string (filename and options)
+#define OPT_SPARSE		"sparse"	// Option: the receiver accepts sparse files
+#define OPT_COMPRESS	"lz"		// Option: the receiver accepts compressed blocks
+#define OPT_DELTA		"delta"		// Option: the receiver has a copy of the file
+#define OPT_CHUNKS		"chunks"	// Option: the receiver has a chunk store
+#define SPARSE_FLAG		(1ULL << 63)	// Reply length flag: the file is sent sparse
+#define COMPRESS_FLAG	(1ULL << 62)	// Reply length flag: the file is sent compressed
+#define DELTA_FLAG		(1ULL << 61)	// Reply length flag: the file is sent as a delta
+#define CHUNK_FLAG		(1ULL << 60)	// Reply length flag: the file is sent in chunks
+#define HDR_FLAGS		(SPARSE_FLAG | COMPRESS_FLAG | DELTA_FLAG | CHUNK_FLAG)
+#define REPLY_HDR_LENGTH	8		// File length and flags
+
+// Compressed transfers: block i has the bytes [i*COMPRESS_BLOCK, (i+1)*COMPRESS_BLOCK) of the
+//    file, compressed independently (lz.h), so blocks can be handled in parallel and a
+//    transfer can resume at any block
+#define COMPRESS_BLOCK	65536		// Bytes of the file in each block
+#define COMPRESS_SAVING	16			// Blocks are sent stored unless they save 1/16
+#define SAMPLE_SAVING	8			// Files are compressed if the samples save 1/8
+#define MAX_BACKOFF		64			// Most blocks sent stored after failing to compress
+
+// Delta transfers (delta.h): the receiver sends a Delta_Sig_Header and the signatures of
+//    the full blocks of its copy; the sender answers with copies of those blocks and literals
+#define DELTA_MIN_SIZE	65536		// Smallest copy used by delta transfers
+#define DELTA_MAX_SIGS	(1 << 24)	// Most signatures
+#define DELTA_MAX_LITERAL	65536	// Longest literal operation
+#define DELTA_BUFFER	(4*1048576)	// Bytes of the new file read at once by the sender
+
+// Zerocopy sends (MSG_ZEROCOPY) of the files in memory (filecache.h): the kernel sends the
+//    pages of the buffer, and reports on the error queue of the socket when it released them
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY		60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY	0x4000000
+#endif
+#define ZEROCOPY_MIN	16384		// Smaller files are copied, which is faster than pinning pages
+#define ZEROCOPY_BACKOFF	64		// Most files copied after the kernel copied a zerocopy send
+
+// Chunked transfers (chunk.h): the sender sends the number of chunks (64 bits) and their
+//    Chunk_Ref; the receiver answers with a bitmap of the chunks it does not have, and the
+//    sender sends them in order. Each Chunk_Ref is sent as | hash[0](8) | hash[1](8) | length(8) |
+#define CHUNK_MAX_COUNT	(1 << 24)	// Most chunks of a file
+#define CHUNK_COUNT_LENGTH	8
+#define CHUNK_REF_LENGTH	24
+#define CHUNK_REF_BATCH		1024	// Chunk_Ref encoded at once
+
+// Data extent of a sparse file, followed by 'length' bytes; the last one has length 0 and
+//    the offset of the end of the file. Sent as | offset(8) | length(8) |
+typedef struct Extent_Header {
+	unsigned long long offset;
+	unsigned long long length;
+} Extent_Header;
+#define EXTENT_HDR_LENGTH	16
+
+// Block of a compressed file, followed by 'length' bytes; when 'length' equals 'raw' the
+//    block is stored without compression. Sent as | raw(4) | length(4) |
+typedef struct Block_Header {
+	uint32_t raw;				// Bytes of the file (COMPRESS_BLOCK, except in the last block)
+	uint32_t length;			// Bytes sent
+} Block_Header;
+#define BLOCK_HDR_LENGTH	8
+
+// Signatures of the copy of the receiver, followed by 'count' Delta_Sig. Sent as
+//    | block(4) | count(4) |, and each Delta_Sig as | weak(4) | strong[0](4) | strong[1](4) |
+typedef struct Delta_Sig_Header {
+	uint32_t block;				// Block size
+	uint32_t count;				// Full blocks of the copy
+} Delta_Sig_Header;
+#define DELTA_SIG_HDR_LENGTH	8
+#define DELTA_SIG_LENGTH		12
+#define DELTA_SIG_BATCH			1024	// Signatures encoded at once
+
+// Operation of a delta transfer. Sent as | op(4) | count(4) | block(8) |
+typedef struct Delta_Op {
+	uint32_t op;				// DELTA_END, DELTA_LITERAL or DELTA_COPY
+	uint32_t count;				// Literal bytes that follow, or blocks copied
+	unsigned long long block;	// First block copied
+} Delta_Op;
+#define DELTA_OP_LENGTH		16
+
+enum { DELTA_END, DELTA_LITERAL, DELTA_COPY };
+
+#define SLAB_DESCS		64			// Thread descriptors allocated together
+
+// Active TCP connections/threads, indexed by transfer id
+GHashTable *tcp_conn = NULL;
+// Free thread descriptors
+static Thread_Data *free_descs= NULL;
+// Last transfer id
+static unsigned next_tid= 0;
+
+// Size of the blocks read and written by the transfer threads
+static int io_buflen= IO_BUFLEN;
+// Drop the received files from the page cache after they are written
+static gboolean drop_cache= FALSE;
+// Splice the files received from the socket to the file, and hash them (reading them back)
+static gboolean recv_splice= FALSE, splice_hash= TRUE;
+// Do not replace existing files when the received files are published
+static gboolean rename_noreplace= FALSE;
+// Create a '.done' marker after publishing each received file
+static gboolean done_marker= FALSE;
+// Ask the senders to compress the files
+static gboolean compression= FALSE;
+// Ask the senders for deltas of the local copies of the files
+static gboolean delta= FALSE;
+// Index the chunks of the files received, and only ask the senders for new chunks
+static gboolean chunk_store= FALSE;
+// Devices whose senders read in turns (Fx_Io_Sched), and reads at once in each one
+static int io_sched= FX_IO_SCHED_ROTATIONAL;
+static int io_slots= 1;
+// Send the files in memory with MSG_ZEROCOPY, and the files copied after the kernel copied one
+static gboolean zerocopy= FALSE;
+static int zc_backoff= 0, zc_skip= 0;
 
 // Mutex to synchronize changes to threads list
 pthread_mutex_t tmutex = PTHREAD_MUTEX_INITIALIZER;
@@ -82,7 +218,36 @@ pthread_mutex_t tmutex = PTHREAD_MUTEX_INITIALIZER;
 |* Functions to handle the list of file transfer threads   *|
 \***********************************************************/
 
-// Add thread information to thread list
+// Take a free descriptor from the slabs; called with tmutex locked
+static Thread_Data *alloc_thread_desc(void) {
+	Thread_Data *pt;
+
+	if (free_descs == NULL) {
+		// New slab - the descriptors are never freed, only reused
+		Thread_Data *slab= (Thread_Data *) calloc(SLAB_DESCS, sizeof(Thread_Data));
+		int i;
+		if (slab == NULL)
+			return NULL;
+		for (i= SLAB_DESCS-1; i >= 0; i--) {
+			slab[i].next_free= free_descs;
+			free_descs= &slab[i];
+		}
+	}
+	pt= free_descs;
+	free_descs= pt->next_free;
+	pt->next_free= NULL;
+	return pt;
+}
+
+// Return a descriptor to the slabs; called with tmutex locked
+static void release_thread_desc(Thread_Data *pt) {
+	pt->gen++;		// Invalidates the references to the transfer
+	pt->id= 0;
+	pt->next_free= free_descs;
+	free_descs= pt;
+}
+
+// Add thread information to thread table
 Thread_Data *new_thread_desc(gboolean sending, struct in6_addr *ip, u_short port,
 		const char *filename, const char *ofilename, unsigned long long flen, uint32_t fhash,
 		gboolean slow) {
@@ -92,14 +257,31 @@ Thread_Data *new_thread_desc(gboolean sending, struct in6_addr *ip, u_short port
 
 	Thread_Data *pt;
 
-	//  g_print("new_desc(pid=%d ; pipe=%d ; %s)\n", pid, pipe, sending?"SND":"RCV");
-	pt = (Thread_Data *) malloc(sizeof(Thread_Data));
+	LOCK_MUTEX(&tmutex, "lock_t1\n");
+	if (tcp_conn == NULL)
+		tcp_conn= g_hash_table_new(g_direct_hash, g_direct_equal);
+	pt= alloc_thread_desc();
+	if (pt == NULL) {
+		UNLOCK_MUTEX(&tmutex, "unlock_t1\n");
+		return NULL;
+	}
+	// Transfer ids are not reused while the transfer is in the table
+	do {
+		if (++next_tid == 0)
+			next_tid= 1;
+	} while (g_hash_table_contains(tcp_conn, GUINT_TO_POINTER(next_tid)));
+	pt->id= next_tid;
+	g_hash_table_insert(tcp_conn, GUINT_TO_POINTER(pt->id), pt);
+	UNLOCK_MUTEX(&tmutex, "unlock_t1\n");
+
 	pt->sending= sending;
 	pt->slow= slow;
 	memcpy(&pt->ip, ip, sizeof(struct in6_addr));
 	pt->port= port;
 	strncpy(pt->fname, filename, sizeof(pt->fname)-1);
+	pt->fname[sizeof(pt->fname)-1]= '\0';
 	strncpy(pt->ofilename, ofilename, sizeof(pt->ofilename)-1);
+	pt->ofilename[sizeof(pt->ofilename)-1]= '\0';
 	pt->flen= flen;
 	pt->fhash= fhash;
 
@@ -107,73 +289,133 @@ Thread_Data *new_thread_desc(gboolean sending, struct in6_addr *ip, u_short port
 	pt->len= 0;
 	pt->s= 0;
 	pt->f= NULL;
+	pt->fw= NULL;
+	pt->tmpname[0]= '\0';
 	pt->total= 0;
+	pt->compressed= FALSE;
+	pt->delta= FALSE;
+	pt->chunked= FALSE;
+	pt->wire= 0;
+	pt->progress= 0;
 	pt->name_str[0]='\0';
-    pt->finished= FALSE;
-    pt->self= pt;
+	if ((pt->buf == NULL) || (pt->buflen != io_buflen)) {
+		// Keeps the buffer of the previous transfer when it has the same size
+		free(pt->buf);
+		pt->buflen= io_buflen;
+		pt->buf= (char *)malloc(pt->buflen);
+	}
+	pt->t0= metric_now_ns();
+	pt->finished= FALSE;
 
-    // Add thread descriptor to list
-	LOCK_MUTEX(&tmutex, "lock_t1\n");
-    tcp_conn = g_list_append(tcp_conn, pt);
-	UNLOCK_MUTEX(&tmutex, "unlock_t1\n");
+	metric_add(MC_TRANSFERS_STARTED, 1);
+	metric_gauge_add(MG_TRANSFERS_ACTIVE, 1);
 	return pt;
 }
 
-// Locate descriptor in thread list
-Thread_Data *locate_thead_desc(unsigned tid) {
-	GList *list = tcp_conn;
-	while (list != NULL) {
-		if (((unsigned)((Thread_Data *) list->data)->tid) == tid)
-			return (Thread_Data *) list->data;
-		list = list->next;
-	}
-	return NULL;
+// Locate descriptor in thread table; called with tmutex locked
+static Thread_Data *locate_thead_desc(unsigned tid) {
+	if (tcp_conn == NULL)
+		return NULL;
+	return (Thread_Data *) g_hash_table_lookup(tcp_conn, GUINT_TO_POINTER(tid));
+}
+
+// Transfer removed from the thread table, reported after tmutex is unlocked
+typedef struct Transfer_End {
+	unsigned id;
+	gboolean sending;
+	long long total;	// Bytes transferred
+} Transfer_End;
+
+// Mark a transfer removed from the thread table as ending, and copy what is reported to
+//   'end'; called with tmutex locked
+static void detach_thread_desc(Thread_Data *pt, Transfer_End *end) {
+	pt->finished= TRUE;  // Mark the thread as ending
+	metric_gauge_add(MG_TRANSFERS_ACTIVE, -1);
+	long long dt= metric_now_ns() - pt->t0;
+	if ((pt->total > 0) && (dt > 0))
+		metric_observe(MH_TRANSFER_KBPS, (unsigned long long)(pt->total*1e6/dt));	// KB/s
+	end->id= pt->id;
+	end->sending= pt->sending;
+	end->total= pt->total;
 }
 
+// Report the bytes transferred and remove the thread from the GUI; called without tmutex,
+//   as the application callbacks take their own locks
+static void report_end_thread(const Transfer_End *end, gboolean lock_glib, gboolean report_end) {
+	GUI_transfer_done(end->id, end->sending, end->total, lock_glib);
+	if (report_end)
+		GUI_del_thread(end->id, lock_glib);
+}
 
-// Remove descriptor from file thread list, stop it and free memory
+// Stop transfer 'tid', or the transfer in 'pt' when it is not NULL.
+//   Only the thread that runs the transfer (or the one that failed to start it) passes 'pt',
+//   which closes the descriptor and returns it to the slabs. The other callers only stop
+//   the transfer: the thread sees it finished and releases the descriptor
 gboolean stop_thread_desc(unsigned tid, Thread_Data *pt, gboolean lock_glib) {
+	Transfer_End end;
+	gboolean ended= FALSE;
+
 	LOCK_MUTEX(&tmutex, "lock_t2\n");
-	if (pt == NULL)
-		pt = locate_thead_desc(tid);
-	if (pt != NULL) {
-		if (pt->self != pt) {
+	if (pt == NULL) {
+		pt= locate_thead_desc(tid);
+		if (pt == NULL) {
 			UNLOCK_MUTEX(&tmutex, "unlock_t2\n");
 			return FALSE;
 		}
-		if (tcp_conn != NULL) {
-			tcp_conn = g_list_remove(tcp_conn, pt);
-		}
-		pt->finished= TRUE;  // Mark the thread as ending
-		// Remove the thread from the GUI
-		GUI_del_thread((unsigned)pt->tid, lock_glib);
-		// Mark block as freed
-		pt->self= NULL;
+		g_hash_table_remove(tcp_conn, GUINT_TO_POINTER(pt->id));
+		detach_thread_desc(pt, &end);
+		// Wake up the thread if it is blocked in the socket
+		if (pt->s > 0)
+			shutdown(pt->s, SHUT_RDWR);
 		UNLOCK_MUTEX(&tmutex, "unlock_t2\n");
-
-		// Close the socket
-		if (pt->s>0) {
-			close (pt->s);
-			pt->s= 0;
-		}
-		// Close the file
-		if (pt->f != NULL) {
-			fclose(pt->f);
-			pt->f= NULL;
-		}
-
-		// Free memory
-		free(pt);
+		report_end_thread(&end, lock_glib, TRUE);
 		return TRUE;
-	} else {
+	}
+
+	if (pt->id == 0) {
+		// Already released
 		UNLOCK_MUTEX(&tmutex, "unlock_t2\n");
 		return FALSE;
 	}
+	if ((pt->fw != NULL) || (pt->tmpname[0] != '\0')) {
+		// Waits for the writer thread - without the lock
+		UNLOCK_MUTEX(&tmutex, "unlock_t2\n");
+		if (pt->fw != NULL) {
+			fw_close(pt->fw);
+			pt->fw= NULL;
+		}
+		// Remove the file of a download that was not published
+		if (pt->tmpname[0] != '\0') {
+			unlink(pt->tmpname);
+			pt->tmpname[0]= '\0';
+		}
+		LOCK_MUTEX(&tmutex, "lock_t2\n");
+	}
+	if (!pt->finished) {
+		g_hash_table_remove(tcp_conn, GUINT_TO_POINTER(pt->id));
+		detach_thread_desc(pt, &end);
+		ended= TRUE;
+	}
+	// Close the socket
+	if (pt->s>0) {
+		close (pt->s);
+		pt->s= 0;
+	}
+	// Close the file
+	if (pt->f != NULL) {
+		fclose(pt->f);
+		pt->f= NULL;
+	}
+	release_thread_desc(pt);
+	UNLOCK_MUTEX(&tmutex, "unlock_t2\n");
+	if (ended)
+		report_end_thread(&end, lock_glib, TRUE);
+	return TRUE;
 }
 
-// Validate if a thread_data pointer is valid
-gboolean valid_thread_desc(Thread_Data *pt) {
-	return pt!=NULL && (pt->self==pt);
+// Validate if a thread_data pointer still holds the transfer of generation 'gen'
+gboolean valid_thread_desc(Thread_Data *pt, unsigned gen) {
+	return pt!=NULL && (pt->id!=0) && (pt->gen==gen);
 }
 
 
@@ -183,49 +425,767 @@ gboolean valid_thread_desc(Thread_Data *pt) {
 \*******************************************************/
 
 
-// Auxiliary macro that stops a thread and frees the descriptor
-#define STOP_THREAD(pt) { if (valid_thread_desc(pt)) \
-							stop_thread_desc((unsigned)pt->tid, pt, TRUE); \
+// Auxiliary macro that stops a thread and frees the descriptor, if it was not freed before
+#define STOP_THREAD(pt) { if (valid_thread_desc(pt, gen)) \
+							stop_thread_desc(pt->id, pt, TRUE); \
 						  return NULL; \
 						}
 
+// Publish the percentage of 'len' bytes transferred, read by fx_foreach_transfer without locks
+#define PUBLISH_PROGRESS(pt,len) __atomic_store_n(&(pt)->progress, \
+									(int)((100*(pt)->total)/((len) ? (len) : 1)), __ATOMIC_RELAXED)
+
 // Auxiliary macro that tests if a thread has been stopped and frees the descriptor
-#define TEST_INTERRUPTED(pt) { if (!active || (pt->self!=pt) || pt->finished) {  \
-									if (pt->self==pt) \
-										g_print("%s interrupted\n", pt->name_str); \
+#define TEST_INTERRUPTED(pt) { if (!active || !valid_thread_desc(pt, gen) || pt->finished) {  \
+									if (valid_thread_desc(pt, gen)) \
+										LOGF(FX_LOG_INFO, "%s interrupted\n", pt->name_str); \
 									STOP_THREAD(pt); \
 								} \
 							 }
 
 
 
+// Send 'len' bytes from 'buf' to pt->s; 'flags' as in send. Returns FALSE if it failed
+static gboolean send_all(Thread_Data *pt, const void *buf, size_t len, int flags) {
+	size_t sent= 0;
+
+	while (sent < len) {
+		ssize_t m= send(pt->s, (const char *)buf+sent, len-sent, flags);
+		if (m < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error sending the file");
+			return FALSE;
+		}
+		sent += m;
+	}
+	return TRUE;
+}
+
+
+// Receive 'len' bytes from pt->s to 'buf'. Returns FALSE if it failed
+static gboolean recv_all(Thread_Data *pt, void *buf, size_t len) {
+	size_t got= 0;
+
+	while (got < len) {
+		ssize_t r= recv(pt->s, (char *)buf+got, len-got, 0);
+		if (r <= 0) {
+			if ((r < 0) && (errno == EINTR))
+				continue;
+			return FALSE;
+		}
+		got += r;
+	}
+	return TRUE;
+}
+
+
+// Write the reply header with the file length and flags 'hlen' to 'buf' (REPLY_HDR_LENGTH
+//    bytes), in network byte order, or in host order for older receivers if not 'net_order'
+static void put_reply_header(char *buf, unsigned long long hlen, gboolean net_order) {
+	char *pt= buf;
+
+	if (net_order)
+		codec_put_u64(&pt, buf+REPLY_HDR_LENGTH, hlen);
+	else
+		memcpy(buf, &hlen, sizeof(hlen));
+}
+
+
+// Read the reply header written by put_reply_header from 'buf'
+static unsigned long long get_reply_header(const char *buf, gboolean net_order) {
+	const char *pt= buf;
+	uint64_t v;
+	unsigned long long hlen;
+
+	if (!net_order) {
+		memcpy(&hlen, buf, sizeof(hlen));
+		return hlen;
+	}
+	codec_get_u64(&pt, buf+REPLY_HDR_LENGTH, &v);
+	return v;
+}
+
+
+// Send the Extent_Header 'eh' to pt->s; 'flags' as in send. Returns FALSE if it failed
+static gboolean send_extent_header(Thread_Data *pt, const Extent_Header *eh, int flags) {
+	char buf[EXTENT_HDR_LENGTH], *p= buf;
+
+	codec_put_u64(&p, buf+sizeof(buf), eh->offset);
+	codec_put_u64(&p, buf+sizeof(buf), eh->length);
+	return send_all(pt, buf, sizeof(buf), flags);
+}
+
+
+// Receive an Extent_Header from pt->s to 'eh'. Returns FALSE if it failed
+static gboolean recv_extent_header(Thread_Data *pt, Extent_Header *eh) {
+	char buf[EXTENT_HDR_LENGTH];
+	const char *p= buf;
+	uint64_t offset, length;
+
+	if (!recv_all(pt, buf, sizeof(buf)))
+		return FALSE;
+	codec_get_u64(&p, buf+sizeof(buf), &offset);
+	codec_get_u64(&p, buf+sizeof(buf), &length);
+	eh->offset= offset;
+	eh->length= length;
+	return TRUE;
+}
+
+
+// Send the Block_Header 'bh' to pt->s; 'flags' as in send. Returns FALSE if it failed
+static gboolean send_block_header(Thread_Data *pt, const Block_Header *bh, int flags) {
+	char buf[BLOCK_HDR_LENGTH], *p= buf;
+
+	codec_put_u32(&p, buf+sizeof(buf), bh->raw);
+	codec_put_u32(&p, buf+sizeof(buf), bh->length);
+	return send_all(pt, buf, sizeof(buf), flags);
+}
+
+
+// Receive a Block_Header from pt->s to 'bh'. Returns FALSE if it failed
+static gboolean recv_block_header(Thread_Data *pt, Block_Header *bh) {
+	char buf[BLOCK_HDR_LENGTH];
+	const char *p= buf;
+
+	if (!recv_all(pt, buf, sizeof(buf)))
+		return FALSE;
+	codec_get_u32(&p, buf+sizeof(buf), &bh->raw);
+	codec_get_u32(&p, buf+sizeof(buf), &bh->length);
+	return TRUE;
+}
+
+
+// Send the Delta_Op 'op' to pt->s; 'flags' as in send. Returns FALSE if it failed
+static gboolean send_delta_op(Thread_Data *pt, const Delta_Op *op, int flags) {
+	char buf[DELTA_OP_LENGTH], *p= buf;
+
+	codec_put_u32(&p, buf+sizeof(buf), op->op);
+	codec_put_u32(&p, buf+sizeof(buf), op->count);
+	codec_put_u64(&p, buf+sizeof(buf), op->block);
+	return send_all(pt, buf, sizeof(buf), flags);
+}
+
+
+// Receive a Delta_Op from pt->s to 'op'. Returns FALSE if it failed
+static gboolean recv_delta_op(Thread_Data *pt, Delta_Op *op) {
+	char buf[DELTA_OP_LENGTH];
+	const char *p= buf;
+	uint64_t block;
+
+	if (!recv_all(pt, buf, sizeof(buf)))
+		return FALSE;
+	codec_get_u32(&p, buf+sizeof(buf), &op->op);
+	codec_get_u32(&p, buf+sizeof(buf), &op->count);
+	codec_get_u64(&p, buf+sizeof(buf), &block);
+	op->block= block;
+	return TRUE;
+}
+
+
+// Send the number of chunks 'count' and the chunk list 'list' to pt->s. Returns FALSE if it failed
+static gboolean send_chunk_list(Thread_Data *pt, const Chunk_Ref *list, uint64_t count) {
+	char buf[CHUNK_REF_BATCH*CHUNK_REF_LENGTH], *p= buf;
+
+	if (!codec_put_u64(&p, buf+sizeof(buf), count) || !send_all(pt, buf, p-buf, MSG_MORE))
+		return FALSE;
+	for (uint64_t i= 0; i < count; ) {
+		p= buf;
+		for (; (i < count) && (p < buf+sizeof(buf)); i++) {
+			codec_put_u64(&p, buf+sizeof(buf), list[i].hash[0]);
+			codec_put_u64(&p, buf+sizeof(buf), list[i].hash[1]);
+			codec_put_u64(&p, buf+sizeof(buf), list[i].length);
+		}
+		if (!send_all(pt, buf, p-buf, (i < count) ? MSG_MORE : 0))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+
+// Receive the 'count' Chunk_Ref of a chunk list from pt->s to 'list'. Returns FALSE if it failed
+static gboolean recv_chunk_list(Thread_Data *pt, Chunk_Ref *list, uint64_t count) {
+	char buf[CHUNK_REF_BATCH*CHUNK_REF_LENGTH];
+
+	for (uint64_t i= 0; i < count; ) {
+		uint64_t n= (count - i < CHUNK_REF_BATCH) ? count - i : CHUNK_REF_BATCH;
+		const char *p= buf;
+		if (!recv_all(pt, buf, n*CHUNK_REF_LENGTH))
+			return FALSE;
+		for (; n > 0; n--, i++) {
+			codec_get_u64(&p, buf+sizeof(buf), &list[i].hash[0]);
+			codec_get_u64(&p, buf+sizeof(buf), &list[i].hash[1]);
+			codec_get_u64(&p, buf+sizeof(buf), &list[i].length);
+		}
+	}
+	return TRUE;
+}
+
+
 /**************************************************\
 |* Functions that implement the receiving thread  *|
 \**************************************************/
 
+// Write in 'buf' the hidden name of file 'name' in its directory, for transfer 'id' and 'ext'
+//    Returns FALSE if it does not fit
+static gboolean hidden_name(char *buf, size_t blen, const char *name, unsigned id, const char *ext) {
+	const char *base= get_trunc_filename(name);
+	int n= snprintf(buf, blen, "%.*s.%s.%u.%s", (int)(base-name), name, base, id, ext);
+	return (n > 0) && ((size_t)n < blen);
+}
+
+
+// Rename 'from' to 'to'; with 'noreplace' it fails with EEXIST when 'to' exists
+static int publish_rename(const char *from, const char *to, gboolean noreplace) {
+	if (!noreplace)
+		return rename(from, to);
+	if (!renameat2(AT_FDCWD, from, AT_FDCWD, to, RENAME_NOREPLACE))
+		return 0;
+	if ((errno != EINVAL) && (errno != ENOSYS))
+		return -1;
+	// Filesystem without RENAME_NOREPLACE - link also fails when 'to' exists
+	if (link(from, to))
+		return -1;
+	unlink(from);
+	return 0;
+}
+
+
+// Create the marker '<name>.done' with the length and hash of file 'name'; it is renamed
+//    into place, so it appears complete (IN_MOVED_TO for inotify)
+static void write_done_marker(Thread_Data *pt, const char *name) {
+	char tmp[sizeof(pt->tmpname)], marker[sizeof(pt->ofilename)+24];
+	FILE *f;
+
+	if (!hidden_name(tmp, sizeof(tmp), name, pt->id, "done")
+			|| (snprintf(marker, sizeof(marker), "%s.done", name) >= (int)sizeof(marker))) {
+		LOGF(FX_LOG_WARNING, "%sname too long for the marker of '%s'\n", pt->name_str, name);
+		return;
+	}
+	if ((f= fopen(tmp, "w")) == NULL) {
+		LOGF(FX_LOG_WARNING, "%sfailed creating marker '%s': %s\n", pt->name_str, tmp, strerror(errno));
+		return;
+	}
+	fprintf(f, "%s\t%llu\t%u\n", get_trunc_filename(name), pt->flen, pt->fhash);
+	if ((fclose(f) != 0) || rename(tmp, marker)) {
+		LOGF(FX_LOG_WARNING, "%sfailed creating marker '%s': %s\n", pt->name_str, marker, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+
+// Verify the length and the hash of the file received in pt->tmpname and rename it to
+//    pt->ofilename (or '<ofilename>.<id>' if it exists and files are not replaced)
+//    Returns FALSE, after removing it, if it is not valid
+//    The chunks of the file are indexed when the chunk store is enabled, from 'list' if not NULL
+static gboolean publish_file(Thread_Data *pt, uint32_t hash, const Chunk_Ref *list, uint32_t n) {
+	char name[sizeof(pt->ofilename)+16];
+	const char *fname= pt->ofilename;
+
+	if ((unsigned long long)pt->total != pt->flen) {
+		LOGF(FX_LOG_WARNING, "%sincomplete file (%lld of %llu bytes) - discarded\n",
+				pt->name_str, pt->total, pt->flen);
+		return FALSE;
+	}
+	if (hash != pt->fhash) {
+		LOGF(FX_LOG_ERROR, "%sfile hash %u differs from %u in the HIT - discarded\n",
+				pt->name_str, hash, pt->fhash);
+		return FALSE;
+	}
+	if (publish_rename(pt->tmpname, fname, rename_noreplace)) {
+		if (errno == EEXIST) {
+			snprintf(name, sizeof(name), "%s.%u", pt->ofilename, pt->id);
+			LOGF(FX_LOG_WARNING, "%s'%s' exists - keeping the file as '%s'\n", pt->name_str,
+					pt->ofilename, name);
+			fname= name;
+		}
+		if ((fname == pt->ofilename) || publish_rename(pt->tmpname, fname, TRUE)) {
+			LOGF(FX_LOG_ERROR, "%sfailed renaming '%s' to '%s': %s\n", pt->name_str,
+					pt->tmpname, fname, strerror(errno));
+			return FALSE;
+		}
+	}
+	pt->tmpname[0]= '\0';	// Published
+	if (done_marker)
+		write_done_marker(pt, fname);
+	if (chunk_store) {
+		if (list != NULL)
+			chunk_store_add(fname, list, n);
+		else
+			chunk_store_add_file(fname);
+	}
+	LOGF(FX_LOG_INFO, "%spublished '%s'\n", pt->name_str, fname);
+	return TRUE;
+}
+
+
+// Receive the next 'len' bytes of the file from pt->s into pt->fw and the hash 'hs'
+//    Returns FALSE if the connection or the writes failed
+static gboolean receive_data(Thread_Data *pt, unsigned long long len, Fhash_State *hs) {
+	unsigned long long end= pt->total + len;
+	int n, m;
+
+	while (active && ((unsigned long long)pt->total < end)) {
+		char *wbuf= fw_buffer(pt->fw, &m);
+		if (wbuf == NULL) {
+			LOGF(FX_LOG_WARNING, "%sfailed writing the file - aborting\n", pt->name_str);
+			return FALSE;
+		}
+		if ((unsigned long long)m > end - pt->total)
+			m= (int)(end - pt->total);
+		n= read(pt->s, wbuf, (m < pt->buflen) ? m : pt->buflen);
+		if (n <= 0) {
+			// Connection closed or failed before the end of the file
+			if ((n < 0) && (errno == EINTR))
+				continue;
+			return FALSE;
+		}
+		fhash_update(hs, wbuf, n);
+		fw_commit(pt->fw, n);
+		pt->total += n;
+		metric_add(MC_BYTES_RECEIVED, n);
+		PUBLISH_PROGRESS(pt, pt->flen);
+		if (pt->slow)
+			usleep(SLOW_SLEEPTIME);
+	}
+	return active;
+}
+
+
+// Receive the next 'len' bytes of the file from pt->s into pt->fw, opened with FW_SPLICE,
+//    without copying them to user space; with 'hs', they are copied to pt->buf and hashed
+//    Returns FALSE if the connection or the writes failed
+static gboolean receive_spliced(Thread_Data *pt, unsigned long long len, Fhash_State *hs) {
+	unsigned long long end= pt->total + len;
+	int n;
+
+	while (active && ((unsigned long long)pt->total < end)) {
+		n= fw_splice(pt->fw, pt->s, (end - pt->total < (unsigned long long)pt->buflen) ?
+				(int)(end - pt->total) : pt->buflen, (hs != NULL) ? pt->buf : NULL);
+		if (n <= 0)
+			return FALSE;	// Connection closed or failed, or the write failed
+		if (hs != NULL)
+			fhash_update(hs, pt->buf, n);
+		pt->total += n;
+		metric_add(MC_BYTES_RECEIVED, n);
+		PUBLISH_PROGRESS(pt, pt->flen);
+		if (pt->slow)
+			usleep(SLOW_SLEEPTIME);
+	}
+	return active;
+}
+
+
+// Receive a sparse file with 'len' bytes: each Extent_Header is followed by its data, and
+//    the gaps between extents are left as holes. Returns FALSE if it failed
+static gboolean receive_extents(Thread_Data *pt, unsigned long long len, Fhash_State *hs) {
+	Extent_Header eh;
+
+	for (;;) {
+		if (!active || !recv_extent_header(pt, &eh))
+			return FALSE;
+		if ((eh.offset < (unsigned long long)pt->total) || (eh.offset > len)
+				|| (eh.length > len - eh.offset)) {
+			LOGF(FX_LOG_WARNING, "%sinvalid extent (%llu, %llu) - aborting\n", pt->name_str,
+					eh.offset, eh.length);
+			return FALSE;
+		}
+		if (eh.offset > (unsigned long long)pt->total) {
+			// Hole - skipped in the file and hashed as zeros
+			if (!fw_hole(pt->fw, eh.offset - pt->total))
+				return FALSE;
+			fhash_zeros(hs, eh.offset - pt->total);
+			pt->total= eh.offset;
+			PUBLISH_PROGRESS(pt, len);
+		}
+		if (eh.length == 0)
+			return TRUE;	// End of the file
+		if (!receive_data(pt, eh.length, hs))
+			return FALSE;
+	}
+}
+
+
+// Receive a compressed file with 'len' bytes, as a sequence of Block_Header, each followed
+//    by the block compressed or stored. Returns FALSE if it failed
+static gboolean receive_blocks(Thread_Data *pt, unsigned long long len, Fhash_State *hs) {
+	uint8_t *cbuf= (uint8_t *)malloc(2*COMPRESS_BLOCK);	// Compressed and decompressed blocks
+	gboolean ok= (cbuf != NULL);
+	Block_Header bh;
+	int m;
+
+	while (ok && active && ((unsigned long long)pt->total < len)) {
+		if (!recv_block_header(pt, &bh)) {
+			ok= FALSE;
+			break;
+		}
+		if ((bh.raw == 0) || (bh.raw > COMPRESS_BLOCK) || (bh.raw > len - pt->total)
+				|| (bh.length == 0) || (bh.length > bh.raw)) {
+			LOGF(FX_LOG_WARNING, "%sinvalid block (%u, %u) - aborting\n", pt->name_str, bh.raw,
+					bh.length);
+			ok= FALSE;
+			break;
+		}
+		pt->wire += BLOCK_HDR_LENGTH + bh.length;
+		if (bh.length == bh.raw) {
+			// Stored
+			ok= receive_data(pt, bh.raw, hs);
+			continue;
+		}
+		if (recv(pt->s, cbuf, bh.length, MSG_WAITALL) != bh.length) {
+			ok= FALSE;
+			break;
+		}
+		// Decompress to the file blocks, which are COMPRESS_BLOCK aligned, or to cbuf and copy
+		uint8_t *wbuf= (uint8_t *)fw_buffer(pt->fw, &m);
+		if (wbuf == NULL) {
+			ok= FALSE;
+			break;
+		}
+		uint8_t *dst= ((unsigned)m >= bh.raw) ? wbuf : cbuf+COMPRESS_BLOCK;
+		if (lz_decompress(cbuf, bh.length, dst, bh.raw) != (int)bh.raw) {
+			LOGF(FX_LOG_WARNING, "%sinvalid compressed block - aborting\n", pt->name_str);
+			ok= FALSE;
+			break;
+		}
+		fhash_update(hs, dst, bh.raw);
+		if (dst == wbuf)
+			fw_commit(pt->fw, bh.raw);
+		else
+			for (unsigned done= 0; ok && (done < bh.raw); done += m) {
+				if ((wbuf= (uint8_t *)fw_buffer(pt->fw, &m)) == NULL) {
+					ok= FALSE;
+					break;
+				}
+				if ((unsigned)m > bh.raw - done)
+					m= bh.raw - done;
+				memcpy(wbuf, dst+done, m);
+				fw_commit(pt->fw, m);
+			}
+		pt->total += bh.raw;
+		metric_add(MC_BYTES_RECEIVED, bh.raw);
+		PUBLISH_PROGRESS(pt, len);
+		if (pt->slow)
+			usleep(SLOW_SLEEPTIME);
+	}
+	free(cbuf);
+	return ok && active;
+}
+
+
+// Copy 'len' bytes at offset 'off' of the file 'fd' into pt->fw and the hash 'hs'
+//    Returns FALSE if the reads or the writes failed
+static gboolean copy_local(Thread_Data *pt, int fd, unsigned long long off, unsigned long long len,
+		Fhash_State *hs) {
+	unsigned long long end= off + len;
+	int m;
+
+	while (off < end) {
+		char *wbuf= fw_buffer(pt->fw, &m);
+		if (wbuf == NULL)
+			return FALSE;
+		if ((unsigned long long)m > end - off)
+			m= (int)(end - off);
+		ssize_t n= pread(fd, wbuf, m, off);
+		if (n <= 0) {
+			if ((n < 0) && (errno == EINTR))
+				continue;
+			LOGF(FX_LOG_WARNING, "%sfailed reading the local copy - aborting\n", pt->name_str);
+			return FALSE;
+		}
+		fhash_update(hs, wbuf, n);
+		fw_commit(pt->fw, n);
+		off += n;
+		pt->total += n;
+		metric_add(MC_DELTA_COPIED_BYTES, n);
+		PUBLISH_PROGRESS(pt, pt->flen);
+	}
+	return TRUE;
+}
+
+
+// Send the Delta_Sig_Header and the signatures of the full blocks of file 'fd' (-1: none)
+//    Returns the header sent in 'sh', or FALSE if it failed
+static gboolean send_signatures(Thread_Data *pt, int fd, Delta_Sig_Header *sh) {
+	char sig[DELTA_SIG_BATCH*DELTA_SIG_LENGTH], *sp= sig;
+	char hdr[DELTA_SIG_HDR_LENGTH], *hp= hdr;
+	uint32_t strong[2];
+	struct stat st;
+	uint8_t *blk= NULL;
+	gboolean ok= TRUE;
+	unsigned n= 0;
+
+	sh->block= DELTA_MIN_BLOCK;
+	sh->count= 0;
+	if ((fd >= 0) && !fstat(fd, &st)) {
+		sh->block= delta_block_size(st.st_size);
+		if ((blk= (uint8_t *)malloc(sh->block)) != NULL)
+			sh->count= (st.st_size/sh->block < DELTA_MAX_SIGS) ? st.st_size/sh->block : DELTA_MAX_SIGS;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+	codec_put_u32(&hp, hdr+sizeof(hdr), sh->block);
+	codec_put_u32(&hp, hdr+sizeof(hdr), sh->count);
+	ok= send_all(pt, hdr, sizeof(hdr), (sh->count > 0) ? MSG_MORE : 0);
+	for (uint32_t b= 0; ok && (b < sh->count); b++) {
+		unsigned long long off= (unsigned long long)b*sh->block;
+		uint32_t done= 0;
+		while (done < sh->block) {
+			ssize_t r= pread(fd, blk+done, sh->block-done, off+done);
+			if (r <= 0) {
+				if ((r < 0) && (errno == EINTR))
+					continue;
+				memset(blk+done, 0, sh->block-done);	// Truncated: the block is not matched
+				break;
+			}
+			done += r;
+		}
+		delta_strong(blk, sh->block, strong);
+		codec_put_u32(&sp, sig+sizeof(sig), delta_weak(blk, sh->block));
+		codec_put_u32(&sp, sig+sizeof(sig), strong[0]);
+		codec_put_u32(&sp, sig+sizeof(sig), strong[1]);
+		if ((++n == DELTA_SIG_BATCH) || (b+1 == sh->count)) {
+			ok= send_all(pt, sig, n*DELTA_SIG_LENGTH, (b+1 < sh->count) ? MSG_MORE : 0) && active;
+			sp= sig;
+			n= 0;
+		}
+	}
+	free(blk);
+	pt->wire += DELTA_SIG_HDR_LENGTH + (long long)sh->count*DELTA_SIG_LENGTH;
+	return ok;
+}
+
+
+// Receive a file with 'len' bytes as a delta of the local copy pt->ofilename: send the
+//    signatures of the copy, then copy its blocks or receive literals as each Delta_Op says
+//    Returns FALSE if it failed
+static gboolean receive_delta(Thread_Data *pt, unsigned long long len, Fhash_State *hs) {
+	int fd= open(pt->ofilename, O_RDONLY | O_CLOEXEC);
+	Delta_Sig_Header sh;
+	Delta_Op op;
+	gboolean ok= send_signatures(pt, fd, &sh);
+
+	while (ok && active) {
+		if (!recv_delta_op(pt, &op)) {
+			ok= FALSE;
+			break;
+		}
+		pt->wire += DELTA_OP_LENGTH;
+		if (op.op == DELTA_END) {
+			ok= ((unsigned long long)pt->total == len);
+			break;
+		}
+		if ((op.op == DELTA_LITERAL) && (op.count > 0) && (op.count <= DELTA_MAX_LITERAL)
+				&& (op.count <= len - pt->total)) {
+			pt->wire += op.count;
+			ok= receive_data(pt, op.count, hs);
+		} else if ((op.op == DELTA_COPY) && (op.count > 0) && (op.block < sh.count)
+				&& (op.count <= sh.count - op.block)
+				&& ((unsigned long long)op.count*sh.block <= len - pt->total)) {
+			ok= copy_local(pt, fd, op.block*sh.block, (unsigned long long)op.count*sh.block, hs);
+			if (pt->slow)
+				usleep(SLOW_SLEEPTIME);
+		} else {
+			LOGF(FX_LOG_WARNING, "%sinvalid delta operation (%u, %u, %llu) - aborting\n",
+					pt->name_str, op.op, op.count, op.block);
+			ok= FALSE;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	return ok && active;
+}
+
+
+// Write the 'n' bytes of 'buf' to pt->fw and the hash 'hs'. Returns FALSE if it failed
+static gboolean write_buffer(Thread_Data *pt, const uint8_t *buf, uint32_t n, Fhash_State *hs) {
+	int m;
+
+	fhash_update(hs, buf, n);
+	for (uint32_t done= 0; done < n; done += m) {
+		char *wbuf= fw_buffer(pt->fw, &m);
+		if (wbuf == NULL)
+			return FALSE;
+		if ((unsigned)m > n - done)
+			m= n - done;
+		memcpy(wbuf, buf+done, m);
+		fw_commit(pt->fw, m);
+	}
+	pt->total += n;
+	PUBLISH_PROGRESS(pt, pt->flen);
+	return TRUE;
+}
+
+
+// Read chunk 'ref' from the chunk store to 'buf', keeping the file open in 'fd' and its
+//    name in 'cur'. Returns FALSE if it is not there or its contents changed
+static gboolean read_stored_chunk(const Chunk_Ref *ref, uint8_t *buf, int *fd, char *cur,
+		size_t clen) {
+	char path[512];
+	unsigned long long off;
+	uint64_t hash[2];
+	uint32_t done= 0;
+
+	if (!chunk_store_find(ref->hash, ref->length, path, sizeof(path), &off))
+		return FALSE;
+	if ((*fd < 0) || strcmp(path, cur)) {
+		if (*fd >= 0)
+			close(*fd);
+		cur[0]= '\0';
+		if ((*fd= open(path, O_RDONLY | O_CLOEXEC)) < 0)
+			return FALSE;
+		snprintf(cur, clen, "%s", path);
+	}
+	while (done < ref->length) {
+		ssize_t r= pread(*fd, buf+done, ref->length-done, off+done);
+		if (r <= 0) {
+			if ((r < 0) && (errno == EINTR))
+				continue;
+			break;
+		}
+		done += r;
+	}
+	if (done == ref->length) {
+		chunk_hash(buf, ref->length, hash);
+		if (!memcmp(hash, ref->hash, sizeof(hash)))
+			return TRUE;
+	}
+	chunk_store_forget(ref->hash);
+	return FALSE;
+}
+
+
+// Receive a file with 'len' bytes as a list of chunks: receive the list, ask for the chunks
+//    not found in the chunk store, and copy or receive each chunk in order
+//    Returns the list in 'list' and its length in 'n', to index the file, or FALSE if it failed
+static gboolean receive_chunks(Thread_Data *pt, unsigned long long len, Fhash_State *hs,
+		Chunk_Ref **list, uint32_t *n) {
+	uint8_t *cbuf= (uint8_t *)malloc(CHUNK_MAX), *need= NULL;
+	char cur[512]= "";
+	unsigned long long sum= 0, needed= 0;
+	uint64_t hash[2], count;
+	char hdr[CHUNK_COUNT_LENGTH];
+	const char *hp= hdr;
+	gboolean ok= FALSE;
+	int fd= -1;
+	uint32_t i;
+
+	*list= NULL;
+	*n= 0;
+	if ((cbuf == NULL) || !recv_all(pt, hdr, sizeof(hdr)) || !codec_get_u64(&hp, hdr+sizeof(hdr), &count)
+			|| (count > CHUNK_MAX_COUNT)
+			|| ((*list= (Chunk_Ref *)malloc(count ? count*sizeof(Chunk_Ref) : 1)) == NULL)
+			|| ((need= (uint8_t *)calloc((count+7)/8 ? (count+7)/8 : 1, 1)) == NULL)
+			|| !recv_chunk_list(pt, *list, count))
+		goto out;
+	pt->wire += sizeof(hdr) + count*CHUNK_REF_LENGTH + (count+7)/8;
+	// Ask for the chunks that are not in the store
+	for (i= 0; i < count; i++) {
+		Chunk_Ref *ref= &(*list)[i];
+		if ((ref->length == 0) || (ref->length > CHUNK_MAX) || (ref->length > len - sum)) {
+			LOGF(FX_LOG_WARNING, "%sinvalid chunk list - aborting\n", pt->name_str);
+			goto out;
+		}
+		sum += ref->length;
+		char path[512];
+		unsigned long long off;
+		if (!chunk_store_find(ref->hash, ref->length, path, sizeof(path), &off)) {
+			need[i/8] |= 1 << (i%8);
+			needed += ref->length;
+		}
+	}
+	if (sum != len) {
+		LOGF(FX_LOG_WARNING, "%sinvalid chunk list - aborting\n", pt->name_str);
+		goto out;
+	}
+	if (!send_all(pt, need, (count+7)/8, 0))
+		goto out;
+	LOGF(FX_LOG_DEBUG, "%sneeds %llu of %llu bytes\n", pt->name_str, needed, len);
+	// Write the chunks in order, from the store or from the connection
+	for (i= 0; active && (i < count); i++) {
+		Chunk_Ref *ref= &(*list)[i];
+		if (!(need[i/8] & (1 << (i%8)))) {
+			if (!read_stored_chunk(ref, cbuf, &fd, cur, sizeof(cur))) {
+				LOGF(FX_LOG_WARNING, "%sstored chunk changed - aborting\n", pt->name_str);
+				goto out;
+			}
+			metric_add(MC_CHUNK_DEDUP_BYTES, ref->length);
+		} else {
+			if (!recv_all(pt, cbuf, ref->length))
+				goto out;
+			pt->wire += ref->length;
+			chunk_hash(cbuf, ref->length, hash);
+			if (memcmp(hash, ref->hash, sizeof(hash))) {
+				LOGF(FX_LOG_WARNING, "%sinvalid chunk received - aborting\n", pt->name_str);
+				goto out;
+			}
+			metric_add(MC_BYTES_RECEIVED, ref->length);
+			if (pt->slow)
+				usleep(SLOW_SLEEPTIME);
+		}
+		if (!write_buffer(pt, cbuf, ref->length, hs))
+			goto out;
+	}
+	*n= count;
+	ok= active;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(cbuf);
+	free(need);
+	if (!ok) {
+		free(*list);
+		*list= NULL;
+		*n= 0;
+	}
+	return ok;
+}
+
+
+// Log the bytes on the connection of a compressed, delta or chunked transfer that took 'diff' usec
+static void log_wire(Thread_Data *pt, long diff) {
+	if (!pt->compressed && !pt->delta && !pt->chunked)
+		return;
+	LOGF(FX_LOG_INFO, "%s%s %lld bytes to %lld (ratio %.3f) - effective %.1f MB/s\n", pt->name_str,
+			pt->delta ? "delta of" : (pt->chunked ? "deduplicated" : "compressed"), pt->total, pt->wire,
+			pt->total ? (double)pt->wire/pt->total : 1.0, (diff > 0) ? (double)pt->total/diff : 0.0);
+}
+
+
 // Starts thread for sending a file
 void *file_download_thread (void *ptr)
 {
 	assert(ptr!=NULL);
 	Thread_Data *pt= (Thread_Data *)ptr;
+	unsigned gen= pt->gen;	// The descriptor is released when the generation changes
 
 	// Starts a thread that receives data from the TCP socket
-	char buf[RCV_BUFLEN+1];
+	char buf[600];
 	struct sockaddr_in6 server;
 	short int slen;
 	struct timeval timeout;	  // To set a timeout for reading from the TCP socket
 	struct timeval tv1, tv2;
 	struct timezone tz;
 	long diff= 0, last_diff= 0;
-	int n,m;
+	char hdr[sizeof(short int) + REQ_MAX_LENGTH];	// Request header, sent at once
+	char *req= hdr + sizeof(slen);					// Filename and options
+	int on= 1;
+	gboolean sparse, spliced, net_order;
+	Fhash_State hs;
+	struct stat st;
+	Chunk_Ref *chunks= NULL;
+	uint32_t nchunks= 0;
 
 	//*********************************************************************************
 	//*      THREAD                                                                   *
 	//*********************************************************************************
-	sprintf(pt->name_str, "RCV(%u)> ", (unsigned)pt->tid);
+	sprintf(pt->name_str, "RCV(%u)> ", pt->id);
 	fprintf(stderr, "%sstarted download thread (file= '%s' from [%s]:%hu ; tid = %u)\n",
-			pt->name_str, pt->fname, addr_ipv6(&pt->ip), pt->port, (int)pt->tid);
-	buf[SND_BUFLEN]= '\0';
+			pt->name_str, pt->fname, addr_ipv6(&pt->ip), pt->port, pt->id);
+	if (pt->buf == NULL) {
+		fprintf(stderr, "%sfailed to allocate the buffer\n", pt->name_str);
+		STOP_THREAD(pt);
+	}
 
 	// TASK 5:
 	//Log("Please complete function thread.file_download_thread (TASK 5)\n");
@@ -244,6 +1204,8 @@ void *file_download_thread (void *ptr)
 	server.sin6_family 		= AF_INET6;                
 	server.sin6_port 		= htons(pt->port);       
 	server.sin6_flowinfo 	= 0;
+	server.sin6_addr		= pt->ip;
+	server.sin6_scope_id	= 0;
       
 	
 	//Connect the socket to (pt->ip : pt->port)
@@ -259,6 +1221,9 @@ void *file_download_thread (void *ptr)
 	if (setsockopt (pt->s, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0) {
 		perror("setsockopt failed\n");
 	}
+	// Headers are written whole (or with MSG_MORE), so Nagle would only delay their last segment
+	if (setsockopt(pt->s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		perror("Error setting TCP_NODELAY");
 
 	/*if (!pt->slow) {
 		Log("Does not optimize socket communication (TASK 6) ...\n");
@@ -270,16 +1235,32 @@ void *file_download_thread (void *ptr)
 	// %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 	// Send the request header
 
-	// Send the filename length
+	// The filename length, the filename and the options, in one send
 	slen= strlen(pt->fname)+1;
-	if (send(pt->s, &slen, sizeof(slen), 0) < 0) {
-		g_print("%sfailed sending header - aborting\n",
-				pt->name_str);
-		STOP_THREAD(pt);
+	memcpy(req, pt->fname, slen);
+	// Options, when the filename leaves room for them
+	if (slen + sizeof(OPT_SPARSE) <= REQ_MAX_LENGTH) {
+		memcpy(req+slen, OPT_SPARSE, sizeof(OPT_SPARSE));	// Accept sparse files
+		slen += sizeof(OPT_SPARSE);
+	}
+	if (compression && (slen + sizeof(OPT_COMPRESS) <= REQ_MAX_LENGTH)) {
+		memcpy(req+slen, OPT_COMPRESS, sizeof(OPT_COMPRESS));	// Accept compressed blocks
+		slen += sizeof(OPT_COMPRESS);
+	}
+	if (delta && !stat(pt->ofilename, &st) && S_ISREG(st.st_mode) && (st.st_size >= DELTA_MIN_SIZE)
+			&& (slen + sizeof(OPT_DELTA) <= REQ_MAX_LENGTH)) {
+		memcpy(req+slen, OPT_DELTA, sizeof(OPT_DELTA));	// Has an older copy of the file
+		slen += sizeof(OPT_DELTA);
+	}
+	if (chunk_store && (slen + sizeof(OPT_CHUNKS) <= REQ_MAX_LENGTH)) {
+		memcpy(req+slen, OPT_CHUNKS, sizeof(OPT_CHUNKS));	// Only needs the new chunks
+		slen += sizeof(OPT_CHUNKS);
 	}
-	// Send the filename (pt->fname)
-	if (send(pt->s, pt->fname, slen , 0) < 0){
-		perror("Error to send filename");
+	net_order= (slen > (short int)strlen(pt->fname)+1);	// Senders reply to options in network order
+	memcpy(hdr, &slen, sizeof(slen));
+	if (!send_all(pt, hdr, sizeof(slen) + slen, 0)) {
+		LOGF(FX_LOG_WARNING, "%sfailed sending header - aborting\n",
+				pt->name_str);
 		STOP_THREAD(pt);
 	}
 
@@ -288,72 +1269,75 @@ void *file_download_thread (void *ptr)
 
 	TEST_INTERRUPTED(pt);
 	unsigned long long len_f;
+	char rhdr[REPLY_HDR_LENGTH];
 
 	// Receive the file length and validate if the length is equal to the one received by UDP
 	
-	if ((recv(pt->s, &len_f, sizeof(len_f), 0)) < 0){
+	if (!recv_all(pt, rhdr, sizeof(rhdr))) {
 		perror("Error at receiving the file");
 		STOP_THREAD(pt);
 	}
+	len_f= get_reply_header(rhdr, net_order);
+	sparse= (len_f & SPARSE_FLAG) != 0;
+	pt->compressed= (len_f & COMPRESS_FLAG) != 0;
+	pt->delta= (len_f & DELTA_FLAG) != 0;
+	pt->chunked= (len_f & CHUNK_FLAG) != 0;
+	len_f &= ~HDR_FLAGS;
 	if( pt->flen != len_f){
 		perror("Error at receiving the file, Wrong Size");
 		STOP_THREAD(pt);
 	}
 
-	int byteStep = len_f/PERCSTEP;
-	int perc = 0,auxperc;
 	pt->total = 0;
 
 	if (gettimeofday(&tv1, &tz))
 		Log("Error getting the time to start reception\n");
 	// %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 	// Receive the file
-	// Open file
-	if ((pt->f= fopen(pt->ofilename, "w")) != NULL) {
-
-		// Receive the file
-		// Program receiving loop reading from pt->s to pt->f
-		// See the file copy example in the documentation (section 2.1.9) and adapt to a socket scenario ...
-		 do { // Loop forever until end of file
-			 	n = read(pt->s, buf, RCV_BUFLEN);
-				// write tperc
-			 	if(n > 0){
-			 		if((m = fwrite(buf, 1, n, pt->f)) != n){
-			 			perror("Error trying to write");
-			 			STOP_THREAD(pt);
-			 		}
-			 		// update pt->total with the total number of bytes received
-			 		// update the % of number of bytes (percent) received using:
-					/*
-					pt->total 	+= n;
-					auxperc 	= perc;
-					perc 		= ((float) pt->total/len_f)*100;
-
-					if(perc != auxperc && !(perc % PERCSTEP)){
-						GUI_update_bytes_sent((unsigned)pt->tid, perc, TRUE);
-					}*/
-
-					pt->total += n;
-					if( !(pt->total % byteStep) ){
-						perc 		= ((float) pt->total/len_f)*100;
-						GUI_update_bytes_sent((unsigned)pt->tid, perc, TRUE);
-					}
-
-				 	if (pt->slow){
-				 		usleep(SLOW_SLEEPTIME);
-				 	}
-
-			 	}
-		  } while (active && pt->total < len_f);
-
+	// Open a hidden file - preallocated (unless it is sparse) and written by a write-behind
+	//    thread. It is only renamed to pt->ofilename after the length and the hash are verified
+	if (!hidden_name(pt->tmpname, sizeof(pt->tmpname), pt->ofilename, pt->id, "part")) {
+		LOGF(FX_LOG_ERROR, "%soutput filename '%s' too long\n", pt->name_str, pt->ofilename);
+		pt->tmpname[0]= '\0';
+		STOP_THREAD(pt);
+	}
+	fhash_init(&hs);
+	// Plain files may be spliced from the socket to the file
+	spliced= recv_splice && !sparse && !pt->delta && !pt->chunked && !pt->compressed;
+	if ((pt->fw= fw_open(pt->tmpname, len_f, (drop_cache ? FW_DROP_CACHE : 0)
+			| (sparse ? FW_SPARSE : 0) | (spliced ? FW_SPLICE : 0))) != NULL) {
+
+		// Receive the file from pt->s to the blocks of pt->fw; publish_file checks if it ended
+		if (sparse)
+			receive_extents(pt, len_f, &hs);
+		else if (pt->delta)
+			receive_delta(pt, len_f, &hs);
+		else if (pt->chunked)
+			receive_chunks(pt, len_f, &hs, &chunks, &nchunks);
+		else if (pt->compressed)
+			receive_blocks(pt, len_f, &hs);
+		else if (spliced)
+			receive_spliced(pt, len_f, splice_hash ? &hs : NULL);
+		else
+			receive_data(pt, len_f, &hs);
+
+		// Wait for the writes
+		gboolean written= fw_close(pt->fw);
+		pt->fw= NULL;
 		if (gettimeofday(&tv2, &tz)) {
 			Log("Error getting the time to stop reception\n");
 			diff= 0;
 		} else
 			diff= (tv2.tv_sec-tv1.tv_sec)*1000000+(tv2.tv_usec-tv1.tv_usec);
+		if (!written)
+			LOGF(FX_LOG_WARNING, "%sfailed writing the file - discarded\n", pt->name_str);
+		else	// Removed by STOP_THREAD if it fails; files spliced without the hash only check the length
+			publish_file(pt, (spliced && !splice_hash) ? pt->fhash : fhash_final(&hs), chunks, nchunks);
+		free(chunks);
 	} else {
 		perror("Error creating file for writing");
-		fprintf(stderr, "%sfailed to create file '%s' for writing\n", pt->name_str, pt->fname);
+		fprintf(stderr, "%sfailed to create file '%s' for writing\n", pt->name_str, pt->tmpname);
+		pt->tmpname[0]= '\0';
 		STOP_THREAD(pt);
 	}
 
@@ -364,6 +1348,7 @@ void *file_download_thread (void *ptr)
 	sprintf(buf, "%sreceiving thread ended - read %lld of %lld bytes in %ld usec\n",
 			pt->name_str, pt->total, pt->flen, diff);
 	Log(buf);
+	log_wire(pt, diff);
 
 	STOP_THREAD(pt);
 	//*************************************************************************************
@@ -381,16 +1366,19 @@ Thread_Data *start_file_download_thread (struct in6_addr *ip_file, u_short port,
 	assert(filename != NULL);
 
 	Thread_Data *pt= new_thread_desc(FALSE, ip_file, port, filename, ofilename, f_len, fhash, slow);
+	pthread_t thread;
 
+	if (pt == NULL)
+		return NULL;
+	// Update the FList table - before the thread starts, which may report its end
+	GUI_regist_thread(pt->id, FALSE, filename, ofilename, TRUE);
 	// Start the thread
-	if (pthread_create(&pt->tid, NULL, file_download_thread, (void *)pt)) {
+	if (pthread_create(&thread, NULL, file_download_thread, (void *)pt)) {
 		fprintf(stderr, "main: error starting thread\n");
-		free (pt);
+		stop_thread_desc(0, pt, FALSE);
 		return NULL;
 	}
-
-	// Update the FList table
-	GUI_regist_thread((unsigned)pt->tid, FALSE, filename, ofilename, TRUE);
+	pthread_detach(thread);	// Never joined
 
 	return pt;
 }
@@ -400,17 +1388,641 @@ Thread_Data *start_file_download_thread (struct in6_addr *ip_file, u_short port,
 |* Functions that implement the sending thread  *|
 \************************************************/
 
+// Ask the kernel to read the next READAHEAD bytes of pt->f in the background when the
+//    position sent passes half of the bytes prefetched, which end at '*ahead'
+static void prefetch(Thread_Data *pt, unsigned long long *ahead) {
+	if ((*ahead >= pt->flen) || ((unsigned long long)pt->total + READAHEAD/2 < *ahead))
+		return;
+	posix_fadvise(fileno(pt->f), *ahead, READAHEAD, POSIX_FADV_WILLNEED);
+	*ahead += READAHEAD;
+}
+
+
+// Send the data extents of the sparse file pt->f, found with SEEK_DATA and SEEK_HOLE, each
+//    after an Extent_Header, and the final empty extent. Returns FALSE if it failed
+static gboolean send_extents(Thread_Data *pt) {
+	int fd= fileno(pt->f);
+	Extent_Header eh;
+	off_t data, hole;
+
+	while (active && !pt->finished && ((unsigned long long)pt->total < pt->flen)) {
+		if ((data= lseek(fd, pt->total, SEEK_DATA)) < 0) {
+			if (errno != ENXIO) {
+				perror("Error looking for data in the file");
+				return FALSE;
+			}
+			break;		// Hole until the end of the file
+		}
+		if ((hole= lseek(fd, data, SEEK_HOLE)) < 0) {
+			perror("Error looking for holes in the file");
+			return FALSE;
+		}
+		if ((unsigned long long)hole > pt->flen)
+			hole= pt->flen;
+		eh.offset= data;
+		eh.length= hole - data;
+		if (!send_extent_header(pt, &eh, MSG_MORE))
+			return FALSE;
+		pt->total= data;
+		while ((unsigned long long)pt->total < (unsigned long long)hole) {
+			ssize_t n= pread(fd, pt->buf, ((hole - pt->total) < pt->buflen) ? (hole - pt->total) :
+					pt->buflen, pt->total);
+			if (n <= 0) {
+				if ((n < 0) && (errno == EINTR))
+					continue;
+				perror("Error reading the file");
+				return FALSE;	// The receiver fails - the extent is not complete
+			}
+			if (!send_all(pt, pt->buf, n, 0))
+				return FALSE;
+			pt->total += n;
+			metric_add(MC_BYTES_SENT, n);
+			PUBLISH_PROGRESS(pt, pt->flen);
+			if (pt->slow)
+				usleep(SLOW_SLEEPTIME);
+			if (!active || pt->finished)
+				return FALSE;
+		}
+	}
+	if (!active || pt->finished)
+		return FALSE;
+	pt->total= pt->flen;
+	eh.offset= pt->flen;
+	eh.length= 0;
+	return send_extent_header(pt, &eh, 0);
+}
+
+
+// Read block 'n' of file 'fd' to 'buf'; returns its length, or -1 if it failed
+static int read_block(int fd, unsigned long long flen, unsigned long long n, uint8_t *buf) {
+	unsigned long long off= n*COMPRESS_BLOCK;
+	int len= (flen - off < COMPRESS_BLOCK) ? (int)(flen - off) : COMPRESS_BLOCK;
+	int done= 0;
+
+	while (done < len) {
+		ssize_t r= pread(fd, buf+done, len-done, off+done);
+		if (r <= 0) {
+			if ((r < 0) && (errno == EINTR))
+				continue;
+			return -1;
+		}
+		done += r;
+	}
+	return len;
+}
+
+
+// Return TRUE if file pt->f is worth compressing: samples of its first and middle blocks
+//    must save 1/SAMPLE_SAVING of their bytes
+static gboolean sample_compressible(Thread_Data *pt) {
+	uint8_t *raw= (uint8_t *)malloc(2*COMPRESS_BLOCK);
+	unsigned long long nblocks= (pt->flen + COMPRESS_BLOCK - 1)/COMPRESS_BLOCK;
+	long long in= 0, out= 0;
+	int n, c;
+
+	if ((raw == NULL) || (nblocks == 0)) {
+		free(raw);
+		return FALSE;
+	}
+	for (unsigned long long b= 0; b < nblocks; b += (nblocks/2 > 0) ? nblocks/2 : 1) {
+		if ((n= read_block(fileno(pt->f), pt->flen, b, raw)) < 0)
+			break;
+		c= lz_compress(raw, n, raw+COMPRESS_BLOCK, n);
+		in += n;
+		out += (c > 0) ? c : n;
+		if (b > 0)
+			break;
+	}
+	free(raw);
+	return (in > 0) && (out <= in - in/SAMPLE_SAVING);
+}
+
+
+// Send file pt->f in blocks compressed independently, each after a Block_Header. Blocks that
+//    do not compress are stored, and the next ones are sent stored without trying, for up to
+//    MAX_BACKOFF blocks. Returns FALSE if it failed
+static gboolean send_blocks(Thread_Data *pt) {
+	uint8_t *raw= (uint8_t *)malloc(2*COMPRESS_BLOCK);	// Block read and block compressed
+	int fd= fileno(pt->f);
+	int backoff= 0, skip= 0;
+	gboolean ok= (raw != NULL);
+	unsigned long long ahead= 0;
+	Block_Header bh;
+
+	for (unsigned long long b= 0; ok && ((unsigned long long)pt->total < pt->flen); b++) {
+		prefetch(pt, &ahead);
+		int n= read_block(fd, pt->flen, b, raw);
+		if (n <= 0) {
+			perror("Error reading the file");
+			ok= FALSE;
+			break;
+		}
+		bh.raw= n;
+		bh.length= 0;
+		if (skip > 0)
+			skip--;
+		else if ((bh.length= lz_compress(raw, n, raw+COMPRESS_BLOCK, n - n/COMPRESS_SAVING)) == 0) {
+			backoff= (backoff == 0) ? 1 : ((2*backoff < MAX_BACKOFF) ? 2*backoff : MAX_BACKOFF);
+			skip= backoff;
+		} else
+			backoff= 0;
+		if (bh.length == 0)
+			bh.length= n;	// Stored
+		ok= send_block_header(pt, &bh, MSG_MORE)
+				&& send_all(pt, (bh.length < bh.raw) ? raw+COMPRESS_BLOCK : raw, bh.length, 0);
+		pt->total += n;
+		pt->wire += BLOCK_HDR_LENGTH + bh.length;
+		metric_add(MC_BYTES_SENT, n);
+		PUBLISH_PROGRESS(pt, pt->flen);
+		if (pt->slow)
+			usleep(SLOW_SLEEPTIME);
+		if (!active || pt->finished)
+			ok= FALSE;
+	}
+	free(raw);
+	return ok;
+}
+
+
+// Send the pending copy of 'copy->count' blocks, if any
+static gboolean delta_send_copy(Thread_Data *pt, Delta_Op *copy, uint32_t block) {
+	if (copy->count == 0)
+		return TRUE;
+	if (!send_delta_op(pt, copy, MSG_MORE))
+		return FALSE;
+	pt->total += (long long)copy->count*block;
+	pt->wire += DELTA_OP_LENGTH;	// The blocks are copied by the receiver, not sent
+	PUBLISH_PROGRESS(pt, pt->flen);
+	copy->count= 0;
+	return TRUE;
+}
+
+
+// Send the 'len' bytes of 'buf' as literals, after the pending copy
+static gboolean delta_send_literal(Thread_Data *pt, Delta_Op *copy, uint32_t block,
+		const uint8_t *buf, size_t len) {
+	Delta_Op op= { DELTA_LITERAL, 0, 0 };
+
+	if (!delta_send_copy(pt, copy, block))
+		return FALSE;
+	for (size_t done= 0; done < len; done += op.count) {
+		op.count= (len - done < DELTA_MAX_LITERAL) ? len - done : DELTA_MAX_LITERAL;
+		if (!send_delta_op(pt, &op, MSG_MORE) || !send_all(pt, buf+done, op.count, MSG_MORE))
+			return FALSE;
+		pt->total += op.count;
+		pt->wire += DELTA_OP_LENGTH + op.count;
+		metric_add(MC_BYTES_SENT, op.count);
+		PUBLISH_PROGRESS(pt, pt->flen);
+		if (pt->slow)
+			usleep(SLOW_SLEEPTIME);
+	}
+	return TRUE;
+}
+
+
+// Send file pt->f as a delta of the copy of the receiver: receive its signatures and
+//    look for their blocks at every byte of the file with the rolling checksum. Blocks found
+//    are sent as copies, coalesced when consecutive, and the bytes between them as literals
+//    Returns FALSE if it failed
+static gboolean send_delta(Thread_Data *pt) {
+	int fd= fileno(pt->f);
+	Delta_Sig_Header sh;
+	Delta_Sig *sig= NULL;
+	char hdr[DELTA_SIG_HDR_LENGTH], sbuf[DELTA_SIG_BATCH*DELTA_SIG_LENGTH];
+	const char *hp= hdr;
+	Delta_Index di= { NULL, 0, 0, NULL, NULL };
+	Delta_Op copy= { DELTA_COPY, 0, 0 };
+	Delta_Op end= { DELTA_END, 0, 0 };
+	uint8_t *buf= NULL;
+	size_t bsize, bytes;
+	size_t fill= 0, p= 0, lit= 0;		// Bytes in 'buf', window start, and literal start
+	unsigned long long base= 0;			// File offset of buf[0]
+	uint32_t weak= 0;
+	gboolean rolling= FALSE, eof= (pt->flen == 0), ok= FALSE;
+	int32_t hint= -1;
+
+	// Receive the signatures
+	if (!recv_all(pt, hdr, sizeof(hdr)) || !codec_get_u32(&hp, hdr+sizeof(hdr), &sh.block)
+			|| !codec_get_u32(&hp, hdr+sizeof(hdr), &sh.count) || (sh.block < DELTA_MIN_BLOCK)
+			|| (sh.block > DELTA_MAX_BLOCK) || (sh.count > DELTA_MAX_SIGS)) {
+		LOGF(FX_LOG_WARNING, "%sinvalid delta signatures - aborting\n", pt->name_str);
+		return FALSE;
+	}
+	bytes= (size_t)sh.count*sizeof(Delta_Sig);
+	bsize= (4*sh.block > DELTA_BUFFER) ? 4*sh.block : DELTA_BUFFER;
+	if (((sig= (Delta_Sig *)malloc(bytes ? bytes : 1)) == NULL)
+			|| ((buf= (uint8_t *)malloc(bsize)) == NULL))
+		goto out;
+	for (uint32_t b= 0; b < sh.count; ) {
+		uint32_t n= (sh.count - b < DELTA_SIG_BATCH) ? sh.count - b : DELTA_SIG_BATCH;
+		const char *sp= sbuf;
+		if (!recv_all(pt, sbuf, n*DELTA_SIG_LENGTH))
+			goto out;
+		for (; n > 0; n--, b++) {
+			codec_get_u32(&sp, sbuf+sizeof(sbuf), &sig[b].weak);
+			codec_get_u32(&sp, sbuf+sizeof(sbuf), &sig[b].strong[0]);
+			codec_get_u32(&sp, sbuf+sizeof(sbuf), &sig[b].strong[1]);
+		}
+	}
+	pt->wire += DELTA_SIG_HDR_LENGTH + (unsigned long long)sh.count*DELTA_SIG_LENGTH;
+	if (!delta_index_init(&di, sig, sh.count))
+		goto out;
+
+	// Look for the blocks in a window moved over the file
+	for (;;) {
+		if ((fill - p < sh.block) && !eof) {
+			// Keep the pending literals and read more of the file
+			memmove(buf, buf+lit, fill-lit);
+			base += lit;
+			fill -= lit;
+			p -= lit;
+			lit= 0;
+			while (!eof && (fill < bsize)) {
+				size_t want= (pt->flen - base - fill < bsize - fill) ? pt->flen - base - fill : bsize - fill;
+				ssize_t r= pread(fd, buf+fill, want, base+fill);
+				if (r < 0) {
+					if (errno == EINTR)
+						continue;
+					perror("Error reading the file");
+					goto out;
+				}
+				fill += r;
+				eof= (r == 0) || (base+fill >= pt->flen);
+			}
+			if (!active || pt->finished)
+				goto out;
+			continue;
+		}
+		if (fill - p < sh.block)
+			break;		// End of the file
+		if (!rolling) {
+			weak= delta_weak(buf+p, sh.block);
+			rolling= TRUE;
+		}
+		int32_t b= (sh.count > 0) ? delta_find(&di, weak, buf+p, sh.block, hint) : -1;
+		if (b >= 0) {
+			if (((p > lit) && !delta_send_literal(pt, &copy, sh.block, buf+lit, p-lit))
+					|| ((copy.count > 0) && (copy.block+copy.count != (unsigned long long)b)
+						&& !delta_send_copy(pt, &copy, sh.block)))
+				goto out;
+			if (copy.count == 0)
+				copy.block= b;
+			copy.count++;
+			p += sh.block;
+			lit= p;
+			hint= b + 1;
+			rolling= FALSE;
+			continue;
+		}
+		if (p + sh.block < fill)
+			weak= delta_roll(weak, buf[p], buf[p+sh.block], sh.block);
+		else
+			rolling= FALSE;
+		p++;
+		if (p - lit >= DELTA_MAX_LITERAL) {
+			if (!delta_send_literal(pt, &copy, sh.block, buf+lit, p-lit))
+				goto out;
+			lit= p;
+		}
+	}
+	ok= delta_send_literal(pt, &copy, sh.block, buf+lit, fill-lit) && delta_send_copy(pt, &copy, sh.block)
+			&& ((unsigned long long)pt->total == pt->flen) && send_delta_op(pt, &end, 0);
+	pt->wire += DELTA_OP_LENGTH;
+
+out:
+	delta_index_free(&di);
+	free(sig);
+	free(buf);
+	return ok && active && !pt->finished;
+}
+
+
+// Send file pt->f as a list of chunks: send the list, receive the bitmap of the chunks the
+//    receiver needs, and send them in order, reading runs of consecutive chunks together
+//    Returns FALSE if it failed
+static gboolean send_chunks(Thread_Data *pt) {
+	int fd= fileno(pt->f);
+	uint32_t n, i;
+	Chunk_Ref *list= chunk_file(fd, &n);
+	unsigned long long count= n, off= 0, start= 0, run= 0;
+	uint8_t *need= NULL;
+	gboolean ok= FALSE;
+
+	if ((list == NULL) || (count > CHUNK_MAX_COUNT)
+			|| ((need= (uint8_t *)malloc((count+7)/8 ? (count+7)/8 : 1)) == NULL)) {
+		LOGF(FX_LOG_WARNING, "%sfailed chunking the file\n", pt->name_str);
+		goto out;
+	}
+	if (!send_chunk_list(pt, list, count) || !recv_all(pt, need, (count+7)/8))
+		goto out;
+	pt->wire += CHUNK_COUNT_LENGTH + count*CHUNK_REF_LENGTH + (count+7)/8;
+	for (i= 0; i <= n; i++) {
+		if ((i < n) && (need[i/8] & (1 << (i%8)))) {
+			if (run == 0)
+				start= off;
+			run += list[i].length;
+		} else if (run > 0) {
+			// Send the run of chunks needed that ends here
+			for (unsigned long long done= 0; done < run; ) {
+				ssize_t r= pread(fd, pt->buf, (run - done < (unsigned)pt->buflen) ? run - done :
+						(unsigned)pt->buflen, start + done);
+				if (r <= 0) {
+					if ((r < 0) && (errno == EINTR))
+						continue;
+					perror("Error reading the file");
+					goto out;
+				}
+				if (!send_all(pt, pt->buf, r, 0))
+					goto out;
+				done += r;
+				pt->wire += r;
+				metric_add(MC_BYTES_SENT, r);
+				if (pt->slow)
+					usleep(SLOW_SLEEPTIME);
+				if (!active || pt->finished)
+					goto out;
+			}
+			run= 0;
+		}
+		if (i < n) {
+			off += list[i].length;
+			pt->total= off;
+			PUBLISH_PROGRESS(pt, pt->flen);
+		}
+	}
+	ok= ((unsigned long long)pt->total == pt->flen);
+
+out:
+	free(list);
+	free(need);
+	return ok && active && !pt->finished;
+}
+
+
+// Send file pt->f reading IO_QUANTUM bytes in each turn of device 'dev', shared with the
+//    other senders of the device (iosched.h). Returns FALSE if it failed
+static gboolean send_scheduled(Thread_Data *pt, Io_Device *dev) {
+	char *quantum= (char *)malloc(IO_QUANTUM);
+	int fd= fileno(pt->f);
+
+	if (quantum == NULL)
+		return FALSE;
+	while ((unsigned long long)pt->total < pt->flen) {
+		size_t want= (pt->flen - pt->total < IO_QUANTUM) ? pt->flen - pt->total : IO_QUANTUM;
+		size_t got= 0, n;
+
+		io_begin(dev, io_key(fd, pt->total));
+		while (got < want) {
+			ssize_t r= pread(fd, quantum+got, want-got, pt->total+got);
+			if (r <= 0) {
+				if ((r < 0) && (errno == EINTR))
+					continue;
+				break;
+			}
+			got += r;
+		}
+		io_end(dev);
+		if (got < want) {
+			perror("Error reading the file");
+			break;
+		}
+		for (size_t sent= 0; sent < got; sent += n) {
+			n= (got - sent < (size_t)pt->buflen) ? got - sent : (size_t)pt->buflen;
+			if (!send_all(pt, quantum+sent, n, 0) || !active || pt->finished)
+				goto out;
+			pt->total += n;
+			metric_add(MC_BYTES_SENT, n);
+			PUBLISH_PROGRESS(pt, pt->flen);
+			if (pt->slow)
+				usleep(SLOW_SLEEPTIME);
+		}
+	}
+
+out:
+	free(quantum);
+	return ((unsigned long long)pt->total == pt->flen) && active && !pt->finished;
+}
+
+
+// Send the 'cnt' buffers of 'v' (modified) to pt->s with sendmsg and 'flags', counting in
+//    '*calls' the zerocopy sends. Zerocopy sends fall back to copies when the kernel cannot
+//    pin more pages (ENOBUFS). Returns FALSE if it failed
+static gboolean sendv_all(Thread_Data *pt, struct iovec *v, int cnt, int flags, unsigned *calls) {
+	struct msghdr msg;
+
+	while (cnt > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov= v;
+		msg.msg_iovlen= cnt;
+		ssize_t m= sendmsg(pt->s, &msg, flags);
+		if (m < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == ENOBUFS) && (flags & MSG_ZEROCOPY)) {
+				flags &= ~MSG_ZEROCOPY;
+				continue;
+			}
+			perror("Error sending the file");
+			return FALSE;
+		}
+		if (flags & MSG_ZEROCOPY)
+			(*calls)++;
+		for (; (cnt > 0) && ((size_t)m >= v->iov_len); v++, cnt--)
+			m -= v->iov_len;
+		if (cnt > 0) {
+			v->iov_base= (char *)v->iov_base + m;
+			v->iov_len -= m;
+		}
+	}
+	return TRUE;
+}
+
+
+// Wait until the kernel releases the buffers of the 'calls' zerocopy sends of socket 's',
+//    reading the notifications of the error queue and counting them in '*done'; sets '*copied'
+//    if it copied the data instead. The sender thread 'pt' gives up after READ_TIMEOUT seconds
+//    or when it is stopped; without 'pt' it waits until all are released
+//    Returns FALSE if it failed or timed out
+static gboolean zerocopy_wait(Thread_Data *pt, int s, unsigned calls, unsigned *done, gboolean *copied) {
+	struct pollfd pfd= { s, 0, 0 };		// POLLERR is always reported
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	time_t start= time(NULL);
+
+	while (*done < calls) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control= control;
+		msg.msg_controllen= sizeof(control);
+		if (recvmsg(s, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno != EAGAIN) || ((pt != NULL)
+					&& (!active || pt->finished || (time(NULL) - start >= READ_TIMEOUT))))
+				return FALSE;
+			if ((poll(&pfd, 1, 1000) > 0) && !(pfd.revents & POLLERR))
+				usleep(100000);		// Sockets shut down do not block poll
+			continue;
+		}
+		for (cm= CMSG_FIRSTHDR(&msg); cm != NULL; cm= CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *ee= (struct sock_extended_err *)CMSG_DATA(cm);
+			if ((ee->ee_errno != 0) || (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY))
+				continue;
+			*done += ee->ee_data - ee->ee_info + 1;	// Range of sends released
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				*copied= TRUE;
+		}
+	}
+	return TRUE;
+}
+
+
+// Zerocopy send of a file in memory, with the buffers the kernel may still use
+typedef struct Zerocopy_Send {
+	char hdr[REPLY_HDR_LENGTH];	// Reply header
+	File_Cache_Entry *ce;		// File sent
+	int s;						// Socket (a copy, for the reaper)
+	unsigned calls, done;		// Zerocopy sends, and the ones released by the kernel
+	gboolean copied;			// The kernel copied some of the sends
+} Zerocopy_Send;
+
+
+// Reaper of a failed zerocopy send: waits until the kernel releases its buffers and frees it
+static void *zerocopy_reaper(void *ptr) {
+	Zerocopy_Send *zs= (Zerocopy_Send *)ptr;
+
+	if (!zerocopy_wait(NULL, zs->s, zs->calls, &zs->done, &zs->copied)) {
+		perror("Error waiting for the zerocopy send - the file stays in memory");
+		close(zs->s);
+		return NULL;
+	}
+	close(zs->s);
+	file_cache_release(zs->ce);
+	free(zs);
+	return NULL;
+}
+
+
+// Release the zerocopy send 'zs' after the send failed: the connection is shut down and, if
+//    the kernel has not released all the buffers, they are freed later by a reaper thread
+static void zerocopy_abort(Thread_Data *pt, Zerocopy_Send *zs) {
+	pthread_t tid;
+
+	if (zs->done >= zs->calls) {
+		file_cache_release(zs->ce);
+		free(zs);
+		return;
+	}
+	LOGF(FX_LOG_WARNING, "%s%u zerocopy sends not released by the kernel - shutting down\n",
+			pt->name_str, zs->calls - zs->done);
+	shutdown(pt->s, SHUT_RDWR);		// The kernel drops the data when the peer is gone
+	if (((zs->s= dup(pt->s)) < 0) || pthread_create(&tid, NULL, zerocopy_reaper, zs)) {
+		perror("Error starting the zerocopy reaper - the file stays in memory");
+		if (zs->s >= 0)
+			close(zs->s);
+		return;
+	}
+	pthread_detach(tid);
+}
+
+
+// Return TRUE if the next file in memory must be copied, after the kernel copied zerocopy sends
+static gboolean zerocopy_skip(void) {
+	int skip= __atomic_load_n(&zc_skip, __ATOMIC_RELAXED);
+
+	return (skip > 0) && __atomic_compare_exchange_n(&zc_skip, &skip, skip-1, FALSE,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+
+// Record if the kernel copied a zerocopy send (e.g. to the loopback or a device without
+//    scatter-gather): the next files are copied, for up to ZEROCOPY_BACKOFF files
+static void zerocopy_result(gboolean copied) {
+	int backoff= 0;
+
+	if (copied) {
+		backoff= __atomic_load_n(&zc_backoff, __ATOMIC_RELAXED);
+		backoff= (backoff == 0) ? 1 : ((2*backoff < ZEROCOPY_BACKOFF) ? 2*backoff : ZEROCOPY_BACKOFF);
+		__atomic_store_n(&zc_skip, backoff, __ATOMIC_RELAXED);
+		metric_add(MC_ZEROCOPY_COPIED, 1);
+	}
+	__atomic_store_n(&zc_backoff, backoff, __ATOMIC_RELAXED);
+}
+
+
+// Send the reply header 'hdr' (REPLY_HDR_LENGTH bytes) and the 'len' bytes of file 'data' (from the file cache entry
+//    'ce', released here). Files of ZEROCOPY_MIN bytes or more are sent with MSG_ZEROCOPY, in
+//    one sendmsg, when it is enabled; the header and the entry are kept until the kernel
+//    releases them, by a reaper if the send fails. Other files have the header and the first
+//    block in one writev, so files up to pt->buflen bytes are sent in one call, and the rest in
+//    blocks. Returns FALSE if it failed
+static gboolean send_cached(Thread_Data *pt, const char *hdr, File_Cache_Entry *ce,
+		const char *data, size_t len) {
+	size_t first= (len < (size_t)pt->buflen) ? len : (size_t)pt->buflen, n;
+	struct iovec iov[2]= { { (void *)hdr, REPLY_HDR_LENGTH }, { (void *)data, first } };
+	Zerocopy_Send *zs= NULL;
+	unsigned calls= 0;
+	gboolean ok= TRUE;
+	int on= 1;
+
+	if (zerocopy && (len >= ZEROCOPY_MIN) && !zerocopy_skip()
+			&& !setsockopt(pt->s, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on))
+			&& ((zs= (Zerocopy_Send *)calloc(1, sizeof(Zerocopy_Send))) != NULL)) {
+		memcpy(zs->hdr, hdr, REPLY_HDR_LENGTH);
+		zs->ce= ce;
+		iov[0].iov_base= zs->hdr;
+		iov[1].iov_len= len;
+		if (!sendv_all(pt, iov, 2, MSG_ZEROCOPY, &zs->calls)
+				|| ((zs->calls > 0) && !zerocopy_wait(pt, pt->s, zs->calls, &zs->done, &zs->copied))) {
+			zerocopy_abort(pt, zs);
+			return FALSE;
+		}
+		if (zs->calls > 0) {
+			metric_add(MC_ZEROCOPY_SENDS, 1);
+			zerocopy_result(zs->copied);
+		}
+		free(zs);
+		first= len;
+	} else
+		ok= sendv_all(pt, iov, 2, 0, &calls);
+	for (size_t sent= 0; ok && (sent < len); sent += n) {
+		n= (sent == 0) ? first : ((len - sent < (size_t)pt->buflen) ? len - sent : (size_t)pt->buflen);
+		if ((sent > 0) && !send_all(pt, data+sent, n, 0)) {
+			ok= FALSE;
+			break;
+		}
+		pt->total += n;
+		metric_add(MC_BYTES_SENT, n);
+		PUBLISH_PROGRESS(pt, pt->flen);
+		ok= active && !pt->finished;
+	}
+	file_cache_release(ce);
+	return ok;
+}
+
+
 // Starts a thread for sending a file
 void *snd_file_thread (void *ptr)
 {
 	assert(ptr!=NULL);
 	Thread_Data *pt= (Thread_Data *)ptr;
+	unsigned gen= pt->gen;	// The descriptor is released when the generation changes
 
 	// Starts a thread that receives data from the TCP socket
-	char buf[SND_BUFLEN+1];
-	char nome_f[257];
-	int n= 0;
+	char buf[600];
+	char hdr[sizeof(short int) + REQ_MAX_LENGTH];	// Request header
+	char *nome_f= hdr + sizeof(short int);			// Filename and options
+	int n= 0, on= 1;
+	ssize_t got;
 	short int slen;
+	gboolean sparse= FALSE, compress= FALSE, want_delta= FALSE, want_chunks= FALSE, net_order;
+	char rhdr[REPLY_HDR_LENGTH];	// Reply header
+	unsigned long long ahead= 0;
+	Io_Device *dev;
+	File_Cache_Entry *ce;
+	const char *cdata;
+	size_t clen;
+	struct stat st;
 	struct timeval timeout;	  // To set a timeout for reading from the TCP socket
 	struct timeval tv1, tv2;
 	struct timezone tz;
@@ -419,10 +2031,12 @@ void *snd_file_thread (void *ptr)
 	// *************************************************************************************
 	// *      THREAD                                                                   *
 	// *************************************************************************************
-	sprintf(pt->name_str, "SND(%u)> ", (unsigned)pt->tid);
-	fprintf(stderr, "%s started sending thread (tid = %u)\n", pt->name_str,
-			(unsigned)pt->tid);
-	buf[RCV_BUFLEN]= '\0';
+	sprintf(pt->name_str, "SND(%u)> ", pt->id);
+	fprintf(stderr, "%s started sending thread (tid = %u)\n", pt->name_str, pt->id);
+	if (pt->buf == NULL) {
+		fprintf(stderr, "%sfailed to allocate the buffer\n", pt->name_str);
+		STOP_THREAD(pt);
+	}
 
 	// Set timeout for reading
 	timeout.tv_sec= READ_TIMEOUT;	// Segundos
@@ -438,62 +2052,112 @@ void *snd_file_thread (void *ptr)
 		//	e.g. SO_SNDBUF, SO_RECVBUF, timeout, etc.
 		// The two best groups will receive bonus points at the end.
 	//}
+	// The reply header goes with the first data (MSG_MORE or writev); the last segment of a
+	//    file must not wait for the ACK of the previous one
+	if (setsockopt(pt->s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		perror("Error setting TCP_NODELAY");
 
 	// %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
-	// Read the request header
+	// Read the request header, usually in one read: the receiver sends it at once and
+	//    sends nothing else before the reply
 
 	// Read and validate the filename length
-	if (!active || pt->finished || read(pt->s, &slen, sizeof(slen)) != sizeof(slen)) {
-		g_print("%sdid not receive the file name length - aborting\n", pt->name_str);
+	do
+		got= recv(pt->s, hdr, sizeof(hdr), 0);
+	while ((got < 0) && (errno == EINTR));
+	if (!active || pt->finished || (got <= 0) || (((size_t)got < sizeof(slen))
+			&& !recv_all(pt, hdr+got, sizeof(slen)-got))) {
+		LOGF(FX_LOG_WARNING, "%sdid not receive the file name length - aborting\n", pt->name_str);
 		STOP_THREAD(pt);
 	}
-	if (slen> 257) {
-		g_print("%sinvalid file name length - aborting\n", pt->name_str);
+	memcpy(&slen, hdr, sizeof(slen));
+	if ((slen <= 0) || (slen > REQ_MAX_LENGTH) || ((size_t)got > sizeof(slen) + slen)) {
+		LOGF(FX_LOG_WARNING, "%sinvalid file name length - aborting\n", pt->name_str);
 		STOP_THREAD(pt);
 	}
 	TEST_INTERRUPTED(pt);
 	// Read and validate the filename string
-	if (!active || pt->finished || read(pt->s, nome_f, slen) != slen) {
-		g_print("%sdid not receive the file name - aborting\n", pt->name_str);
+	if ((size_t)got < sizeof(slen))
+		got= sizeof(slen);	// recv_all read the rest of the length
+	if (!active || pt->finished || !recv_all(pt, hdr+got, sizeof(slen)+slen-got)) {
+		LOGF(FX_LOG_WARNING, "%sdid not receive the file name - aborting\n", pt->name_str);
 		STOP_THREAD(pt);
 	}
 	if (nome_f[slen-1] != '\0') {
-		g_print("%sfile name does not have '\\0'- aborting\n", pt->name_str);
+		LOGF(FX_LOG_WARNING, "%sfile name does not have '\\0'- aborting\n", pt->name_str);
 		STOP_THREAD(pt);
 	}
+	// Options after the filename; older receivers send none, and read the reply in host order
+	net_order= (nome_f+strlen(nome_f)+1 < nome_f+slen);
+	for (const char *opt= nome_f+strlen(nome_f)+1; opt < nome_f+slen; opt += strlen(opt)+1)
+		if (!strcmp(opt, OPT_SPARSE))
+			sparse= TRUE;
+		else if (!strcmp(opt, OPT_COMPRESS))
+			compress= TRUE;
+		else if (!strcmp(opt, OPT_DELTA))
+			want_delta= TRUE;
+		else if (!strcmp(opt, OPT_CHUNKS))
+			want_chunks= TRUE;
 	TEST_INTERRUPTED(pt);
 
-	GUI_update_filename((unsigned)pt->tid, nome_f, TRUE);
+	GUI_update_filename(pt->id, nome_f, TRUE);
 	pt->total= 0;
 	pt->flen= 0L;
 
 	// Get the file details
 	const char *fullname= NULL;
-	if (!get_File_fullname(nome_f, &fullname, TRUE)) {
+	if (!ft_fullname(&file_table, nome_f, &fullname)) {
 		if (fullname != NULL)
 			free((void *)fullname);
-		g_print("%sfile %s not found. Ending connection\n", pt->name_str, nome_f);
+		LOGF(FX_LOG_WARNING, "%sfile %s not found. Ending connection\n", pt->name_str, nome_f);
 
 		// Sends the file length of 0 to the receiver
 		if (send(pt->s, &pt->flen, sizeof(pt->flen), 0) < 0) {
-			g_print("%sfailed sending header - aborting\n",
+			LOGF(FX_LOG_WARNING, "%sfailed sending header - aborting\n",
 					pt->name_str);
 		}
 		STOP_THREAD(pt);
 	}
 
-	g_print("%ssending file %s\n", pt->name_str, nome_f);
+	LOGF(FX_LOG_INFO, "%ssending file %s\n", pt->name_str, nome_f);
 
-		// Open file
-	if ((pt->f= fopen(fullname, "r")) != NULL) {
-		// TASK 4 - Complete the sending of the headers and the file contents
-		Log("thread.c - snd_file_thread is incomplete (Task 4)\n");
+	// Small files sent often come from memory, when they are sent whole
+	if (!want_delta && !want_chunks && !compress && !pt->slow
+			&& ((ce= file_cache_get(fullname, &cdata, &clen)) != NULL)) {
+		free((void *)fullname);
+		pt->flen= clen;
+		if (gettimeofday(&tv1, &tz))
+			Log("Error getting the time to start sending\n");
+		put_reply_header(rhdr, pt->flen, net_order);
+		gboolean ok= send_cached(pt, rhdr, ce, cdata, clen);
+		if (!ok) {
+			LOGF(FX_LOG_WARNING, "%sfailed sending the file - aborting\n", pt->name_str);
+			STOP_THREAD(pt);
+		}
 
+		// Open file
+	} else if ((pt->f= fopen(fullname, "r")) != NULL) {
 		// %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 		pt->flen= get_filesize(fullname);
-		// Send the reply header with the file length
-		// ...
-
+		free((void *)fullname);
+		posix_fadvise(fileno(pt->f), 0, 0, POSIX_FADV_SEQUENTIAL);	// Larger readahead
+		// Only files with holes are sent sparse, when the receiver accepts it
+		sparse= sparse && !fstat(fileno(pt->f), &st) && ((unsigned long long)st.st_blocks*512 < pt->flen);
+		// Other files are sent as deltas when the receiver has a copy, as chunks when it has
+		//    a chunk store, or compressed when the receiver accepts it and samples compress well
+		pt->delta= !sparse && want_delta;
+		pt->chunked= !sparse && !pt->delta && want_chunks;
+		pt->compressed= !sparse && !pt->delta && !pt->chunked && compress && sample_compressible(pt);
+		// Send the reply header with the file length, in the segment of the first data; deltas
+		//    and chunks wait for the receiver
+		unsigned long long hlen= pt->flen | (sparse ? SPARSE_FLAG : 0)
+				| (pt->compressed ? COMPRESS_FLAG : 0) | (pt->delta ? DELTA_FLAG : 0)
+				| (pt->chunked ? CHUNK_FLAG : 0);
+		put_reply_header(rhdr, hlen, net_order);
+		if (!send_all(pt, rhdr, sizeof(rhdr), (!pt->delta && !pt->chunked && (pt->flen > 0)) ? MSG_MORE : 0)) {
+			LOGF(FX_LOG_WARNING, "%sfailed sending header - aborting\n", pt->name_str);
+			STOP_THREAD(pt);
+		}
 
 		// %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 		// Send the file
@@ -501,22 +2165,55 @@ void *snd_file_thread (void *ptr)
 		if (gettimeofday(&tv1, &tz))
 			Log("Error getting the time to start sending\n");
 
-		// Send the file contents from pt->f to pt->s
-		// See the file copy example in the documentation (section 2.1.9) and adapt to a socket scenario ...
-		// do { // Loop forever until end of file
-		//	 n= fread(buf, 1, SND_BUFLEN, pt->f);
-		//		write to socket
-		//		update pt->total with the total number of bytes received
-		// 		update the % of file received using:
-		//			GUI_update_bytes_sent((unsigned)pt->tid, perc, TRUE);
-		//		where perc is an integer between 0 and 100 (percentage of the file received)
-		//   ...
-		//	 if (pt->slow)
-		//		usleep(SLOW_SLEEPTIME);
-		//  } while (active && (n > 0) && ???? );
+		if (sparse) {
+			// Send only the data extents of a sparse file
+			if (!send_extents(pt)) {
+				LOGF(FX_LOG_WARNING, "%sfailed sending the file - aborting\n", pt->name_str);
+				STOP_THREAD(pt);
+			}
+		} else if (pt->delta) {
+			// Send the differences to the copy of the receiver
+			if (!send_delta(pt)) {
+				LOGF(FX_LOG_WARNING, "%sfailed sending the file - aborting\n", pt->name_str);
+				STOP_THREAD(pt);
+			}
+		} else if (pt->chunked) {
+			// Send the chunks that the receiver does not have
+			if (!send_chunks(pt)) {
+				LOGF(FX_LOG_WARNING, "%sfailed sending the file - aborting\n", pt->name_str);
+				STOP_THREAD(pt);
+			}
+		} else if (pt->compressed) {
+			// Send the file in compressed blocks
+			if (!send_blocks(pt)) {
+				LOGF(FX_LOG_WARNING, "%sfailed sending the file - aborting\n", pt->name_str);
+				STOP_THREAD(pt);
+			}
+		} else if ((io_sched != FX_IO_SCHED_OFF)
+				&& ((dev= io_device_get(fileno(pt->f), io_sched == FX_IO_SCHED_ALL, io_slots)) != NULL)) {
+			// Read the file in turns with the other senders of the same disk
+			if (!send_scheduled(pt, dev)) {
+				LOGF(FX_LOG_WARNING, "%sfailed sending the file - aborting\n", pt->name_str);
+				STOP_THREAD(pt);
+			}
+		} else {
+			// Send the file contents from pt->f to pt->s
+			do { // Loop until end of file
+				prefetch(pt, &ahead);
+				n= fread(pt->buf, 1, pt->buflen, pt->f);
+				if (!send_all(pt, pt->buf, n, 0))
+					STOP_THREAD(pt);
+				pt->total += n;
+				metric_add(MC_BYTES_SENT, n);
+				PUBLISH_PROGRESS(pt, pt->flen);
+				if (pt->slow)
+					usleep(SLOW_SLEEPTIME);
+				TEST_INTERRUPTED(pt);
+			} while (active && (n > 0) && (pt->total < pt->flen));
+		}
 
 		// Close file
-		if ((pt->self==pt) && (pt->f!=NULL)) {
+		if (valid_thread_desc(pt, gen) && (pt->f!=NULL)) {
 			fclose(pt->f);
 			pt->f= NULL;
 		}
@@ -524,10 +2221,11 @@ void *snd_file_thread (void *ptr)
 
 	} else {
 
+		free((void *)fullname);
 		perror("Error opening file - sending length 0");
 		// Sends the file length
 		if (send(pt->s, &pt->flen, sizeof(pt->flen), 0) < 0) {
-			g_print("%sfailed sending header - aborting\n",
+			LOGF(FX_LOG_WARNING, "%sfailed sending header - aborting\n",
 					pt->name_str);
 		}
 		STOP_THREAD(pt);
@@ -543,6 +2241,7 @@ void *snd_file_thread (void *ptr)
 	sprintf(buf, "%ssending thread ended - sent %lld of %lld bytes in %ld usec\n",
 			pt->name_str, pt->total, pt->flen, diff);
 	Log(buf);
+	log_wire(pt, diff);
 
 	STOP_THREAD(pt);
 	//*********************************************************************************
@@ -558,19 +2257,24 @@ Thread_Data *start_snd_file_thread (int msgsock, struct in6_addr *ip, u_short po
 		return NULL;
 
 	Thread_Data *pt= new_thread_desc(TRUE, ip, port, "", "", 0L, 0, slow);
+	pthread_t thread;
+	char tmp_buf[100];
 
+	if (pt == NULL)
+		return NULL;
 	// Store the socket information
 	pt->s= msgsock;
+	// Adds to the FList table - before the thread starts, which may report its end
+	sprintf(tmp_buf, "to [%s] : %hu", addr_ipv6(ip), port);
+	GUI_regist_thread(pt->id, TRUE, "?", tmp_buf, TRUE);
 	// Start the thread
-	if (pthread_create(&pt->tid, NULL, snd_file_thread, (void *)pt)) {
+	if (pthread_create(&thread, NULL, snd_file_thread, (void *)pt)) {
 		fprintf(stderr, "main: error starting thread\n");
-		free (pt);
+		pt->s= 0;	// The caller closes the socket
+		stop_thread_desc(0, pt, FALSE);
 		return NULL;
 	}
-	// Adds to the FList table
-	char tmp_buf[100];
-	sprintf(tmp_buf, "to [%s] : %hu", addr_ipv6(ip), port);
-	GUI_regist_thread((unsigned)pt->tid, TRUE, "?", tmp_buf, TRUE);
+	pthread_detach(thread);	// Never joined
 
 	return pt;
 }
@@ -581,69 +2285,136 @@ Thread_Data *start_snd_file_thread (int msgsock, struct in6_addr *ip, u_short po
 
 
 // Stop the transmission of all files
+//   In one pass over the thread table; the GUI list is cleared at once
 void stop_all_threads_GUI(gboolean lock_glib) {
-	GtkTreeIter	iter;
-	GtkTreeModel *list_store;
-	gboolean valid;
-
-	if (lock_glib) {
-		/* get GTK thread lock */
-		gdk_threads_enter ();
+	GArray *ends= g_array_new(FALSE, FALSE, sizeof(Transfer_End));
+	GHashTableIter iter;
+	gpointer value;
+	Transfer_End end;
+	guint i;
+
+	LOCK_MUTEX(&tmutex, "lock_t4\n");
+	if (tcp_conn != NULL) {
+		g_hash_table_iter_init(&iter, tcp_conn);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			Thread_Data *pt= (Thread_Data *) value;
+			g_hash_table_iter_remove(&iter);
+			// Stop thread - it releases the descriptor
+			detach_thread_desc(pt, &end);
+			g_array_append_val(ends, end);
+			if (pt->s > 0)
+				shutdown(pt->s, SHUT_RDWR);
+		}
 	}
-	list_store= GTK_TREE_MODEL(main_window->listThread);
-	// Get the first iter in the list
-	valid = gtk_tree_model_get_iter_first (list_store, &iter);
+	UNLOCK_MUTEX(&tmutex, "unlock_t4\n");
+	for (i= 0; i < ends->len; i++)
+		report_end_thread(&g_array_index(ends, Transfer_End, i), lock_glib, FALSE);
+	g_array_free(ends, TRUE);
+	GUI_clear_threads(lock_glib);
+}
 
-	while (valid)
-	{
-		// Walk through the list, reading each row
-		unsigned tid;
 
-		// Make sure you terminate calls to gtk_tree_model_get() with a '-1' value
-		gtk_tree_model_get (list_store, &iter, 0, &tid, -1);
+// Stop transfer 'tid'
+void fx_stop_transfer(unsigned tid) {
+	if (tid == 0) {
+		Log("Invalid transfer TID\n");
+		return;
+	}
+	stop_thread_desc(tid, NULL, FALSE);
+}
 
-		// Stop thread
-		stop_thread_desc(tid, NULL, FALSE);
 
-		valid = gtk_tree_model_iter_next (list_store, &iter);
-	}
-	if (lock_glib) {
-		/* release GTK thread lock */
-		gdk_threads_leave ();
+// Call 'fn' for each transfer with its progress; 'fn' runs with the transfer list locked and
+//   must not call the engine
+void fx_foreach_transfer(void (*fn)(void *data, unsigned tid, gboolean sending, int percent),
+		void *data) {
+	GHashTableIter iter;
+	gpointer value;
+
+	assert(fn != NULL);
+	LOCK_MUTEX(&tmutex, "lock_t5\n");
+	if (tcp_conn != NULL) {
+		g_hash_table_iter_init(&iter, tcp_conn);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			Thread_Data *pt= (Thread_Data *) value;
+			fn(data, pt->id, pt->sending, __atomic_load_n(&pt->progress, __ATOMIC_RELAXED));
+		}
 	}
+	UNLOCK_MUTEX(&tmutex, "unlock_t5\n");
 }
 
 
-// Callback button 'Stop': stops the selected TCP subprocess transmission
-void on_buttonStop_clicked(GtkButton *button, gpointer user_data) {
-	GtkTreeSelection *selection;
-	GtkTreeModel	*model;
-	GtkTreeIter	iter;
-	unsigned tid;
+// Drop the received files from the page cache after they are written
+void fx_set_drop_cache(gboolean drop) {
+	drop_cache= drop;
+}
 
-	selection= gtk_tree_view_get_selection(main_window->treeThread);
-	if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
-		gtk_tree_model_get (model, &iter, 0, &tid, -1);
-#ifdef DEBUG
-		g_print ("Thread %u will be stopped\n", tid);
-#endif
-	} else {
-		Log ("No thread selected\n");
-		/* release GTK thread lock */
-		gdk_threads_leave ();
-		return;
-	}
-	if (tid <= 0) {
-		Log("Invalid TID in the selected line\n");
-		/* release GTK thread lock */
-		gdk_threads_leave ();
-		return;
-	}
 
-	if (!gtk_list_store_remove(main_window->listThread, &iter)) {
-		Log("Failed to stop thread from list\n");
-	}
-	// Stop thread
-	stop_thread_desc(tid, NULL, FALSE);
+// Splice the plain files received from the socket to the file, hashing them if 'hash'
+void fx_set_splice(gboolean enable, gboolean hash) {
+	recv_splice= enable;
+	splice_hash= hash;
 }
 
+
+// Keep the existing files when the received files are published
+void fx_set_rename_noreplace(gboolean noreplace) {
+	rename_noreplace= noreplace;
+}
+
+
+// Create a '.done' marker after publishing each received file
+void fx_set_done_marker(gboolean marker) {
+	done_marker= marker;
+}
+
+
+// Ask the senders to compress the files received
+void fx_set_compression(gboolean compress) {
+	compression= compress;
+}
+
+
+// Ask the senders for deltas of the local copies of the files
+void fx_set_delta(gboolean enable) {
+	delta= enable;
+}
+
+
+// Index the chunks of the files received, and only ask the senders for new chunks
+void fx_set_chunk_store(gboolean enable) {
+	chunk_store= enable;
+	if (!enable)
+		chunk_store_clear();
+}
+
+
+// Send the files in memory with MSG_ZEROCOPY
+void fx_set_zerocopy(gboolean enable) {
+	zerocopy= enable;
+}
+
+
+// Set the memory budget of the cache of small files sent often (0 disables it)
+void fx_set_file_cache(unsigned long long bytes) {
+	file_cache_set_budget(bytes);
+}
+
+
+// Select the devices whose senders read in turns, and the reads at once in each one
+void fx_set_io_scheduler(int mode, int slots) {
+	io_sched= mode;
+	io_slots= (slots > 0) ? slots : 1;
+}
+
+
+// Set the size of the blocks read and written by new transfers (0 for the default)
+void fx_set_buffer_size(unsigned size) {
+	if (size == 0)
+		size= IO_BUFLEN;
+	if (size < IO_BUFLEN_MIN)
+		size= IO_BUFLEN_MIN;
+	if (size > IO_BUFLEN_MAX)
+		size= IO_BUFLEN_MAX;
+	io_buflen= (int)size;
+}
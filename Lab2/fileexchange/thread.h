@@ -11,8 +11,9 @@
 #ifndef THREAD_INC_
 #define THREAD_INC_
 
-#include <gtk/gtk.h>
+#include <glib.h>
 #include <netinet/in.h>
+#include "filewriter.h"
 
 
 // File thread (TCP connection) information
@@ -22,43 +23,52 @@ typedef struct Thread_Data {
     int len;		   	// if (!sending) has the block size being received
 
 	char ofilename[512];// if (!sending) has the output file full pathname
+	char tmpname[512];	// if (!sending) hidden file being written, renamed to ofilename when verified
 	unsigned long long flen; // File length
 	uint32_t fhash;		// File hash value received in HIT packet
 
-    pthread_t tid;	   	// Thread ID
+    unsigned id;		// Transfer ID, reported to the GUI
     char name_str[80]; 	// Thread name
     int s;			   	// Descriptor of the TCP socket
-    FILE *f;		   	// In/out file descriptor
+    FILE *f;		   	// In file descriptor (sending)
+    File_Writer *fw;	// Out file writer (receiving)
     long long total; 	// Bytes handled in the subprocess
+    gboolean compressed;	// The file is sent in compressed blocks
+    gboolean delta;		// The file is sent as a delta of the copy of the receiver
+    gboolean chunked;	// The file is sent as a list of chunks, without those the receiver has
+    long long wire;		// Bytes on the connection of compressed, delta or chunked transfers
+    int progress;		// Percentage transferred, written by the thread without locks
+    long long t0;		// Start time (ns), for the throughput metric
+    char *buf;			// Transfer buffer
+    int buflen;			// Transfer buffer size
     struct in6_addr ip; // IP address of remote node
     u_short port;		// port number of remote node
 	gboolean slow;		// Using slow configuration
 
     gboolean finished;	// If it finished the transference
-    struct Thread_Data *self;	// Self testing pointer, to detected freed memory blocks
+    unsigned gen;		// Generation of the descriptor, incremented when it is released
+    struct Thread_Data *next_free;	// Next free descriptor
 } Thread_Data ;
 
 
 // Directory pathname to write output files
 extern char *out_dir;
-// List with active TCP connections/subprocesses
-extern GList *tcp_conn;
+// Active TCP connections/threads, indexed by transfer id
+extern GHashTable *tcp_conn;
 
 
 
 /***********************************************************\
 |*  Functions to handle the list of file transfer threads  *|
 \***********************************************************/
-// Add thread information to process list
+// Add thread information to the thread table (descriptors are allocated in slabs)
 Thread_Data *new_thread_desc(gboolean sending, struct in6_addr *ip, u_short port,
 		const char *filename, const char *ofilename, unsigned long long h_flen, uint32_t fhash,
 		gboolean slow);
-// Locate descriptor in subprocess list
-Thread_Data *locate_file_thread_in_list(unsigned tid);
-// Delete descriptor in subprocess list
+// Stop transfer 'tid'; the thread of the transfer passes its descriptor 'pt' to free it
 gboolean stop_thread_desc(unsigned tid, Thread_Data *pt, gboolean lock_glib);
-// Validate if a thread_data pointer is valid
-gboolean valid_thread_desc(Thread_Data *pt);
+// Validate if a thread_data pointer still holds the transfer of generation 'gen'
+gboolean valid_thread_desc(Thread_Data *pt, unsigned gen);
 
 /************************************************************\
 |* Functions that implement file transmission subprocesses  *|
@@ -68,8 +78,6 @@ gboolean valid_thread_desc(Thread_Data *pt);
 void send_kill(int pid, int sig, gboolean may_fail);
 // Stop the transmission of all files
 void stop_all_threads_GUI(gboolean lock_glib);
-// Callback button 'Stop': stops the selected TCP subprocess transmission
-void on_buttonStop_clicked(GtkButton *button, gpointer user_data);
 // Starts a thread for file reception
 Thread_Data *start_file_download_thread (struct in6_addr *ip_file, u_short port,
 		const char *filename, const char *ofilename, unsigned long long f_len, uint32_t fhash,
@@ -0,0 +1,469 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * trigram.c
+ *
+ * Trigram inverted index over filenames, used to answer substring and
+ *   glob searches
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#define _GNU_SOURCE		// strcasestr and FNM_CASEFOLD
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fnmatch.h>
+#include "trigram.h"
+
+
+#define SLOT_EMPTY		0
+#define SLOT_DELETED	UINT32_MAX
+#define INIT_CAP		1024		// Initial number of slots of the hash tables
+#define COMPACT_MIN		1024		// Minimum number of deleted names before compacting
+
+
+
+/***************************\
+|*   Auxiliary functions   *|
+\***************************/
+
+// Return the trigram starting at 'p' (lower case)
+static inline uint32_t tri_of(const char *p) {
+	return ((uint32_t)tolower((unsigned char)p[0]) << 16) |
+			((uint32_t)tolower((unsigned char)p[1]) << 8) |
+			(uint32_t)tolower((unsigned char)p[2]);
+}
+
+// Hash of a trigram
+static inline uint32_t tri_hash(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+// Hash of a name (FNV-1a)
+static inline uint32_t name_hash(const char *s) {
+	uint32_t h= 2166136261U;
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+// Return the smallest power of 2 >= n and >= INIT_CAP
+static uint32_t pow2_cap(uint32_t n) {
+	uint32_t cap= INIT_CAP;
+	while (cap < n)
+		cap <<= 1;
+	return cap;
+}
+
+
+/******************************\
+|*  Name hash table (name->id) *|
+\******************************/
+
+// Return the slot with 'name', or -1 if it is not in the table
+static long find_name(const Trigram_Index *idx, const char *name) {
+	uint32_t mask= idx->name_cap-1;
+	uint32_t i= name_hash(name) & mask;
+	while (idx->name_slot[i] != SLOT_EMPTY) {
+		if ((idx->name_slot[i] != SLOT_DELETED) &&
+				!strcmp(idx->docs[idx->name_slot[i]-1].name, name))
+			return i;
+		i= (i+1) & mask;
+	}
+	return -1;
+}
+
+// Put 'id' in the name table (the name must not be there)
+static void put_name(Trigram_Index *idx, uint32_t id) {
+	uint32_t mask= idx->name_cap-1;
+	uint32_t i= name_hash(idx->docs[id].name) & mask;
+	while ((idx->name_slot[i] != SLOT_EMPTY) && (idx->name_slot[i] != SLOT_DELETED))
+		i= (i+1) & mask;
+	if (idx->name_slot[i] == SLOT_EMPTY)
+		idx->name_used++;
+	idx->name_slot[i]= id+1;
+}
+
+// Rebuild the name table with room for the alive names, dropping deleted slots
+static void rehash_names(Trigram_Index *idx) {
+	uint32_t id;
+	free(idx->name_slot);
+	idx->name_cap= pow2_cap(4*(idx->nalive+1));
+	idx->name_slot= calloc(idx->name_cap, sizeof(uint32_t));
+	idx->name_used= 0;
+	for (id= 0; id < idx->ndocs; id++) {
+		if (idx->docs[id].name != NULL)
+			put_name(idx, id);
+	}
+}
+
+
+/*****************************************\
+|*  Trigram hash table (trigram->list)   *|
+\*****************************************/
+
+// Return the list of 'tri', or NULL if no name has it
+static const Tgram_List *find_list(const Trigram_Index *idx, uint32_t tri) {
+	uint32_t mask= idx->tri_cap-1;
+	uint32_t i= tri_hash(tri) & mask;
+	while (idx->tri_key[i] != SLOT_EMPTY) {
+		if (idx->tri_key[i] == tri+1)
+			return &idx->lists[idx->tri_list[i]];
+		i= (i+1) & mask;
+	}
+	return NULL;
+}
+
+// Put the list number 'l' of 'tri' in the trigram table
+static void put_list(Trigram_Index *idx, uint32_t tri, uint32_t l) {
+	uint32_t mask= idx->tri_cap-1;
+	uint32_t i= tri_hash(tri) & mask;
+	while (idx->tri_key[i] != SLOT_EMPTY)
+		i= (i+1) & mask;
+	idx->tri_key[i]= tri+1;
+	idx->tri_list[i]= l;
+}
+
+// Double the trigram table
+static void grow_lists(Trigram_Index *idx) {
+	uint32_t *old_key= idx->tri_key, *old_list= idx->tri_list;
+	uint32_t old_cap= idx->tri_cap, i;
+	idx->tri_cap *= 2;
+	idx->tri_key= calloc(idx->tri_cap, sizeof(uint32_t));
+	idx->tri_list= malloc(idx->tri_cap*sizeof(uint32_t));
+	for (i= 0; i < old_cap; i++) {
+		if (old_key[i] != SLOT_EMPTY)
+			put_list(idx, old_key[i]-1, old_list[i]);
+	}
+	free(old_key);
+	free(old_list);
+}
+
+// Add 'id' to the list of 'tri', creating the list if needed
+static void add_to_list(Trigram_Index *idx, uint32_t tri, uint32_t id) {
+	Tgram_List *l= (Tgram_List *)find_list(idx, tri);
+	if (l == NULL) {
+		if (2*(idx->nlists+1) > idx->tri_cap)
+			grow_lists(idx);
+		if (idx->nlists == idx->lists_cap) {
+			idx->lists_cap= idx->lists_cap ? 2*idx->lists_cap : INIT_CAP;
+			idx->lists= realloc(idx->lists, idx->lists_cap*sizeof(Tgram_List));
+		}
+		put_list(idx, tri, idx->nlists);
+		l= &idx->lists[idx->nlists++];
+		l->ids= NULL;
+		l->n= l->cap= 0;
+	}
+	if ((l->n > 0) && (l->ids[l->n-1] == id))
+		return;		// Repeated trigram in the same name
+	if (l->n == l->cap) {
+		l->cap= l->cap ? 2*l->cap : 4;
+		l->ids= realloc(l->ids, l->cap*sizeof(uint32_t));
+	}
+	l->ids[l->n++]= id;	// Ids are increasing: the list stays sorted
+}
+
+
+/**********************\
+|*  Index management  *|
+\**********************/
+
+// Initialize an empty index
+void tgram_init(Trigram_Index *idx) {
+	memset(idx, 0, sizeof(Trigram_Index));
+	idx->name_cap= INIT_CAP;
+	idx->name_slot= calloc(idx->name_cap, sizeof(uint32_t));
+	idx->tri_cap= INIT_CAP;
+	idx->tri_key= calloc(idx->tri_cap, sizeof(uint32_t));
+	idx->tri_list= malloc(idx->tri_cap*sizeof(uint32_t));
+}
+
+
+// Free all index memory
+void tgram_free(Trigram_Index *idx) {
+	uint32_t i;
+	for (i= 0; i < idx->ndocs; i++)
+		free(idx->docs[i].name);
+	for (i= 0; i < idx->nlists; i++)
+		free(idx->lists[i].ids);
+	free(idx->docs);
+	free(idx->lists);
+	free(idx->name_slot);
+	free(idx->tri_key);
+	free(idx->tri_list);
+	memset(idx, 0, sizeof(Trigram_Index));
+}
+
+
+// Remove all names from the index
+void tgram_clear(Trigram_Index *idx) {
+	tgram_free(idx);
+	tgram_init(idx);
+}
+
+
+// Rebuild the index without the deleted names
+static void compact(Trigram_Index *idx) {
+	Trigram_Index n;
+	uint32_t id;
+	tgram_init(&n);
+	for (id= 0; id < idx->ndocs; id++) {
+		if (idx->docs[id].name != NULL) {
+			tgram_add(&n, idx->docs[id].name, idx->docs[id].flen);
+			n.docs[n.ndocs-1].refs= idx->docs[id].refs;
+		}
+	}
+	tgram_free(idx);
+	*idx= n;
+}
+
+
+// Add a name with its file length; a name added twice must be deleted twice
+gboolean tgram_add(Trigram_Index *idx, const char *name, unsigned long long flen) {
+	if ((name == NULL) || (idx->ndocs == UINT32_MAX-1))
+		return FALSE;
+
+	long slot= find_name(idx, name);
+	if (slot >= 0) {
+		Tgram_Doc *d= &idx->docs[idx->name_slot[slot]-1];
+		d->refs++;
+		d->flen= flen;
+		return TRUE;
+	}
+
+	// New name
+	if (2*(idx->name_used+1) > idx->name_cap)
+		rehash_names(idx);
+	if (idx->ndocs == idx->docs_cap) {
+		idx->docs_cap= idx->docs_cap ? 2*idx->docs_cap : INIT_CAP;
+		idx->docs= realloc(idx->docs, idx->docs_cap*sizeof(Tgram_Doc));
+	}
+	uint32_t id= idx->ndocs++;
+	Tgram_Doc *d= &idx->docs[id];
+	d->name= strdup(name);
+	d->flen= flen;
+	d->refs= 1;
+	idx->nalive++;
+	put_name(idx, id);
+
+	size_t len= strlen(name), i;
+	for (i= 0; i+3 <= len; i++)
+		add_to_list(idx, tri_of(name+i), id);
+	return TRUE;
+}
+
+
+// Delete a name; returns FALSE if it was not in the index
+gboolean tgram_del(Trigram_Index *idx, const char *name) {
+	if (name == NULL)
+		return FALSE;
+	long slot= find_name(idx, name);
+	if (slot < 0)
+		return FALSE;
+
+	Tgram_Doc *d= &idx->docs[idx->name_slot[slot]-1];
+	if (--d->refs > 0)
+		return TRUE;
+	// The stale id stays in the trigram lists and is skipped by the searches
+	free(d->name);
+	d->name= NULL;
+	idx->name_slot[slot]= SLOT_DELETED;
+	idx->nalive--;
+	uint32_t ndeleted= idx->ndocs - idx->nalive;
+	if ((ndeleted > COMPACT_MIN) && (ndeleted > idx->nalive))
+		compact(idx);
+	return TRUE;
+}
+
+
+// Return the number of names in the index
+unsigned tgram_size(const Trigram_Index *idx) {
+	return idx->nalive;
+}
+
+
+/************\
+|*  Search  *|
+\************/
+
+// Return TRUE if 'pattern' has glob special characters
+gboolean tgram_is_glob(const char *pattern) {
+	return strpbrk(pattern, "*?[") != NULL;
+}
+
+
+// Add the lists of the trigrams of the literal fragment 'frag' (length 'len') to 'sel',
+//   keeping the TGRAM_MAX_LISTS shortest ones. Returns FALSE if a trigram has no list.
+static gboolean select_lists(const Trigram_Index *idx, const char *frag, int len,
+		const Tgram_List **sel, int *nsel) {
+	int i, j;
+	for (i= 0; i+3 <= len; i++) {
+		const Tgram_List *l= find_list(idx, tri_of(frag+i));
+		if (l == NULL)
+			return FALSE;	// No name has this trigram
+		if (*nsel < TGRAM_MAX_LISTS) {
+			sel[(*nsel)++]= l;
+			continue;
+		}
+		// Replace the longest selected list if 'l' is shorter
+		int longest= 0;
+		for (j= 1; j < *nsel; j++) {
+			if (sel[j]->n > sel[longest]->n)
+				longest= j;
+		}
+		if (l->n < sel[longest]->n)
+			sel[longest]= l;
+	}
+	return TRUE;
+}
+
+
+// Split a glob pattern into its literal fragments and select their trigram lists
+//   Returns FALSE if the pattern cannot match any name in the index
+static gboolean select_glob_lists(const Trigram_Index *idx, const char *pattern,
+		const Tgram_List **sel, int *nsel) {
+	char frag[512];
+	int len= 0;
+	const char *p= pattern;
+
+	while (*p) {
+		if ((*p == '*') || (*p == '?') || (*p == '[')) {
+			if (!select_lists(idx, frag, len, sel, nsel))
+				return FALSE;
+			len= 0;
+			if (*p == '[') {
+				// Skip the bracket expression; "[]" and "[!]" start with a literal ']'
+				const char *q= p+1;
+				if ((*q == '!') || (*q == '^'))
+					q++;
+				if (*q == ']')
+					q++;
+				while (*q && (*q != ']'))
+					q++;
+				if (*q == '\0')
+					return TRUE;	// Unterminated: no more literal fragments used
+				p= q;
+			}
+			p++;
+			continue;
+		}
+		if ((*p == '\\') && (p[1] != '\0'))
+			p++;	// Escaped character is literal
+		if (len < (int)sizeof(frag))
+			frag[len++]= *p;
+		p++;
+	}
+	return select_lists(idx, frag, len, sel, nsel);
+}
+
+
+// Return TRUE if the name matches the pattern
+static inline gboolean matches(const char *name, const char *pattern, gboolean glob) {
+	if (glob)
+		return fnmatch(pattern, name, FNM_CASEFOLD) == 0;
+	return strcasestr(name, pattern) != NULL;
+}
+
+
+// Return the position of the first id >= 'id' in 'l', starting at 'from'
+static inline uint32_t lower_bound(const Tgram_List *l, uint32_t from, uint32_t id) {
+	uint32_t step= 1, lo= from, hi;
+	// Galloping search followed by binary search
+	while ((lo+step < l->n) && (l->ids[lo+step] < id)) {
+		lo += step;
+		step <<= 1;
+	}
+	hi= (lo+step < l->n) ? lo+step : l->n;
+	while (lo < hi) {
+		uint32_t mid= lo + (hi-lo)/2;
+		if (l->ids[mid] < id)
+			lo= mid+1;
+		else
+			hi= mid;
+	}
+	return lo;
+}
+
+
+// Sort the selected lists by increasing length
+static int cmp_list_len(const void *a, const void *b) {
+	const Tgram_List *la= *(const Tgram_List **)a, *lb= *(const Tgram_List **)b;
+	return (la->n > lb->n) - (la->n < lb->n);
+}
+
+
+// Search for names matching 'pattern': a glob if tgram_is_glob(pattern), a substring otherwise.
+//   Skips the first 'offset' matches and writes up to 'max' matches in 'res';
+//   sets *more to TRUE if there are more matches, or candidates not verified when the search
+//   budget runs out. Returns the number of matches in 'res'.
+int tgram_search(const Trigram_Index *idx, const char *pattern, int offset, int max,
+		Tgram_Match *res, gboolean *more) {
+	const Tgram_List *sel[TGRAM_MAX_LISTS];
+	uint32_t pos[TGRAM_MAX_LISTS];
+	int nsel= 0, nres= 0, skipped= 0, verified= 0, j;
+	gboolean glob;
+	uint32_t i;
+
+	*more= FALSE;
+	if ((pattern == NULL) || (*pattern == '\0') || (offset < 0) || (max <= 0) || (res == NULL))
+		return 0;
+	glob= tgram_is_glob(pattern);
+	if (glob) {
+		if (!select_glob_lists(idx, pattern, sel, &nsel))
+			return 0;
+	} else if (!select_lists(idx, pattern, strlen(pattern), sel, &nsel))
+		return 0;
+
+	// Candidate ids: all names if the pattern has no trigrams, or the intersection of the lists
+	uint32_t ncand= (nsel == 0) ? idx->ndocs : sel[0]->n;
+	if (nsel > 1) {
+		qsort(sel, nsel, sizeof(sel[0]), cmp_list_len);
+		ncand= sel[0]->n;
+	}
+	memset(pos, 0, sizeof(pos));
+	for (i= 0; i < ncand; i++) {
+		uint32_t id= (nsel == 0) ? i : sel[0]->ids[i];
+		for (j= 1; j < nsel; j++) {
+			pos[j]= lower_bound(sel[j], pos[j], id);
+			if ((pos[j] == sel[j]->n) || (sel[j]->ids[pos[j]] != id))
+				break;
+		}
+		if (j < nsel) {
+			if (pos[j] == sel[j]->n)
+				break;		// A list has no more ids: no more candidates
+			continue;
+		}
+		const Tgram_Doc *d= &idx->docs[id];
+		if (d->name == NULL)
+			continue;
+		if (verified == TGRAM_MAX_VERIFY) {
+			*more= TRUE;	// Search budget exhausted: partial results
+			break;
+		}
+		if (!matches(d->name, pattern, glob)) {
+			verified++;
+			continue;
+		}
+		if (skipped < offset) {
+			skipped++;		// Matches of the previous pages do not use the budget
+			continue;
+		}
+		verified++;
+		if (nres == max) {
+			*more= TRUE;
+			break;
+		}
+		res[nres].name= d->name;
+		res[nres].flen= d->flen;
+		nres++;
+	}
+	return nres;
+}
@@ -0,0 +1,97 @@
+/*****************************************************************************\
+ * Redes Integradas de Telecomunicacoes
+ * MIEEC/MEEC/MERSIM - FCT NOVA   2024/2025
+ *
+ * trigram.h
+ *
+ * Header file of a trigram inverted index over filenames, used to answer
+ *   substring and glob (*, ?, [...]) searches. Matching is case insensitive.
+ *
+ * Each name gets an increasing id and each trigram (3 consecutive lower case
+ * bytes) keeps a sorted list of the ids with it. A search intersects the lists
+ * of the trigrams of the literal parts of the pattern and only verifies the
+ * surviving candidates, up to TGRAM_MAX_VERIFY per search, bounding the search
+ * time of patterns with few trigrams (e.g. "*.c") on large lists - these may
+ * return partial results. The matches skipped for the previous pages are not
+ * counted, so later pages get the same budget. Deleted names leave stale ids in the lists, which are
+ * skipped, until the index is compacted.
+ *
+ * @author  Luis Bernardo
+\*****************************************************************************/
+#ifndef _INCL_TRIGRAM_H_
+#define _INCL_TRIGRAM_H_
+
+#include <stdint.h>
+#include <glib.h>
+
+
+#define TGRAM_MAX_LISTS		8		/* Maximum number of lists intersected per search */
+#define TGRAM_MAX_VERIFY	32768	/* Maximum number of candidates verified per search */
+
+
+// Indexed name
+typedef struct Tgram_Doc {
+	char *name;					// Name (NULL if deleted)
+	unsigned long long flen;	// File length
+	unsigned refs;				// Number of times the name was added
+} Tgram_Doc;
+
+// List of ids with a trigram
+typedef struct Tgram_List {
+	uint32_t *ids;				// Sorted ids
+	uint32_t n, cap;
+} Tgram_List;
+
+// Search result
+typedef struct Tgram_Match {
+	const char *name;			// Points into the index - valid until it is modified
+	unsigned long long flen;
+} Tgram_Match;
+
+// Trigram index
+typedef struct Trigram_Index {
+	Tgram_Doc *docs;			// Indexed by id
+	uint32_t ndocs, docs_cap;
+	uint32_t nalive;			// Names not deleted
+
+	uint32_t *name_slot;		// Hash table name -> id+1 (0 empty, UINT32_MAX deleted)
+	uint32_t name_cap;			// Number of slots (power of 2)
+	uint32_t name_used;			// Slots not empty
+
+	uint32_t *tri_key;			// Hash table trigram+1 -> list (0 empty)
+	uint32_t *tri_list;			// List index of each slot
+	uint32_t tri_cap;			// Number of slots (power of 2)
+	Tgram_List *lists;			// Lists of ids
+	uint32_t nlists, lists_cap;
+} Trigram_Index;
+
+
+// Initialize an empty index
+void tgram_init(Trigram_Index *idx);
+
+// Free all index memory
+void tgram_free(Trigram_Index *idx);
+
+// Remove all names from the index
+void tgram_clear(Trigram_Index *idx);
+
+// Add a name with its file length; a name added twice must be deleted twice
+gboolean tgram_add(Trigram_Index *idx, const char *name, unsigned long long flen);
+
+// Delete a name; returns FALSE if it was not in the index
+gboolean tgram_del(Trigram_Index *idx, const char *name);
+
+// Return the number of names in the index
+unsigned tgram_size(const Trigram_Index *idx);
+
+// Return TRUE if 'pattern' has glob special characters
+gboolean tgram_is_glob(const char *pattern);
+
+// Search for names matching 'pattern': a glob if tgram_is_glob(pattern), a substring otherwise.
+//   Skips the first 'offset' matches and writes up to 'max' matches in 'res';
+//   sets *more to TRUE if there are more matches, or candidates not verified when the search
+//   budget runs out. Returns the number of matches in 'res'.
+int tgram_search(const Trigram_Index *idx, const char *pattern, int offset, int max,
+		Tgram_Match *res, gboolean *more);
+
+#endif